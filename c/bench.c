@@ -0,0 +1,532 @@
+/*
+  This file is part of the RA package (http://github.com/davidssmith/ra).
+
+  The MIT License (MIT)
+
+  Copyright (c) 2015-2019 David Smith
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+/*
+   Benchmark suite for the C library.
+
+   Every operation is timed rep by rep, and each result row reports the
+   throughput at the median latency along with the p50/p90/p99 latencies.
+   File reads are measured twice: warm, straight after the file was
+   written, and cold, after the file's pages have been dropped from the
+   page cache with posix_fadvise(POSIX_FADV_DONTNEED). Reads and writes
+   are also run with ra_set_direct_io, next to the buffered path, and for
+   those rows cache_mb gives how much the system page cache grew per rep.
+   Output is CSV or JSON so runs can be compared between releases.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "ra.h"
+
+#define SMALL_FILE_MAX  (1UL<<16)  /* sizes up to this also get a many-files run */
+#define NSMALLFILES     256
+
+static const char *dir = "tmp";
+static int reps = 20;
+static int json = 0;
+static int nrows = 0;
+static double cache_mb = NAN;  /* page cache growth for the next row, if measured */
+static FILE *out;
+
+static double
+now (void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+static void
+drop_cache (const char *path)
+{  /* flush and evict a file's pages so the next read comes from the device */
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	fdatasync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+static double
+page_cache_mb (void)
+{  /* size of the system page cache from /proc/meminfo, or NAN if unavailable */
+	char line[256];
+	double kb = NAN;
+	FILE *f = fopen("/proc/meminfo", "r");
+	if (f == NULL)
+		return NAN;
+	while (fgets(line, sizeof line, f))
+		if (sscanf(line, "Cached: %lf kB", &kb) == 1)
+			break;
+	fclose(f);
+	return kb/1024;
+}
+
+static int
+cmp_double (const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+static double
+percentile (const double sorted[], const int n, const double p)
+{
+	int k = (int)ceil(p*n) - 1;
+	return sorted[k < 0 ? 0 : k];
+}
+
+static void
+report (const char *op, const char *type, const char *cache, const uint64_t bytes,
+		const uint64_t files, double lat[], const int n)
+{  /* lat[] holds n per-rep latencies in seconds, each moving bytes over files */
+	qsort(lat, n, sizeof(double), cmp_double);
+	double p50 = percentile(lat, n, 0.5), p90 = percentile(lat, n, 0.9), p99 = percentile(lat, n, 0.99);
+	double mbps = p50 > 0 ? 1e-6*bytes/p50 : 0;
+	double fps = p50 > 0 ? files/p50 : 0;
+	char cachestr[32] = "";
+	if (!isnan(cache_mb))
+		snprintf(cachestr, sizeof cachestr, "%.1f", cache_mb);
+	if (json)
+		fprintf(out, "%s  {\"op\": \"%s\", \"type\": \"%s\", \"cache\": \"%s\", \"bytes\": %lu, "
+				"\"files\": %lu, \"reps\": %d, \"mb_per_s\": %.1f, \"files_per_s\": %.1f, "
+				"\"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, \"cache_mb\": %s}",
+				nrows ? ",\n" : "", op, type, cache, bytes, files, n, mbps, fps,
+				1e6*p50, 1e6*p90, 1e6*p99, *cachestr ? cachestr : "null");
+	else
+		fprintf(out, "%s,%s,%s,%lu,%lu,%d,%.1f,%.1f,%.1f,%.1f,%.1f,%s\n", op, type, cache,
+				bytes, files, n, mbps, fps, 1e6*p50, 1e6*p90, 1e6*p99, cachestr);
+	fflush(out);
+	cache_mb = NAN;
+	++nrows;
+}
+
+static ra_t *
+make_array (const char *type, const uint64_t bytes)
+{  /* a square-ish 2D array of smoothly varying values, so compression has work to do */
+	uint64_t eltype, elbyte;
+	ra_parse_type(type, &eltype, &elbyte);
+	elbyte /= 8;
+	uint64_t n = bytes / elbyte;
+	uint64_t dims[2];
+	dims[0] = (uint64_t)sqrt((double)n);
+	while (n % dims[0])
+		--dims[0];
+	dims[1] = n / dims[0];
+	char typestr[24];
+	snprintf(typestr, sizeof typestr, "%c%lu", type[0], elbyte);
+	int half = elbyte == 2 && (eltype == RA_TYPE_FLOAT || eltype == RA_TYPE_BFLOAT);
+	ra_t *r = ra_create(half ? "f4" : typestr, 2, dims, RA_DEFAULT);  // halves are filled as floats
+	uint64_t nvals = eltype == RA_TYPE_COMPLEX ? 2*n : n;
+	for (uint64_t i = 0; i < nvals; ++i) {
+		double v = 1000.0*sin(1e-3*i) + (i % 7);
+		if (half || eltype == RA_TYPE_FLOAT || eltype == RA_TYPE_COMPLEX) {
+			if (half || elbyte == (eltype == RA_TYPE_FLOAT ? 4 : 8))
+				((float*)r->data)[i] = v;
+			else
+				((double*)r->data)[i] = v;
+		} else {
+			int64_t k = (int64_t)v;
+			switch (elbyte) {
+			case 1: ((uint8_t*)r->data)[i] = k; break;
+			case 2: ((int16_t*)r->data)[i] = k; break;
+			case 4: ((int32_t*)r->data)[i] = k; break;
+			default: ((int64_t*)r->data)[i] = k; break;
+			}
+		}
+	}
+	if (half)
+		ra_convert(r, typestr);
+	return r;
+}
+
+static ra_t *
+clone (ra_t *r)
+{
+	char typestr[24];
+	snprintf(typestr, sizeof typestr, "%c%lu", RA_TYPE_CODES[r->eltype], r->elbyte);
+	ra_t *c = ra_create(typestr, r->ndims, r->dims, r->flags);
+	ra_copy(c, r);
+	return c;
+}
+
+static void
+bench_files (const char *type, ra_t *r, double lat[])
+{  /* write, read, mmap and slab-read one file */
+	char path[512];
+	ra_t a;
+	snprintf(path, sizeof path, "%s/bench.ra", dir);
+
+	for (int i = 0; i < reps; ++i) {
+		double t = now();
+		ra_write(r, path);
+		lat[i] = now() - t;
+	}
+	report("write", type, "warm", r->size, 1, lat, reps);
+
+	for (int cold = 0; cold <= 1; ++cold) {
+		const char *cache = cold ? "cold" : "warm";
+		for (int i = 0; i < reps; ++i) {
+			if (cold)
+				drop_cache(path);
+			double t = now();
+			ra_read(&a, path);
+			lat[i] = now() - t;
+			ra_free(&a);
+		}
+		report("read", type, cache, r->size, 1, lat, reps);
+
+		for (int i = 0; i < reps; ++i) {
+			if (cold)
+				drop_cache(path);
+			double t = now();
+			ra_mmap(&a, path, RA_MMAP_DEFAULT);
+			volatile uint8_t sum = 0;
+			for (uint64_t k = 0; k < a.size; k += 4096)  // fault in every page
+				sum += a.data[k];
+			lat[i] = now() - t;
+			ra_munmap(&a);
+		}
+		report("mmap", type, cache, r->size, 1, lat, reps);
+
+		// the central quarter of the array
+		uint64_t start[2], count[2];
+		for (int d = 0; d < 2; ++d) {
+			start[d] = r->dims[d] / 4;
+			count[d] = r->dims[d] / 2 > 0 ? r->dims[d] / 2 : 1;
+		}
+		for (int i = 0; i < reps; ++i) {
+			if (cold)
+				drop_cache(path);
+			double t = now();
+			ra_read_slab(path, start, count, NULL, &a);
+			lat[i] = now() - t;
+			ra_free(&a);
+		}
+		report("slab", type, cache, count[0]*count[1]*r->elbyte, 1, lat, reps);
+	}
+	unlink(path);
+}
+
+static void
+bench_direct (const char *type, ra_t *r, double lat[])
+{  /* buffered against direct io, starting each rep with the file out of the cache */
+	char path[512];
+	ra_t a;
+	snprintf(path, sizeof path, "%s/bench.ra", dir);
+	for (int direct = 0; direct <= 1; ++direct) {
+		ra_set_direct_io(direct);
+		double grown = 0;
+		for (int i = 0; i < reps; ++i) {
+			unlink(path);
+			double c = page_cache_mb(), t = now();
+			ra_write(r, path);
+			lat[i] = now() - t;
+			grown += page_cache_mb() - c;
+		}
+		cache_mb = grown / reps;
+		report("write", type, direct ? "direct" : "buffered", r->size, 1, lat, reps);
+
+		grown = 0;
+		for (int i = 0; i < reps; ++i) {
+			drop_cache(path);
+			double c = page_cache_mb(), t = now();
+			ra_read(&a, path);
+			lat[i] = now() - t;
+			grown += page_cache_mb() - c;
+			ra_free(&a);
+		}
+		cache_mb = grown / reps;
+		report("read", type, direct ? "direct" : "cold", r->size, 1, lat, reps);
+	}
+	ra_set_direct_io(0);
+	unlink(path);
+}
+
+static void
+bench_many (const char *type, ra_t *r, double lat[])
+{  /* read many small files, one at a time, as a batch and from a pack */
+	char packpath[512];
+	char *names = malloc(NSMALLFILES*512);
+	const char **paths = malloc(NSMALLFILES*sizeof(char*));
+	ra_t *arrays = calloc(NSMALLFILES, sizeof(ra_t));
+	for (int k = 0; k < NSMALLFILES; ++k) {
+		paths[k] = names + 512*k;
+		snprintf(names + 512*k, 512, "%s/bench%d.ra", dir, k);
+		ra_write(r, paths[k]);
+	}
+	snprintf(packpath, sizeof packpath, "%s/bench_pack.ra", dir);
+	ra_pack_files(packpath, paths, NSMALLFILES);
+	for (int cold = 0; cold <= 1; ++cold) {
+		const char *cache = cold ? "cold" : "warm";
+		for (int i = 0; i < reps; ++i) {
+			for (int k = 0; cold && k < NSMALLFILES; ++k)
+				drop_cache(paths[k]);
+			double t = now();
+			for (int k = 0; k < NSMALLFILES; ++k) {
+				ra_read(&arrays[k], paths[k]);
+				ra_free(&arrays[k]);
+			}
+			lat[i] = now() - t;
+		}
+		report("read_loop", type, cache, r->size*NSMALLFILES, NSMALLFILES, lat, reps);
+
+		memset(arrays, 0, NSMALLFILES*sizeof(ra_t));
+		for (int i = 0; i < reps; ++i) {
+			for (int k = 0; cold && k < NSMALLFILES; ++k)
+				drop_cache(paths[k]);
+			double t = now();
+			ra_read_many(paths, NSMALLFILES, arrays);
+			lat[i] = now() - t;
+		}
+		for (int k = 0; k < NSMALLFILES; ++k)
+			ra_free(&arrays[k]);
+		report("read_many", type, cache, r->size*NSMALLFILES, NSMALLFILES, lat, reps);
+
+		for (int i = 0; i < reps; ++i) {
+			if (cold)
+				drop_cache(packpath);
+			double t = now();
+			ra_pack_t *p = ra_pack_open(packpath);
+			for (int k = 0; k < NSMALLFILES; ++k) {
+				ra_pack_read(p, k, &arrays[k]);
+				ra_free(&arrays[k]);
+			}
+			ra_pack_close(p);
+			lat[i] = now() - t;
+		}
+		report("read_pack", type, cache, r->size*NSMALLFILES, NSMALLFILES, lat, reps);
+	}
+	unlink(packpath);
+	for (int k = 0; k < NSMALLFILES; ++k)
+		unlink(paths[k]);
+	free(arrays);
+	free(paths);
+	free(names);
+}
+
+static void
+bench_memory (const char *type, ra_t *r, double lat[], double lat2[])
+{  /* in-memory operations: compress, decompress, diff, stats, histogram, convert, split and transpose */
+	for (int i = 0; i < reps; ++i) {
+		ra_t *c = clone(r);
+		double t = now();
+		ra_compress(c);
+		lat[i] = now() - t;
+		t = now();
+		ra_decompress(c);
+		lat2[i] = now() - t;
+		ra_free(c);
+		free(c);
+	}
+	report("compress", type, "mem", r->size, 1, lat, reps);
+	report("decompress", type, "mem", r->size, 1, lat2, reps);
+
+	ra_t *c = clone(r);
+	for (int i = 0; i < reps; ++i) {
+		double t = now();
+		ra_diff(r, c, RA_DIFF_EQ);
+		lat[i] = now() - t;
+	}
+	report("diff", type, "mem", r->size, 1, lat, reps);
+	for (int i = 0; i < reps; ++i) {
+		ra_stats_t st;
+		double t = now();
+		ra_stats(r, &st);
+		lat[i] = now() - t;
+	}
+	report("stats", type, "mem", r->size, 1, lat, reps);
+	for (int i = 0; i < reps; ++i) {
+		ra_hist_t h;
+		double t = now();
+		ra_histogram(r, &h);
+		lat[i] = now() - t;
+		ra_hist_free(&h);
+	}
+	report("histogram", type, "mem", r->size, 1, lat, reps);
+	const char *to = r->eltype == RA_TYPE_FLOAT && r->elbyte == 4 ? "i2" : "f4";
+	for (int i = 0; i < reps; ++i) {
+		ra_t *d = clone(r);
+		double t = now();
+		ra_convert(d, to);
+		lat[i] = now() - t;
+		ra_free(d);
+		free(d);
+	}
+	report("convert", type, "mem", r->size, 1, lat, reps);
+	if (r->eltype == RA_TYPE_COMPLEX) {
+		ra_t re, im, z;
+		for (int i = 0; i < reps; ++i) {
+			double t = now();
+			ra_complex_split(r, &re, &im, 0);
+			lat[i] = now() - t;
+			t = now();
+			ra_complex_interleave(&re, &im, &z, 0);
+			lat2[i] = now() - t;
+			ra_free(&re);
+			ra_free(&im);
+			ra_free(&z);
+		}
+		report("split", type, "mem", r->size, 1, lat, reps);
+		report("interleave", type, "mem", r->size, 1, lat2, reps);
+	}
+
+	const uint64_t swap[2] = { 1, 0 }, n0 = r->dims[0], n1 = r->dims[1], E = r->elbyte;
+	for (int i = 0; i < reps; ++i) {  // the strided copy a transpose replaces
+		double t = now();
+		for (uint64_t a = 0; a < n0; ++a)
+			for (uint64_t b = 0; b < n1; ++b)
+				memcpy(c->data + (a*n1 + b)*E, r->data + (a + b*n0)*E, E);
+		lat[i] = now() - t;
+	}
+	report("transpose_naive", type, "mem", r->size, 1, lat, reps);
+	for (int i = 0; i < reps; ++i) {
+		double t = now();
+		ra_permute(c, swap);
+		lat[i] = now() - t;
+	}
+	report("permute", type, "mem", r->size, 1, lat, reps);
+	ra_free(c);
+	free(c);
+}
+
+static uint64_t
+parse_size (const char *s)
+{  /* byte count with an optional K, M or G suffix */
+	char *end;
+	uint64_t n = strtoull(s, &end, 10);
+	switch (*end) {
+	case 'k': case 'K': return n << 10;
+	case 'm': case 'M': return n << 20;
+	case 'g': case 'G': return n << 30;
+	default: return n;
+	}
+}
+
+static void
+print_usage (const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-f csv|json] [-o file] [-d dir] [-n reps] [-j threads]\n", prog);
+	fprintf(stderr, "\t\t[-s size,...] [-t type,...]\n");
+	fprintf(stderr, "\t-f\toutput format (default csv)\n");
+	fprintf(stderr, "\t-o\twrite results to file instead of stdout\n");
+	fprintf(stderr, "\t-d\tscratch directory, created if needed (default tmp)\n");
+	fprintf(stderr, "\t-n\trepetitions per measurement (default 20)\n");
+	fprintf(stderr, "\t-j\tworker threads for compression and batch reads\n");
+	fprintf(stderr, "\t-s\tarray sizes in bytes, with K, M or G suffixes (default 4K,256K,16M)\n");
+	fprintf(stderr, "\t-t\telement types (default u8,i16,f32,f64,c64; also f16, b16 for bfloat16)\n");
+}
+
+int
+main (int argc, char *argv[])
+{
+	char sizes[256] = "4K,256K,16M", types[256] = "u8,i16,f32,f64,c64";
+	const char *outpath = NULL;
+	int c;
+
+	ra_set_exit_on_error(1);
+	while ((c = getopt(argc, argv, "f:o:d:n:j:s:t:h")) != -1) {
+		switch (c) {
+		case 'f':
+			json = strcmp(optarg, "json") == 0;
+			break;
+		case 'o':
+			outpath = optarg;
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'n':
+			reps = atoi(optarg);
+			break;
+		case 'j':
+			ra_set_num_threads(atoi(optarg));
+			break;
+		case 's':
+			snprintf(sizes, sizeof sizes, "%s", optarg);
+			break;
+		case 't':
+			snprintf(types, sizeof types, "%s", optarg);
+			break;
+		case 'h':
+		default:
+			print_usage(argv[0]);
+			return EX_USAGE;
+		}
+	}
+	if (reps < 1) {
+		print_usage(argv[0]);
+		return EX_USAGE;
+	}
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		perror(dir);
+		return EX_CANTCREAT;
+	}
+	out = outpath ? fopen(outpath, "w") : stdout;
+	if (out == NULL) {
+		perror(outpath);
+		return EX_CANTCREAT;
+	}
+
+	if (json)
+		fprintf(out, "[\n");
+	else
+		fprintf(out, "op,type,cache,bytes,files,reps,mb_per_s,files_per_s,p50_us,p90_us,p99_us,cache_mb\n");
+	double *lat = malloc(reps*sizeof(double));
+	double *lat2 = malloc(reps*sizeof(double));
+	for (char *type = strtok(types, ","); type; type = strtok(NULL, ",")) {
+		for (char *s = sizes; *s; ) {
+			uint64_t bytes = parse_size(s);
+			ra_t *r = make_array(type, bytes);
+			bench_files(type, r, lat);
+			bench_direct(type, r, lat);
+			if (bytes <= SMALL_FILE_MAX)
+				bench_many(type, r, lat);
+			bench_memory(type, r, lat, lat2);
+			ra_free(r);
+			free(r);
+			s = strchr(s, ',');
+			s = s ? s + 1 : "";
+		}
+	}
+	if (json)
+		fprintf(out, "\n]\n");
+	free(lat2);
+	free(lat);
+	if (outpath)
+		fclose(out);
+	return 0;
+}
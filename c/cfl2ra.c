@@ -70,6 +70,8 @@ cfl_read(ra_t * a, char *filename)
     a->ndims--;                 // to account for trailing 0 dimension
     a->dims = (uint64_t *)malloc(a->ndims * sizeof(uint64_t));
     a->flags = 0;
+    a->top = NULL;
+    a->mapsize = 0;
     a->eltype = RA_TYPE_COMPLEX;
     a->elbyte = 8;
     a->size = a->elbyte;
@@ -101,6 +103,7 @@ int
 main(int argc, char *argv[])
 {
     ra_t a;
+    ra_set_exit_on_error(1);
     if (argc < 3)
     {
         printf("Convert a cfl file to ra format.\n");
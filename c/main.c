@@ -24,6 +24,7 @@
   SOFTWARE.
 */
 
+#include <errno.h>
 #include <math.h>
 #include <sysexits.h>
 #include <stdint.h>
@@ -33,6 +34,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <sys/stat.h>
 #include "ra.h"
 
 
@@ -41,47 +43,101 @@ diff_print_usage(char *argv[])
 {
 
     fprintf(stderr, "Compare two RA files.\n");
-    fprintf(stderr, "Usage: ra %s [-1] [-2] [-h] <file1.ra> <file2.ra>\n",
-        argv[0]);
+    fprintf(stderr, "Usage: ra %s [-1] [-2] [-i] [-s] [-a atol] [-r rtol] [-j threads] [-h]\n"
+        "\t<file1.ra> <file2.ra>\n", argv[0]);
     fprintf(stderr, "\t-1\tCompute L1 distance between data sections.\n");
     fprintf(stderr, "\t-2\tCompute L2 distance between data sections.\n");
+    fprintf(stderr, "\t-i\tCompute max absolute difference between data sections.\n");
+    fprintf(stderr, "\t-s\tPrint all difference statistics.\n");
+    fprintf(stderr, "\t-a\tAbsolute tolerance: elements within atol + rtol*|file2| match.\n");
+    fprintf(stderr, "\t-r\tRelative tolerance.\n");
+    fprintf(stderr, "\t-j\tNumber of threads to compare with.\n");
     fprintf(stderr, "\t-h\tPrint usage.\n");
     fprintf(stderr,
-        "Default behavior is to identify first differing datum.\n");
+        "Default behavior is to identify first differing datum.\n"
+        "Exits with status 1 if the files differ beyond the tolerance.\n");
 }
 
 int
 diff(int argc, char *argv[])
 {
     ra_t r1, r2;
+    ra_diffstat_t s;
     int isdiff = 0;
-    int diff_type = 0;
+    int diff_type = RA_DIFF_EQ;
+    int all = 0;
+    double atol = 0, rtol = 0;
     int c;
-    while ((c = getopt(argc, argv, "12h")) != -1)
+    while ((c = getopt(argc, argv, "12isa:r:j:h")) != -1)
     {
         switch (c) {
         case '2':
-            diff_type = 2;
+            diff_type = RA_DIFF_L2;
             break;
         case '1':
-            diff_type = 1;
+            diff_type = RA_DIFF_L1;
             break;
+        case 'i':
+            diff_type = RA_DIFF_LINF;
+            break;
+        case 's':
+            all = 1;
+            break;
+        case 'a':
+            atol = atof(optarg);
+            break;
+        case 'r':
+            rtol = atof(optarg);
+            break;
+        case 'j':
+            ra_set_num_threads(atoi(optarg));
+            break;
+        case 'h':
+        default:
+            diff_print_usage(argv);
+            return EX_USAGE;
         }
     }
 
-    if (argc == optind)
+    if (argc - optind < 2)
     {
         diff_print_usage(argv);
         return EX_USAGE;
     }
-    for (int index = optind; index < argc; index++)
+    ra_read(&r1, argv[optind]);
+    ra_read(&r2, argv[optind + 1]);
+    ra_decompress(&r1);
+    ra_decompress(&r2);
+    if (ra_diff_stats(&r1, &r2, atol, rtol, &s) > 0)
+    {
+        printf("%s and %s differ in type or shape\n", argv[optind], argv[optind + 1]);
+        isdiff = 1;
+    }
+    else
     {
-        if (index == optind)
-            ra_read(&r1, argv[index]);
-        else if (index == optind + 1)
-            ra_read(&r2, argv[index]);
+        if (all)
+        {
+            printf("elements: %lu\n", s.n);
+            printf("differing: %lu\n", s.ndiffer);
+            if (s.ndiffer > 0)
+                printf("first difference: %lu\n", s.first);
+            printf("L1 distance: %g\n", s.l1);
+            printf("L2 distance: %g\n", s.l2);
+            printf("Linf distance: %g\n", s.linf);
+            printf("max relative error: %g\n", s.maxrel);
+            printf("max ULP distance: %lu\n", s.maxulp);
+            printf("outside tolerance: %lu\n", s.nexceed);
+        }
+        else if (diff_type == RA_DIFF_EQ && s.nexceed > 0)
+            ra_diff(&r1, &r2, diff_type);
+        else if (diff_type == RA_DIFF_L1)
+            printf("L1 distance: %g\n", s.l1);
+        else if (diff_type == RA_DIFF_L2)
+            printf("L2 distance: %g\n", s.l2);
+        else if (diff_type == RA_DIFF_LINF)
+            printf("Linf distance: %g\n", s.linf);
+        isdiff = s.nexceed > 0;
     }
-    ra_diff(&r1, &r2, diff_type);
     ra_free(&r1);
     ra_free(&r2);
     return isdiff;
@@ -105,44 +161,53 @@ dims (int argc, char *argv[])
     return 0;
 }
 
+static const char *head_fields[] = { "magic", "flags", "eltype", "elbyte", "size", "ndims" };
+
 int
 head(int argc, char *argv[])
 {
-    if (argc > 2) 
-	{
-		if (strncmp(argv[1], "flags", 5) == 0)
-		{
-			printf("%lu\n", ra_flags(argv[2]));
-		}
-		else if (strncmp(argv[1], "eltype", 6) == 0)
-		{
-			printf("%lu\n", ra_eltype(argv[2]));
-		}
-		else if (strncmp(argv[1], "elbyte", 6) == 0)
-		{
-			printf("%lu\n", ra_elbyte(argv[2]));
-		}
-		else if (strncmp(argv[1], "size", 4) == 0)
-		{
-			printf("%lu\n", ra_size(argv[2]));
-		}
-		else if (strncmp(argv[1], "ndims", 5) == 0)
-		{
-			printf("%lu\n", ra_ndims(argv[2]));
-		}
-		else
-		{
-        	ra_print_header(argv[1]);
-		}
-	}
-	else if (argc > 1)
-        ra_print_header(argv[1]);
-    else
+	int field = -1, all = 0, first = 1;
+	if (argc > 2 && (strcmp(argv[1], "--all") == 0 || strcmp(argv[1], "-a") == 0))
+		all = first = 2;
+	else if (argc > 2)
+		for (int k = 1; k < 6; ++k)
+			if (strcmp(argv[1], head_fields[k]) == 0)
+				field = k, first = 2;
+    if (argc <= first)
     {
-        printf("View header of ra file.\n");
-        printf("Usage: ra head [flags|eltype|elbyte|size|ndims] <file.ra>\n");
+        printf("View header of ra files.\n");
+        printf("Usage: ra head [--all|flags|eltype|elbyte|size|ndims] <file.ra> ...\n");
+        return EX_USAGE;
     }
-
+	int n = argc - first;
+	ra_header_t **h = calloc(n, sizeof(ra_header_t*));
+	if (getenv("RA_NUM_THREADS") == NULL)  // stat files concurrently unless told otherwise
+		ra_set_num_threads(sysconf(_SC_NPROCESSORS_ONLN));
+	ra_header_many((const char * const *)argv + first, n, h);
+	for (int i = 0; i < n; ++i) {
+		const char *path = argv[first + i];
+		if (field >= 0 && n == 1)
+			printf("%lu\n", ((uint64_t*)h[i])[field]);
+		else if (field >= 0)
+			printf("%-30s %lu\n", path, ((uint64_t*)h[i])[field]);
+		else if (all) {
+			printf("%-30s flags=%lu eltype=%lu elbyte=%lu size=%lu ndims=%lu", path,
+					h[i]->flags, h[i]->eltype, h[i]->elbyte, h[i]->size, h[i]->ndims);
+			if (h[i]->align)
+				printf(" align=%lu", h[i]->align);
+			printf(" dims=(");
+			for (uint64_t k = 0; k < h[i]->ndims; ++k)
+				printf(k ? ", %lu" : "%lu", h[i]->dims[k]);
+			printf(")\n");
+		} else {
+			ra_t a = { h[i]->magic, h[i]->flags, h[i]->eltype, h[i]->elbyte, h[i]->size,
+				h[i]->ndims, h[i]->dims };
+			printf("%-30s ", path);
+			ra_peek(&a);
+		}
+		free(h[i]);
+	}
+	free(h);
     return 0;
 }
 
@@ -151,22 +216,15 @@ head(int argc, char *argv[])
 int
 reshape(int argc, char *argv[])
 {
-    ra_t r;
     uint64_t *newdims;
     uint64_t ndimsnew;
     if (argc > 2)
     {
-        ra_read(&r, argv[1]);
         ndimsnew = argc - 2;
         newdims = (uint64_t *) malloc(ndimsnew * sizeof(uint64_t));
         for (uint64_t k = 0; k < ndimsnew; ++k)
             newdims[k] = atol(argv[k + 2]);
-        if (ra_reshape(&r, newdims, ndimsnew) == 0)
-        {
-            // TODO: just write the header if total elements still the same
-            ra_write(&r, argv[1]);
-        }
-        ra_free(&r);
+        ra_reshape_file(argv[1], newdims, ndimsnew);
         free(newdims);
     }
     else
@@ -179,17 +237,46 @@ reshape(int argc, char *argv[])
 }
 
 
+int
+parse_compress_opts (int argc, char *argv[], uint64_t *filter)
+{  /* handle the options shared by the compression subcommands */
+	int c;
+	while ((c = getopt(argc, argv, "j:sbh")) != -1)
+	{
+		switch (c) {
+		case 'j':
+			ra_set_num_threads(atoi(optarg));
+			break;
+		case 's':
+			*filter = RA_FLAG_SHUFFLE;
+			break;
+		case 'b':
+			*filter = RA_FLAG_BITSHUFFLE;
+			break;
+		case 'h':
+		default:
+			return -1;
+		}
+	}
+	return argc > optind ? optind : -1;
+}
+
 int
 compress (int argc, char *argv[])
 {
 	ra_t r;
-	if (argc < 2) {
-		printf("ra compress <file.ra>\n");
+	uint64_t filter = 0;
+	int i = parse_compress_opts(argc, argv, &filter);
+	if (i < 0) {
+		printf("ra compress [-j nthreads] [-s|-b] <file.ra>\n");
+		printf("\t-j\tnumber of threads\n");
+		printf("\t-s\tbyte-shuffle elements before compressing\n");
+		printf("\t-b\tbit-shuffle elements before compressing\n");
 		return EX_USAGE;
 	}
-	ra_read(&r, argv[1]);
-	ra_compress(&r);
-	ra_write(&r, argv[1]);
+	ra_read(&r, argv[i]);
+	ra_compress_chunked(&r, RA_BLOCK_SIZE, filter);
+	ra_write(&r, argv[i]);
 	ra_free(&r);
 	return EX_OK;
 }
@@ -199,36 +286,576 @@ int
 decompress (int argc, char *argv[])
 {
 	ra_t r;
-	if (argc < 2) {
-		printf("ra decompress <file.ra>\n");
+	uint64_t filter = 0;
+	int i = parse_compress_opts(argc, argv, &filter);
+	if (i < 0) {
+		printf("ra decompress [-j nthreads] <file.ra>\n");
 		return EX_USAGE;
 	}
-	ra_read(&r, argv[1]);
+	ra_read(&r, argv[i]);
 	ra_decompress(&r);
-	ra_write(&r, argv[1]);
+	ra_write(&r, argv[i]);
 	ra_free(&r);
 	return EX_OK;
 }
 
+int
+slice (int argc, char *argv[])
+{
+	ra_t out;
+	if (argc < 3) {
+		fprintf(stderr, "Extract a hyperslab of an ra file.\n");
+		fprintf(stderr, "Usage: ra %s <in.ra> <out.ra> [start:count[:stride] | :] ...\n", argv[0]);
+		fprintf(stderr, "One range per dimension, fastest varying first. Missing trailing\n");
+		fprintf(stderr, "ranges and bare ':' select the whole dimension.\n");
+		return EX_USAGE;
+	}
+	uint64_t ndims = ra_ndims(argv[1]);
+	uint64_t *dims = ra_dims(argv[1]);
+	uint64_t *start = calloc(ndims, sizeof(uint64_t));
+	uint64_t *count = malloc(ndims * sizeof(uint64_t));
+	uint64_t *stride = malloc(ndims * sizeof(uint64_t));
+	if (argc - 3 > ndims) {
+		fprintf(stderr, "%s has only %lu dimensions\n", argv[1], ndims);
+		return EX_USAGE;
+	}
+	for (uint64_t k = 0; k < ndims; ++k) {
+		count[k] = dims[k];
+		stride[k] = 1;
+		if (k + 3 < argc && strcmp(argv[k + 3], ":") != 0) {
+			if (sscanf(argv[k + 3], "%lu:%lu:%lu", &start[k], &count[k], &stride[k]) < 2) {
+				fprintf(stderr, "bad range '%s'\n", argv[k + 3]);
+				return EX_USAGE;
+			}
+		}
+	}
+	ra_read_slab(argv[1], start, count, stride, &out);
+	ra_write(&out, argv[2]);
+	ra_free(&out);
+	free(dims);
+	free(start);
+	free(count);
+	free(stride);
+	return EX_OK;
+}
+
+int
+checksum (int argc, char *argv[])
+{
+	int store = 0, failed = 0;
+	int c;
+	while ((c = getopt(argc, argv, "wh")) != -1) {
+		switch (c) {
+		case 'w':
+			store = 1;
+			break;
+		case 'h':
+		default:
+			optind = argc;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "Print the CRC32C of the data segment of ra files, checking it against\n");
+		fprintf(stderr, "the checksum record stored in the file if there is one.\n");
+		fprintf(stderr, "Usage: ra %s [-w] <file.ra> ...\n", argv[0]);
+		fprintf(stderr, "\t-w\tstore the checksum record in each file\n");
+		return EX_USAGE;
+	}
+	ra_set_exit_on_error(0);  // report each file and carry on
+	for (int i = optind; i < argc; ++i) {
+		uint32_t crc;
+		int ret = store ? ra_checksum_store(argv[i]) : 0;
+		if (ret == 0)
+			ret = ra_checksum(argv[i], &crc);
+		if (ret < 0) {
+			printf("%-8s  %s  FAILED: %s\n", "", argv[i], ra_strerror());
+			++failed;
+		} else
+			printf("%08x  %s%s\n", crc, argv[i], ret == 1 ? "  OK" : "");
+	}
+	return failed ? EX_DATAERR : EX_OK;
+}
+
+int
+align (int argc, char *argv[])
+{
+	uint64_t alignment = RA_DEFAULT_ALIGN;
+	int c;
+	while ((c = getopt(argc, argv, "a:h")) != -1) {
+		switch (c) {
+		case 'a':
+			alignment = strtoull(optarg, NULL, 0);
+			break;
+		case 'h':
+		default:
+			optind = argc;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "Pad the header of ra files so their data starts on an aligned offset.\n");
+		fprintf(stderr, "Usage: ra %s [-a bytes] <file.ra> ...\n", argv[0]);
+		fprintf(stderr, "\t-a\talignment, a power of two (default %d); 0 removes the padding\n",
+				RA_DEFAULT_ALIGN);
+		return EX_USAGE;
+	}
+	for (int i = optind; i < argc; ++i)
+		ra_align_file(argv[i], alignment);
+	return EX_OK;
+}
+
+int
+stats (int argc, char *argv[])
+{
+	int failed = 0;
+	if (argc < 2) {
+		fprintf(stderr, "Print the count, NaN and Inf counts, min, max, mean and standard deviation\n");
+		fprintf(stderr, "of the values of ra files. Complex values contribute their magnitude.\n");
+		fprintf(stderr, "Usage: ra %s <file.ra> ...\n", argv[0]);
+		return EX_USAGE;
+	}
+	ra_set_exit_on_error(0);  // report each file and carry on
+	for (int i = 1; i < argc; ++i) {
+		ra_stats_t s;
+		if (ra_stats_file(argv[i], &s) < 0) {
+			printf("%s  FAILED: %s\n", argv[i], ra_strerror());
+			++failed;
+		} else
+			printf("%s  n=%lu nan=%lu inf=%lu min=%.10g max=%.10g mean=%.9g std=%.9g\n", argv[i],
+					s.n, s.nnan, s.ninf, s.min, s.max, s.mean, s.std);
+	}
+	return failed ? EX_DATAERR : EX_OK;
+}
+
+int
+hist (int argc, char *argv[])
+{
+	uint64_t nbins = 20;
+	double lo = NAN, hi = NAN, p[16] = { 1, 50, 99 };
+	int c, np = 3, bad = 0;
+	char *colon;
+	while ((c = getopt(argc, argv, "b:r:p:h")) != -1) {
+		switch (c) {
+		case 'b':
+			nbins = strtoull(optarg, NULL, 0);
+			bad |= nbins == 0;
+			break;
+		case 'r':
+			lo = strtod(optarg, &colon);
+			bad |= *colon != ':';
+			hi = strtod(colon + 1, NULL);
+			break;
+		case 'p':
+			np = 0;
+			for (char *t = strtok(optarg, ","); t != NULL && np < 16; t = strtok(NULL, ","))
+				p[np++] = strtod(t, NULL);
+			break;
+		case 'h':
+		default:
+			bad = 1;
+		}
+	}
+	if (bad || optind + 1 != argc) {
+		fprintf(stderr, "Print the percentiles and a histogram of the values of an ra file, in one pass.\n");
+		fprintf(stderr, "Complex values contribute their magnitude.\n");
+		fprintf(stderr, "Usage: ra %s [-b bins] [-r lo:hi] [-p 1,50,99] <file.ra>\n", argv[0]);
+		fprintf(stderr, "\t-b\tnumber of bins (default 20)\n");
+		fprintf(stderr, "\t-r\trange of the bins (default min:max)\n");
+		fprintf(stderr, "\t-p\tpercentiles to print (default 1,50,99)\n");
+		return EX_USAGE;
+	}
+	ra_hist_t h;
+	ra_histogram_file(argv[optind], &h);
+	printf("n=%lu nan=%lu inf=%lu min=%.10g max=%.10g\n", h.n + h.nnan + h.ninf, h.nnan, h.ninf,
+			h.min, h.max);
+	for (int k = 0; k < np; ++k)
+		printf("%sp%g=%.6g", k ? "  " : "", p[k], ra_hist_quantile(&h, p[k] / 100));
+	printf("\n");
+	if (isnan(lo)) {
+		lo = h.min;
+		hi = h.max;
+	}
+	uint64_t *counts = malloc(nbins*sizeof(uint64_t)), most = 1;
+	if (h.n > 0 && counts != NULL) {
+		ra_hist_bins(&h, lo, hi, nbins, counts);
+		for (uint64_t b = 0; b < nbins; ++b)
+			most = counts[b] > most ? counts[b] : most;
+		for (uint64_t b = 0; b < nbins; ++b) {
+			printf("%12.6g %12lu  ", lo + (hi - lo)*b/nbins, counts[b]);
+			for (uint64_t j = 0; j < (counts[b]*50 + most - 1)/most; ++j)
+				putchar('#');
+			putchar('\n');
+		}
+	}
+	free(counts);
+	ra_hist_free(&h);
+	return EX_OK;
+}
+
+int
+convert (int argc, char *argv[])
+{
+	double scale = 1, offset = 0;
+	int c, flags = 0, bad = 0;
+	while ((c = getopt(argc, argv, "a:b:wh")) != -1) {
+		switch (c) {
+		case 'a':
+			scale = strtod(optarg, NULL);
+			break;
+		case 'b':
+			offset = strtod(optarg, NULL);
+			break;
+		case 'w':
+			flags |= RA_CONVERT_WRAP;
+			break;
+		case 'h':
+		default:
+			bad = 1;
+		}
+	}
+	if (bad || optind + 3 != argc) {
+		fprintf(stderr, "Convert an ra file to another element type, as a*x + b, streaming so that\n");
+		fprintf(stderr, "files larger than memory convert in constant memory.\n");
+		fprintf(stderr, "Usage: ra %s [-a scale] [-b offset] [-w] <type> <in.ra> <out.ra>\n", argv[0]);
+		fprintf(stderr, "\ttype\tas in ra_create: i1-i8, u1-u8, f2, f4, f8, b2 (bfloat16), c8 or c16\n");
+		fprintf(stderr, "\t-a\tmultiply by scale (default 1)\n");
+		fprintf(stderr, "\t-b\tthen add offset (default 0)\n");
+		fprintf(stderr, "\t-w\tlet integers wrap around instead of saturating\n");
+		return EX_USAGE;
+	}
+	ra_convert_file(argv[optind + 1], argv[optind + 2], argv[optind], scale, offset, flags);
+	return EX_OK;
+}
+
+int
+split (int argc, char *argv[])
+{
+	int c, flags = 0, bad = 0;
+	while ((c = getopt(argc, argv, "ph")) != -1) {
+		switch (c) {
+		case 'p':
+			flags |= RA_COMPLEX_POLAR;
+			break;
+		case 'h':
+		default:
+			bad = 1;
+		}
+	}
+	if (bad || optind + 2 > argc || optind + 3 < argc) {
+		fprintf(stderr, "Split a complex ra file into files of its real and imaginary parts, streaming.\n");
+		fprintf(stderr, "Usage: ra %s [-p] <in.ra> <re.ra> [im.ra]\n", argv[0]);
+		fprintf(stderr, "\t-p\tmagnitude and phase instead of real and imaginary parts\n");
+		return EX_USAGE;
+	}
+	ra_complex_split_file(argv[optind], argv[optind + 1], argv[optind + 2], flags);
+	return EX_OK;
+}
+
+int
+interleave (int argc, char *argv[])
+{
+	int c, flags = 0, bad = 0;
+	while ((c = getopt(argc, argv, "ph")) != -1) {
+		switch (c) {
+		case 'p':
+			flags |= RA_COMPLEX_POLAR;
+			break;
+		case 'h':
+		default:
+			bad = 1;
+		}
+	}
+	if (bad || optind + 3 != argc) {
+		fprintf(stderr, "Interleave files of real and imaginary parts into a complex ra file, streaming.\n");
+		fprintf(stderr, "Usage: ra %s [-p] <re.ra> <im.ra> <out.ra>\n", argv[0]);
+		fprintf(stderr, "\t-p\tthe parts are magnitude and phase\n");
+		return EX_USAGE;
+	}
+	ra_complex_interleave_file(argv[optind], argv[optind + 1], argv[optind + 2], flags);
+	return EX_OK;
+}
+
+int
+endian (int argc, char *argv[])
+{
+	uint64_t order = __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__ ? RA_FLAG_BIG_ENDIAN : 0;
+	int c;
+	while ((c = getopt(argc, argv, "blh")) != -1) {
+		switch (c) {
+		case 'b':
+			order = RA_FLAG_BIG_ENDIAN;
+			break;
+		case 'l':
+			order = 0;
+			break;
+		case 'h':
+		default:
+			optind = argc;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "Byte-swap the data of uncompressed ra files in place.\n");
+		fprintf(stderr, "Usage: ra %s [-b|-l] <file.ra> ...\n", argv[0]);
+		fprintf(stderr, "\t-b\tstore big-endian\n");
+		fprintf(stderr, "\t-l\tstore little-endian\n");
+		fprintf(stderr, "\tThe default is the byte order of this machine.\n");
+		return EX_USAGE;
+	}
+	for (int i = optind; i < argc; ++i)
+		ra_endian_file(argv[i], order);
+	return EX_OK;
+}
+
+int
+pack (int argc, char *argv[])
+{
+	if (argc < 3) {
+		fprintf(stderr, "Pack ra files into one indexed file, naming each member by its path.\n");
+		fprintf(stderr, "Usage: ra %s <pack.ra> <file.ra> ...\n", argv[0]);
+		return EX_USAGE;
+	}
+	ra_pack_files(argv[1], (const char * const *)argv + 2, argc - 2);
+	return EX_OK;
+}
+
+static int
+make_parents (char *path)
+{  /* create the directories leading up to path */
+	for (char *p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		int ret = mkdir(path, 0755);
+		*p = '/';
+		if (ret != 0 && errno != EEXIST)
+			return -1;
+	}
+	return 0;
+}
+
+int
+unpack (int argc, char *argv[])
+{
+	int failed = 0;
+	if (argc < 2) {
+		fprintf(stderr, "Extract the members of a pack, under dir if given.\n");
+		fprintf(stderr, "Usage: ra %s <pack.ra> [dir]\n", argv[0]);
+		return EX_USAGE;
+	}
+	const char *dir = argc > 2 ? argv[2] : ".";
+	ra_pack_t *p = ra_pack_open(argv[1]);
+	for (uint64_t i = 0; i < ra_pack_count(p); ++i) {
+		const char *name = ra_pack_name(p, i);
+		char *path = malloc(strlen(dir) + strlen(name) + 2);
+		sprintf(path, "%s/%s", dir, name);
+		if (name[0] == '/' || strncmp(name, "../", 3) == 0 || strstr(name, "/../")) {
+			fprintf(stderr, "skipping %s: it would land outside %s\n", name, dir);
+			++failed;
+		} else if (make_parents(path) != 0) {
+			perror(path);
+			++failed;
+		} else
+			ra_pack_extract(p, i, path);
+		free(path);
+	}
+	ra_pack_close(p);
+	return failed ? EX_CANTCREAT : EX_OK;
+}
+
+int
+ls (int argc, char *argv[])
+{
+	ra_t a;
+	if (argc < 2) {
+		fprintf(stderr, "List the members of a pack.\n");
+		fprintf(stderr, "Usage: ra %s <pack.ra>\n", argv[0]);
+		return EX_USAGE;
+	}
+	ra_pack_t *p = ra_pack_open(argv[1]);
+	for (uint64_t i = 0; i < ra_pack_count(p); ++i) {
+		ra_pack_mmap(p, i, &a);
+		printf("%-30s ", ra_pack_name(p, i));
+		ra_peek(&a);
+		ra_munmap(&a);
+	}
+	ra_pack_close(p);
+	return EX_OK;
+}
+
+int
+index_dir (int argc, char *argv[])
+{
+	const char *out = NULL;
+	int c;
+	while ((c = getopt(argc, argv, "o:h")) != -1) {
+		switch (c) {
+		case 'o':
+			out = optarg;
+			break;
+		case 'h':
+		default:
+			optind = argc;
+		}
+	}
+	if (optind + 1 != argc) {
+		fprintf(stderr, "Index the headers of the ra files below a directory, for ra query.\n");
+		fprintf(stderr, "Usage: ra %s [-o index] <dir>\n", argv[0]);
+		fprintf(stderr, "\t-o\twrite the index here instead of <dir>/%s\n", RA_INDEX_NAME);
+		return EX_USAGE;
+	}
+	if (getenv("RA_NUM_THREADS") == NULL)
+		ra_set_num_threads(sysconf(_SC_NPROCESSORS_ONLN));
+	int nread = ra_index_build(argv[optind], out);
+	printf("%d headers read\n", nread);
+	return EX_OK;
+}
+
+static int
+parse_dims (char *spec, ra_filter_t *f)
+{  /* "256,256,*" fixes ndims at 3 and the first two dims */
+	uint64_t k = 0;
+	for (char *s = strtok(spec, ",x"); s != NULL; s = strtok(NULL, ",x"), ++k) {
+		if (k == RA_INDEX_MAXDIMS)
+			return -1;
+		f->dims[k] = strcmp(s, "*") == 0 ? RA_ANY : strtoull(s, NULL, 0);
+	}
+	f->ndims = k;
+	return 0;
+}
+
+int
+query (int argc, char *argv[])
+{
+	ra_filter_t f;
+	int c, count = 0, bad = 0;
+	char *colon;
+	struct stat st;
+	ra_filter_init(&f);
+	while ((c = getopt(argc, argv, "t:e:b:n:d:s:ch")) != -1) {
+		switch (c) {
+		case 't':
+			ra_parse_type(optarg, &f.eltype, &f.elbyte);
+			if (f.elbyte == 0)  // just the kind, as in -t c
+				f.elbyte = RA_ANY;
+			break;
+		case 'e':
+			f.eltype = strchr(RA_TYPE_CODES, optarg[0]) ? strchr(RA_TYPE_CODES, optarg[0]) - RA_TYPE_CODES
+				: strtoull(optarg, NULL, 0);
+			break;
+		case 'b':
+			f.elbyte = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			f.ndims = strtoull(optarg, NULL, 0);
+			break;
+		case 'd':
+			bad |= parse_dims(optarg, &f);
+			break;
+		case 's':
+			f.minsize = strtoull(optarg, &colon, 0);
+			f.maxsize = *colon == ':' ? (colon[1] ? strtoull(colon + 1, NULL, 0) : RA_ANY) : f.minsize;
+			break;
+		case 'c':
+			count = 1;
+			break;
+		case 'h':
+		default:
+			bad = 1;
+		}
+	}
+	if (bad || optind + 1 != argc) {
+		fprintf(stderr, "List the ra files below a directory that match, using its index.\n");
+		fprintf(stderr, "Usage: ra %s [-t type] [-e eltype] [-b elbyte] [-n ndims] [-d dims] [-s bytes] [-c]\n"
+			"\t<dir|index>\n", argv[0]);
+		fprintf(stderr, "\t-t\ttype code as in ra_create, such as c8; c alone means any complex\n");
+		fprintf(stderr, "\t-e\telemental type, as a code letter or number\n");
+		fprintf(stderr, "\t-b\tbytes per element\n");
+		fprintf(stderr, "\t-n\tnumber of dimensions\n");
+		fprintf(stderr, "\t-d\tdimensions such as 256,256,*, where * matches any length\n");
+		fprintf(stderr, "\t-s\tdata size in bytes, or a range min:max where either may be left out\n");
+		fprintf(stderr, "\t-c\tprint only the number of matches\n");
+		fprintf(stderr, "Build or refresh the index with ra index <dir>.\n");
+		return EX_USAGE;
+	}
+	const char *dir = argv[optind];
+	char *path = NULL;
+	if (stat(dir, &st) == 0 && S_ISDIR(st.st_mode)) {
+		path = malloc(strlen(dir) + strlen(RA_INDEX_NAME) + 2);
+		sprintf(path, "%s/%s", dir, RA_INDEX_NAME);
+	} else
+		dir = NULL;  // an index file given directly; its names are printed as stored
+	ra_index_t *x = ra_index_open(path ? path : argv[optind]);
+	uint64_t nmatch = 0;
+	for (uint64_t i = 0; i < ra_index_count(x); ++i)
+		if (ra_index_match(ra_index_entry(x, i), &f)) {
+			++nmatch;
+			if (!count && dir)
+				printf("%s/%s\n", dir, ra_index_name(x, i));
+			else if (!count)
+				printf("%s\n", ra_index_name(x, i));
+		}
+	if (count)
+		printf("%lu\n", nmatch);
+	ra_index_close(x);
+	free(path);
+	return nmatch ? EX_OK : 1;
+}
+
+int
+permute (int argc, char *argv[])
+{
+	if (argc < 3) {
+		fprintf(stderr, "Permute the dimensions of an ra file.\n");
+		fprintf(stderr, "Usage: ra %s <in.ra> <out.ra> [p0 p1 ...]\n", argv[0]);
+		fprintf(stderr, "Dimension k of out.ra is dimension pk of in.ra, counting from 0. Without\n"
+			"a permutation the dimensions are reversed, which turns column-major order\n"
+			"into row-major.\n");
+		return EX_USAGE;
+	}
+	ra_header_t *h = ra_header(argv[1]);
+	if (argc > 3 && argc - 3 != h->ndims) {
+		fprintf(stderr, "%s has %lu dimensions, but %d were given\n", argv[1], h->ndims, argc - 3);
+		free(h);
+		return EX_USAGE;
+	}
+	uint64_t *perm = malloc(h->ndims*sizeof(uint64_t) + 1);
+	for (uint64_t k = 0; k < h->ndims; ++k)
+		perm[k] = argc > 3 ? strtoull(argv[k + 3], NULL, 0) : h->ndims - 1 - k;
+	if (getenv("RA_NUM_THREADS") == NULL)
+		ra_set_num_threads(sysconf(_SC_NPROCESSORS_ONLN));
+	if (h->flags & RA_FLAG_COMPRESSED) {  // only a file with raw data can be permuted in place on disk
+		ra_t r;
+		ra_read(&r, argv[1]);
+		ra_decompress(&r);
+		ra_permute(&r, perm);
+		ra_write(&r, argv[2]);
+		ra_free(&r);
+	} else
+		ra_permute_file(argv[1], argv[2], perm);
+	free(perm);
+	free(h);
+	return EX_OK;
+}
+
 void
 print_usage()
 {
-		printf("Usage: ra [diff|head|reshape|compress|decompress] <options>\n");
+		printf("Usage: ra [diff|head|reshape|slice|compress|decompress|checksum|stats|hist|convert|split|interleave|align|endian|pack|unpack|ls|index|query|permute] <options>\n");
 }
 
 int
 main (int argc, char *argv[])
 {
+	ra_set_exit_on_error(1);
 	if (argc < 2) {
 		print_usage();
 		return EX_USAGE;
 	}
 	if (strncmp(argv[1], "diff", 4) == 0)
-		diff(argc-1, argv+1);
+		return diff(argc-1, argv+1);
 	else if (strncmp(argv[1], "head", 4) == 0)
-		head(argc-1, argv+1);
+		return head(argc-1, argv+1);
 	else if (strncmp(argv[1], "reshape", 7) == 0)
 		reshape(argc-1, argv+1);
+	else if (strncmp(argv[1], "slice", 5) == 0)
+		slice(argc-1, argv+1);
 	else if (strncmp(argv[1], "dims", 4) == 0)
 		dims(argc-1, argv+1);
 	else if (strncmp(argv[1], "head", 4) == 0)
@@ -238,6 +865,34 @@ main (int argc, char *argv[])
 		compress(argc-1, argv+1);
 	else if (strncmp(argv[1], "decompress", 10) == 0)
 		decompress(argc-1, argv+1);
+	else if (strncmp(argv[1], "checksum", 8) == 0)
+		return checksum(argc-1, argv+1);
+	else if (strncmp(argv[1], "stats", 5) == 0)
+		return stats(argc-1, argv+1);
+	else if (strncmp(argv[1], "hist", 4) == 0)
+		return hist(argc-1, argv+1);
+	else if (strncmp(argv[1], "convert", 7) == 0)
+		return convert(argc-1, argv+1);
+	else if (strncmp(argv[1], "split", 5) == 0)
+		return split(argc-1, argv+1);
+	else if (strncmp(argv[1], "interleave", 10) == 0)
+		return interleave(argc-1, argv+1);
+	else if (strncmp(argv[1], "align", 5) == 0)
+		return align(argc-1, argv+1);
+	else if (strncmp(argv[1], "endian", 6) == 0)
+		return endian(argc-1, argv+1);
+	else if (strncmp(argv[1], "pack", 4) == 0)
+		return pack(argc-1, argv+1);
+	else if (strncmp(argv[1], "unpack", 6) == 0)
+		return unpack(argc-1, argv+1);
+	else if (strncmp(argv[1], "ls", 2) == 0)
+		return ls(argc-1, argv+1);
+	else if (strncmp(argv[1], "index", 5) == 0)
+		return index_dir(argc-1, argv+1);
+	else if (strncmp(argv[1], "query", 5) == 0)
+		return query(argc-1, argv+1);
+	else if (strncmp(argv[1], "permute", 7) == 0)
+		return permute(argc-1, argv+1);
 	else  {
 		print_usage();
 		return EX_USAGE;
@@ -78,6 +78,7 @@ png_read (const char *png_file)
 int main(int argc, char *argv[])
 {
 	char png_file[256], ra_file[256];
+	ra_set_exit_on_error(1);
 	if (argc < 2) {
 		printf("%s <pngfile>\n", argv[0]);
 		return 1;
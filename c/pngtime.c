@@ -97,6 +97,7 @@ int
 main(int argc, char *argv[])
 {
 	char png_file[256], ra_file[256];
+	ra_set_exit_on_error(1);
 	if (argc < 2) {
 		printf("%s <basename>\n", argv[0]);
 		return 1;
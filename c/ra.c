@@ -24,13 +24,20 @@
   SOFTWARE.
 */
 
+#define _GNU_SOURCE
+#include <dirent.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <malloc.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -51,7 +58,7 @@
 #define DIMS_OFFSET   48
 
 enum diff_type {
-	DIFF_FLAGS = 0,
+	DIFF_FLAGS = 1,  /* 0 means the arrays are identical */
 	DIFF_ELTYPE,
 	DIFF_ELBYTE,
 	DIFF_SIZE,
@@ -64,9 +71,217 @@ enum diff_type {
 
 /* flag booleans */
 inline static int is_compressed(ra_t *r) { return r->flags & RA_FLAG_COMPRESSED; }
+inline static int is_chunked(ra_t *r) { return r->flags & RA_FLAG_CHUNKED; }
 inline static int is_big_endian(ra_t *r) { return r->flags & RA_FLAG_BIG_ENDIAN; }
 
 
+//
+// SIMD SUPPORT
+//
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RA_X86
+#include <immintrin.h>
+#define TARGET(isa) __attribute__((target(isa)))
+
+static int
+have_avx2(void)
+{
+	static int has = -1;
+	if (has < 0)
+		has = __builtin_cpu_supports("avx2");
+	return has;
+}
+#endif
+
+//
+// BYTE ORDER
+//
+
+/*
+   RA_FLAG_BIG_ENDIAN gives the byte order of the data. Headers are normally
+   little-endian, but one written natively on a big-endian machine shows up
+   here with its magic number byte-reversed, and is reversed word by word
+   before use. Reads hand back data in host order and set the flag to match.
+   Complex numbers are swapped as two halves, and user types not at all.
+*/
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HOST_ORDER  RA_FLAG_BIG_ENDIAN
+#else
+#define HOST_ORDER  0
+#endif
+
+#define SWAPPED_MAGIC  __builtin_bswap64(RA_MAGIC_NUMBER)
+
+static uint64_t
+swap_width(const ra_t *r)
+{  /* bytes per word whose order is reversed, or 1 for none */
+	if (r->eltype == RA_TYPE_USER || r->elbyte < 2)
+		return 1;
+	return r->eltype == RA_TYPE_COMPLEX ? r->elbyte / 2 : r->elbyte;
+}
+
+static int
+is_foreign(ra_t *r)
+{  /* whether the data is in the other byte order than the host's */
+	return (is_big_endian(r) != 0) != (HOST_ORDER != 0) && swap_width(r) > 1;
+}
+
+#ifdef RA_X86
+static const uint8_t swap_masks[4][16] = {  /* for words of 2, 4, 8 and 16 bytes */
+	{ 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 },
+	{ 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 },
+	{ 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8 },
+	{ 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0 }
+};
+
+static int
+have_ssse3(void)
+{
+	static int has = -1;
+	if (has < 0)
+		has = __builtin_cpu_supports("ssse3");
+	return has;
+}
+
+TARGET("ssse3") static uint64_t
+swap_ssse3(uint8_t *p, const uint64_t len, const uint8_t *mask, uint64_t i)
+{
+	const __m128i m = _mm_loadu_si128((const __m128i*)mask);
+	for (; i + 16 <= len; i += 16)
+		_mm_storeu_si128((__m128i*)(p + i), _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)(p + i)), m));
+	return i;
+}
+
+TARGET("avx2") static uint64_t
+swap_avx2(uint8_t *p, const uint64_t len, const uint8_t *mask, uint64_t i)
+{  /* the shuffle works within each 128-bit lane, so both get the same mask */
+	const __m256i m = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)mask));
+	for (; i + 64 <= len; i += 64) {
+		__m256i x = _mm256_loadu_si256((__m256i*)(p + i)), y = _mm256_loadu_si256((__m256i*)(p + i + 32));
+		_mm256_storeu_si256((__m256i*)(p + i), _mm256_shuffle_epi8(x, m));
+		_mm256_storeu_si256((__m256i*)(p + i + 32), _mm256_shuffle_epi8(y, m));
+	}
+	return i;
+}
+#endif
+
+static void
+swap_bytes(uint8_t *p, const uint64_t len, const uint64_t w)
+{  /* reverse the bytes of each whole w-byte word of p in place */
+	uint64_t i = 0;
+	if (w < 2)
+		return;
+#ifdef RA_X86
+	int k = w == 2 ? 0 : w == 4 ? 1 : w == 8 ? 2 : w == 16 ? 3 : -1;
+	if (k >= 0 && have_avx2())
+		i = swap_avx2(p, len, swap_masks[k], i);
+	if (k >= 0 && have_ssse3())
+		i = swap_ssse3(p, len, swap_masks[k], i);
+#endif
+	for (; i + w <= len; i += w)
+		if (w == 2) {
+			uint16_t x;
+			memcpy(&x, p + i, 2);
+			x = __builtin_bswap16(x);
+			memcpy(p + i, &x, 2);
+		} else if (w == 4) {
+			uint32_t x;
+			memcpy(&x, p + i, 4);
+			x = __builtin_bswap32(x);
+			memcpy(p + i, &x, 4);
+		} else if (w == 8) {
+			uint64_t x;
+			memcpy(&x, p + i, 8);
+			x = __builtin_bswap64(x);
+			memcpy(p + i, &x, 8);
+		} else
+			for (uint64_t j = 0; j < w/2; ++j) {
+				uint8_t t = p[i+j];
+				p[i+j] = p[i+w-1-j];
+				p[i+w-1-j] = t;
+			}
+}
+
+static void
+swap_header(uint8_t *top, const size_t len)
+{  /* reverse the words of a byte-swapped header held in the first len bytes of top */
+	uint64_t ndims, flags, end = DIMS_OFFSET;
+	swap_bytes(top, DIMS_OFFSET < len ? DIMS_OFFSET : len, sizeof(uint64_t));
+	if (len < DIMS_OFFSET)
+		return;
+	memcpy(&flags, top + FLAGS_OFFSET, sizeof(uint64_t));
+	memcpy(&ndims, top + NDIMS_OFFSET, sizeof(uint64_t));
+	if (ndims < (len - DIMS_OFFSET) / sizeof(uint64_t))
+		end += sizeof(uint64_t)*(ndims + (flags & RA_FLAG_ALIGNED ? 1 : 0));
+	swap_bytes(top + DIMS_OFFSET, (end < len ? end : len) - DIMS_OFFSET, sizeof(uint64_t));
+}
+
+//
+// ERROR HANDLING
+//
+
+static __thread int last_error = RA_OK;
+static __thread char last_message[256];
+static int exit_on_error = 0;
+
+/* process exit status for each error code when exiting on error */
+static const int exit_status[] = {
+	EX_OK, EX_IOERR, EX_OSERR, EX_CANTCREAT, EX_DATAERR, EX_DATAERR, EX_USAGE, EX_DATAERR
+};
+
+void
+ra_set_exit_on_error(const int on)
+{
+	exit_on_error = on;
+}
+
+int
+ra_errno(void)
+{
+	return last_error;
+}
+
+const char *
+ra_strerror(void)
+{
+	return last_message;
+}
+
+static int
+raise_error(const int code)
+{
+	last_error = code;
+	if (exit_on_error)
+		errx(exit_status[code], "%s", last_message);
+	return -code;
+}
+
+static int
+fail(const int code, const char *fmt, ...)
+{  /* record a failure for the calling thread and return its negated code */
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(last_message, sizeof last_message, fmt, ap);
+	va_end(ap);
+	return raise_error(code);
+}
+
+static int
+fail_sys(const int code, const char *fmt, ...)
+{  /* like fail, with the description of errno appended */
+	int saved = errno;
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(last_message, sizeof last_message, fmt, ap);
+	va_end(ap);
+	size_t n = strlen(last_message);
+	snprintf(last_message + n, sizeof last_message - n, ": %s", strerror(saved));
+	return raise_error(code);
+}
+
+
 //
 // VALIDATION FUNCTIONS
 //
@@ -74,14 +289,57 @@ inline static int is_big_endian(ra_t *r) { return r->flags & RA_FLAG_BIG_ENDIAN;
 static int
 check_magic_and_flags (const ra_t * restrict a)
 {
+    if (a->magic == SWAPPED_MAGIC)
+        return fail(RA_EFORMAT, "byte-swapped header; convert the file with ra endian");
     if (a->magic != RA_MAGIC_NUMBER)
-        err(EX_DATAERR, "Invalid magic: %lu\n", a->magic);
+        return fail(RA_EFORMAT, "Invalid magic: %lu", a->magic);
     if (a->flags & RA_UNKNOWN_FLAGS) {
         fprintf(stderr, "Warning: This RA file must have been written by a newer version of this\n");
         fprintf(stderr, "code. Correctness of input is not guaranteed. Update your version of the\n");
         fprintf(stderr, "RawArray package to stop this warning.\n");
     }
-    return 1;
+    return 0;
+}
+
+static int
+valid_align(const uint64_t align)
+{
+	return align >= sizeof(uint64_t) && align <= RA_MAX_ALIGN && (align & (align - 1)) == 0;
+}
+
+inline static uint64_t
+padded_header(const uint64_t ndims, const uint64_t align)
+{  /* header length with room for the alignment word, rounded up to align */
+	return (DIMS_OFFSET + sizeof(uint64_t)*(ndims + 1) + align - 1) & ~(align - 1);
+}
+
+inline static size_t
+ra_header_size(const ra_t * restrict r)
+{
+	if (r->flags & RA_FLAG_ALIGNED)
+		return padded_header(r->ndims, r->align);
+	return DIMS_OFFSET + sizeof(uint64_t)*r->ndims;
+}
+
+inline static size_t
+ra_file_size(const ra_t * restrict r)
+{
+	return ra_header_size(r) + r->size;
+}
+
+static int
+load_align(ra_t *a, const uint8_t *file, const size_t size, const char *path)
+{  /* fetch the alignment word of a file in memory whose ndims is known to fit */
+	uint64_t at = DIMS_OFFSET + sizeof(uint64_t)*a->ndims;
+	a->align = 0;
+	if (!(a->flags & RA_FLAG_ALIGNED))
+		return 0;
+	if (at + sizeof(uint64_t) > size)
+		return fail(RA_EFORMAT, "%s is truncated inside its header", path);
+	memcpy(&a->align, file + at, sizeof(uint64_t));
+	if (!valid_align(a->align))
+		return fail(RA_EFORMAT, "%s: invalid data alignment %lu", path, a->align);
+	return 0;
 }
 
 void
@@ -93,56 +351,192 @@ print_magic (const ra_t *r)
 	printf("\n");
 }
 
-static size_t
+static int
 valid_read(int fd, void *buf, const size_t count)
 {
-    size_t nread = read(fd, buf, count);
+    ssize_t nread = read(fd, buf, count);
+    if (nread < 0)
+        return fail_sys(RA_EIO, "read failed");
     if (nread != count)
-        err(EX_IOERR, "Read %lu bytes instead of %lu.\n", nread, count);
-    return nread;
+        return fail(RA_EIO, "Read %ld bytes instead of %lu.", nread, count);
+    return 0;
 }
 
-static size_t
+static int
+valid_pread(int fd, void *buf, const size_t count, const off_t offset)
+{
+	size_t bytesleft = count;
+	uint8_t *cursor = buf;
+	while (bytesleft > 0)
+	{
+		size_t chunk = bytesleft < RA_MAX_BYTES ? bytesleft : RA_MAX_BYTES;
+		ssize_t nread = pread(fd, cursor, chunk, offset + (count - bytesleft));
+		if (nread < 0)
+			return fail_sys(RA_EIO, "read failed");
+		if (nread == 0)
+			return fail(RA_EIO, "Read %lu bytes instead of %lu.", count - bytesleft, count);
+		cursor += nread;
+		bytesleft -= nread;
+	}
+	return 0;
+}
+
+static int
 valid_write (int fd, const void * restrict buf, const size_t count)
 {
-    size_t nwrote = write(fd, buf, count);
+    ssize_t nwrote = write(fd, buf, count);
+    if (nwrote < 0)
+        return fail_sys(RA_EIO, "write failed");
     if (nwrote != count)
-        err(EX_IOERR, "Wrote %lu bytes instead of %lu.\n", nwrote, count);
-    return nwrote;
+        return fail(RA_EIO, "Wrote %ld bytes instead of %lu.", nwrote, count);
+    return 0;
 }
 
 static void *
 safe_malloc(const size_t size)
 {
 	void *data = malloc(size);
-	if (data == NULL)
-		err(EX_OSERR, "unable to allocate memory for data");
+	if (data == NULL && size > 0)
+		fail(RA_ENOMEM, "unable to allocate %lu bytes", size);
 	return data;
 }
 
 static void
 refresh_mem_from_struct(ra_t *r)
 {
-	if (r->top != NULL) {  // only do if using unified mem
+	if (r->top != NULL && r->mapsize == 0) {  // only do if using unified, writable mem
 		*((uint64_t*)(r->top)) = r->magic;
 		*((uint64_t*)(r->top + FLAGS_OFFSET)) = r->flags;
 		*((uint64_t*)(r->top + ELTYPE_OFFSET)) = r->eltype;
 		*((uint64_t*)(r->top + ELBYTE_OFFSET)) = r->elbyte;
 		*((uint64_t*)(r->top + SIZE_OFFSET)) =  r->size;
 		*((uint64_t*)(r->top + NDIMS_OFFSET)) =  r->ndims;
+		if (r->flags & RA_FLAG_ALIGNED) {  // alignment word, then zeros up to the data
+			uint8_t *pad = r->top + DIMS_OFFSET + sizeof(uint64_t)*r->ndims;
+			memset(pad, 0, r->data - pad);
+			memcpy(pad, &r->align, sizeof(uint64_t));
+		}
+	}
+}
+
+static void
+to_host_order(ra_t *r)
+{  /* swap the data of an uncompressed array in writable memory to host order */
+	if (is_compressed(r) || !is_foreign(r))
+		return;
+	swap_bytes(r->data, r->size, swap_width(r));
+	r->flags ^= RA_FLAG_BIG_ENDIAN;
+	refresh_mem_from_struct(r);
+}
+
+static size_t
+mem_pad(const size_t header)
+{  /* bytes to put before a header of this length so the data after it is aligned */
+	return (RA_MEM_ALIGN - header % RA_MEM_ALIGN) % RA_MEM_ALIGN;
+}
+
+static uint8_t *
+alloc_top(ra_t *r)
+{  /* unified memory for r, with the data on an RA_MEM_ALIGN boundary */
+	void *base;
+	size_t n = mem_pad(ra_header_size(r)) + ra_file_size(r);
+	if (posix_memalign(&base, RA_MEM_ALIGN, n) != 0) {
+		fail(RA_ENOMEM, "unable to allocate %lu bytes", n);
+		return NULL;
+	}
+	r->topoff = mem_pad(ra_header_size(r));
+	return (uint8_t*)base + r->topoff;
+}
+
+static void
+release_top(ra_t *r)
+{
+	if (r->mapsize)
+		munmap(r->top - r->topoff, r->mapsize);
+	else
+		free(r->top - r->topoff);
+	r->top = NULL;
+	r->mapsize = 0;
+	r->topoff = 0;
+}
+
+static int
+deunify(ra_t *r, uint8_t *newdata)
+{  /* give the struct its own dims and data so the unified memory can be released */
+	uint64_t *dims = safe_malloc(r->ndims*sizeof(uint64_t));
+	if (dims == NULL && r->ndims > 0)
+		return -RA_ENOMEM;
+	memcpy(dims, r->top + DIMS_OFFSET, r->ndims*sizeof(uint64_t));
+	r->dims = dims;
+	r->data = newdata;
+	release_top(r);
+	return 0;
+}
+
+static int
+relayout(ra_t *r, const ra_t *old)
+{  /* after a change of ndims or alignment, move the header and data of unified
+      memory to where they now belong, keeping the data aligned in memory */
+	size_t oldhead = ra_header_size(old), head = ra_header_size(r);
+	if (r->top == NULL || r->mapsize || head == oldhead)
+		return 0;
+	size_t keep = DIMS_OFFSET + sizeof(uint64_t)*(r->ndims < old->ndims ? r->ndims : old->ndims);
+	uint8_t *base = old->top - old->topoff;
+	size_t topoff = mem_pad(head);
+	if (topoff + head <= old->topoff + oldhead) {  // fits in place: header moves first
+		memmove(base + topoff, old->top, keep);
+		memmove(base + topoff + head, old->data, r->size);
+		r->topoff = topoff;
+		r->top = base + topoff;
+	} else {
+		if ((r->top = alloc_top(r)) == NULL) {
+			r->top = old->top;
+			r->topoff = old->topoff;
+			return -RA_ENOMEM;
+		}
+		memcpy(r->top, old->top, keep);
+		memcpy(r->top + head, old->data, r->size);
+		free(base);
 	}
+	r->dims = (uint64_t*)(r->top + DIMS_OFFSET);
+	r->data = r->top + head;
+	return 0;
 }
 
+static uint8_t *
+header_block(const ra_t *r)
+{  /* the header of r as stored on disk, padding included */
+	size_t n = ra_header_size(r);
+	uint8_t *h = calloc(n, 1);
+	if (h == NULL) {
+		fail(RA_ENOMEM, "unable to allocate %lu bytes", n);
+		return NULL;
+	}
+	memcpy(h, r, DIMS_OFFSET);
+	memcpy(h + DIMS_OFFSET, r->dims, r->ndims*sizeof(uint64_t));
+	if (r->flags & RA_FLAG_ALIGNED)
+		memcpy(h + DIMS_OFFSET + r->ndims*sizeof(uint64_t), &r->align, sizeof(uint64_t));
+	return h;
+}
 
 static int
 valid_open(const char *path, const int perms)
 {
     int fd = open(path, perms, 0644);
     if (fd == -1)
-        err(EX_CANTCREAT, "unable to open %s", path);
+        return fail_sys(RA_EOPEN, "unable to open %s", path);
     return fd;
 }
 
+static int
+distinct_output(const char *src, const char *dst)
+{  /* refuse to write dst over src, which truncating it would destroy before it is read */
+    struct stat s, d;
+    if (stat(src, &s) == 0 && stat(dst, &d) == 0 && s.st_dev == d.st_dev && s.st_ino == d.st_ino)
+        return fail(RA_EINVAL, "%s and %s are the same file", src, dst);
+    return 0;
+}
+
 
 //
 // SIMPLE QUERIES
@@ -160,18 +554,6 @@ ra_ondisk_size(int fd)
 	//return st.st_size;
 }
 
-inline static size_t
-ra_header_size(const ra_t * restrict r)
-{
-	return DIMS_OFFSET + sizeof(uint64_t)*r->ndims;
-}
-
-inline static size_t
-ra_file_size(const ra_t * restrict r)
-{
-	return DIMS_OFFSET + sizeof(uint64_t)*r->ndims + r->size;
-}
-
 inline static uint64_t
 ra_data_size(const ra_t *restrict r)
 {  /* return size of data region based on dimensions and elbyte */
@@ -182,36 +564,419 @@ ra_data_size(const ra_t *restrict r)
 }
 
 
+//
+// CHECKSUMS
+//
+
+#define CRC_PIECE  (1UL<<20)  /* bytes read or written between checksum updates */
+
+static int write_checksum = 0;
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+void
+ra_set_checksum(const int on)
+{
+	write_checksum = on;
+}
+
+static void
+crc_init(void)
+{  /* tables for slicing-by-8 over the reflected CRC32C polynomial */
+	for (uint32_t n = 0; n < 256; ++n) {
+		uint32_t c = n;
+		for (int k = 0; k < 8; ++k)
+			c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+		crc_table[0][n] = c;
+	}
+	for (uint32_t n = 0; n < 256; ++n)
+		for (int t = 1; t < 8; ++t)
+			crc_table[t][n] = (crc_table[t-1][n] >> 8) ^ crc_table[0][crc_table[t-1][n] & 0xff];
+}
+
+static uint32_t
+crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	pthread_once(&crc_once, crc_init);
+	for (; len >= 8; p += 8, len -= 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		w ^= crc;
+		crc = crc_table[7][w & 0xff] ^ crc_table[6][(w >> 8) & 0xff]
+			^ crc_table[5][(w >> 16) & 0xff] ^ crc_table[4][(w >> 24) & 0xff]
+			^ crc_table[3][(w >> 32) & 0xff] ^ crc_table[2][(w >> 40) & 0xff]
+			^ crc_table[1][(w >> 48) & 0xff] ^ crc_table[0][w >> 56];
+	}
+	while (len--)
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+#if defined(RA_X86) && defined(__x86_64__)
+static int
+have_sse42(void)
+{
+	static int has = -1;
+	if (has < 0)
+		has = __builtin_cpu_supports("sse4.2");
+	return has;
+}
+
+static TARGET("sse4.2") uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t c = crc;
+	for (; len >= 8; p += 8, len -= 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		c = _mm_crc32_u64(c, w);
+	}
+	crc = c;
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+#endif
+
+uint32_t
+ra_crc32c(uint32_t crc, const void *data, const size_t len)
+{  /* continue a CRC32C over len more bytes; start from 0 */
+	crc = ~crc;
+#if defined(RA_X86) && defined(__x86_64__)
+	if (have_sse42())
+		return ~crc32c_sse42(crc, data, len);
+#endif
+	return ~crc32c_sw(crc, data, len);
+}
+
+static void
+crc_span(uint32_t *crc, const uint8_t *buf, const uint64_t off, const uint64_t len,
+		const uint64_t begin, const uint64_t end)
+{  /* fold the part of buf, which holds file bytes [off, off+len), inside [begin, end) */
+	uint64_t lo = off > begin ? off : begin;
+	uint64_t hi = off + len < end ? off + len : end;
+	if (lo < hi)
+		*crc = ra_crc32c(*crc, buf + (lo - off), hi - lo);
+}
+
+#define RECORD_MISMATCH  2
+
+static int
+check_record(const uint8_t *record, const uint32_t crc)
+{  /* returns 1 for a matching record, 0 if there is none */
+	uint64_t tag, value;
+	memcpy(&tag, record, sizeof tag);
+	memcpy(&value, record + sizeof tag, sizeof value);
+	if (tag != RA_CHECKSUM_TAG)
+		return 0;
+	return value == crc ? 1 : RECORD_MISMATCH;
+}
+
+static int
+checksum_mismatch(const char *path, const uint32_t crc)
+{
+	return fail(RA_ECHECKSUM, "%s: data checksum %08x does not match the stored record", path, crc);
+}
+
+
+//
+// DIRECT IO
+//
+
+#define DIRECT_ALIGN  4096          /* a multiple of the logical block size of any device */
+#define DIRECT_PIECE  (4UL<<20)     /* bytes per bounce buffer */
+
+static int direct_io = 0;
+
+void
+ra_set_direct_io(const int on)
+{
+	direct_io = on;
+}
+
+/* A file streamed through two aligned bounce buffers. An io thread moves one
+   buffer between the disk and the buffer while the caller copies in or out of
+   the other, so the device always has a request outstanding. */
+typedef struct {
+	int fd;
+	int writing;
+	uint8_t *buf[2];
+	uint64_t piece;      /* size of each buffer */
+	uint64_t len[2];     /* bytes held in each buffer */
+	int busy[2];         /* buffer is with the io thread */
+	int cur;             /* buffer the caller is draining or filling */
+	uint64_t pos;        /* caller's position in it */
+	uint64_t off;        /* writing: file offset of the caller's buffer */
+	uint64_t end;        /* length of the file, or when writing the expected length */
+	int done;            /* no more buffers will be handed over */
+	int status;          /* error code of a failed transfer */
+	char message[sizeof last_message];
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} direct_stream;
+
+static int
+direct_transfer(direct_stream *s, const int b, const uint64_t off)
+{  /* move buffer b to or from the file at off, in whole device blocks */
+	uint64_t want = s->writing ? s->len[b] : s->end - off < s->piece ? s->end - off : s->piece;
+	uint64_t got = 0;
+	while (got < want) {
+		ssize_t n = s->writing ? pwrite(s->fd, s->buf[b] + got, want - got, off + got)
+			: pread(s->fd, s->buf[b] + got, s->piece - got, off + got);
+		if (n < 0)
+			return fail_sys(RA_EIO, s->writing ? "direct write failed" : "direct read failed");
+		if (n == 0)
+			return fail(RA_EIO, "Moved %lu bytes instead of %lu.", got, want);
+		got += n;
+	}
+	s->len[b] = want;
+	return 0;
+}
+
+static void *
+direct_worker(void *s_)
+{
+	direct_stream *s = s_;
+	uint64_t off = 0;
+	for (int b = 0; s->writing || off < s->end; b ^= 1) {
+		pthread_mutex_lock(&s->lock);
+		while (!s->busy[b] && !s->done)
+			pthread_cond_wait(&s->cond, &s->lock);
+		pthread_mutex_unlock(&s->lock);
+		if (!s->busy[b])
+			break;
+		int ret = direct_transfer(s, b, off);
+		off += s->len[b];
+		pthread_mutex_lock(&s->lock);
+		if (ret < 0) {
+			s->status = last_error;
+			memcpy(s->message, last_message, sizeof s->message);
+		}
+		s->busy[b] = 0;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+		if (ret < 0)
+			break;
+	}
+	return NULL;
+}
+
+static int
+direct_start(direct_stream *s, const int fd, const int writing, const uint64_t end)
+{  /* switch fd to O_DIRECT and start the io thread, or return -1 to stay buffered */
+	void *bufs;
+	uint64_t piece = end < DIRECT_PIECE ? (end + DIRECT_ALIGN - 1) & ~(uint64_t)(DIRECT_ALIGN - 1) : DIRECT_PIECE;
+	int flags = fcntl(fd, F_GETFL);
+	if (!direct_io || flags == -1 || fcntl(fd, F_SETFL, flags | O_DIRECT) == -1)
+		return -1;  // not asked for, or the filesystem cannot do it
+	if (piece == 0)
+		piece = DIRECT_ALIGN;
+	if (posix_memalign(&bufs, DIRECT_ALIGN, 2*piece) != 0) {
+		fcntl(fd, F_SETFL, flags);
+		return -1;
+	}
+	memset(s, 0, sizeof(direct_stream));
+	s->fd = fd;
+	s->writing = writing;
+	s->buf[0] = bufs;
+	s->piece = piece;
+	s->buf[1] = s->buf[0] + piece;
+	s->busy[0] = s->busy[1] = !writing;  // the reader fills both buffers straight away
+	s->end = end;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	if (pthread_create(&s->thread, NULL, direct_worker, s) != 0) {
+		pthread_cond_destroy(&s->cond);
+		pthread_mutex_destroy(&s->lock);
+		free(bufs);
+		fcntl(fd, F_SETFL, flags);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+direct_wait(direct_stream *s, const int b)
+{  /* wait for the io thread to hand buffer b back */
+	pthread_mutex_lock(&s->lock);
+	while (s->busy[b] && s->status == 0)
+		pthread_cond_wait(&s->cond, &s->lock);
+	int status = s->status;
+	pthread_mutex_unlock(&s->lock);
+	if (status == 0)
+		return 0;
+	memcpy(last_message, s->message, sizeof last_message);
+	return raise_error(status);
+}
+
+static void
+direct_handover(direct_stream *s)
+{  /* give the caller's buffer to the io thread and move on to the other */
+	pthread_mutex_lock(&s->lock);
+	s->busy[s->cur] = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	s->cur ^= 1;
+	s->pos = 0;
+}
+
+static int
+direct_fetch(direct_stream *s, uint8_t *dst, uint64_t n)
+{  /* copy the next n bytes of the file to dst */
+	while (n > 0) {
+		if (direct_wait(s, s->cur) < 0)
+			return -last_error;
+		uint64_t k = s->len[s->cur] - s->pos < n ? s->len[s->cur] - s->pos : n;
+		memcpy(dst, s->buf[s->cur] + s->pos, k);
+		s->pos += k;
+		dst += k;
+		n -= k;
+		if (s->pos == s->len[s->cur])
+			direct_handover(s);
+	}
+	return 0;
+}
+
+static int
+direct_put(direct_stream *s, const uint8_t *src, uint64_t n)
+{  /* append n bytes from src to the file */
+	while (n > 0) {
+		uint64_t k = s->piece - s->pos < n ? s->piece - s->pos : n;
+		memcpy(s->buf[s->cur] + s->pos, src, k);
+		s->pos += k;
+		src += k;
+		n -= k;
+		if (s->pos == s->piece) {
+			s->len[s->cur] = s->piece;
+			s->off += s->piece;
+			direct_handover(s);
+			if (direct_wait(s, s->cur) < 0)
+				return -last_error;
+		}
+	}
+	return 0;
+}
+
+static int
+direct_stop(direct_stream *s, int ret)
+{  /* end the stream, writing out what is left, and put fd back to buffered io */
+	pthread_mutex_lock(&s->lock);
+	s->done = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	pthread_join(s->thread, NULL);
+	uint64_t whole = s->pos & ~(uint64_t)(DIRECT_ALIGN - 1);
+	if (s->writing && ret == 0)
+		ret = direct_wait(s, s->cur ^ 1);
+	if (s->writing && ret == 0 && whole > 0 && pwrite(s->fd, s->buf[s->cur], whole, s->off) != whole)
+		ret = fail_sys(RA_EIO, "direct write failed");
+	fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) & ~O_DIRECT);
+	// a tail that is not a whole number of blocks goes through the page cache
+	if (s->writing && ret == 0 && s->pos > whole
+			&& pwrite(s->fd, s->buf[s->cur] + whole, s->pos - whole, s->off + whole) != s->pos - whole)
+		ret = fail_sys(RA_EIO, "write failed");
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+	free(s->buf[0]);
+	return ret;
+}
+
+
 // 
 // WRAPPED IO FUNCTIONS
 //
 
+#define HEAD_PIECE  4096  /* first read, after which the data is put on its memory alignment */
+
 static uint8_t *
-chunked_read(int fd)
-{
-	size_t size = ra_ondisk_size(fd);
-	uint8_t *data = safe_malloc(size);
-    size_t bytesleft = size;
-    uint8_t *cursor = data;
-	size_t bufsize = bytesleft < RA_MAX_BYTES ? bytesleft : RA_MAX_BYTES;
-    while (bytesleft > 0)
-    {
-        valid_read(fd, cursor, bufsize);
-        cursor += bufsize;
-        bytesleft -= bufsize;
-    }
+chunked_read(int fd, uint8_t *buf, const size_t cap, size_t *size, size_t *topoff,
+		uint32_t *crc, int *hasrecord)
+{  /* read the whole file into memory aligned for its data segment, returning the
+      start of the file, which is *topoff bytes into the allocation. buf, which
+      holds cap bytes, is reused if it is big enough and freed if not or on failure.
+      If the file has room for a checksum record after its data, the data segment
+      is hashed into crc piece by piece as it arrives. */
+	struct stat st;
+	direct_stream ds;
+	void *base = buf;
+	if (fstat(fd, &st) != 0) {
+		free(buf);
+		fail_sys(RA_EIO, "unable to stat file");
+		return NULL;
+	}
+	if (buf == NULL || cap < st.st_size + RA_MEM_ALIGN) {
+		free(buf);
+		if (posix_memalign(&base, RA_MEM_ALIGN, st.st_size + RA_MEM_ALIGN) != 0) {
+			fail(RA_ENOMEM, "unable to allocate %lu bytes", (size_t)st.st_size);
+			return NULL;
+		}
+	}
+	uint8_t *data = base;
+	uint64_t begin = 0, end = 0;
+	int direct = direct_start(&ds, fd, 0, st.st_size) == 0;
+	*crc = 0;
+	*hasrecord = -1;  // not known until the header is in
+	for (uint64_t done = 0; done < st.st_size; ) {
+		uint64_t piece = done == 0 ? HEAD_PIECE : CRC_PIECE;
+		uint64_t n = st.st_size - done < piece ? st.st_size - done : piece;
+		if ((direct ? direct_fetch(&ds, data + done, n) : valid_pread(fd, data + done, n, done)) < 0) {
+			if (direct)
+				direct_stop(&ds, -1);
+			free(base);
+			return NULL;
+		}
+		if (*hasrecord < 0 && done + n >= DIMS_OFFSET) {
+			uint64_t flags, ndims, datasize, align = 0;
+			memcpy(&flags, data + FLAGS_OFFSET, sizeof(uint64_t));
+			memcpy(&datasize, data + SIZE_OFFSET, sizeof(uint64_t));
+			memcpy(&ndims, data + NDIMS_OFFSET, sizeof(uint64_t));
+			begin = DIMS_OFFSET + ndims*sizeof(uint64_t);
+			*hasrecord = ndims < st.st_size / sizeof(uint64_t) && datasize < st.st_size;
+			if (*hasrecord && flags & RA_FLAG_ALIGNED) {
+				if (done + n < begin + sizeof(uint64_t)) {
+					*hasrecord = -1;  // alignment word is in a later piece
+					done += n;
+					continue;
+				}
+				memcpy(&align, data + begin, sizeof(uint64_t));
+				*hasrecord = valid_align(align);
+				if (*hasrecord)
+					begin = padded_header(ndims, align);
+			}
+			end = begin + datasize;
+			*hasrecord = *hasrecord && end + RA_CHECKSUM_SIZE <= st.st_size;
+			size_t off = mem_pad(begin);
+			memmove(data + off, data, done + n);  // normally just the first piece
+			data += off;
+		}
+		if (*hasrecord > 0)
+			crc_span(crc, data + done, done, n, begin, end);
+		done += n;
+	}
+	if (direct)
+		direct_stop(&ds, 0);
+	*hasrecord = *hasrecord > 0;
+	*size = st.st_size;
+	*topoff = data - (uint8_t*)base;
 	return data;
 }
 
 static int
-chunked_write(int fd, uint8_t* data, const size_t size)
-{
+chunked_write(int fd, direct_stream *ds, const uint8_t* data, const size_t size, const uint64_t skip,
+		uint32_t *crc)
+{  /* write to fd, or through ds if it is not NULL. With crc, also hash everything
+      past the first skip bytes as it is written. */
     size_t bytesleft = size;
-    uint8_t *cursor = data;
-    size_t bufsize = bytesleft < RA_MAX_BYTES ? bytesleft : RA_MAX_BYTES;
+    const uint8_t *cursor = data;
+	size_t piece = crc ? CRC_PIECE : RA_MAX_BYTES;
     while (bytesleft > 0)
     {
-        valid_write(fd, cursor, bufsize);
+		size_t bufsize = bytesleft < piece ? bytesleft : piece;
+        if ((ds ? direct_put(ds, cursor, bufsize) : valid_write(fd, cursor, bufsize)) < 0)
+			return -RA_EIO;
+		if (crc)
+			crc_span(crc, cursor, cursor - data, bufsize, skip, size);
         cursor += bufsize;
         bytesleft -= bufsize;
     }
@@ -221,15 +986,55 @@ chunked_write(int fd, uint8_t* data, const size_t size)
 
 int
 ra_read_header(ra_t *a, const char *path)
-{
+{  /* returns the open file, positioned at the start of the data, or a negative code */
+	int ret;
     int fd = valid_open(path, O_RDONLY);
-    valid_read(fd, a, DIMS_OFFSET);
-    check_magic_and_flags(a);
-    a->dims = (uint64_t *) malloc(a->ndims * sizeof(uint64_t));
+	if (fd < 0)
+		return fd;
 	a->top = NULL;
+	a->mapsize = 0;
+	a->topoff = 0;
+	a->align = 0;
+	a->dims = NULL;
 	a->data = NULL;
-    valid_read(fd, a->dims, a->ndims * sizeof(uint64_t));
+	if ((ret = valid_read(fd, a, DIMS_OFFSET)) < 0)
+		goto fail;
+	int swapped = a->magic == SWAPPED_MAGIC;
+	if (swapped)
+		swap_bytes((uint8_t*)a, DIMS_OFFSET, sizeof(uint64_t));
+	if ((ret = check_magic_and_flags(a)) < 0)
+		goto fail;
+	if (a->ndims > RA_MAX_BYTES / sizeof(uint64_t)) {
+		ret = fail(RA_EFORMAT, "%s: implausible ndims %lu", path, a->ndims);
+		goto fail;
+	}
+    a->dims = (uint64_t *) safe_malloc(a->ndims * sizeof(uint64_t));
+	if (a->dims == NULL && a->ndims > 0) {
+		ret = -RA_ENOMEM;
+		goto fail;
+	}
+    if ((ret = valid_read(fd, a->dims, a->ndims * sizeof(uint64_t))) < 0)
+		goto fail;
+	if (swapped)
+		swap_bytes((uint8_t*)a->dims, a->ndims * sizeof(uint64_t), sizeof(uint64_t));
+	if (a->flags & RA_FLAG_ALIGNED) {
+		if ((ret = valid_read(fd, &a->align, sizeof(uint64_t))) < 0)
+			goto fail;
+		if (swapped)
+			a->align = __builtin_bswap64(a->align);
+		if (!valid_align(a->align)) {
+			ret = fail(RA_EFORMAT, "%s: invalid data alignment %lu", path, a->align);
+			goto fail;
+		}
+		lseek(fd, ra_header_size(a), SEEK_SET);
+	}
 	return fd;
+
+fail:
+	free(a->dims);
+	a->dims = NULL;
+	close(fd);
+	return ret;
 }
 
 void
@@ -253,26 +1058,29 @@ ra_peek(const ra_t *a)
     printf("%lu)\n", a->dims[a->ndims - 1]);
 }
 
-void
+int
 ra_print_header(const char * path)
 {
     ra_t a;
 	int fd = ra_read_header(&a, path);
+	if (fd < 0)
+		return fd;
 	printf("%-30s ", path);
 	ra_peek(&a);
 	close(fd);
 	ra_free(&a);
+	return 0;
 }
 
 uint64_t
 ra_get_field(const char *path, const int n)
-{
-    uint64_t val;
-    int fd = valid_open(path, O_RDONLY);
-    lseek(fd, n * sizeof(uint64_t), SEEK_CUR);
-    valid_read(fd, &val, sizeof(uint64_t));
-    close(fd);
-    return val;
+{  /* field n of the fixed header, counting the magic number as field 0 */
+	ra_header_t *h = ra_header(path);
+	if (h == NULL)
+		return RA_BAD_FIELD;
+	uint64_t val = ((uint64_t*)h)[n];
+	free(h);
+	return val;
 }
 
 #define MAKE_ACCESSOR(var,num) \
@@ -288,17 +1096,17 @@ MAKE_ACCESSOR(ndims,  5);
 uint64_t *
 ra_dims(const char *path)
 {
-    uint64_t *dims;
-    uint64_t ndims;
-    int fd = valid_open(path, O_RDONLY);
-    lseek(fd, 5 * sizeof(uint64_t), SEEK_CUR);
-    valid_read(fd, &ndims, sizeof(uint64_t));
-    dims = (uint64_t *) malloc(ndims * sizeof(uint64_t));
-    valid_read(fd, dims, ndims * sizeof(uint64_t));
+	ra_header_t *h = ra_header(path);
+	if (h == NULL)
+		return NULL;
+	uint64_t *dims = safe_malloc(h->ndims*sizeof(uint64_t));
+	if (dims != NULL)
+		memcpy(dims, h->dims, h->ndims*sizeof(uint64_t));
+	free(h);
     return dims;
 }
 
-void
+int
 ra_parse_type(const char *typestr, uint64_t *eltype, uint64_t *elbyte)
 {
 	switch(typestr[0]) {
@@ -317,10 +1125,14 @@ ra_parse_type(const char *typestr, uint64_t *eltype, uint64_t *elbyte)
 	case 'c':
 		*eltype = RA_TYPE_COMPLEX;
 		break;
+	case 'b':
+		*eltype = RA_TYPE_BFLOAT;
+		break;
 	default:
-		err(EX_USAGE, "Unknown type code %c", typestr[0]);
+		return fail(RA_EINVAL, "Unknown type code %c", typestr[0]);
 	}
 	*elbyte = atoi(typestr+1);
+	return 0;
 }
 
 
@@ -328,206 +1140,5443 @@ ra_t *
 ra_create(const char *type, const uint64_t ndims,
 		const uint64_t dims[], const uint64_t flags)
 {
-	ra_t *r = malloc(sizeof(ra_t));
+	ra_t *r = safe_malloc(sizeof(ra_t));
+	if (r == NULL)
+		return NULL;
 	r->magic = RA_MAGIC_NUMBER;
-	r->flags = flags;
-	ra_parse_type(type, &(r->eltype), &r->elbyte);
+	r->flags = (flags & ~RA_FLAG_BIG_ENDIAN) | HOST_ORDER;
+	if (ra_parse_type(type, &(r->eltype), &r->elbyte) < 0) {
+		free(r);
+		return NULL;
+	}
 	r->ndims = ndims;
 	r->size = r->elbyte;
 	for (uint64_t i = 0; i < ndims; ++i)
 		r->size *= dims[i];
-	r->top = (uint8_t*) malloc(ra_file_size(r));
-	refresh_mem_from_struct(r);
+	r->align = flags & RA_FLAG_ALIGNED ? RA_DEFAULT_ALIGN : 0;
+	r->top = alloc_top(r);
+	if (r->top == NULL) {
+		free(r);
+		return NULL;
+	}
+	r->mapsize = 0;
 	r->dims = (uint64_t*)(r->top + DIMS_OFFSET);
 	for (int i = 0; i < ndims; ++i)
 		r->dims[i] = dims[i];
 	r->data = (uint8_t*)(r->top +  ra_header_size(r));
+	refresh_mem_from_struct(r);
 	return r;
 }
 
-int
-ra_read(ra_t *a, const char *path)
-{
+static int
+read_file(ra_t *a, const char *path, uint8_t *buf, const size_t cap)
+{  /* ra_read into unified memory, reusing buf of cap bytes if it is big enough */
+	size_t size, topoff;
+	uint32_t crc;
+	int hasrecord;
     int fd = valid_open(path, O_RDONLY);
-	a->top = chunked_read(fd);
+	if (fd < 0) {
+		free(buf);
+		return fd;
+	}
+	uint8_t *top = chunked_read(fd, buf, cap, &size, &topoff, &crc, &hasrecord);
 	close(fd);
-	memcpy(a, a->top, DIMS_OFFSET); // fixed part of struct
+	if (top == NULL)
+		return -ra_errno();
+	int ret = 0;
+	if (size < DIMS_OFFSET) {
+		ret = fail(RA_EFORMAT, "%s is too short to be an RA file", path);
+		goto fail;
+	}
+	if (*(uint64_t*)top == SWAPPED_MAGIC)
+		swap_header(top, size);
+	memcpy(a, top, DIMS_OFFSET); // fixed part of struct
+	if ((ret = check_magic_and_flags(a)) < 0)
+		goto fail;
+	if (a->ndims > (size - DIMS_OFFSET) / sizeof(uint64_t)
+			|| (ret = load_align(a, top, size, path)) < 0 || ra_file_size(a) > size) {
+		if (ret == 0)
+			ret = fail(RA_EFORMAT, "%s is truncated: header claims %lu bytes, file has %lu",
+					path, ra_file_size(a), size);
+		goto fail;
+	}
+	if (hasrecord && check_record(top + ra_file_size(a), crc) == RECORD_MISMATCH) {
+		ret = checksum_mismatch(path, crc);
+		goto fail;
+	}
+	a->top = top;
+	a->mapsize = 0;
+	a->topoff = topoff;
 	a->dims = (uint64_t*)(a->top + DIMS_OFFSET);
-	a->data = a->top + DIMS_OFFSET + sizeof(uint64_t)*a->ndims;
+	a->data = a->top + ra_header_size(a);
+	to_host_order(a);
     return 0;
+
+fail:
+	free(top - topoff);
+	return ret;
 }
 
 int
-ra_write(ra_t *a, const char *path)
+ra_read(ra_t *a, const char *path)
 {
-    int fd;
-    fd = valid_open(path, O_WRONLY | O_TRUNC | O_CREAT); //0644
-	if (a->top == NULL) // don't have a single malloc-ed space for the raw array
-	{
-		valid_write(fd, a, DIMS_OFFSET);  // write in parts
-		valid_write(fd, a->dims, a->ndims * sizeof(uint64_t));
-		chunked_write(fd, a->data, a->size);
+	return read_file(a, path, NULL, 0);
+}
+
+static int
+map_file(ra_t *a, uint8_t *map, const size_t off, const size_t size, const char *path)
+{  /* point a at the RA file of size bytes found off bytes into a mapping */
+	if (size < DIMS_OFFSET)
+		return fail(RA_EFORMAT, "%s is too short to be an RA file", path);
+	memcpy(a, map + off, DIMS_OFFSET);
+	int ret = check_magic_and_flags(a);
+	if (ret == 0 && (a->ndims > (size - DIMS_OFFSET) / sizeof(uint64_t)
+			|| (ret = load_align(a, map + off, size, path)) < 0 || ra_file_size(a) > size) && ret == 0)
+		ret = fail(RA_EFORMAT, "%s is truncated: header claims %lu bytes, file has %lu",
+				path, ra_file_size(a), size);
+	if (ret < 0)
+		return ret;
+	a->top = map + off;
+	a->mapsize = off + size;
+	a->topoff = off;
+	a->dims = (uint64_t*)(a->top + DIMS_OFFSET);
+	a->data = a->top + ra_header_size(a);
+	return 0;
+}
+
+int
+ra_mmap(ra_t *a, const char *path, const int hints)
+{  /* zero-copy read: dims and data point straight into a read-only mapping of the file */
+    int fd = valid_open(path, O_RDONLY);
+	if (fd < 0)
+		return fd;
+	size_t size = ra_ondisk_size(fd);
+	if (size < DIMS_OFFSET) {
+		close(fd);
+		return fail(RA_EFORMAT, "%s is too short to be an RA file", path);
 	}
-	else 
-	{
-		refresh_mem_from_struct(a);  // make sure malloc memory contains updated struct vars
-		chunked_write(fd, a->top, ra_file_size(a));  // can write all at once
+	int mflags = MAP_SHARED;
+#ifdef MAP_POPULATE
+	if (hints & RA_MMAP_POPULATE)
+		mflags |= MAP_POPULATE;
+#endif
+	void *p = mmap(NULL, size, PROT_READ, mflags, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return fail_sys(RA_ENOMEM, "unable to mmap %s", path);
+	if (hints & RA_MMAP_SEQUENTIAL)
+		madvise(p, size, MADV_SEQUENTIAL);
+	if (hints & RA_MMAP_RANDOM)
+		madvise(p, size, MADV_RANDOM);
+	if (hints & RA_MMAP_WILLNEED)
+		madvise(p, size, MADV_WILLNEED);
+	int ret = map_file(a, p, 0, size, path);
+	if (ret < 0)
+		munmap(p, size);
+	return ret;
+}
+
+void
+ra_munmap(ra_t *a)
+{
+	if (a->mapsize) {
+		release_top(a);
+		a->dims = NULL;
+		a->data = NULL;
 	}
-    close(fd);
-    return 0;
 }
 
 
+//
+// THREADING
+//
+
+static int num_threads = 0;  /* 0 means not yet set: consult RA_NUM_THREADS */
+
+void
+ra_set_num_threads(const int n)
+{
+	num_threads = n;
+}
+
 int
-ra_copy (ra_t *dst, ra_t *src)
+ra_num_threads(void)
 {
-	if (src->top == NULL) {
-		memcpy(dst, src, DIMS_OFFSET);
-		memcpy(dst->dims, src->dims, src->ndims*sizeof(uint64_t));
-		memcpy(dst->data, src->data, src->size);
-	} else {
-		refresh_mem_from_struct(src);
-		memcpy(dst->top, src->top, ra_file_size(src));
+	if (num_threads > 0)
+		return num_threads;
+	const char *s = getenv("RA_NUM_THREADS");
+	int n = s == NULL ? 1 : atoi(s);
+	if (n <= 0)  // RA_NUM_THREADS=0 means one per online cpu
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
+
+typedef int (*task_fn)(void *arg, const uint64_t i);
+
+typedef struct {
+	task_fn fn;
+	void *arg;
+	uint64_t n;
+	uint64_t next;     /* next task index, claimed atomically */
+	int status;        /* error code of the first failed task */
+	char message[sizeof last_message];
+} task_queue;
+
+static void *
+task_worker(void *q_)
+{
+	task_queue *q = q_;
+	uint64_t i;
+	while ((i = __sync_fetch_and_add(&q->next, 1)) < q->n)
+		if (q->fn(q->arg, i) < 0) {
+			if (__sync_bool_compare_and_swap(&q->status, 0, last_error))
+				memcpy(q->message, last_message, sizeof q->message);
+			__sync_fetch_and_add(&q->next, q->n);  // stop handing out tasks
+			break;
+		}
+	return NULL;
+}
+
+static int
+parallel_for(const uint64_t n, task_fn fn, void *arg)
+{  /* run fn(arg, i) for 0 <= i < n across the worker threads */
+	task_queue q = { fn, arg, n, 0, 0, "" };
+	uint64_t nthreads = ra_num_threads();
+	if (nthreads > n)
+		nthreads = n;
+	pthread_t *threads = NULL;
+	uint64_t started = 0;
+	if (nthreads > 1 && (threads = malloc((nthreads - 1)*sizeof(pthread_t))) != NULL)
+		for (; started < nthreads - 1; ++started)
+			if (pthread_create(&threads[started], NULL, task_worker, &q) != 0)
+				break;  // carry on with the threads we have
+	task_worker(&q);
+	for (uint64_t t = 0; t < started; ++t)
+		pthread_join(threads[t], NULL);
+	free(threads);
+	if (q.status == 0)
+		return 0;
+	// hand the failure over to the calling thread
+	memcpy(last_message, q.message, sizeof last_message);
+	last_error = q.status;
+	return -q.status;
+}
+
+
+//
+// BATCH READS
+//
+
+typedef struct {
+	const char * const *paths;
+	ra_t *out;
+	int status;          /* code of the first failure */
+	uint64_t nfailed;
+} batch_job;
+
+static int
+read_many_task(void *job_, const uint64_t i)
+{
+	batch_job *job = job_;
+	ra_t *a = &job->out[i];
+	uint8_t *buf = NULL;
+	size_t cap = 0;
+	if (a->mapsize)
+		ra_munmap(a);
+	else if (a->top == NULL) {
+		free(a->dims);
+		free(a->data);
+	} else {  // recycle the previous array's memory
+		buf = a->top - a->topoff;
+		cap = malloc_usable_size(buf);
 	}
+	if (read_file(a, job->paths[i], buf, cap) < 0) {
+		__sync_bool_compare_and_swap(&job->status, 0, last_error);
+		__sync_fetch_and_add(&job->nfailed, 1);
+		memset(a, 0, sizeof(ra_t));
+	}
+	return 0;  // one bad file does not stop the batch
+}
+
+int
+ra_read_many(const char * const paths[], const size_t n, ra_t out[])
+{  /* ra_read each of paths[] into out[], with the files spread over the worker threads */
+	batch_job job = { paths, out, 0, 0 };
+	int ret = parallel_for(n, read_many_task, &job);
+	if (ret < 0)
+		return ret;
+	if (job.status)
+		return fail(job.status, "%lu of %lu files could not be read", job.nfailed, n);
 	return 0;
 }
 
-ra_t *
-ra_compress(ra_t *r)
+//
+// HEADER CACHE
+//
+
+#define HEADER_PIECE  4096  /* read at once; holds the header of up to 505 dims */
+
+typedef struct header_entry {
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	off_t fsize;
+	ra_header_t *h;
+	struct header_entry *newer, *older;  /* LRU order */
+	struct header_entry *chain;          /* next in the same hash bucket */
+} header_entry;
+
+#define HEADER_BUCKETS  4096
+
+static struct {
+	pthread_mutex_t lock;
+	size_t cap, n;
+	header_entry *newest, *oldest;
+	header_entry *buckets[HEADER_BUCKETS];
+} hcache = { PTHREAD_MUTEX_INITIALIZER, 1024, 0, NULL, NULL, { NULL } };
+
+static size_t
+header_size_of(const ra_header_t *h)
 {
-	if (is_compressed(r))  // already compressed
-		return r;
-	size_t maxoutsize = LZ4_compressBound(r->size);
-	//printf("Uncompressed size: %lu\n", r->size);
-	//printf("INferred maxoutsize: %lu\n", maxoutsize);
-	char *compressed_data = safe_malloc(maxoutsize);
-	size_t outsize = LZ4_compress_default((char*)r->data, compressed_data, r->size, maxoutsize);
-	//printf("Actual outsize: %lu\n", outsize);
-	if (outsize <= 0)
-		err(EX_DATAERR, "LZ4 compression failed, size=%lu", r->size);
-	if (r->top == NULL) {
-		free(r->data);
-		r->data = (uint8_t*)compressed_data;
-	} else {
-		memcpy(r->data, compressed_data, outsize);
-		free(compressed_data);
-	}
-	r->flags |= RA_FLAG_COMPRESSED;
-	r->size = outsize;
-	return r;
+	return sizeof(ra_header_t) + h->ndims*sizeof(uint64_t);
 }
 
+static ra_header_t *
+header_copy(const ra_header_t *h)
+{
+	ra_header_t *c = safe_malloc(header_size_of(h));
+	if (c != NULL)
+		memcpy(c, h, header_size_of(h));
+	return c;
+}
 
-ra_t *
-ra_decompress(ra_t *r)
+static header_entry **
+cache_slot(const struct stat *st)
+{  /* the bucket link that points at the entry for st, or at NULL if it has none */
+	header_entry **e = &hcache.buckets[(st->st_dev * 31 + st->st_ino) % HEADER_BUCKETS];
+	for (; *e != NULL; e = &(*e)->chain)
+		if ((*e)->dev == st->st_dev && (*e)->ino == st->st_ino)
+			break;
+	return e;
+}
+
+static void
+cache_unlink(header_entry *e)
+{  /* take e out of the LRU list */
+	if (e->newer)
+		e->newer->older = e->older;
+	else
+		hcache.newest = e->older;
+	if (e->older)
+		e->older->newer = e->newer;
+	else
+		hcache.oldest = e->newer;
+}
+
+static void
+cache_push(header_entry *e)
+{  /* make e the most recently used entry */
+	e->newer = NULL;
+	e->older = hcache.newest;
+	if (hcache.newest)
+		hcache.newest->newer = e;
+	hcache.newest = e;
+	if (hcache.oldest == NULL)
+		hcache.oldest = e;
+}
+
+static void
+cache_drop(header_entry **slot)
 {
-	if (!is_compressed(r)) // only do if compressed
-		return r;
-	size_t orig_size = ra_data_size(r);
-	//printf("compressed_size: %lu\n", r->size);
-	//printf("orig_size: %lu\n", orig_size);
-	char *decompressed_data = safe_malloc(orig_size);
-	size_t decompressed_size = LZ4_decompress_safe((char*)r->data, decompressed_data, r->size, orig_size);
-	//printf("decompressed_size: %lu\n", decompressed_size);
-	if (decompressed_size <= 0 || decompressed_size != orig_size)
-		err(EX_DATAERR, "LZ4 decompression failed on data size %lu", r->size);
-	if (r->top == NULL) {
-		free(r->data);
-		r->data = (uint8_t*)decompressed_data;
-	} else {
-		// for most cases, fastest is to redo dims and de-unify
-		r->dims = safe_malloc(r->ndims*sizeof(uint64_t));
-		memcpy(r->dims, r->top + DIMS_OFFSET, r->ndims*sizeof(uint64_t));
-		r->data = (uint8_t*)decompressed_data;
-		free(r->top);
-		r->top = NULL;
-	}
-	r->flags ^= RA_FLAG_COMPRESSED;  // turn off compression flag
-	r->size = orig_size;
-	refresh_mem_from_struct(r);
-	return r;
+	header_entry *e = *slot;
+	*slot = e->chain;
+	cache_unlink(e);
+	free(e->h);
+	free(e);
+	--hcache.n;
 }
 
-void
-ra_free(ra_t * a)
+static ra_header_t *
+cache_get(const struct stat *st)
+{  /* a copy of the cached header for this version of the file, or NULL */
+	ra_header_t *h = NULL;
+	pthread_mutex_lock(&hcache.lock);
+	header_entry **slot = cache_slot(st), *e = *slot;
+	if (e != NULL && (e->mtime.tv_sec != st->st_mtim.tv_sec || e->mtime.tv_nsec != st->st_mtim.tv_nsec
+				|| e->fsize != st->st_size))
+		cache_drop(slot);  // the file has changed since
+	else if (e != NULL) {
+		cache_unlink(e);
+		cache_push(e);
+		h = e->h;
+	}
+	if (h != NULL)
+		h = header_copy(h);
+	pthread_mutex_unlock(&hcache.lock);
+	return h;
+}
+
+static void
+cache_put(const struct stat *st, const ra_header_t *h)
 {
-	if (a->top == NULL) {
-		free(a->dims);
-		free(a->data);
-	} else
-    	free(a->top);
+	header_entry *e = calloc(1, sizeof(header_entry));
+	if (e == NULL || (e->h = header_copy(h)) == NULL) {
+		free(e);
+		return;  // the cache is only an optimisation
+	}
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->mtime = st->st_mtim;
+	e->fsize = st->st_size;
+	pthread_mutex_lock(&hcache.lock);
+	header_entry **slot = cache_slot(st);
+	if (*slot != NULL)  // another thread got here first
+		cache_drop(slot);
+	while (hcache.n > 0 && hcache.n >= hcache.cap) {
+		struct stat old = { .st_dev = hcache.oldest->dev, .st_ino = hcache.oldest->ino };
+		cache_drop(cache_slot(&old));
+	}
+	slot = cache_slot(st);  // evictions may have freed the entry the old slot was in
+	if (hcache.cap > 0) {
+		e->chain = *slot;
+		*slot = e;
+		cache_push(e);
+		++hcache.n;
+		e = NULL;
+	}
+	pthread_mutex_unlock(&hcache.lock);
+	if (e != NULL) {
+		free(e->h);
+		free(e);
+	}
+}
 
+void
+ra_set_header_cache(const size_t n)
+{  /* keep up to n headers; 0 turns the cache off and empties it */
+	pthread_mutex_lock(&hcache.lock);
+	hcache.cap = n;
+	while (hcache.n > n) {
+		struct stat old = { .st_dev = hcache.oldest->dev, .st_ino = hcache.oldest->ino };
+		cache_drop(cache_slot(&old));
+	}
+	pthread_mutex_unlock(&hcache.lock);
 }
 
-int
-ra_reshape(ra_t * r, const uint64_t newdims[], const uint64_t ndimsnew)
+static ra_header_t *
+header_read(const char *path)
+{  /* the header of a file from one pread, bypassing the cache */
+	uint8_t buf[HEADER_PIECE];
+	ra_header_t *h = NULL;
+	int fd = valid_open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	ssize_t n = pread(fd, buf, HEADER_PIECE, 0);
+	ra_t a;
+	if (n < 0) {
+		fail_sys(RA_EIO, "unable to read %s", path);
+		goto done;
+	}
+	if (n < DIMS_OFFSET) {
+		fail(RA_EFORMAT, "%s is too short to be an RA file", path);
+		goto done;
+	}
+	int swapped = *(uint64_t*)buf == SWAPPED_MAGIC;
+	if (swapped)
+		swap_bytes(buf, DIMS_OFFSET, sizeof(uint64_t));
+	memcpy(&a, buf, DIMS_OFFSET);
+	if (check_magic_and_flags(&a) < 0)
+		goto done;
+	if (a.ndims > RA_MAX_BYTES / sizeof(uint64_t)) {
+		fail(RA_EFORMAT, "%s: implausible ndims %lu", path, a.ndims);
+		goto done;
+	}
+	uint64_t need = DIMS_OFFSET + sizeof(uint64_t)*(a.ndims + (a.flags & RA_FLAG_ALIGNED ? 1 : 0));
+	if ((h = safe_malloc(sizeof(ra_header_t) + a.ndims*sizeof(uint64_t))) == NULL)
+		goto done;
+	memcpy(h, buf, DIMS_OFFSET);
+	if (need <= n)
+		memcpy(h->dims, buf + DIMS_OFFSET, a.ndims*sizeof(uint64_t));
+	else if (valid_pread(fd, h->dims, a.ndims*sizeof(uint64_t), DIMS_OFFSET) < 0)
+		goto fail;  // a header too long for the first read
+	if (swapped)
+		swap_bytes((uint8_t*)h->dims, a.ndims*sizeof(uint64_t), sizeof(uint64_t));
+	h->align = 0;
+	if (a.flags & RA_FLAG_ALIGNED) {
+		uint64_t at = DIMS_OFFSET + a.ndims*sizeof(uint64_t);
+		if (need <= n)
+			memcpy(&h->align, buf + at, sizeof(uint64_t));
+		else if (valid_pread(fd, &h->align, sizeof(uint64_t), at) < 0)
+			goto fail;
+		if (swapped)
+			h->align = __builtin_bswap64(h->align);
+		if (!valid_align(h->align)) {
+			fail(RA_EFORMAT, "%s: invalid data alignment %lu", path, h->align);
+			goto fail;
+		}
+	}
+	goto done;
+
+fail:
+	free(h);
+	h = NULL;
+done:
+	close(fd);
+	return h;
+}
+
+ra_header_t *
+ra_header(const char *path)
+{  /* the header of a file from one pread, or from the cache if the file is unchanged */
+	struct stat st;
+	ra_header_t *h;
+	if (stat(path, &st) != 0) {
+		fail_sys(RA_EOPEN, "unable to open %s", path);
+		return NULL;
+	}
+	if (hcache.cap > 0 && (h = cache_get(&st)) != NULL)
+		return h;
+	if ((h = header_read(path)) != NULL && hcache.cap > 0)
+		cache_put(&st, h);
+	return h;
+}
+
+typedef struct {
+	const char * const *paths;
+	ra_header_t **out;
+	int status;          /* code of the first failure */
+	uint64_t nfailed;
+} header_job;
+
+static int
+header_many_task(void *job_, const uint64_t i)
 {
-    uint64_t newsize = 1;
-    for (uint64_t k = 0; k < ndimsnew; ++k)
-        newsize *= newdims[k];
-    if (r->size != newsize * r->elbyte)
-		err(EX_DATAERR, "Total number of elements must be conserved.");
-    // if new dims preserve total number of elements, then change the dims
-    r->ndims = ndimsnew;
-    size_t newdimsize = ndimsnew * sizeof(uint64_t);
-    free(r->dims);
-    r->dims = (uint64_t *) malloc(newdimsize);
-    memcpy(r->dims, newdims, newdimsize);
-    return 0;
+	header_job *job = job_;
+	if ((job->out[i] = ra_header(job->paths[i])) == NULL) {
+		__sync_bool_compare_and_swap(&job->status, 0, last_error);
+		__sync_fetch_and_add(&job->nfailed, 1);
+	}
+	return 0;
 }
 
 int
-ra_diff(const ra_t * a, const ra_t * b, const int diff_type)
+ra_header_many(const char * const paths[], const size_t n, ra_header_t *out[])
+{  /* ra_header of each of paths[], spread over the worker threads; failures give NULL */
+	header_job job = { paths, out, 0, 0 };
+	int ret = parallel_for(n, header_many_task, &job);
+	if (ret < 0)
+		return ret;
+	if (job.status)
+		return fail(job.status, "%lu of %lu headers could not be read", job.nfailed, n);
+	return 0;
+}
+
+
+//
+// SHUFFLE FILTERS
+//
+
+/*
+   Byte shuffle stores byte j of every element together: dst[j*n + i] =
+   src[i*E + j] for n elements of E bytes. Bit shuffle additionally
+   transposes each resulting byte plane so that bit k of every byte is
+   stored together, 8 bytes (one 8x8 bit matrix) at a time. Trailing bytes
+   that do not fill an element or a matrix are copied as-is.
+
+   Power-of-two element sizes are shuffled as log2(E) passes of a 2-way
+   byte (de)interleave across E vectors, which amounts to rotating the
+   index bits of i*E + j into j*n + i.
+*/
+
+#ifdef __SSE2__
+static uint64_t
+byte_shuffle_sse2(const uint8_t *src, uint8_t *dst, const uint64_t n, const uint64_t E, uint64_t i)
+{  /* shuffles elements from i on in groups of 16, returns where it stopped */
+	__m128i va[16], vb[16], *v = va, *w = vb, *t;
+	const __m128i lo = _mm_set1_epi16(0x00ff);
+	for (; i + 16 <= n; i += 16) {
+		for (uint64_t k = 0; k < E; ++k)
+			v[k] = _mm_loadu_si128((const __m128i*)(src + i*E + 16*k));
+		for (uint64_t s = E; s > 1; s >>= 1) {
+			for (uint64_t m = 0; m < E/2; ++m) {
+				w[m] = _mm_packus_epi16(_mm_and_si128(v[2*m], lo), _mm_and_si128(v[2*m+1], lo));
+				w[E/2+m] = _mm_packus_epi16(_mm_srli_epi16(v[2*m], 8), _mm_srli_epi16(v[2*m+1], 8));
+			}
+			t = v; v = w; w = t;
+		}
+		for (uint64_t k = 0; k < E; ++k)
+			_mm_storeu_si128((__m128i*)(dst + k*n + i), v[k]);
+	}
+	return i;
+}
+
+static uint64_t
+byte_unshuffle_sse2(const uint8_t *src, uint8_t *dst, const uint64_t n, const uint64_t E, uint64_t i)
 {
-    if (a->flags != b->flags)
-        return DIFF_FLAGS;
-    if (a->eltype != b->eltype)
-        return DIFF_ELTYPE;
-    if (a->elbyte != b->elbyte)
-        return DIFF_ELBYTE;
-    if (a->size != b->size)
-        return DIFF_SIZE;
-    if (a->ndims != b->ndims)
-        return DIFF_NDIMS;
-    for (size_t i = 0; i < a->ndims; ++i)
-        if (a->dims[i] != b->dims[i])
-            return DIFF_DIMS;
-    if (diff_type == 0)
-    {
-        for (size_t i = 0; i < a->size; ++i)
-        {
-            if (a->data[i] != b->data[i])
-            {
-                printf("differ at position %ld: lhs=%u rhs=%u\n", i,
-                    a->data[i], b->data[i]);
-                return DIFF_DATA;
-            }
-        }
-    }
-    else if (diff_type == 1)
-    {
-        double norm = 0.0;
-        for (size_t i = 0; i < a->size; ++i)
-            norm += fabs(a->data[i] - b->data[i]);
-        norm = sqrtf(norm);
-        printf("L1 distance: %g\n", norm);
-        if (norm > 0.)
-            return DIFF_DATA;
-    }
-    else if (diff_type == 2)
-    {
-        double t, norm = 0.0;
-        for (size_t i = 0; i < a->size; ++i)
-        {
-            t = (a->data[i] - b->data[i]);
-            norm += t * t;
-        }
-        norm = sqrtf(norm);
-        printf("L2 distance: %g\n", norm);
-        if (norm > 0.)
-            return DIFF_DATA;
-    }
-    else
-        err(EX_USAGE, "Unknown diff_type %d\n", diff_type);
-    return 0;
+	__m128i va[16], vb[16], *v = va, *w = vb, *t;
+	for (; i + 16 <= n; i += 16) {
+		for (uint64_t k = 0; k < E; ++k)
+			v[k] = _mm_loadu_si128((const __m128i*)(src + k*n + i));
+		for (uint64_t s = E; s > 1; s >>= 1) {
+			for (uint64_t m = 0; m < E/2; ++m) {
+				w[2*m] = _mm_unpacklo_epi8(v[m], v[E/2+m]);
+				w[2*m+1] = _mm_unpackhi_epi8(v[m], v[E/2+m]);
+			}
+			t = v; v = w; w = t;
+		}
+		for (uint64_t k = 0; k < E; ++k)
+			_mm_storeu_si128((__m128i*)(dst + i*E + 16*k), v[k]);
+	}
+	return i;
+}
+#endif
+
+#ifdef RA_X86
+TARGET("avx2") static uint64_t
+byte_shuffle_avx2(const uint8_t *src, uint8_t *dst, const uint64_t n, const uint64_t E, uint64_t i)
+{
+	__m256i va[16], vb[16], *v = va, *w = vb, *t;
+	const __m256i lo = _mm256_set1_epi16(0x00ff);
+	for (; i + 32 <= n; i += 32) {
+		for (uint64_t k = 0; k < E; ++k)
+			v[k] = _mm256_loadu_si256((const __m256i*)(src + i*E + 32*k));
+		for (uint64_t s = E; s > 1; s >>= 1) {
+			for (uint64_t m = 0; m < E/2; ++m) {  // pack works per lane, so fix up the qword order
+				w[m] = _mm256_permute4x64_epi64(_mm256_packus_epi16(
+					_mm256_and_si256(v[2*m], lo), _mm256_and_si256(v[2*m+1], lo)), 0xd8);
+				w[E/2+m] = _mm256_permute4x64_epi64(_mm256_packus_epi16(
+					_mm256_srli_epi16(v[2*m], 8), _mm256_srli_epi16(v[2*m+1], 8)), 0xd8);
+			}
+			t = v; v = w; w = t;
+		}
+		for (uint64_t k = 0; k < E; ++k)
+			_mm256_storeu_si256((__m256i*)(dst + k*n + i), v[k]);
+	}
+	return i;
+}
+
+TARGET("avx2") static uint64_t
+byte_unshuffle_avx2(const uint8_t *src, uint8_t *dst, const uint64_t n, const uint64_t E, uint64_t i)
+{
+	__m256i va[16], vb[16], *v = va, *w = vb, *t;
+	for (; i + 32 <= n; i += 32) {
+		for (uint64_t k = 0; k < E; ++k)
+			v[k] = _mm256_loadu_si256((const __m256i*)(src + k*n + i));
+		for (uint64_t s = E; s > 1; s >>= 1) {
+			for (uint64_t m = 0; m < E/2; ++m) {  // unpack works per lane, so spread the qwords first
+				__m256i a = _mm256_permute4x64_epi64(v[m], 0xd8);
+				__m256i b = _mm256_permute4x64_epi64(v[E/2+m], 0xd8);
+				w[2*m] = _mm256_unpacklo_epi8(a, b);
+				w[2*m+1] = _mm256_unpackhi_epi8(a, b);
+			}
+			t = v; v = w; w = t;
+		}
+		for (uint64_t k = 0; k < E; ++k)
+			_mm256_storeu_si256((__m256i*)(dst + i*E + 32*k), v[k]);
+	}
+	return i;
+}
+#endif
+
+static inline int
+pow2_vectorizable(const uint64_t E)
+{
+	return E > 1 && E <= 16 && (E & (E - 1)) == 0;
+}
+
+static void
+byte_shuffle(const uint8_t *src, uint8_t *dst, const uint64_t len, const uint64_t E)
+{
+	uint64_t n = len / E, i = 0;
+	if (pow2_vectorizable(E)) {
+#ifdef RA_X86
+		if (have_avx2())
+			i = byte_shuffle_avx2(src, dst, n, E, i);
+#endif
+#ifdef __SSE2__
+		i = byte_shuffle_sse2(src, dst, n, E, i);
+#endif
+	}
+	for (; i < n; ++i)
+		for (uint64_t j = 0; j < E; ++j)
+			dst[j*n + i] = src[i*E + j];
+	memcpy(dst + n*E, src + n*E, len - n*E);
+}
+
+static void
+byte_unshuffle(const uint8_t *src, uint8_t *dst, const uint64_t len, const uint64_t E)
+{
+	uint64_t n = len / E, i = 0;
+	if (pow2_vectorizable(E)) {
+#ifdef RA_X86
+		if (have_avx2())
+			i = byte_unshuffle_avx2(src, dst, n, E, i);
+#endif
+#ifdef __SSE2__
+		i = byte_unshuffle_sse2(src, dst, n, E, i);
+#endif
+	}
+	for (; i < n; ++i)
+		for (uint64_t j = 0; j < E; ++j)
+			dst[i*E + j] = src[j*n + i];
+	memcpy(dst + n*E, src + n*E, len - n*E);
+}
+
+/* transpose the 8x8 bit matrix whose rows are the bytes of x */
+#define TRANSPOSE_BITS(x, t, srl, sll, xor, and, m1, m2, m3) \
+	t = and(xor(x, srl(x, 7)), m1);  x = xor(x, xor(t, sll(t, 7))); \
+	t = and(xor(x, srl(x, 14)), m2); x = xor(x, xor(t, sll(t, 14))); \
+	t = and(xor(x, srl(x, 28)), m3); x = xor(x, xor(t, sll(t, 28)));
+
+#define M1 0x00aa00aa00aa00aaULL
+#define M2 0x0000cccc0000ccccULL
+#define M3 0x00000000f0f0f0f0ULL
+#define SRL(x, s) ((x) >> (s))
+#define SLL(x, s) ((x) << (s))
+#define XOR(a, b) ((a) ^ (b))
+#define AND(a, b) ((a) & (b))
+
+#ifdef __SSE2__
+static uint64_t
+transpose_bits_sse2(uint8_t *p, const uint64_t nwords, uint64_t i)
+{
+	const __m128i m1 = _mm_set1_epi64x(M1), m2 = _mm_set1_epi64x(M2), m3 = _mm_set1_epi64x(M3);
+	for (; i + 2 <= nwords; i += 2) {
+		__m128i x = _mm_loadu_si128((__m128i*)(p + 8*i)), t;
+		TRANSPOSE_BITS(x, t, _mm_srli_epi64, _mm_slli_epi64, _mm_xor_si128, _mm_and_si128, m1, m2, m3)
+		_mm_storeu_si128((__m128i*)(p + 8*i), x);
+	}
+	return i;
+}
+#endif
+
+#ifdef RA_X86
+TARGET("avx2") static uint64_t
+transpose_bits_avx2(uint8_t *p, const uint64_t nwords, uint64_t i)
+{
+	const __m256i m1 = _mm256_set1_epi64x(M1), m2 = _mm256_set1_epi64x(M2), m3 = _mm256_set1_epi64x(M3);
+	for (; i + 4 <= nwords; i += 4) {
+		__m256i x = _mm256_loadu_si256((__m256i*)(p + 8*i)), t;
+		TRANSPOSE_BITS(x, t, _mm256_srli_epi64, _mm256_slli_epi64, _mm256_xor_si256, _mm256_and_si256, m1, m2, m3)
+		_mm256_storeu_si256((__m256i*)(p + 8*i), x);
+	}
+	return i;
+}
+#endif
+
+static void
+transpose_bits(uint8_t *p, const uint64_t nwords)
+{  /* in place; an involution, so it also undoes itself */
+	uint64_t i = 0;
+#ifdef RA_X86
+	if (have_avx2())
+		i = transpose_bits_avx2(p, nwords, i);
+#endif
+#ifdef __SSE2__
+	i = transpose_bits_sse2(p, nwords, i);
+#endif
+	for (; i < nwords; ++i) {
+		uint64_t x, t;
+		memcpy(&x, p + 8*i, sizeof(uint64_t));
+		TRANSPOSE_BITS(x, t, SRL, SLL, XOR, AND, M1, M2, M3)
+		memcpy(p + 8*i, &x, sizeof(uint64_t));
+	}
+}
+
+static void
+shuffle(const uint8_t *src, uint8_t *dst, const uint64_t len, const uint64_t E,
+		const uint64_t filter, uint8_t *tmp)
+{  /* tmp is only needed, and must hold len bytes, for bit shuffle */
+	if (!(filter & RA_FLAG_BITSHUFFLE)) {
+		byte_shuffle(src, dst, len, E);
+		return;
+	}
+	uint64_t n = len / E;
+	byte_shuffle(src, tmp, len, E);
+	for (uint64_t j = 0; j < E; ++j) {  // bit matrices become 8 rows of one byte each
+		transpose_bits(tmp + j*n, n/8);
+		byte_shuffle(tmp + j*n, dst + j*n, n, 8);
+	}
+	memcpy(dst + n*E, tmp + n*E, len - n*E);
+}
+
+static void
+unshuffle(const uint8_t *src, uint8_t *dst, const uint64_t len, const uint64_t E,
+		const uint64_t filter, uint8_t *tmp)
+{
+	if (!(filter & RA_FLAG_BITSHUFFLE)) {
+		byte_unshuffle(src, dst, len, E);
+		return;
+	}
+	uint64_t n = len / E;
+	for (uint64_t j = 0; j < E; ++j) {
+		byte_unshuffle(src + j*n, tmp + j*n, n, 8);
+		transpose_bits(tmp + j*n, n/8);
+	}
+	memcpy(tmp + n*E, src + n*E, len - n*E);
+	byte_unshuffle(tmp, dst, len, E);
+}
+
+//
+// BLOCK-INDEXED COMPRESSION
+//
+
+#define CHUNK_TRAILER_SIZE  (2*sizeof(uint64_t))
+
+typedef struct {
+	uint64_t filter;     /* RA_FLAG_SHUFFLE or RA_FLAG_BITSHUFFLE, or 0 */
+	uint64_t typesize;   /* bytes per element for the shuffle */
+	int chunked;         /* blocks may be stored raw */
+} codec;
+
+static void
+codec_init(codec *c, const ra_t *r)
+{
+	c->filter = r->flags & (RA_FLAG_SHUFFLE | RA_FLAG_BITSHUFFLE);
+	c->typesize = r->elbyte > 0 ? r->elbyte : 1;
+	if (r->eltype == RA_TYPE_COMPLEX && r->elbyte % 2 == 0)  // shuffle re and im as separate floats
+		c->typesize /= 2;
+	c->chunked = (r->flags & RA_FLAG_CHUNKED) != 0;
+}
+
+static int
+encode_block(const codec *c, const uint8_t *src, const uint64_t len, uint8_t *dst, uint64_t *stored)
+{  /* sets stored length; incompressible chunked blocks are stored raw */
+	uint8_t *buf = NULL;
+	if (c->filter) {
+		if ((buf = safe_malloc(2*len)) == NULL)
+			return -RA_ENOMEM;
+		shuffle(src, buf, len, c->typesize, c->filter, buf + len);
+		src = buf;
+	}
+	int outsize = LZ4_compress_default((const char*)src, (char*)dst, len, LZ4_compressBound(len));
+	if (c->chunked && (outsize <= 0 || outsize >= len)) {
+		memcpy(dst, src, len);
+		outsize = len;
+	}
+	free(buf);
+	if (outsize <= 0)
+		return fail(RA_ECOMPRESS, "LZ4 compression failed, size=%lu", len);
+	*stored = outsize;
+	return 0;
+}
+
+static int
+decode_block(const codec *c, const uint8_t *src, const uint64_t srclen, uint8_t *dst, const uint64_t len)
+{
+	uint8_t *buf = NULL, *out = dst;
+	if (c->filter && (out = buf = safe_malloc(2*len)) == NULL)
+		return -RA_ENOMEM;
+	if (c->chunked && srclen == len)
+		memcpy(out, src, len);
+	else {
+		int outsize = LZ4_decompress_safe((const char*)src, (char*)out, srclen, len);
+		if (outsize < 0 || outsize != len) {
+			free(buf);
+			return fail(RA_ECOMPRESS, "LZ4 decompression failed on block of size %lu", srclen);
+		}
+	}
+	if (c->filter) {
+		unshuffle(buf, dst, len, c->typesize, c->filter, buf + len);
+		free(buf);
+	}
+	return 0;
+}
+
+static int
+chunk_trailer(const uint8_t *trailer, const uint64_t size, const uint64_t rawsize,
+		uint64_t *blocksize, uint64_t *nblocks)
+{
+	memcpy(blocksize, trailer, sizeof(uint64_t));
+	memcpy(nblocks, trailer + sizeof(uint64_t), sizeof(uint64_t));
+	if (*blocksize == 0 || *nblocks != (rawsize + *blocksize - 1) / *blocksize
+			|| *nblocks > size / sizeof(uint64_t)
+			|| (*nblocks + 1)*sizeof(uint64_t) + CHUNK_TRAILER_SIZE > size)
+		return fail(RA_EFORMAT, "corrupt block index");
+	return 0;
+}
+
+static uint64_t *
+chunk_table(const uint8_t *table, const uint64_t size, const uint64_t nblocks)
+{  /* validate the offset table and return a malloc-ed, aligned copy, or NULL */
+	uint64_t tablesize = (nblocks + 1)*sizeof(uint64_t);
+	uint64_t *offsets = safe_malloc(tablesize);
+	if (offsets == NULL)
+		return NULL;
+	memcpy(offsets, table, tablesize);
+	int ok = offsets[0] == 0 && offsets[nblocks] <= size - CHUNK_TRAILER_SIZE - tablesize;
+	for (uint64_t i = 0; i < nblocks; ++i)
+		if (offsets[i] > offsets[i+1])
+			ok = 0;
+	if (!ok) {
+		free(offsets);
+		fail(RA_EFORMAT, "corrupt block index");
+		return NULL;
+	}
+	return offsets;
+}
+
+/* random access to the uncompressed data segment of an open file */
+typedef struct {
+	int fd;
+	uint64_t data_off;    /* file offset of the data segment */
+	uint64_t rawsize;     /* uncompressed size of the data */
+	uint64_t blocksize;   /* 0 if the data is stored uncompressed */
+	uint64_t nblocks;
+	codec c;
+	uint64_t *offsets;
+	uint64_t maxstored;   /* largest compressed block */
+	uint8_t *zbuf;        /* one compressed block, allocated on first use */
+	uint8_t *block;       /* one decompressed block, allocated on first use */
+	uint64_t cached;      /* index of the block in 'block', nblocks if none */
+} block_reader;
+
+static int
+block_reader_open(block_reader *br, const int fd, ra_t *h)
+{
+	int ret;
+	memset(br, 0, sizeof(block_reader));
+	br->fd = fd;
+	br->data_off = ra_header_size(h);
+	br->rawsize = h->size;
+	if (!is_compressed(h))
+		return 0;
+	br->rawsize = ra_data_size(h);
+	codec_init(&br->c, h);
+	if (is_chunked(h)) {
+		uint8_t trailer[CHUNK_TRAILER_SIZE];
+		if (h->size < CHUNK_TRAILER_SIZE)
+			return fail(RA_EFORMAT, "corrupt block index");
+		if ((ret = valid_pread(fd, trailer, CHUNK_TRAILER_SIZE, br->data_off + h->size - CHUNK_TRAILER_SIZE)) < 0
+				|| (ret = chunk_trailer(trailer, h->size, br->rawsize, &br->blocksize, &br->nblocks)) < 0)
+			return ret;
+		uint64_t tablesize = (br->nblocks + 1)*sizeof(uint64_t);
+		uint8_t *table = safe_malloc(tablesize);
+		if (table == NULL)
+			return -RA_ENOMEM;
+		if ((ret = valid_pread(fd, table, tablesize, br->data_off + h->size - CHUNK_TRAILER_SIZE - tablesize)) == 0)
+			br->offsets = chunk_table(table, h->size, br->nblocks);
+		free(table);
+		if (br->offsets == NULL)
+			return ret < 0 ? ret : -ra_errno();
+	} else {  // original layout: the whole array is a single block
+		br->blocksize = br->rawsize;
+		br->nblocks = 1;
+		if ((br->offsets = safe_malloc(2*sizeof(uint64_t))) == NULL)
+			return -RA_ENOMEM;
+		br->offsets[0] = 0;
+		br->offsets[1] = h->size;
+	}
+	for (uint64_t i = 0; i < br->nblocks; ++i)
+		if (br->offsets[i+1] - br->offsets[i] > br->maxstored)
+			br->maxstored = br->offsets[i+1] - br->offsets[i];
+	br->cached = br->nblocks;
+	return 0;
+}
+
+static int
+block_reader_load(block_reader *br, const uint64_t b, uint8_t *dst)
+{
+	int ret;
+	uint64_t stored = br->offsets[b+1] - br->offsets[b];
+	uint64_t len = b == br->nblocks - 1 ? br->rawsize - b*br->blocksize : br->blocksize;
+	if (br->zbuf == NULL && (br->zbuf = safe_malloc(br->maxstored)) == NULL)
+		return -RA_ENOMEM;
+	if ((ret = valid_pread(br->fd, br->zbuf, stored, br->data_off + br->offsets[b])) < 0)
+		return ret;
+	return decode_block(&br->c, br->zbuf, stored, dst, len);
+}
+
+static int
+block_reader_read(block_reader *br, uint64_t off, uint64_t len, uint8_t *dst)
+{  /* copy uncompressed bytes [off, off+len) of the data segment into dst */
+	int ret;
+	if (br->blocksize == 0)
+		return valid_pread(br->fd, dst, len, br->data_off + off);
+	while (len > 0) {
+		uint64_t b = off / br->blocksize;
+		uint64_t inblock = off - b*br->blocksize;
+		uint64_t blocklen = b == br->nblocks - 1 ? br->rawsize - b*br->blocksize : br->blocksize;
+		uint64_t n = blocklen - inblock < len ? blocklen - inblock : len;
+		if (n == blocklen) {  // whole block wanted: skip the cache
+			if ((ret = block_reader_load(br, b, dst)) < 0)
+				return ret;
+		} else {
+			if (br->block == NULL && (br->block = safe_malloc(br->blocksize)) == NULL)
+				return -RA_ENOMEM;
+			if (br->cached != b) {
+				br->cached = br->nblocks;
+				if ((ret = block_reader_load(br, b, br->block)) < 0)
+					return ret;
+				br->cached = b;
+			}
+			memcpy(dst, br->block + inblock, n);
+		}
+		off += n;
+		dst += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void
+block_reader_close(block_reader *br)
+{
+	free(br->offsets);
+	free(br->zbuf);
+	free(br->block);
+}
+
+//
+// SLAB READS
+//
+
+#define SLAB_BUFSIZE  (1UL<<20)   /* bounce buffer for coalescing nearby runs */
+#define SLAB_MAXGAP   (1UL<<16)   /* read through gaps up to this size rather than seek */
+
+typedef struct {
+	block_reader *br;
+	uint64_t runlen;     /* bytes per contiguous run */
+	uint8_t *dst;        /* destination of the next flushed run */
+	uint64_t *offs;      /* data offsets of pending runs */
+	size_t n, cap;
+	uint8_t *buf;
+} slab_reader;
+
+static int
+slab_flush(slab_reader *s)
+{
+	int ret = 0;
+	if (s->n == 0)
+		return 0;
+	uint64_t span = s->offs[s->n - 1] + s->runlen - s->offs[0];
+	if (span == s->n * s->runlen)  // runs are back-to-back on disk
+		ret = block_reader_read(s->br, s->offs[0], span, s->dst);
+	else if ((ret = block_reader_read(s->br, s->offs[0], span, s->buf)) == 0)
+		for (size_t i = 0; i < s->n; ++i)
+			memcpy(s->dst + i*s->runlen, s->buf + (s->offs[i] - s->offs[0]), s->runlen);
+	s->dst += s->n * s->runlen;
+	s->n = 0;
+	return ret;
+}
+
+static int
+slab_add(slab_reader *s, const uint64_t off)
+{
+	int ret = 0;
+	if (s->n > 0) {
+		uint64_t end = s->offs[s->n - 1] + s->runlen;
+		if (s->n == s->cap || off - end > SLAB_MAXGAP || off + s->runlen - s->offs[0] > SLAB_BUFSIZE)
+			ret = slab_flush(s);
+	}
+	s->offs[s->n++] = off;
+	return ret;
+}
+
+int
+ra_read_slab(const char *path, const uint64_t start[], const uint64_t count[],
+		const uint64_t stride[], ra_t *out)
+{  /* read the hyperslab start + i*stride, 0 <= i < count, of each dimension */
+	ra_t h;
+	block_reader br;
+	int ret;
+	int fd = ra_read_header(&h, path);
+	if (fd < 0)
+		return fd;
+	slab_reader s = { &br, 0, NULL, NULL, 0, 0, NULL };
+	uint64_t *pitch = NULL, *step = NULL, *idx = NULL;
+	out->top = NULL;
+	if ((ret = block_reader_open(&br, fd, &h)) < 0)
+		goto done;
+	pitch = safe_malloc(h.ndims*sizeof(uint64_t));
+	step = safe_malloc(h.ndims*sizeof(uint64_t));
+	idx = calloc(h.ndims, sizeof(uint64_t));
+	if (pitch == NULL || step == NULL || idx == NULL) {
+		ret = fail(RA_ENOMEM, "unable to allocate slab index");
+		goto done;
+	}
+	uint64_t p = h.elbyte;
+	for (uint64_t d = 0; d < h.ndims; ++d) {
+		step[d] = stride == NULL ? 1 : stride[d];
+		if (count[d] == 0 || step[d] == 0 || start[d] + (count[d] - 1)*step[d] >= h.dims[d]) {
+			ret = fail(RA_EINVAL, "slab exceeds dimension %lu of %s", d, path);
+			goto done;
+		}
+		pitch[d] = p;
+		p *= h.dims[d];
+	}
+
+	out->magic = RA_MAGIC_NUMBER;
+	out->flags = h.flags & ~(RA_FLAG_COMPRESSED | RA_FLAG_CHUNKED | RA_FLAG_SHUFFLE | RA_FLAG_BITSHUFFLE);
+	out->eltype = h.eltype;
+	out->elbyte = h.elbyte;
+	out->ndims = h.ndims;
+	out->size = h.elbyte;
+	for (uint64_t d = 0; d < h.ndims; ++d)
+		out->size *= count[d];
+	out->align = h.align;
+	if ((out->top = alloc_top(out)) == NULL) {
+		ret = -RA_ENOMEM;
+		goto done;
+	}
+	out->mapsize = 0;
+	out->dims = (uint64_t*)(out->top + DIMS_OFFSET);
+	memcpy(out->dims, count, h.ndims*sizeof(uint64_t));
+	out->data = out->top + ra_header_size(out);
+	refresh_mem_from_struct(out);
+
+	// Dims [0,k) form one contiguous run on disk: all but the last must be
+	// read in full, and the last may be any unit-stride range.
+	uint64_t k = 0, runlen = h.elbyte;
+	if (step[0] == 1) {
+		k = 1;
+		while (k < h.ndims && step[k] == 1 && start[k-1] == 0 && count[k-1] == h.dims[k-1])
+			++k;
+		runlen = pitch[k-1]*count[k-1];
+	}
+	uint64_t base = k > 0 ? start[k-1]*pitch[k-1] : 0;
+	for (uint64_t d = k; d < h.ndims; ++d)
+		base += start[d]*pitch[d];
+
+	s.runlen = runlen;
+	s.dst = out->data;
+	s.cap = SLAB_BUFSIZE/runlen + 1;
+	s.offs = safe_malloc(s.cap*sizeof(uint64_t));
+	s.buf = safe_malloc(SLAB_BUFSIZE);
+	if (s.offs == NULL || s.buf == NULL) {
+		ret = -RA_ENOMEM;
+		goto done;
+	}
+	uint64_t off = base;
+	for (;;) {
+		if ((ret = slab_add(&s, off)) < 0)
+			goto done;
+		uint64_t d = k;  // advance odometer over the remaining dims
+		while (d < h.ndims && ++idx[d] == count[d]) {
+			off -= (count[d] - 1)*step[d]*pitch[d];
+			idx[d++] = 0;
+		}
+		if (d == h.ndims)
+			break;
+		off += step[d]*pitch[d];
+	}
+	if ((ret = slab_flush(&s)) == 0)
+		to_host_order(out);
+
+done:
+	if (ret < 0 && out->top != NULL)
+		release_top(out);
+	block_reader_close(&br);
+	close(fd);
+	free(s.offs);
+	free(s.buf);
+	free(idx);
+	free(step);
+	free(pitch);
+	ra_free(&h);
+	return ret;
+}
+
+int
+ra_write(ra_t *a, const char *path)
+{
+    int fd, ret;
+	uint32_t crc = 0;
+	direct_stream ds, *s;
+    fd = valid_open(path, O_WRONLY | O_TRUNC | O_CREAT); //0644
+	if (fd < 0)
+		return fd;
+	s = direct_start(&ds, fd, 1, ra_file_size(a) + (write_checksum ? RA_CHECKSUM_SIZE : 0)) == 0
+		? &ds : NULL;
+	if (a->top == NULL || a->mapsize) // don't have a single writable space for the raw array
+	{
+		uint8_t *header = header_block(a);  // write in parts
+		size_t hsize = ra_header_size(a);
+		ret = header == NULL ? -RA_ENOMEM : chunked_write(fd, s, header, hsize, hsize, NULL);
+		free(header);
+		if (ret == 0)
+			ret = chunked_write(fd, s, a->data, a->size, 0, write_checksum ? &crc : NULL);
+	}
+	else
+	{
+		refresh_mem_from_struct(a);  // make sure malloc memory contains updated struct vars
+		ret = chunked_write(fd, s, a->top, ra_file_size(a), ra_header_size(a),
+				write_checksum ? &crc : NULL);  // can write all at once
+	}
+	if (ret == 0 && write_checksum) {
+		uint64_t record[2] = { RA_CHECKSUM_TAG, crc };
+		ret = chunked_write(fd, s, (uint8_t*)record, RA_CHECKSUM_SIZE, RA_CHECKSUM_SIZE, NULL);
+	}
+	if (s != NULL)
+		ret = direct_stop(s, ret);
+    close(fd);
+    return ret;
+}
+
+
+int
+ra_copy (ra_t *dst, ra_t *src)
+{
+	if (src->top == NULL || src->mapsize) {
+		memcpy(dst, src, DIMS_OFFSET);
+		dst->align = src->align;
+		memcpy(dst->dims, src->dims, src->ndims*sizeof(uint64_t));
+		memcpy(dst->data, src->data, src->size);
+	} else {
+		refresh_mem_from_struct(src);
+		memcpy(dst->top, src->top, ra_file_size(src));
+	}
+	return 0;
+}
+
+//
+// STREAMING WRITER
+//
+
+#define WRITER_BUFSIZE  (1UL<<20)  /* appends are gathered into writes of this size */
+
+struct ra_writer {
+	ra_t h;              /* header as last written; owns h.dims */
+	int fd;
+	int checksum;        /* append a checksum record on close */
+	uint32_t crc;
+	uint64_t slice;      /* bytes per index of the last dimension */
+	uint64_t ondisk;     /* data bytes written to the file so far */
+	uint64_t buffered;
+	uint8_t *buf;
+};
+
+static int
+writer_patch(ra_writer_t *w)
+{  /* describe the whole slices on disk in the header, so readers can follow the file */
+	w->h.dims[w->h.ndims - 1] = w->ondisk / w->slice;
+	w->h.size = w->h.dims[w->h.ndims - 1] * w->slice;
+	uint64_t at = DIMS_OFFSET + (w->h.ndims - 1)*sizeof(uint64_t);
+	if (pwrite(w->fd, &w->h.size, sizeof(uint64_t), SIZE_OFFSET) != sizeof(uint64_t)
+			|| pwrite(w->fd, &w->h.dims[w->h.ndims - 1], sizeof(uint64_t), at) != sizeof(uint64_t))
+		return fail_sys(RA_EIO, "unable to update header");
+	return 0;
+}
+
+static int
+writer_flush(ra_writer_t *w)
+{
+	if (w->buffered == 0)
+		return 0;
+	if (valid_write(w->fd, w->buf, w->buffered) < 0)
+		return -RA_EIO;
+	w->ondisk += w->buffered;
+	w->buffered = 0;
+	return writer_patch(w);
+}
+
+ra_writer_t *
+ra_writer_open(const char *path, const char *type, const uint64_t ndims, const uint64_t dims[],
+		const uint64_t flags)
+{  /* start a file whose last dimension grows with each append; dims[ndims-1] is ignored */
+	if (ndims == 0 || flags & RA_FLAG_COMPRESSED) {
+		fail(RA_EINVAL, "a streamed array needs a dimension to grow and cannot be compressed");
+		return NULL;
+	}
+	ra_writer_t *w = calloc(1, sizeof(ra_writer_t));
+	if (w == NULL) {
+		fail(RA_ENOMEM, "unable to allocate writer");
+		return NULL;
+	}
+	w->fd = -1;
+	w->h.magic = RA_MAGIC_NUMBER;
+	w->h.flags = (flags & RA_FLAG_ALIGNED) | HOST_ORDER;  // raw slices, as the host has them
+	w->h.align = flags & RA_FLAG_ALIGNED ? RA_DEFAULT_ALIGN : 0;
+	w->h.ndims = ndims;
+	w->checksum = write_checksum;
+	if (ra_parse_type(type, &w->h.eltype, &w->h.elbyte) < 0
+			|| (w->h.dims = safe_malloc(ndims*sizeof(uint64_t))) == NULL
+			|| (w->buf = safe_malloc(WRITER_BUFSIZE)) == NULL)
+		goto fail;
+	w->slice = w->h.elbyte;
+	for (uint64_t d = 0; d < ndims - 1; ++d) {
+		w->h.dims[d] = dims[d];
+		if (dims[d] > 0 && w->slice > UINT64_MAX / dims[d]) {
+			fail(RA_EINVAL, "slices of %s would overflow a byte count", path);
+			goto fail;
+		}
+		w->slice *= dims[d];
+	}
+	w->h.dims[ndims - 1] = 0;
+	if (w->slice == 0) {
+		fail(RA_EINVAL, "slices of %s would be empty", path);
+		goto fail;
+	}
+	uint8_t *header = header_block(&w->h);
+	if (header == NULL || (w->fd = valid_open(path, O_WRONLY | O_TRUNC | O_CREAT)) < 0
+			|| valid_write(w->fd, header, ra_header_size(&w->h)) < 0) {
+		free(header);
+		goto fail;
+	}
+	free(header);
+	return w;
+
+fail:
+	if (w->fd >= 0)
+		close(w->fd);
+	free(w->buf);
+	free(w->h.dims);
+	free(w);
+	return NULL;
+}
+
+int
+ra_writer_append(ra_writer_t *w, const void *data, const uint64_t n)
+{  /* append n slices, each the size of the array without its last dimension */
+	const uint8_t *src = data;
+	if (n > (UINT64_MAX - ra_header_size(&w->h) - w->ondisk - w->buffered) / w->slice)
+		return fail(RA_EINVAL, "%lu more slices would overflow the size of the file", n);
+	uint64_t left = n * w->slice;
+	if (w->checksum)
+		w->crc = ra_crc32c(w->crc, src, left);
+	while (left > 0) {
+		if (w->buffered == 0 && left >= WRITER_BUFSIZE) {  // big appends skip the buffer
+			uint64_t k = left - left % WRITER_BUFSIZE;
+			if (chunked_write(w->fd, NULL, src, k, 0, NULL) < 0)
+				return -RA_EIO;
+			w->ondisk += k;
+			src += k;
+			left -= k;
+			int ret = writer_patch(w);
+			if (ret < 0)
+				return ret;
+			continue;
+		}
+		uint64_t k = WRITER_BUFSIZE - w->buffered < left ? WRITER_BUFSIZE - w->buffered : left;
+		memcpy(w->buf + w->buffered, src, k);
+		w->buffered += k;
+		src += k;
+		left -= k;
+		if (w->buffered == WRITER_BUFSIZE) {
+			int ret = writer_flush(w);
+			if (ret < 0)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+int
+ra_writer_sync(ra_writer_t *w)
+{  /* push everything appended so far to the file and the header */
+	int ret = writer_flush(w);
+	if (ret == 0 && fdatasync(w->fd) != 0)
+		ret = fail_sys(RA_EIO, "unable to sync");
+	return ret;
+}
+
+int
+ra_writer_close(ra_writer_t *w)
+{
+	int ret = writer_flush(w);
+	if (ret == 0 && w->checksum) {
+		uint64_t record[2] = { RA_CHECKSUM_TAG, w->crc };
+		ret = valid_write(w->fd, record, RA_CHECKSUM_SIZE);
+	}
+	if (close(w->fd) != 0 && ret == 0)
+		ret = fail_sys(RA_EIO, "unable to close");
+	free(w->buf);
+	free(w->h.dims);
+	free(w);
+	return ret;
+}
+
+
+static int
+replace_data(ra_t *r, uint8_t *newdata, const uint64_t newsize)
+{  /* swap in a new data segment, staying in unified memory if it fits */
+	if (r->top == NULL) {
+		free(r->data);
+		r->data = newdata;
+	} else if (r->mapsize == 0 && newsize <= r->size) {
+		memcpy(r->data, newdata, newsize);
+		free(newdata);
+	} else if (deunify(r, newdata) < 0)
+		return -RA_ENOMEM;
+	r->size = newsize;
+	return 0;
+}
+
+typedef struct {
+	codec c;
+	const uint8_t *src;
+	uint8_t *dst;
+	uint64_t rawsize;
+	uint64_t blocksize;
+	uint64_t slot;       /* compressed bytes reserved per block */
+	uint64_t *offsets;
+	uint64_t first;      /* block that src and dst start at when decompressing */
+} block_job;
+
+static int
+compress_task(void *job_, const uint64_t b)
+{  /* compress block b into its slot and record the stored length */
+	block_job *job = job_;
+	uint64_t len = (b + 1)*job->blocksize > job->rawsize ? job->rawsize - b*job->blocksize : job->blocksize;
+	return encode_block(&job->c, job->src + b*job->blocksize, len, job->dst + b*job->slot, &job->offsets[b]);
+}
+
+static int
+decompress_task(void *job_, const uint64_t i)
+{
+	block_job *job = job_;
+	uint64_t b = job->first + i;
+	uint64_t len = (b + 1)*job->blocksize > job->rawsize ? job->rawsize - b*job->blocksize : job->blocksize;
+	return decode_block(&job->c, job->src + job->offsets[b] - job->offsets[job->first],
+			job->offsets[b+1] - job->offsets[b], job->dst + i*job->blocksize, len);
+}
+
+ra_t *
+ra_compress(ra_t *r)
+{
+	return ra_compress_chunked(r, RA_BLOCK_SIZE, 0);
+}
+
+ra_t *
+ra_compress_chunked(ra_t *r, uint64_t blocksize, const uint64_t filter)
+{  /* arrays that fit in one block keep the original single-block layout */
+	if (is_compressed(r))  // already compressed
+		return r;
+	if (blocksize == 0)
+		blocksize = RA_BLOCK_SIZE;
+	if (r->elbyte > 0 && blocksize >= r->elbyte)  // blocks hold whole elements
+		blocksize -= blocksize % r->elbyte;
+	if (blocksize > LZ4_MAX_INPUT_SIZE) {
+		fail(RA_EINVAL, "block size %lu exceeds the LZ4 limit", blocksize);
+		return NULL;
+	}
+	uint8_t *out;
+	uint64_t outsize;
+	uint64_t oldflags = r->flags;
+	codec c;
+	r->flags |= filter & (RA_FLAG_SHUFFLE | RA_FLAG_BITSHUFFLE);
+	if (r->size <= blocksize) {
+		r->flags |= RA_FLAG_COMPRESSED;
+		codec_init(&c, r);
+		if ((out = safe_malloc(LZ4_compressBound(r->size))) == NULL
+				|| encode_block(&c, r->data, r->size, out, &outsize) < 0)
+			goto fail;
+	} else {
+		r->flags |= RA_FLAG_COMPRESSED | RA_FLAG_CHUNKED;
+		uint64_t nblocks = (r->size + blocksize - 1) / blocksize;
+		uint64_t tablesize = (nblocks + 1)*sizeof(uint64_t);
+		uint64_t slot = LZ4_compressBound(blocksize);
+		out = safe_malloc(nblocks*slot + tablesize + CHUNK_TRAILER_SIZE);
+		uint64_t *offsets = safe_malloc(tablesize);
+		block_job job = { {0}, r->data, out, r->size, blocksize, slot, offsets + 1, 0 };
+		codec_init(&job.c, r);
+		if (out == NULL || offsets == NULL || parallel_for(nblocks, compress_task, &job) < 0) {
+			free(offsets);
+			goto fail;
+		}
+		// blocks were compressed into fixed-size slots; pack them down
+		offsets[0] = 0;
+		for (uint64_t b = 0; b < nblocks; ++b) {
+			uint64_t stored = offsets[b+1];
+			memmove(out + offsets[b], out + b*slot, stored);
+			offsets[b+1] = offsets[b] + stored;
+		}
+		outsize = offsets[nblocks];
+		memcpy(out + outsize, offsets, tablesize);
+		outsize += tablesize;
+		memcpy(out + outsize, &blocksize, sizeof(uint64_t));
+		memcpy(out + outsize + sizeof(uint64_t), &nblocks, sizeof(uint64_t));
+		outsize += CHUNK_TRAILER_SIZE;
+		free(offsets);
+	}
+	if (replace_data(r, out, outsize) < 0)
+		goto fail;
+	return r;
+
+fail:  // leave the array as it was
+	free(out);
+	r->flags = oldflags;
+	return NULL;
+}
+
+
+ra_t *
+ra_decompress(ra_t *r)
+{
+	if (!is_compressed(r)) // only do if compressed
+		return r;
+	uint64_t orig_size = ra_data_size(r);
+	uint8_t *out = safe_malloc(orig_size);
+	if (out == NULL)
+		return NULL;
+	codec c;
+	codec_init(&c, r);
+	if (is_chunked(r)) {
+		uint64_t blocksize, nblocks, *offsets;
+		if (r->size < CHUNK_TRAILER_SIZE) {
+			fail(RA_EFORMAT, "corrupt block index");
+			goto fail;
+		}
+		const uint8_t *trailer = r->data + r->size - CHUNK_TRAILER_SIZE;
+		if (chunk_trailer(trailer, r->size, orig_size, &blocksize, &nblocks) < 0
+				|| (offsets = chunk_table(trailer - (nblocks + 1)*sizeof(uint64_t), r->size, nblocks)) == NULL)
+			goto fail;
+		block_job job = { c, r->data, out, orig_size, blocksize, 0, offsets, 0 };
+		int ret = parallel_for(nblocks, decompress_task, &job);
+		free(offsets);
+		if (ret < 0)
+			goto fail;
+	} else if (decode_block(&c, r->data, r->size, out, orig_size) < 0)
+		goto fail;
+	// for most cases, fastest is to redo dims and de-unify
+	if (replace_data(r, out, orig_size) < 0)
+		goto fail;
+	r->flags &= ~(RA_FLAG_COMPRESSED | RA_FLAG_CHUNKED | RA_FLAG_SHUFFLE | RA_FLAG_BITSHUFFLE);
+	refresh_mem_from_struct(r);
+	to_host_order(r);
+	return r;
+
+fail:
+	free(out);
+	return NULL;
+}
+
+#define STREAM_BUFSIZE  (1UL<<22)  /* compressed bytes read per batch of blocks */
+
+int64_t
+ra_read_into(const char *path, void *dst, const size_t cap)
+{  /* read the uncompressed data of path into dst, streaming compressed blocks */
+	ra_t h;
+	block_reader br;
+	int64_t ret;
+	int fd = ra_read_header(&h, path);
+	if (fd < 0)
+		return fd;
+	if ((ret = block_reader_open(&br, fd, &h)) < 0)
+		goto done;
+	if (br.rawsize > cap)
+		ret = fail(RA_EINVAL, "%s holds %lu bytes of data, buffer only %lu", path, br.rawsize, cap);
+	else if (br.blocksize == 0)
+		ret = valid_pread(fd, dst, br.rawsize, br.data_off);
+	else {
+		uint8_t *zbuf = safe_malloc(br.maxstored > STREAM_BUFSIZE ? br.maxstored : STREAM_BUFSIZE);
+		if (zbuf == NULL) {
+			ret = -RA_ENOMEM;
+			goto done;
+		}
+		block_job job = { br.c, zbuf, dst, br.rawsize, br.blocksize, 0, br.offsets, 0 };
+		for (uint64_t b = 0, e; b < br.nblocks && ret == 0; b = e) {
+			e = b + 1;  // gather blocks until the batch is full
+			while (e < br.nblocks && br.offsets[e+1] - br.offsets[b] <= STREAM_BUFSIZE)
+				++e;
+			ret = valid_pread(fd, zbuf, br.offsets[e] - br.offsets[b], br.data_off + br.offsets[b]);
+			job.first = b;
+			job.dst = (uint8_t*)dst + b*br.blocksize;
+			if (ret == 0)
+				ret = parallel_for(e - b, decompress_task, &job);
+		}
+		free(zbuf);
+	}
+	if (ret == 0 && is_foreign(&h))
+		swap_bytes(dst, br.rawsize, swap_width(&h));
+
+done:
+	block_reader_close(&br);
+	close(fd);
+	ra_free(&h);
+	return ret < 0 ? ret : (int64_t)br.rawsize;
+}
+
+static int
+data_checksum(const int fd, const ra_t *h, const char *path, uint32_t *crc)
+{  /* stream the data segment of an open file through the checksum, then check_record */
+	uint64_t off = ra_header_size(h), left = h->size;
+	uint8_t record[RA_CHECKSUM_SIZE];
+	int ret = 0;
+	uint8_t *buf = safe_malloc(STREAM_BUFSIZE);
+	if (buf == NULL)
+		return -RA_ENOMEM;
+	*crc = 0;
+	while (left > 0 && ret == 0) {
+		uint64_t n = left < STREAM_BUFSIZE ? left : STREAM_BUFSIZE;
+		if ((ret = valid_pread(fd, buf, n, off)) == 0)
+			*crc = ra_crc32c(*crc, buf, n);
+		off += n;
+		left -= n;
+	}
+	free(buf);
+	if (ret < 0)
+		return ret;
+	if (pread(fd, record, RA_CHECKSUM_SIZE, off) != RA_CHECKSUM_SIZE)
+		return 0;
+	return check_record(record, *crc);
+}
+
+int
+ra_checksum(const char *path, uint32_t *crc)
+{
+	ra_t h;
+	int fd = ra_read_header(&h, path);
+	if (fd < 0)
+		return fd;
+	int ret = data_checksum(fd, &h, path, crc);
+	if (ret == RECORD_MISMATCH)
+		ret = checksum_mismatch(path, *crc);
+	close(fd);
+	ra_free(&h);
+	return ret;
+}
+
+int
+ra_checksum_store(const char *path)
+{  /* hash the data segment and write the record just after it */
+	ra_t h;
+	uint32_t crc;
+	int fd = ra_read_header(&h, path);
+	if (fd < 0)
+		return fd;
+	close(fd);
+	int ret = (fd = valid_open(path, O_RDWR));
+	if (fd < 0)
+		goto done;
+	if ((ret = data_checksum(fd, &h, path, &crc)) == RECORD_MISMATCH)
+		ret = 0;  // stale record: replace it
+	else if (ret == 1) {  // already up to date
+		ret = 0;
+		close(fd);
+		goto done;
+	}
+	struct stat st;
+	uint64_t end = ra_file_size(&h);
+	if (ret == 0 && fstat(fd, &st) == 0 && st.st_size > end) {
+		uint64_t tag = 0;
+		if (pread(fd, &tag, sizeof tag, end) != sizeof tag || tag != RA_CHECKSUM_TAG)
+			ret = fail(RA_EINVAL, "%s has other metadata after its data", path);
+	}
+	if (ret >= 0) {
+		uint64_t record[2] = { RA_CHECKSUM_TAG, crc };
+		ret = pwrite(fd, record, RA_CHECKSUM_SIZE, end) == RA_CHECKSUM_SIZE ? 0
+			: fail_sys(RA_EIO, "unable to write checksum of %s", path);
+	}
+	close(fd);
+
+done:
+	ra_free(&h);
+	return ret;
+}
+
+void
+ra_free(ra_t * a)
+{
+	if (a->mapsize)
+		ra_munmap(a);
+	else if (a->top == NULL) {
+		free(a->dims);
+		free(a->data);
+	} else
+    	free(a->top - a->topoff);
+
+}
+
+static uint64_t
+numel(const uint64_t dims[], const uint64_t ndims)
+{
+	uint64_t n = 1;
+	for (uint64_t k = 0; k < ndims; ++k)
+		n *= dims[k];
+	return n;
+}
+
+int
+ra_reshape(ra_t * r, const uint64_t newdims[], const uint64_t ndimsnew)
+{
+    if (numel(r->dims, r->ndims) != numel(newdims, ndimsnew))
+		return fail(RA_EINVAL, "Total number of elements must be conserved.");
+    // if new dims preserve total number of elements, then change the dims
+    size_t newdimsize = ndimsnew * sizeof(uint64_t);
+	uint64_t *dims;
+	if (r->top == NULL) {
+		if ((dims = safe_malloc(newdimsize)) == NULL)
+			return -RA_ENOMEM;
+		free(r->dims);
+		r->dims = dims;
+	} else if (r->mapsize) {  // mapping is read-only
+		uint8_t *data = safe_malloc(r->size);
+		if ((dims = safe_malloc(newdimsize)) == NULL || data == NULL) {
+			free(data);
+			free(dims);
+			return -RA_ENOMEM;
+		}
+		memcpy(data, r->data, r->size);
+		release_top(r);
+		r->data = data;
+		r->dims = dims;
+	} else {  // grow or shrink the header in place
+		ra_t old = *r;
+		r->ndims = ndimsnew;
+		if (relayout(r, &old) < 0) {
+			r->ndims = old.ndims;
+			return -RA_ENOMEM;
+		}
+	}
+    r->ndims = ndimsnew;
+    memcpy(r->dims, newdims, newdimsize);
+	refresh_mem_from_struct(r);
+    return 0;
+}
+
+int
+ra_align(ra_t *r, const uint64_t align)
+{  /* pad the header so ra_write puts the data on an align-byte boundary */
+	if (align != 0 && !valid_align(align))
+		return fail(RA_EINVAL, "alignment %lu is not a power of two from 8 to %llu",
+				align, RA_MAX_ALIGN);
+	if (r->top != NULL && r->mapsize) {  // mapping is read-only
+		uint8_t *data = safe_malloc(r->size);
+		if (data == NULL)
+			return -RA_ENOMEM;
+		memcpy(data, r->data, r->size);
+		if (deunify(r, data) < 0) {
+			free(data);
+			return -RA_ENOMEM;
+		}
+	}
+	ra_t old = *r;
+	r->flags = align ? r->flags | RA_FLAG_ALIGNED : r->flags & ~RA_FLAG_ALIGNED;
+	r->align = align;
+	if (relayout(r, &old) < 0) {
+		*r = old;
+		return -RA_ENOMEM;
+	}
+	refresh_mem_from_struct(r);
+	return 0;
+}
+
+static int
+shift_data(int fd, const char *path, const uint64_t from, const uint8_t *header, const uint64_t to)
+{  /* move everything from offset 'from' on to offset 'to' behind the to bytes of header,
+	  returning the file's new fd */
+	struct stat st;
+	int ret = 0;
+	if (fstat(fd, &st) != 0)
+		return fail_sys(RA_EIO, "unable to stat %s", path);
+#ifdef FALLOC_FL_INSERT_RANGE
+	// the kernel can splice whole filesystem blocks in or out at the front
+	if ((to > from && (to - from) % st.st_blksize == 0
+				&& fallocate(fd, FALLOC_FL_INSERT_RANGE, 0, to - from) == 0)
+			|| (from > to && (from - to) % st.st_blksize == 0
+				&& fallocate(fd, FALLOC_FL_COLLAPSE_RANGE, 0, from - to) == 0)) {
+		if (pwrite(fd, header, to, 0) != to)
+			return fail_sys(RA_EIO, "unable to write header of %s", path);
+		return fd;
+	}
+#endif
+	// otherwise stream into a temporary file that then replaces the original
+	char *tmppath = safe_malloc(strlen(path) + 8);
+	if (tmppath == NULL)
+		return -RA_ENOMEM;
+	sprintf(tmppath, "%s.XXXXXX", path);
+	int out = mkstemp(tmppath);
+	if (out == -1) {
+		ret = fail_sys(RA_EOPEN, "unable to create %s", tmppath);
+		free(tmppath);
+		return ret;
+	}
+	fchmod(out, st.st_mode & 07777);
+	loff_t in_off = from, out_off = to;
+	uint64_t bytesleft = st.st_size - from;
+	while (bytesleft > 0) {
+		ssize_t n = copy_file_range(fd, &in_off, out, &out_off, bytesleft, 0);
+		if (n <= 0)
+			break;
+		bytesleft -= n;
+	}
+	if (bytesleft > 0) {  // no in-kernel copy between these files
+		uint8_t *buf = safe_malloc(STREAM_BUFSIZE);
+		if (buf == NULL)
+			ret = -RA_ENOMEM;
+		while (ret == 0 && bytesleft > 0) {
+			size_t n = bytesleft < STREAM_BUFSIZE ? bytesleft : STREAM_BUFSIZE;
+			if ((ret = valid_pread(fd, buf, n, in_off)) < 0)
+				break;
+			if (pwrite(out, buf, n, out_off) != n)
+				ret = fail_sys(RA_EIO, "unable to write %s", tmppath);
+			in_off += n;
+			out_off += n;
+			bytesleft -= n;
+		}
+		free(buf);
+	}
+	// the copy is whole and on disk before it takes the name of the original
+	if (ret == 0 && pwrite(out, header, to, 0) != to)
+		ret = fail_sys(RA_EIO, "unable to write header of %s", tmppath);
+	if (ret == 0 && fsync(out) != 0)
+		ret = fail_sys(RA_EIO, "unable to sync %s", tmppath);
+	if (ret == 0 && rename(tmppath, path) != 0)
+		ret = fail_sys(RA_EOPEN, "unable to replace %s", path);
+	if (ret < 0) {  // the original file is untouched
+		close(out);
+		unlink(tmppath);
+		free(tmppath);
+		return ret;
+	}
+	free(tmppath);
+	close(fd);
+	return out;
+}
+
+static int
+rewrite_header(int fd, const char *path, const ra_t *old, const ra_t *r)
+{  /* replace the header old of the file open read-write on fd with r, then close it */
+	int ret = 0;
+	uint8_t *header = header_block(r);
+	if (header == NULL) {
+		close(fd);
+		return -RA_ENOMEM;
+	}
+	if (ra_header_size(r) != ra_header_size(old)) {
+		int newfd = shift_data(fd, path, ra_header_size(old), header, ra_header_size(r));
+		if (newfd < 0) {
+			close(fd);
+			free(header);
+			return newfd;
+		}
+		fd = newfd;
+	} else if (pwrite(fd, header, ra_header_size(r), 0) != ra_header_size(r))
+		ret = fail_sys(RA_EIO, "unable to write header of %s", path);
+	free(header);
+	close(fd);
+	return ret;
+}
+
+int
+ra_reshape_file(const char *path, const uint64_t newdims[], const uint64_t ndimsnew)
+{  /* reshape on disk, rewriting only the header when its length is unchanged */
+	ra_t h;
+	int ret = 0;
+	int fd = ra_read_header(&h, path);
+	if (fd < 0)
+		return fd;
+	close(fd);
+    if (numel(h.dims, h.ndims) != numel(newdims, ndimsnew)) {
+		ret = fail(RA_EINVAL, "Total number of elements must be conserved.");
+		goto done;
+	}
+	if ((fd = valid_open(path, O_RDWR)) < 0) {
+		ret = fd;
+		goto done;
+	}
+	ra_t r = h;
+	r.ndims = ndimsnew;
+	r.dims = (uint64_t*)newdims;
+	ret = rewrite_header(fd, path, &h, &r);
+
+done:
+	ra_free(&h);
+	return ret;
+}
+
+int
+ra_align_file(const char *path, const uint64_t align)
+{  /* re-pad the header of a file so its data starts on an align-byte boundary */
+	ra_t h;
+	int ret = 0;
+	if (align != 0 && !valid_align(align))
+		return fail(RA_EINVAL, "alignment %lu is not a power of two from 8 to %llu",
+				align, RA_MAX_ALIGN);
+	int fd = ra_read_header(&h, path);
+	if (fd < 0)
+		return fd;
+	close(fd);
+	if ((fd = valid_open(path, O_RDWR)) < 0) {
+		ret = fd;
+		goto done;
+	}
+	ra_t r = h;
+	r.flags = align ? h.flags | RA_FLAG_ALIGNED : h.flags & ~RA_FLAG_ALIGNED;
+	r.align = align;
+	ret = rewrite_header(fd, path, &h, &r);
+
+done:
+	ra_free(&h);
+	return ret;
+}
+
+int
+ra_endian_file(const char *path, const uint64_t order)
+{  /* swap the data of a file in place, in one pass, to the given byte order */
+	ra_t h;
+	uint32_t oldcrc = 0, newcrc = 0;
+	uint8_t record[RA_CHECKSUM_SIZE], *buf = NULL, *header = NULL;
+	int ret = 0, hasrecord;
+	if (order & ~RA_FLAG_BIG_ENDIAN)
+		return fail(RA_EINVAL, "invalid byte order %lu", order);
+	int fd = ra_read_header(&h, path);
+	if (fd < 0)
+		return fd;
+	close(fd);
+	fd = -1;
+	if (is_compressed(&h)) {
+		ret = fail(RA_EINVAL, "%s is compressed; decompress it first", path);
+		goto done;
+	}
+	if ((fd = valid_open(path, O_RDWR)) < 0) {
+		ret = fd;
+		goto done;
+	}
+	uint64_t w = swap_width(&h), step = STREAM_BUFSIZE - STREAM_BUFSIZE % w;
+	uint64_t off = ra_header_size(&h), end = off + h.size;
+	hasrecord = pread(fd, record, RA_CHECKSUM_SIZE, end) == RA_CHECKSUM_SIZE
+			&& check_record(record, 0) != 0;
+	if ((h.flags & RA_FLAG_BIG_ENDIAN) != order && w > 1) {
+		if ((buf = safe_malloc(step)) == NULL) {
+			ret = -RA_ENOMEM;
+			goto done;
+		}
+		// a record is verified before any data moves, so a mismatch leaves the file as it was
+		for (uint64_t o = off, n; hasrecord && o < end; o += n) {
+			n = end - o < step ? end - o : step;
+			if ((ret = valid_pread(fd, buf, n, o)) < 0)
+				goto done;
+			oldcrc = ra_crc32c(oldcrc, buf, n);
+		}
+		if (hasrecord && check_record(record, oldcrc) != 1) {
+			ret = checksum_mismatch(path, oldcrc);
+			goto done;
+		}
+		for (uint64_t n; off < end; off += n) {
+			n = end - off < step ? end - off : step;
+			if ((ret = valid_pread(fd, buf, n, off)) < 0)
+				goto done;
+			swap_bytes(buf, n, w);
+			if (hasrecord)
+				newcrc = ra_crc32c(newcrc, buf, n);
+			if (pwrite(fd, buf, n, off) != (ssize_t)n) {
+				ret = fail_sys(RA_EIO, "unable to write %s", path);
+				goto done;
+			}
+		}
+		if (hasrecord) {
+			uint64_t fresh[2] = { RA_CHECKSUM_TAG, newcrc };
+			if (pwrite(fd, fresh, RA_CHECKSUM_SIZE, end) != RA_CHECKSUM_SIZE) {
+				ret = fail_sys(RA_EIO, "unable to write checksum of %s", path);
+				goto done;
+			}
+		}
+	}
+	h.flags = (h.flags & ~RA_FLAG_BIG_ENDIAN) | order;
+	if ((header = header_block(&h)) == NULL)
+		ret = -RA_ENOMEM;
+	else if (pwrite(fd, header, ra_header_size(&h), 0) != (ssize_t)ra_header_size(&h))
+		ret = fail_sys(RA_EIO, "unable to write header of %s", path);
+	free(header);
+
+done:
+	if (fd >= 0)
+		close(fd);
+	free(buf);
+	ra_free(&h);
+	return ret;
+}
+
+//
+// PERMUTATION
+//
+
+/*
+   Any permutation of dimensions comes down to a batch of 2-D transposes.
+   Unit dims are dropped, and runs of dims that stay next to each other and
+   in order are merged into one. If the fastest dim then stays fastest it is
+   folded into the element, which grows to a contiguous run. What is left
+   is input dim 0 (a) trading places with the dim that becomes fastest (b),
+   once for each index of the remaining, outer dims. Each transpose is done
+   in square tiles so that both the reads and the writes stay in cache, with
+   SSE2 or AVX2 register transposes for 2-, 4- and 8-byte elements.
+*/
+
+#define PERM_TILE  32           /* elements on a side of a tile */
+#define PERM_BAND  (64 << 20)   /* bytes a band may span when permuting files */
+
+typedef struct {
+	const uint8_t *src;
+	uint8_t *dst;
+	uint64_t E;              /* bytes per element, after folding */
+	uint64_t na, nb;         /* the transposed pair of dims */
+	uint64_t sb, sa;         /* input stride of b and output stride of a, in elements */
+	uint64_t band;           /* rows of a per task */
+	uint64_t nouter, *outer; /* count, input and output stride of each outer dim */
+	uint64_t nrepeat;        /* transposes, the product of the outer counts */
+	uint64_t nbands, ntasks;
+} perm_plan;
+
+static void
+transpose_scalar(const uint8_t *src, const uint64_t ss, uint8_t *dst, const uint64_t ds,
+		const uint64_t a0, const uint64_t na, const uint64_t b0, const uint64_t nb, const uint64_t E)
+{  /* dst[a*ds + b] = src[a + b*ss] over [a0,na) x [b0,nb), in elements of E bytes */
+#define TRANSPOSE_BYTES(n) \
+	for (uint64_t b = b0; b < nb; ++b) \
+		for (uint64_t a = a0; a < na; ++a) \
+			memcpy(dst + (a*ds + b)*(n), src + (a + b*ss)*(n), (n))
+	switch (E) {  // constant sizes become single moves
+	case 1: TRANSPOSE_BYTES(1); break;
+	case 2: TRANSPOSE_BYTES(2); break;
+	case 4: TRANSPOSE_BYTES(4); break;
+	case 8: TRANSPOSE_BYTES(8); break;
+	case 16: TRANSPOSE_BYTES(16); break;
+	default: TRANSPOSE_BYTES(E);
+	}
+#undef TRANSPOSE_BYTES
+}
+
+#ifdef __SSE2__
+/* log2(v) perfect shuffles of v registers transpose a v x v block */
+#define TRANSPOSE_SSE2(bits) \
+	for (uint64_t b = 0; b + v <= nb; b += v) \
+		for (uint64_t a = 0; a + v <= na; a += v) { \
+			__m128i r[16], w[16]; \
+			for (uint64_t k = 0; k < v; ++k)  /* r[k] holds elements a.. of column b + k */ \
+				r[k] = _mm_loadu_si128((const __m128i*)(src + (a + (b + k)*ss)*E)); \
+			for (uint64_t s = v; s > 1; s >>= 1) { \
+				for (uint64_t m = 0; m < v/2; ++m) { \
+					w[2*m] = _mm_unpacklo_epi##bits(r[m], r[v/2+m]); \
+					w[2*m+1] = _mm_unpackhi_epi##bits(r[m], r[v/2+m]); \
+				} \
+				memcpy(r, w, v*sizeof(__m128i)); \
+			} \
+			for (uint64_t k = 0; k < v; ++k)  /* now r[k] is row a + k of the output */ \
+				_mm_storeu_si128((__m128i*)(dst + ((a + k)*ds + b)*E), r[k]); \
+		}
+
+static void
+transpose_sse2(const uint8_t *src, const uint64_t ss, uint8_t *dst, const uint64_t ds,
+		const uint64_t na, const uint64_t nb, const uint64_t E)
+{  /* whole 16-byte square blocks: 16x16 of 1 byte, 8x8 of 2, 4x4 of 4 or 2x2 of 8 */
+	const uint64_t v = 16 / E;
+	switch (E) {
+	case 1: TRANSPOSE_SSE2(8); break;
+	case 2: TRANSPOSE_SSE2(16); break;
+	case 4: TRANSPOSE_SSE2(32); break;
+	case 8: TRANSPOSE_SSE2(64); break;
+	}
+}
+#endif
+
+#ifdef RA_X86
+TARGET("avx2") static void
+transpose_avx2(const uint8_t *src, const uint64_t ss, uint8_t *dst, const uint64_t ds,
+		const uint64_t na, const uint64_t nb, const uint64_t E)
+{  /* whole 32-byte square blocks: 8x8 of 4 bytes or 4x4 of 8 */
+	const uint64_t v = 32 / E;
+	__m256i r[8], t[8];
+	for (uint64_t b = 0; b + v <= nb; b += v)
+		for (uint64_t a = 0; a + v <= na; a += v) {
+			for (uint64_t k = 0; k < v; ++k)
+				r[k] = _mm256_loadu_si256((const __m256i*)(src + (a + (b + k)*ss)*E));
+			if (E == 4) {  // within each 128-bit lane first, then across the lanes
+				for (int k = 0; k < 4; ++k) {
+					t[2*k] = _mm256_unpacklo_epi32(r[2*k], r[2*k+1]);
+					t[2*k+1] = _mm256_unpackhi_epi32(r[2*k], r[2*k+1]);
+				}
+				for (int k = 0; k < 2; ++k)
+					for (int j = 0; j < 2; ++j) {
+						r[4*k+2*j] = _mm256_unpacklo_epi64(t[4*k+j], t[4*k+j+2]);
+						r[4*k+2*j+1] = _mm256_unpackhi_epi64(t[4*k+j], t[4*k+j+2]);
+					}
+				for (int k = 0; k < 4; ++k) {
+					t[k] = _mm256_permute2x128_si256(r[k], r[k+4], 0x20);
+					t[k+4] = _mm256_permute2x128_si256(r[k], r[k+4], 0x31);
+				}
+			} else {
+				r[4] = _mm256_unpacklo_epi64(r[0], r[1]);
+				r[5] = _mm256_unpackhi_epi64(r[0], r[1]);
+				r[6] = _mm256_unpacklo_epi64(r[2], r[3]);
+				r[7] = _mm256_unpackhi_epi64(r[2], r[3]);
+				t[0] = _mm256_permute2x128_si256(r[4], r[6], 0x20);
+				t[1] = _mm256_permute2x128_si256(r[5], r[7], 0x20);
+				t[2] = _mm256_permute2x128_si256(r[4], r[6], 0x31);
+				t[3] = _mm256_permute2x128_si256(r[5], r[7], 0x31);
+			}
+			for (uint64_t k = 0; k < v; ++k)
+				_mm256_storeu_si256((__m256i*)(dst + ((a + k)*ds + b)*E), t[k]);
+		}
+}
+#endif
+
+static void
+transpose_tile(const uint8_t *src, const uint64_t ss, uint8_t *dst, const uint64_t ds,
+		const uint64_t na, const uint64_t nb, const uint64_t E)
+{  /* dst[a*ds + b] = src[a + b*ss] for a < na, b < nb */
+	uint64_t v = 0;  // side of the blocks done by a vector kernel, if any
+#ifdef RA_X86
+	if (have_avx2() && (E == 4 || E == 8)) {
+		v = 32 / E;
+		transpose_avx2(src, ss, dst, ds, na, nb, E);
+	}
+#endif
+#ifdef __SSE2__
+	if (v == 0 && (E == 1 || E == 2 || E == 4 || E == 8)) {
+		v = 16 / E;
+		transpose_sse2(src, ss, dst, ds, na, nb, E);
+	}
+#endif
+	uint64_t va = v ? na - na % v : 0, vb = v ? nb - nb % v : 0;
+	transpose_scalar(src, ss, dst, ds, va, na, 0, nb, E);
+	transpose_scalar(src, ss, dst, ds, 0, va, vb, nb, E);
+}
+
+static int
+permute_task(void *plan_, const uint64_t i)
+{  /* one band of rows of a for one index of the outer dims */
+	const perm_plan *p = plan_;
+	uint64_t o = i / p->nbands, a0 = (i % p->nbands)*p->band;
+	uint64_t a1 = a0 + p->band < p->na ? a0 + p->band : p->na;
+	const uint8_t *src = p->src;
+	uint8_t *dst = p->dst;
+	for (uint64_t k = 0; k < p->nouter; ++k) {
+		uint64_t j = o % p->outer[3*k];
+		o /= p->outer[3*k];
+		src += j*p->outer[3*k+1]*p->E;
+		dst += j*p->outer[3*k+2]*p->E;
+	}
+	for (uint64_t a = a0; a < a1; a += PERM_TILE)  // each tile row of the output is finished in turn
+		for (uint64_t b = 0; b < p->nb; b += PERM_TILE)
+			transpose_tile(src + (a + b*p->sb)*p->E, p->sb, dst + (a*p->sa + b)*p->E, p->sa,
+					a1 - a < PERM_TILE ? a1 - a : PERM_TILE, p->nb - b < PERM_TILE ? p->nb - b : PERM_TILE, p->E);
+	return 0;
+}
+
+static int
+perm_plan_make(perm_plan *p, const uint64_t dims[], const uint64_t ndims, const uint64_t perm[],
+		const uint64_t elbyte)
+{  /* reduce the permutation to a batch of transposes; p->ntasks is 0 for a plain copy */
+	uint64_t *w = calloc(7*(ndims + 1), sizeof(uint64_t));
+	if (w == NULL)
+		return fail(RA_ENOMEM, "unable to allocate permutation plan");
+	uint64_t *pos = w, *first = pos + ndims + 1, *len = first + ndims + 1, *d = len + ndims + 1;
+	uint64_t *rank = d + ndims + 1, *sin = rank + ndims + 1, *sout = sin + ndims + 1;
+	int ret = 0;
+	for (uint64_t k = 0; k < ndims; ++k)
+		if (perm[k] >= ndims || pos[perm[k]]++) {
+			ret = fail(RA_EINVAL, "dims must be a permutation of 0 to %lu", ndims - 1);
+			goto done;
+		}
+	memset(p, 0, sizeof(perm_plan));
+	p->E = elbyte;
+	for (uint64_t j = 0, n = 0; j < ndims; ++j)  // position of each input dim among the non-unit ones
+		pos[j] = dims[j] == 1 ? RA_BAD_FIELD : n++;
+	// groups of non-unit dims that are consecutive and in order both in the input and the output
+	uint64_t m = 0;
+	for (uint64_t k = 0; k < ndims; ++k) {
+		uint64_t j = perm[k];
+		if (pos[j] == RA_BAD_FIELD)
+			continue;
+		if (m > 0 && pos[first[m-1]] + len[m-1] == pos[j]) {
+			d[m-1] *= dims[j];
+			++len[m-1];
+		} else {
+			first[m] = j;
+			len[m] = 1;
+			d[m++] = dims[j];
+		}
+	}
+	for (uint64_t g = 0; g < m; ++g) {  // where each group sits in the input
+		rank[g] = 0;
+		for (uint64_t h = 0; h < m; ++h)
+			rank[g] += first[h] < first[g];
+	}
+	if (m > 0 && rank[0] == 0) {  // the fastest dim stays fastest: fold it into the element
+		p->E *= d[0];
+		for (uint64_t g = 1; g < m; ++g) {
+			d[g-1] = d[g];
+			rank[g-1] = rank[g] - 1;
+		}
+		--m;
+	}
+	if (m == 0)
+		goto done;  // nothing moves relative to anything else
+	uint64_t ga = 0;  // the group that is fastest in the input
+	for (uint64_t g = 0; g < m; ++g) {
+		sin[g] = 1;
+		for (uint64_t h = 0; h < m; ++h)
+			if (rank[h] < rank[g])
+				sin[g] *= d[h];
+		sout[g] = g ? sout[g-1]*d[g-1] : 1;
+		if (rank[g] == 0)
+			ga = g;
+	}
+	p->na = d[ga];
+	p->nb = d[0];
+	p->sa = sout[ga];
+	p->sb = sin[0];
+	if ((p->outer = safe_malloc(3*m*sizeof(uint64_t))) == NULL) {
+		ret = -RA_ENOMEM;
+		goto done;
+	}
+	p->nrepeat = 1;
+	for (uint64_t g = 1; g < m; ++g)
+		if (g != ga) {
+			p->outer[3*p->nouter] = d[g];
+			p->outer[3*p->nouter+1] = sin[g];
+			p->outer[3*p->nouter+2] = sout[g];
+			p->nrepeat *= d[g];
+			++p->nouter;
+		}
+	p->band = PERM_TILE;
+	p->nbands = (p->na + p->band - 1) / p->band;
+	p->ntasks = p->nrepeat * p->nbands;
+
+done:
+	free(w);
+	return ret;
+}
+
+static int
+perm_plan_run(perm_plan *p, const uint8_t *src, uint8_t *dst, const uint64_t size, const uint64_t band)
+{  /* band rows of a per task, at least a tile */
+	p->src = src;
+	p->dst = dst;
+	if (p->ntasks == 0) {
+		memcpy(dst, src, size);
+		return 0;
+	}
+	if (band > p->band) {
+		p->band = (band + PERM_TILE - 1) / PERM_TILE * PERM_TILE;
+		p->nbands = (p->na + p->band - 1) / p->band;
+		p->ntasks = p->nrepeat * p->nbands;
+	}
+	return parallel_for(p->ntasks, permute_task, p);
+}
+
+static int
+check_permutable(const ra_t *a, const char *what)
+{
+	if (a->flags & RA_FLAG_COMPRESSED)
+		return fail(RA_EINVAL, "%s is compressed; decompress it before permuting", what);
+	if (a->elbyte == 0 || numel(a->dims, a->ndims) * a->elbyte != a->size)
+		return fail(RA_EFORMAT, "%s: size %lu does not match its dims and element size", what, a->size);
+	return 0;
+}
+
+int
+ra_permute(ra_t *r, const uint64_t perm[])
+{  /* dim k of the result is dim perm[k] of r, as in Julia's permutedims */
+	perm_plan p;
+	int ret = check_permutable(r, "array");
+	if (ret < 0 || (ret = perm_plan_make(&p, r->dims, r->ndims, perm, r->elbyte)) < 0)
+		return ret;
+	ra_t out = *r;
+	uint64_t *dims = safe_malloc(r->ndims*sizeof(uint64_t) + 1);
+	if (dims == NULL) {
+		ret = -RA_ENOMEM;
+		goto done;
+	}
+	for (uint64_t k = 0; k < r->ndims; ++k)
+		dims[k] = r->dims[perm[k]];
+	if (r->top == NULL)
+		out.data = safe_malloc(r->size + 1);
+	else {  // unified or mapped memory is replaced by new unified memory
+		out.mapsize = 0;
+		if ((out.top = alloc_top(&out)) != NULL) {
+			memcpy(out.top, r->top, ra_header_size(r));
+			out.dims = (uint64_t*)(out.top + DIMS_OFFSET);
+			out.data = out.top + ra_header_size(r);
+		}
+	}
+	if (out.data == NULL || (r->top != NULL && out.top == NULL)) {
+		ret = -RA_ENOMEM;
+		goto done;
+	}
+	if ((ret = perm_plan_run(&p, r->data, out.data, r->size, 0)) < 0) {
+		if (r->top == NULL)
+			free(out.data);
+		else
+			free(out.top - out.topoff);
+		goto done;
+	}
+	if (r->top == NULL)
+		free(r->data);
+	else
+		release_top(r);
+	memcpy(out.dims, dims, r->ndims*sizeof(uint64_t));
+	*r = out;
+
+done:
+	free(dims);
+	free(p.outer);
+	return ret;
+}
+
+int
+ra_permute_file(const char *src, const char *dst, const uint64_t perm[])
+{  /* permute a file into a new one through mappings of both, so neither need fit in memory */
+	perm_plan p = { 0 };
+	ra_t a, h;
+	uint8_t *header = NULL, *map = MAP_FAILED;
+	size_t head, len = 0;
+	int ret, fd = -1;
+	if ((ret = ra_mmap(&a, src, RA_MMAP_DEFAULT)) < 0)
+		return ret;
+	if ((ret = check_permutable(&a, src)) < 0
+			|| (ret = distinct_output(src, dst)) < 0
+			|| (ret = perm_plan_make(&p, a.dims, a.ndims, perm, a.elbyte)) < 0)
+		goto done;
+	h = a;
+	if ((h.dims = safe_malloc(a.ndims*sizeof(uint64_t) + 1)) == NULL) {
+		ret = -RA_ENOMEM;
+		goto done;
+	}
+	for (uint64_t k = 0; k < a.ndims; ++k)
+		h.dims[k] = a.dims[perm[k]];
+	header = header_block(&h);
+	free(h.dims);
+	if (header == NULL) {
+		ret = -RA_ENOMEM;
+		goto done;
+	}
+	head = ra_header_size(&h);
+	len = head + h.size;
+	if ((fd = valid_open(dst, O_RDWR | O_CREAT | O_TRUNC)) < 0) {
+		ret = fd;
+		goto done;
+	}
+	if (ftruncate(fd, len) != 0) {
+		ret = fail_sys(RA_EIO, "unable to size %s", dst);
+		goto done;
+	}
+	if ((map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		ret = fail_sys(RA_ENOMEM, "unable to mmap %s", dst);
+		goto done;
+	}
+	memcpy(map, header, head);
+	/* Bands as tall as fit in PERM_BAND, so that the input pages a band reads
+	   stay cached while it runs and each is read from disk about once, while
+	   the output is written front to back. */
+	if ((ret = perm_plan_run(&p, a.data, map + head, a.size, p.nb ? PERM_BAND / (p.nb*p.E) : 0)) < 0)
+		goto done;
+	if (msync(map, len, MS_SYNC) != 0)
+		ret = fail_sys(RA_EIO, "unable to write %s", dst);
+
+done:
+	if (map != MAP_FAILED)
+		munmap(map, len);
+	if (fd >= 0 && close(fd) != 0 && ret == 0)
+		ret = fail_sys(RA_EIO, "unable to close %s", dst);
+	if (fd >= 0 && ret < 0)
+		unlink(dst);
+	free(header);
+	free(p.outer);
+	ra_munmap(&a);
+	return ret;
+}
+
+//
+// PACKS
+//
+
+typedef struct {
+	uint64_t offset;     /* of the member from the start of the pack */
+	uint64_t length;
+	uint64_t name;       /* offset of its name in the name table */
+} pack_entry;
+
+struct ra_pack {
+	int fd;
+	uint8_t *map;
+	size_t mapsize;
+	uint64_t n, nbuckets;
+	const pack_entry *entries;
+	const uint64_t *buckets;
+	const char *names;
+	uint64_t nameslen;
+};
+
+static uint64_t
+pack_hash(const char *name)
+{  /* FNV-1a */
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (; *name; ++name)
+		h = (h ^ (uint8_t)*name) * 0x100000001b3ULL;
+	return h;
+}
+
+static uint64_t
+member_align(const uint8_t *head, const size_t n)
+{  /* where a member must start: on its own alignment if it has one, else on 8 bytes */
+	ra_t h;
+	uint64_t align;
+	if (n < DIMS_OFFSET)
+		return sizeof(uint64_t);
+	memcpy(&h, head, DIMS_OFFSET);
+	uint64_t at = DIMS_OFFSET + h.ndims*sizeof(uint64_t);
+	if (!(h.flags & RA_FLAG_ALIGNED) || h.ndims > n / sizeof(uint64_t) || at + sizeof(uint64_t) > n)
+		return sizeof(uint64_t);
+	memcpy(&align, head + at, sizeof(uint64_t));
+	return valid_align(align) ? align : sizeof(uint64_t);
+}
+
+static int
+pack_member(const int out, const char *path, uint8_t *buf, uint64_t *offset, uint64_t *length)
+{  /* append the file at path to out at the first suitable offset from *offset on */
+	static const uint8_t zeros[4096];
+	int in = valid_open(path, O_RDONLY);
+	if (in < 0)
+		return in;
+	ssize_t n;
+	int ret = 0;
+	*length = 0;
+	while (ret == 0 && (n = read(in, buf, STREAM_BUFSIZE)) > 0) {
+		if (*length == 0) {
+			uint64_t align = member_align(buf, n);
+			uint64_t pad = (align - *offset % align) % align;
+			if (n < sizeof(uint64_t) || *(uint64_t*)buf != RA_MAGIC_NUMBER) {
+				ret = fail(RA_EFORMAT, "%s is not an RA file", path);
+				break;
+			}
+			*offset += pad;
+			for (uint64_t k; ret == 0 && pad > 0; pad -= k) {
+				k = pad < sizeof zeros ? pad : sizeof zeros;
+				ret = valid_write(out, zeros, k);
+			}
+			if (ret < 0)
+				break;
+		}
+		ret = valid_write(out, buf, n);
+		*length += n;
+	}
+	if (ret == 0 && n < 0)
+		ret = fail_sys(RA_EIO, "unable to read %s", path);
+	if (ret == 0 && *length == 0)
+		ret = fail(RA_EFORMAT, "%s is empty", path);
+	close(in);
+	return ret;
+}
+
+int
+ra_pack_files(const char *path, const char * const members[], const size_t n)
+{  /* write the files members[] into a new pack at path, named by their paths */
+	static const uint8_t zeros[sizeof(uint64_t)];
+	uint64_t nbuckets = 1, size = 0, nameslen = 0;
+	while (nbuckets < 2*n)
+		nbuckets <<= 1;
+	for (size_t i = 0; i < n; ++i)
+		nameslen += strlen(members[i]) + 1;
+	nameslen += (sizeof(uint64_t) - nameslen % sizeof(uint64_t)) % sizeof(uint64_t);
+	pack_entry *entries = safe_malloc(n*sizeof(pack_entry));
+	uint64_t *buckets = calloc(nbuckets, sizeof(uint64_t));
+	char *names = calloc(nameslen > 0 ? nameslen : 1, 1);
+	uint8_t *buf = safe_malloc(STREAM_BUFSIZE);
+	int ret = 0, out = -1;
+	if ((entries == NULL && n > 0) || buckets == NULL || names == NULL || buf == NULL) {
+		ret = fail(RA_ENOMEM, "unable to allocate pack index");
+		goto done;
+	}
+	for (size_t i = 0, at = 0; i < n; ++i) {  // names and hash table first, to catch duplicates
+		entries[i].name = at;
+		strcpy(names + at, members[i]);
+		at += strlen(members[i]) + 1;
+		uint64_t b = pack_hash(members[i]) & (nbuckets - 1);
+		for (; buckets[b]; b = (b + 1) & (nbuckets - 1))
+			if (strcmp(names + entries[buckets[b] - 1].name, members[i]) == 0) {
+				ret = fail(RA_EINVAL, "%s is named twice", members[i]);
+				goto done;
+			}
+		buckets[b] = i + 1;
+	}
+	for (size_t i = 0; i < n; ++i)  // a member the pack truncated would be read as it grew
+		if ((ret = distinct_output(members[i], path)) < 0)
+			goto done;
+	ra_t h = { RA_MAGIC_NUMBER, 0, RA_TYPE_USER, 1, 0, 1, &size };
+	if ((out = valid_open(path, O_WRONLY | O_TRUNC | O_CREAT)) < 0) {
+		ret = out;
+		goto done;
+	}
+	if ((ret = valid_write(out, &h, DIMS_OFFSET)) < 0 || (ret = valid_write(out, &size, sizeof(uint64_t))) < 0)
+		goto done;
+	uint64_t end = ra_header_size(&h);
+	for (size_t i = 0; i < n; ++i) {  // members back to back
+		entries[i].offset = end;
+		if ((ret = pack_member(out, members[i], buf, &entries[i].offset, &entries[i].length)) < 0)
+			goto done;
+		end = entries[i].offset + entries[i].length;
+	}
+	uint64_t pad = (sizeof(uint64_t) - end % sizeof(uint64_t)) % sizeof(uint64_t);
+	if ((ret = valid_write(out, zeros, pad)) < 0)
+		goto done;
+	size = end + pad - ra_header_size(&h);
+	uint64_t trailer[4] = { n, nbuckets, ra_header_size(&h) + size, RA_PACK_TAG };
+	h.size = size;
+	if ((ret = valid_write(out, entries, n*sizeof(pack_entry))) < 0
+			|| (ret = valid_write(out, buckets, nbuckets*sizeof(uint64_t))) < 0
+			|| (ret = valid_write(out, names, nameslen)) < 0
+			|| (ret = valid_write(out, trailer, RA_PACK_TRAILER_SIZE)) < 0)
+		goto done;
+	if (pwrite(out, &h, DIMS_OFFSET, 0) != DIMS_OFFSET
+			|| pwrite(out, &size, sizeof(uint64_t), DIMS_OFFSET) != sizeof(uint64_t))
+		ret = fail_sys(RA_EIO, "unable to write header of %s", path);
+
+done:
+	if (out >= 0 && close(out) != 0 && ret == 0)
+		ret = fail_sys(RA_EIO, "unable to close %s", path);
+	if (out >= 0 && ret < 0)
+		unlink(path);
+	free(buf);
+	free(names);
+	free(buckets);
+	free(entries);
+	return ret;
+}
+
+ra_pack_t *
+ra_pack_open(const char *path)
+{  /* map a pack and its index; members are then found without further reads */
+	ra_pack_t *p = calloc(1, sizeof(ra_pack_t));
+	if (p == NULL) {
+		fail(RA_ENOMEM, "unable to allocate pack");
+		return NULL;
+	}
+	if ((p->fd = valid_open(path, O_RDONLY)) < 0) {
+		free(p);
+		return NULL;
+	}
+	p->mapsize = ra_ondisk_size(p->fd);
+	if (p->mapsize < DIMS_OFFSET + sizeof(uint64_t) + RA_PACK_TRAILER_SIZE) {
+		fail(RA_EFORMAT, "%s is too short to be a pack", path);
+		goto fail;
+	}
+	if ((p->map = mmap(NULL, p->mapsize, PROT_READ, MAP_SHARED, p->fd, 0)) == MAP_FAILED) {
+		p->map = NULL;
+		fail_sys(RA_ENOMEM, "unable to mmap %s", path);
+		goto fail;
+	}
+	uint64_t trailer[4];
+	memcpy(trailer, p->map + p->mapsize - RA_PACK_TRAILER_SIZE, RA_PACK_TRAILER_SIZE);
+	p->n = trailer[0];
+	p->nbuckets = trailer[1];
+	uint64_t index = trailer[2], end = p->mapsize - RA_PACK_TRAILER_SIZE;
+	if (*(uint64_t*)p->map != RA_MAGIC_NUMBER || trailer[3] != RA_PACK_TAG) {
+		fail(RA_EFORMAT, "%s is not a pack", path);
+		goto fail;
+	}
+	if (index % sizeof(uint64_t) || index > end || p->n > (end - index) / sizeof(pack_entry)
+			|| p->nbuckets <= p->n || (p->nbuckets & (p->nbuckets - 1))
+			|| p->nbuckets > (end - index - p->n*sizeof(pack_entry)) / sizeof(uint64_t)) {
+		fail(RA_EFORMAT, "%s has a corrupt index", path);
+		goto fail;
+	}
+	p->entries = (const pack_entry*)(p->map + index);
+	p->buckets = (const uint64_t*)(p->entries + p->n);
+	p->names = (const char*)(p->buckets + p->nbuckets);
+	p->nameslen = (const char*)p->map + end - p->names;
+	if (p->nameslen > 0 && p->names[p->nameslen - 1] != '\0') {
+		fail(RA_EFORMAT, "%s has a corrupt name table", path);
+		goto fail;
+	}
+	return p;
+
+fail:
+	ra_pack_close(p);
+	return NULL;
+}
+
+void
+ra_pack_close(ra_pack_t *p)
+{
+	if (p->map != NULL)
+		munmap(p->map, p->mapsize);
+	close(p->fd);
+	free(p);
+}
+
+uint64_t
+ra_pack_count(const ra_pack_t *p)
+{
+	return p->n;
+}
+
+static const pack_entry *
+pack_lookup(const ra_pack_t *p, const uint64_t i)
+{  /* entry i, checked against the bounds of the pack */
+	if (i >= p->n) {
+		fail(RA_EINVAL, "pack has no member %lu", i);
+		return NULL;
+	}
+	const pack_entry *e = &p->entries[i];
+	if (e->name >= p->nameslen || e->offset > (uint8_t*)p->entries - p->map
+			|| e->length > (uint8_t*)p->entries - p->map - e->offset) {
+		fail(RA_EFORMAT, "pack entry %lu is corrupt", i);
+		return NULL;
+	}
+	return e;
+}
+
+const char *
+ra_pack_name(const ra_pack_t *p, const uint64_t i)
+{
+	const pack_entry *e = pack_lookup(p, i);
+	return e == NULL ? NULL : p->names + e->name;
+}
+
+int64_t
+ra_pack_find(const ra_pack_t *p, const char *name)
+{  /* index of the member called name; a corrupt, full table is probed once round */
+	uint64_t b = pack_hash(name) & (p->nbuckets - 1);
+	for (uint64_t k = 0; k < p->nbuckets && p->buckets[b]; ++k, b = (b + 1) & (p->nbuckets - 1)) {
+		const char *s = ra_pack_name(p, p->buckets[b] - 1);
+		if (s != NULL && strcmp(s, name) == 0)
+			return p->buckets[b] - 1;
+	}
+	return fail(RA_EINVAL, "pack has no member %s", name);
+}
+
+int
+ra_pack_mmap(const ra_pack_t *p, const uint64_t i, ra_t *a)
+{  /* zero-copy view of member i, released with ra_munmap or ra_free */
+	const pack_entry *e = pack_lookup(p, i);
+	if (e == NULL)
+		return -ra_errno();
+	uint64_t off = e->offset % sysconf(_SC_PAGESIZE);
+	void *m = mmap(NULL, off + e->length, PROT_READ, MAP_SHARED, p->fd, e->offset - off);
+	if (m == MAP_FAILED)
+		return fail_sys(RA_ENOMEM, "unable to mmap %s", p->names + e->name);
+	int ret = map_file(a, m, off, e->length, p->names + e->name);
+	if (ret < 0)
+		munmap(m, off + e->length);
+	return ret;
+}
+
+int
+ra_pack_read(const ra_pack_t *p, const uint64_t i, ra_t *a)
+{  /* copy member i into memory, as ra_read would */
+	ra_t v;
+	const pack_entry *e = pack_lookup(p, i);
+	if (e == NULL)
+		return -ra_errno();
+	int ret = map_file(&v, p->map, e->offset, e->length, p->names + e->name);
+	if (ret < 0)
+		return ret;
+	memcpy(a, &v, DIMS_OFFSET);
+	a->align = v.align;
+	if ((a->top = alloc_top(a)) == NULL)
+		return -RA_ENOMEM;
+	memcpy(a->top, v.top, ra_file_size(a));
+	a->mapsize = 0;
+	a->dims = (uint64_t*)(a->top + DIMS_OFFSET);
+	a->data = a->top + ra_header_size(a);
+	to_host_order(a);
+	return 0;
+}
+
+int
+ra_pack_extract(const ra_pack_t *p, const uint64_t i, const char *path)
+{  /* write member i to path exactly as it was packed */
+	const pack_entry *e = pack_lookup(p, i);
+	if (e == NULL)
+		return -ra_errno();
+	int fd = valid_open(path, O_WRONLY | O_TRUNC | O_CREAT);
+	if (fd < 0)
+		return fd;
+	int ret = chunked_write(fd, NULL, p->map + e->offset, e->length, 0, NULL);
+	close(fd);
+	return ret;
+}
+
+
+//
+// INDEXES
+//
+
+struct ra_index {
+	uint8_t *map;
+	size_t mapsize;
+	uint64_t n;
+	const ra_index_entry_t *entries;
+	const char *names;
+	uint64_t nameslen;
+};
+
+typedef struct {
+	char **paths;        /* relative to the indexed directory */
+	size_t n, cap;
+} path_list;
+
+static char *
+join_path(const char *dir, const char *name)
+{  /* dir/name, or name if dir is empty */
+	char *p = safe_malloc(strlen(dir) + strlen(name) + 2);
+	if (p != NULL)
+		sprintf(p, "%s%s%s", dir, *dir ? "/" : "", name);
+	return p;
+}
+
+static int
+list_add(path_list *l, char *path)
+{
+	if (l->n == l->cap) {
+		size_t cap = l->cap ? 2*l->cap : 1024;
+		char **p = realloc(l->paths, cap*sizeof(char*));
+		if (p == NULL) {
+			free(path);
+			return fail(RA_ENOMEM, "unable to allocate file list");
+		}
+		l->paths = p;
+		l->cap = cap;
+	}
+	l->paths[l->n++] = path;
+	return 0;
+}
+
+static int
+walk_dir(const int fd, const char *rel, path_list *l)
+{  /* add the .ra files below the directory open as fd, whose path is rel, to l; closes fd */
+	DIR *d = fdopendir(fd);
+	if (d == NULL) {
+		close(fd);
+		return fail_sys(RA_EOPEN, "unable to read directory %s", *rel ? rel : ".");
+	}
+	struct dirent *e;
+	int ret = 0;
+	while (ret == 0 && (e = readdir(d)) != NULL) {
+		size_t len = strlen(e->d_name);
+		int type = e->d_type;
+		struct stat st;
+		if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+			continue;
+		if (type == DT_UNKNOWN && fstatat(dirfd(d), e->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+			type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+		if (type != DT_DIR && (len < 3 || strcmp(e->d_name + len - 3, ".ra") != 0))
+			continue;
+		char *path = join_path(rel, e->d_name);
+		if (path == NULL)
+			ret = -RA_ENOMEM;
+		else if (type == DT_DIR) {  // links to directories are not followed, so there are no cycles
+			int sub = openat(dirfd(d), e->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			ret = sub < 0 ? fail_sys(RA_EOPEN, "unable to open directory %s", path) : walk_dir(sub, path, l);
+			free(path);
+		} else
+			ret = list_add(l, path);
+	}
+	closedir(d);
+	return ret;
+}
+
+static int
+compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int64_t
+index_find(const ra_index_t *x, const char *name)
+{  /* binary search of the entries, which are in order of name */
+	uint64_t lo = 0, hi = x->n;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo)/2;
+		int c = strcmp(x->names + x->entries[mid].name, name);
+		if (c == 0)
+			return mid;
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return -1;
+}
+
+typedef struct {
+	const char *dir;
+	char * const *paths;
+	const ra_index_t *old;   /* the previous index, or NULL */
+	ra_index_entry_t *entries;
+	int status;              /* code of the first failure */
+	uint64_t nfailed, nread;
+} index_job;
+
+static int
+index_task(void *job_, const uint64_t i)
+{  /* fill in entry i, from the old index if the file has not changed */
+	index_job *job = job_;
+	ra_index_entry_t *e = &job->entries[i];
+	char *path = join_path(job->dir, job->paths[i]);
+	struct stat st;
+	ra_header_t *h;
+	int64_t k;
+	int ok = 0;
+	if (path == NULL)
+		;
+	else if (stat(path, &st) != 0)
+		fail_sys(RA_EOPEN, "unable to open %s", path);
+	else if (job->old && (k = index_find(job->old, job->paths[i])) >= 0
+			&& job->old->entries[k].mtime == st.st_mtim.tv_sec*1000000000ULL + st.st_mtim.tv_nsec
+			&& job->old->entries[k].fsize == (uint64_t)st.st_size) {
+		*e = job->old->entries[k];
+		ok = 1;
+	} else if ((h = header_read(path)) != NULL) {
+		memset(e, 0, sizeof(ra_index_entry_t));
+		e->mtime = st.st_mtim.tv_sec*1000000000ULL + st.st_mtim.tv_nsec;
+		e->fsize = st.st_size;
+		e->flags = h->flags;
+		e->eltype = h->eltype;
+		e->elbyte = h->elbyte;
+		e->size = h->size;
+		e->ndims = h->ndims;
+		memcpy(e->dims, h->dims, (h->ndims < RA_INDEX_MAXDIMS ? h->ndims : RA_INDEX_MAXDIMS)*sizeof(uint64_t));
+		__sync_fetch_and_add(&job->nread, 1);
+		free(h);
+		ok = 1;
+	}
+	e->name = ok ? 0 : RA_BAD_FIELD;
+	if (!ok) {
+		__sync_bool_compare_and_swap(&job->status, 0, last_error);
+		__sync_fetch_and_add(&job->nfailed, 1);
+	}
+	free(path);
+	return 0;
+}
+
+int
+ra_index_build(const char *dir, const char *path)
+{  /* index the .ra files below dir, reusing the entries of an existing index */
+	static const uint8_t zeros[sizeof(uint64_t)];
+	path_list l = { NULL, 0, 0 };
+	char *defpath = NULL, *tmp = NULL;
+	ra_index_t *old = NULL;
+	index_job job = { dir, NULL, NULL, NULL, 0, 0, 0 };
+	int ret, out = -1;
+	if (path == NULL && (path = defpath = join_path(dir, RA_INDEX_NAME)) == NULL)
+		return -RA_ENOMEM;
+	int fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		ret = fail_sys(RA_EOPEN, "unable to open directory %s", dir);
+		goto done;
+	}
+	if ((ret = walk_dir(fd, "", &l)) < 0)
+		goto done;
+	qsort(l.paths, l.n, sizeof(char*), compare_names);
+	if (access(path, F_OK) == 0)
+		old = ra_index_open(path);  // if it is unreadable, every header is read again
+	if ((job.entries = safe_malloc(l.n*sizeof(ra_index_entry_t) + 1)) == NULL) {
+		ret = -RA_ENOMEM;
+		goto done;
+	}
+	job.paths = l.paths;
+	job.old = old;
+	if ((ret = parallel_for(l.n, index_task, &job)) < 0)
+		goto done;
+	uint64_t total = l.n, nameslen = 0;
+	l.n = 0;
+	for (size_t i = 0; i < total; ++i)  // drop the files that failed
+		if (job.entries[i].name == RA_BAD_FIELD)
+			free(l.paths[i]);
+		else {
+			job.entries[l.n] = job.entries[i];
+			job.entries[l.n].name = nameslen;
+			l.paths[l.n++] = l.paths[i];
+			nameslen += strlen(l.paths[i]) + 1;
+		}
+	uint64_t pad = (sizeof(uint64_t) - nameslen % sizeof(uint64_t)) % sizeof(uint64_t);
+	uint64_t dims[2] = { RA_INDEX_WORDS, l.n };
+	uint64_t trailer[2] = { nameslen + pad, RA_INDEX_TAG };
+	ra_t h = { RA_MAGIC_NUMBER, 0, RA_TYPE_UINT, sizeof(uint64_t), l.n*sizeof(ra_index_entry_t), 2, dims };
+	if ((tmp = safe_malloc(strlen(path) + 32)) == NULL) {
+		ret = -RA_ENOMEM;
+		goto done;
+	}
+	sprintf(tmp, "%s.%d.tmp", path, (int)getpid());  // renamed over path, so readers never see half an index
+	if ((out = valid_open(tmp, O_WRONLY | O_TRUNC | O_CREAT)) < 0) {
+		ret = out;
+		goto done;
+	}
+	if ((ret = valid_write(out, &h, DIMS_OFFSET)) < 0 || (ret = valid_write(out, dims, sizeof dims)) < 0
+			|| (ret = valid_write(out, job.entries, l.n*sizeof(ra_index_entry_t))) < 0)
+		goto done;
+	for (size_t i = 0; i < l.n && ret == 0; ++i)
+		ret = valid_write(out, l.paths[i], strlen(l.paths[i]) + 1);
+	if (ret < 0 || (ret = valid_write(out, zeros, pad)) < 0
+			|| (ret = valid_write(out, trailer, RA_INDEX_TRAILER_SIZE)) < 0)
+		goto done;
+	ret = close(out);
+	out = -1;
+	if (ret != 0) {
+		ret = fail_sys(RA_EIO, "unable to close %s", tmp);
+		goto done;
+	}
+	if (rename(tmp, path) != 0) {
+		ret = fail_sys(RA_EIO, "unable to replace %s", path);
+		goto done;
+	}
+	ret = job.status ? fail(job.status, "%lu of %lu files could not be indexed", job.nfailed, total) : job.nread;
+
+done:
+	if (out >= 0)
+		close(out);
+	if (tmp != NULL && ret < 0)
+		unlink(tmp);
+	if (old != NULL)
+		ra_index_close(old);
+	for (size_t i = 0; i < l.n; ++i)
+		free(l.paths[i]);
+	free(l.paths);
+	free(job.entries);
+	free(tmp);
+	free(defpath);
+	return ret;
+}
+
+ra_index_t *
+ra_index_open(const char *path)
+{  /* map an index; it is checked once here so that lookups need no checks */
+	ra_index_t *x = calloc(1, sizeof(ra_index_t));
+	ra_t a;
+	if (x == NULL) {
+		fail(RA_ENOMEM, "unable to allocate index");
+		return NULL;
+	}
+	int fd = valid_open(path, O_RDONLY);
+	if (fd < 0) {
+		free(x);
+		return NULL;
+	}
+	x->mapsize = ra_ondisk_size(fd);
+	if (x->mapsize < DIMS_OFFSET + 2*sizeof(uint64_t) + RA_INDEX_TRAILER_SIZE) {
+		close(fd);
+		fail(RA_EFORMAT, "%s is too short to be an index", path);
+		goto fail;
+	}
+	x->map = mmap(NULL, x->mapsize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (x->map == MAP_FAILED) {
+		x->map = NULL;
+		fail_sys(RA_ENOMEM, "unable to mmap %s", path);
+		goto fail;
+	}
+	if (map_file(&a, x->map, 0, x->mapsize, path) < 0)
+		goto fail;
+	uint64_t trailer[2];
+	memcpy(trailer, x->map + x->mapsize - RA_INDEX_TRAILER_SIZE, RA_INDEX_TRAILER_SIZE);
+	x->n = a.ndims == 2 ? a.dims[1] : 0;
+	x->entries = (const ra_index_entry_t*)a.data;
+	x->names = (const char*)a.data + a.size;
+	x->nameslen = trailer[0];
+	if (trailer[1] != RA_INDEX_TAG || a.flags != 0 || a.eltype != RA_TYPE_UINT || a.elbyte != sizeof(uint64_t)
+			|| a.ndims != 2 || a.dims[0] != RA_INDEX_WORDS || x->n > a.size / sizeof(ra_index_entry_t)
+			|| a.size != x->n*sizeof(ra_index_entry_t)
+			|| x->nameslen != x->mapsize - RA_INDEX_TRAILER_SIZE - ((uint8_t*)x->names - x->map)) {
+		fail(RA_EFORMAT, "%s is not an index", path);
+		goto fail;
+	}
+	int corrupt = x->nameslen > 0 && x->names[x->nameslen - 1] != '\0';
+	for (uint64_t i = 0; i < x->n; ++i)
+		corrupt |= x->entries[i].name >= x->nameslen;
+	if (corrupt) {
+		fail(RA_EFORMAT, "%s has a corrupt name table", path);
+		goto fail;
+	}
+	return x;
+
+fail:
+	ra_index_close(x);
+	return NULL;
+}
+
+void
+ra_index_close(ra_index_t *x)
+{
+	if (x->map != NULL)
+		munmap(x->map, x->mapsize);
+	free(x);
+}
+
+uint64_t
+ra_index_count(const ra_index_t *x)
+{
+	return x->n;
+}
+
+const ra_index_entry_t *
+ra_index_entry(const ra_index_t *x, const uint64_t i)
+{
+	if (i >= x->n) {
+		fail(RA_EINVAL, "index has no entry %lu", i);
+		return NULL;
+	}
+	return &x->entries[i];
+}
+
+const char *
+ra_index_name(const ra_index_t *x, const uint64_t i)
+{
+	const ra_index_entry_t *e = ra_index_entry(x, i);
+	return e == NULL ? NULL : x->names + e->name;
+}
+
+void
+ra_filter_init(ra_filter_t *f)
+{  /* a filter that matches every entry */
+	f->eltype = f->elbyte = f->ndims = RA_ANY;
+	for (int k = 0; k < RA_INDEX_MAXDIMS; ++k)
+		f->dims[k] = RA_ANY;
+	f->minsize = 0;
+	f->maxsize = RA_ANY;
+}
+
+int
+ra_index_match(const ra_index_entry_t *e, const ra_filter_t *f)
+{
+	if ((f->eltype != RA_ANY && e->eltype != f->eltype) || (f->elbyte != RA_ANY && e->elbyte != f->elbyte)
+			|| (f->ndims != RA_ANY && e->ndims != f->ndims) || e->size < f->minsize || e->size > f->maxsize)
+		return 0;
+	for (uint64_t k = 0; k < RA_INDEX_MAXDIMS; ++k)
+		if (f->dims[k] != RA_ANY && (k >= e->ndims || e->dims[k] != f->dims[k]))
+			return 0;
+	return 1;
+}
+
+
+//
+// HALF PRECISION
+//
+
+/*
+   Floats of 2 bytes are IEEE halves, and RA_TYPE_BFLOAT elements are the
+   upper halves of IEEE singles. Both widen to float exactly. Narrowing
+   rounds to nearest even, overflows to Inf and keeps NaNs quiet. A double
+   is first rounded to a float with its last bit set if inexact (round to
+   odd), which leaves the second rounding to give the correctly rounded
+   half. With F16C, halves convert eight at a time; bfloats need only
+   integer shifts and adds.
+*/
+
+#ifdef RA_X86
+static int
+have_f16c(void)
+{
+	static int has = -1;
+	if (has < 0)
+		has = have_avx2() && __builtin_cpu_supports("f16c");
+	return has;
+}
+#endif
+
+static float
+half_to_float(const uint16_t h)
+{
+	uint32_t sign = (uint32_t)(h & 0x8000) << 16, e = (h >> 10) & 0x1f, m = h & 0x3ff, b;
+	if (e == 0x1f)
+		b = sign | 0x7f800000 | m << 13;
+	else if (e > 0)
+		b = sign | (e + 112) << 23 | m << 13;
+	else if (m == 0)
+		b = sign;
+	else {  // subnormal: normalize it
+		for (e = 113; !(m & 0x400); --e)
+			m <<= 1;
+		b = sign | e << 23 | (m & 0x3ff) << 13;
+	}
+	float f;
+	memcpy(&f, &b, sizeof f);
+	return f;
+}
+
+static uint16_t
+float_to_half(const float f)
+{
+	uint32_t b;
+	memcpy(&b, &f, sizeof b);
+	uint16_t sign = (b >> 16) & 0x8000;
+	uint32_t a = b & 0x7fffffff;
+	if (a >= 0x7f800000)  // Inf, or a NaN with its quiet bit set
+		return sign | 0x7c00 | (a > 0x7f800000 ? 0x200 | ((a >> 13) & 0x3ff) : 0);
+	if (a >= 0x477ff000)  // rounds past 65504
+		return sign | 0x7c00;
+	if (a <= 0x33000000)  // at most half the smallest subnormal
+		return sign;
+	uint32_t h, rem, half;
+	if (a < 0x38800000) {  // subnormal
+		uint32_t m = (a & 0x7fffff) | 0x800000, shift = 126 - (a >> 23);
+		h = m >> shift;
+		rem = m & ((1u << shift) - 1);
+		half = 1u << (shift - 1);
+	} else {
+		h = (a - 0x38000000) >> 13;
+		rem = a & 0x1fff;
+		half = 0x1000;
+	}
+	if (rem > half || (rem == half && (h & 1)))
+		++h;  // may carry into the exponent, as it should
+	return sign | h;
+}
+
+static float
+bf16_to_float(const uint16_t h)
+{
+	uint32_t b = (uint32_t)h << 16;
+	float f;
+	memcpy(&f, &b, sizeof f);
+	return f;
+}
+
+static uint16_t
+float_to_bf16(const float f)
+{
+	uint32_t b;
+	memcpy(&b, &f, sizeof b);
+	if ((b & 0x7fffffff) > 0x7f800000)
+		return (b >> 16) | 0x40;
+	return (b + 0x7fff + ((b >> 16) & 1)) >> 16;
+}
+
+#define ODD_FLOAT(name, W, FABS) \
+static float \
+name(const W x) \
+{  /* x rounded to float toward zero, with the last bit set if inexact */ \
+	float f = (float)x; \
+	if ((W)f != x && x == x) { \
+		uint32_t b; \
+		memcpy(&b, &f, sizeof b); \
+		if (FABS((W)f) > FABS(x)) \
+			--b; \
+		b |= 1; \
+		memcpy(&f, &b, sizeof f); \
+	} \
+	return f; \
+}
+
+ODD_FLOAT(odd_float, double, fabs)
+ODD_FLOAT(odd_floatl, long double, fabsl)
+
+#ifdef RA_X86
+static inline TARGET("avx2,f16c") __m256
+widen8_f16(const __m128i h)
+{
+	return _mm256_cvtph_ps(h);
+}
+
+static inline TARGET("avx2") __m256
+widen8_bf16(const __m128i h)
+{
+	return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16));
+}
+
+static inline TARGET("avx2") __m128
+odd_float_avx2(const __m256d x)
+{  /* odd_float of four doubles */
+	const __m256d mag = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffffLL));
+	const __m256i low = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+	__m128 f = _mm256_cvtpd_ps(x);
+	__m256d back = _mm256_cvtps_pd(f);
+	__m256d inexact = _mm256_cmp_pd(back, x, _CMP_NEQ_OQ);
+	__m256d above = _mm256_cmp_pd(_mm256_and_pd(back, mag), _mm256_and_pd(x, mag), _CMP_GT_OQ);
+	__m128i in = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(_mm256_castpd_si256(inexact), low));
+	__m128i up = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(_mm256_castpd_si256(above), low));
+	__m128i b = _mm_add_epi32(_mm_castps_si128(f), up);  // up is -1 where f is too big
+	return _mm_castsi128_ps(_mm_or_si128(b, _mm_and_si128(in, _mm_set1_epi32(1))));
+}
+
+static inline TARGET("avx2") __m128i
+narrow8_bf16(const __m256 f)
+{  /* float_to_bf16 of eight floats */
+	__m256i b = _mm256_castps_si256(f);
+	__m256i hi = _mm256_srli_epi32(b, 16);
+	__m256i r = _mm256_add_epi32(_mm256_add_epi32(b, _mm256_set1_epi32(0x7fff)),
+			_mm256_and_si256(hi, _mm256_set1_epi32(1)));
+	__m256i q = _mm256_or_si256(hi, _mm256_set1_epi32(0x40));
+	r = _mm256_blendv_epi8(_mm256_srli_epi32(r, 16), q, _mm256_castps_si256(_mm256_cmp_ps(f, f, _CMP_UNORD_Q)));
+	return _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi32(r, r), 0x08));
+}
+#endif
+
+//
+// COMPARISON
+//
+
+#define DIFF_CHUNK  (1UL<<16)  /* values compared per task; keeps results independent of thread count */
+
+typedef struct {
+	double l1, l2, linf, maxrel;
+	uint64_t ndiffer, nexceed, maxulp;
+	uint64_t first;      /* element index, UINT64_MAX if none */
+} diff_acc;
+
+typedef struct diff_job diff_job;
+typedef uint64_t (*diff_fn)(const diff_job *job, uint64_t i, const uint64_t n, diff_acc *s);
+
+struct diff_job {
+	const uint8_t *a, *b;
+	uint64_t n;          /* values to compare; complex elements hold two */
+	int cplx;
+	double atol, rtol;
+	diff_fn simd, scalar;
+	diff_acc *acc;       /* one per chunk */
+};
+
+static void
+diff_acc_init(diff_acc *s)
+{
+	memset(s, 0, sizeof(diff_acc));
+	s->first = UINT64_MAX;
+}
+
+static void
+diff_acc_merge(diff_acc *s, const diff_acc *t)
+{  /* fold t, which covers later elements than s, into s */
+	s->l1 += t->l1;
+	s->l2 += t->l2;
+	if (t->linf > s->linf) s->linf = t->linf;
+	if (t->maxrel > s->maxrel) s->maxrel = t->maxrel;
+	if (t->maxulp > s->maxulp) s->maxulp = t->maxulp;
+	if (s->first == UINT64_MAX) s->first = t->first;
+	s->ndiffer += t->ndiffer;
+	s->nexceed += t->nexceed;
+}
+
+static void
+diff_update(diff_acc *s, const diff_job *job, const double d, const double absb,
+		const uint64_t ulp, const uint64_t i)
+{  /* fold in element i, which differs from its counterpart by d */
+	if (s->ndiffer++ == 0)
+		s->first = i;
+	s->l1 += d;
+	s->l2 += d*d;
+	if (d > s->linf)
+		s->linf = d;
+	if (absb > 0 && d/absb > s->maxrel)
+		s->maxrel = d/absb;
+	if (!(d <= job->atol + job->rtol*absb))  // NaN is never within tolerance
+		++s->nexceed;
+	if (ulp > s->maxulp)
+		s->maxulp = ulp;
+}
+
+#define DIFF_INT_KERNEL(name, T) \
+static uint64_t \
+name(const diff_job *job, uint64_t i, const uint64_t n, diff_acc *s) \
+{ \
+	const T *a = (const T*)job->a, *b = (const T*)job->b; \
+	for (; i < n; ++i) \
+		if (a[i] != b[i]) { \
+			uint64_t u = a[i] > b[i] ? (uint64_t)a[i] - (uint64_t)b[i] : (uint64_t)b[i] - (uint64_t)a[i]; \
+			diff_update(s, job, (double)u, fabs((double)b[i]), u, i); \
+		} \
+	return i; \
+}
+
+DIFF_INT_KERNEL(diff_u8,  uint8_t)
+DIFF_INT_KERNEL(diff_u16, uint16_t)
+DIFF_INT_KERNEL(diff_u32, uint32_t)
+DIFF_INT_KERNEL(diff_u64, uint64_t)
+DIFF_INT_KERNEL(diff_i8,  int8_t)
+DIFF_INT_KERNEL(diff_i16, int16_t)
+DIFF_INT_KERNEL(diff_i32, int32_t)
+DIFF_INT_KERNEL(diff_i64, int64_t)
+
+/* Floats are ordered by their bit patterns once negative values are
+   mirrored, so the distance between two mapped values counts the
+   representable numbers between them. */
+static int64_t
+ord_f32(const float x)
+{
+	int32_t i;
+	memcpy(&i, &x, sizeof i);
+	return i < 0 ? -(int64_t)(i & 0x7fffffff) : i;
+}
+
+static int64_t
+ord_f64(const double x)
+{
+	int64_t i;
+	memcpy(&i, &x, sizeof i);
+	return i < 0 ? -(i & 0x7fffffffffffffffLL) : i;
+}
+
+#define DIFF_FLOAT_KERNEL(name, T, ORD) \
+static uint64_t \
+name(const diff_job *job, uint64_t i, const uint64_t n, diff_acc *s) \
+{  /* i and n count values; complex elements are compared by magnitude */ \
+	const T *a = (const T*)job->a, *b = (const T*)job->b; \
+	const int step = job->cplx ? 2 : 1; \
+	for (; i < n; i += step) { \
+		double d2 = 0, b2 = 0; \
+		uint64_t ulp = 0; \
+		int differ = 0; \
+		for (int c = 0; c < step; ++c) { \
+			T x = a[i+c], y = b[i+c]; \
+			b2 += (double)y*y; \
+			if (x == y || (x != x && y != y))  /* NaNs match each other */ \
+				continue; \
+			double d = (double)x - y; \
+			int64_t ox = ORD(x), oy = ORD(y); \
+			uint64_t u = ox > oy ? (uint64_t)ox - oy : (uint64_t)oy - ox; \
+			d2 += d*d; \
+			differ = 1; \
+			if (u > ulp) ulp = u; \
+		} \
+		if (differ) \
+			diff_update(s, job, sqrt(d2), sqrt(b2), ulp, i / step); \
+	} \
+	return i; \
+}
+
+DIFF_FLOAT_KERNEL(diff_f32, float, ord_f32)
+DIFF_FLOAT_KERNEL(diff_f64, double, ord_f64)
+
+static int64_t
+ord_h16(const uint16_t h)
+{  /* ord_f32 for the bits of a half or bfloat */
+	return h & 0x8000 ? -(int64_t)(h & 0x7fff) : h;
+}
+
+#define DIFF_HALF_KERNEL(name, WIDEN) \
+static uint64_t \
+name(const diff_job *job, uint64_t i, const uint64_t n, diff_acc *s) \
+{ \
+	const uint16_t *a = (const uint16_t*)job->a, *b = (const uint16_t*)job->b; \
+	for (; i < n; ++i) { \
+		float x = WIDEN(a[i]), y = WIDEN(b[i]); \
+		if (x == y || (x != x && y != y)) \
+			continue; \
+		int64_t ox = ord_h16(a[i]), oy = ord_h16(b[i]); \
+		uint64_t u = ox > oy ? (uint64_t)ox - oy : (uint64_t)oy - ox; \
+		diff_update(s, job, fabs((double)x - y), fabs((double)y), u, i); \
+	} \
+	return i; \
+}
+
+DIFF_HALF_KERNEL(diff_f16, half_to_float)
+DIFF_HALF_KERNEL(diff_bf16, bf16_to_float)
+
+#ifdef RA_X86
+/* AVX2 works on four doubles at a time; float inputs are widened first
+   so both paths round identically. Complex pairs sit in adjacent lanes. */
+
+static inline TARGET("avx2") __m256i
+ord_epi64(const __m256i v)
+{
+	__m256i s = _mm256_cmpgt_epi64(_mm256_setzero_si256(), v);
+	__m256i mag = _mm256_and_si256(v, _mm256_set1_epi64x(0x7fffffffffffffffLL));
+	return _mm256_sub_epi64(_mm256_xor_si256(mag, s), s);
+}
+
+typedef struct {
+	__m256d l1, l2, linf, maxrel;
+	__m256i maxulp;
+	uint64_t ndiffer, nexceed, first;
+} diff_vacc;
+
+static inline TARGET("avx2") void
+diff_lanes(diff_vacc *v, const diff_job *job, const __m256d x, const __m256d y,
+		const __m256i ox, const __m256i oy, const uint64_t i)
+{  /* values i..i+3 as doubles, with their ordered bit patterns */
+	const __m256d zero = _mm256_setzero_pd();
+	__m256d differ = _mm256_andnot_pd(
+			_mm256_and_pd(_mm256_cmp_pd(x, x, _CMP_UNORD_Q), _mm256_cmp_pd(y, y, _CMP_UNORD_Q)),
+			_mm256_cmp_pd(x, y, _CMP_NEQ_UQ));
+	__m256d d = _mm256_and_pd(differ, _mm256_sub_pd(x, y));
+	__m256d d2 = _mm256_mul_pd(d, d), b2 = _mm256_mul_pd(y, y);
+	__m256i gt = _mm256_cmpgt_epi64(ox, oy);
+	__m256i u = _mm256_blendv_epi8(_mm256_sub_epi64(oy, ox), _mm256_sub_epi64(ox, oy), gt);
+	u = _mm256_and_si256(u, _mm256_castpd_si256(differ));
+	if (job->cplx) {  // both lanes of a pair get the pair's totals
+		d2 = _mm256_add_pd(d2, _mm256_permute_pd(d2, 0x5));
+		b2 = _mm256_add_pd(b2, _mm256_permute_pd(b2, 0x5));
+		differ = _mm256_or_pd(differ, _mm256_permute_pd(differ, 0x5));
+	}
+	__m256d ad = _mm256_sqrt_pd(d2), ab = _mm256_sqrt_pd(b2);
+	v->l1 = _mm256_add_pd(v->l1, ad);
+	v->l2 = _mm256_add_pd(v->l2, d2);
+	v->linf = _mm256_max_pd(ad, v->linf);
+	__m256d rel = _mm256_and_pd(_mm256_cmp_pd(ab, zero, _CMP_GT_OQ), _mm256_div_pd(ad, ab));
+	v->maxrel = _mm256_max_pd(rel, v->maxrel);
+	__m256d tol = _mm256_add_pd(_mm256_set1_pd(job->atol), _mm256_mul_pd(_mm256_set1_pd(job->rtol), ab));
+	__m256d exceed = _mm256_and_pd(differ, _mm256_cmp_pd(ad, tol, _CMP_NLE_UQ));
+	v->nexceed += __builtin_popcount(_mm256_movemask_pd(exceed));
+	const __m256i flip = _mm256_set1_epi64x(0x8000000000000000ULL);  // unsigned compare
+	__m256i more = _mm256_cmpgt_epi64(_mm256_xor_si256(u, flip), _mm256_xor_si256(v->maxulp, flip));
+	v->maxulp = _mm256_blendv_epi8(v->maxulp, u, more);
+	int m = _mm256_movemask_pd(differ);
+	if (m) {
+		v->ndiffer += __builtin_popcount(m);
+		if (v->first == UINT64_MAX)
+			v->first = i + __builtin_ctz(m);
+	}
+}
+
+static TARGET("avx2") void
+diff_vacc_fold(diff_vacc *v, const diff_job *job, diff_acc *s)
+{
+	double l1[4], l2[4], linf[4], maxrel[4];
+	uint64_t ulp[4];
+	_mm256_storeu_pd(l1, v->l1);
+	_mm256_storeu_pd(l2, v->l2);
+	_mm256_storeu_pd(linf, v->linf);
+	_mm256_storeu_pd(maxrel, v->maxrel);
+	_mm256_storeu_si256((__m256i*)ulp, v->maxulp);
+	const int step = job->cplx ? 2 : 1;  // complex totals were counted in both lanes
+	diff_acc t;
+	diff_acc_init(&t);
+	t.l1 = (l1[0] + l1[1] + l1[2] + l1[3]) / step;
+	t.l2 = (l2[0] + l2[1] + l2[2] + l2[3]) / step;
+	for (int k = 0; k < 4; ++k) {
+		if (linf[k] > t.linf) t.linf = linf[k];
+		if (maxrel[k] > t.maxrel) t.maxrel = maxrel[k];
+		if (ulp[k] > t.maxulp) t.maxulp = ulp[k];
+	}
+	t.ndiffer = v->ndiffer / step;
+	t.nexceed = v->nexceed / step;
+	t.first = v->first == UINT64_MAX ? UINT64_MAX : v->first / step;
+	diff_acc_merge(s, &t);
+}
+
+static TARGET("avx2") void
+diff_vacc_init(diff_vacc *v)
+{
+	v->l1 = v->l2 = v->linf = v->maxrel = _mm256_setzero_pd();
+	v->maxulp = _mm256_setzero_si256();
+	v->ndiffer = v->nexceed = 0;
+	v->first = UINT64_MAX;
+}
+
+static inline TARGET("avx2") void
+diff_lanes8(diff_vacc *v, const diff_job *job, const __m256 x, const __m256 y,
+		const __m256i bx, const __m256i by, const __m256i mag, const uint64_t i)
+{  /* eight floats, with their bits sign-extended to 32 and mag masking all but the sign */
+	__m256i sx = _mm256_srai_epi32(bx, 31), sy = _mm256_srai_epi32(by, 31);
+	__m256i ox = _mm256_sub_epi32(_mm256_xor_si256(_mm256_and_si256(bx, mag), sx), sx);
+	__m256i oy = _mm256_sub_epi32(_mm256_xor_si256(_mm256_and_si256(by, mag), sy), sy);
+	diff_lanes(v, job, _mm256_cvtps_pd(_mm256_castps256_ps128(x)),
+			_mm256_cvtps_pd(_mm256_castps256_ps128(y)),
+			_mm256_cvtepi32_epi64(_mm256_castsi256_si128(ox)),
+			_mm256_cvtepi32_epi64(_mm256_castsi256_si128(oy)), i);
+	diff_lanes(v, job, _mm256_cvtps_pd(_mm256_extractf128_ps(x, 1)),
+			_mm256_cvtps_pd(_mm256_extractf128_ps(y, 1)),
+			_mm256_cvtepi32_epi64(_mm256_extracti128_si256(ox, 1)),
+			_mm256_cvtepi32_epi64(_mm256_extracti128_si256(oy, 1)), i + 4);
+}
+
+static TARGET("avx2") uint64_t
+diff_f32_avx2(const diff_job *job, uint64_t i, const uint64_t n, diff_acc *s)
+{
+	const float *a = (const float*)job->a, *b = (const float*)job->b;
+	const __m256i mag = _mm256_set1_epi32(0x7fffffff);
+	diff_vacc v;
+	diff_vacc_init(&v);
+	for (; i + 8 <= n; i += 8) {
+		__m256 x = _mm256_loadu_ps(a + i), y = _mm256_loadu_ps(b + i);
+		diff_lanes8(&v, job, x, y, _mm256_castps_si256(x), _mm256_castps_si256(y), mag, i);
+	}
+	diff_vacc_fold(&v, job, s);
+	return i;
+}
+
+#define DIFF_HALF_AVX2(name, ISA, WIDEN8) \
+static TARGET(ISA) uint64_t \
+name(const diff_job *job, uint64_t i, const uint64_t n, diff_acc *s) \
+{ \
+	const uint16_t *a = (const uint16_t*)job->a, *b = (const uint16_t*)job->b; \
+	const __m256i mag = _mm256_set1_epi32(0x7fff); \
+	diff_vacc v; \
+	diff_vacc_init(&v); \
+	for (; i + 8 <= n; i += 8) { \
+		__m128i ha = _mm_loadu_si128((const __m128i*)(a + i)); \
+		__m128i hb = _mm_loadu_si128((const __m128i*)(b + i)); \
+		diff_lanes8(&v, job, WIDEN8(ha), WIDEN8(hb), _mm256_cvtepi16_epi32(ha), \
+				_mm256_cvtepi16_epi32(hb), mag, i); \
+	} \
+	diff_vacc_fold(&v, job, s); \
+	return i; \
+}
+
+DIFF_HALF_AVX2(diff_f16_avx2, "avx2,f16c", widen8_f16)
+DIFF_HALF_AVX2(diff_bf16_avx2, "avx2", widen8_bf16)
+
+static TARGET("avx2") uint64_t
+diff_f64_avx2(const diff_job *job, uint64_t i, const uint64_t n, diff_acc *s)
+{
+	const double *a = (const double*)job->a, *b = (const double*)job->b;
+	diff_vacc v;
+	diff_vacc_init(&v);
+	for (; i + 4 <= n; i += 4) {
+		__m256d x = _mm256_loadu_pd(a + i), y = _mm256_loadu_pd(b + i);
+		diff_lanes(&v, job, x, y, ord_epi64(_mm256_castpd_si256(x)),
+				ord_epi64(_mm256_castpd_si256(y)), i);
+	}
+	diff_vacc_fold(&v, job, s);
+	return i;
+}
+
+/* Equal bytes mean equal integers of any width, so 32 bytes are compared
+   at once and the scalar kernel sees only the elements that differ. */
+#define DIFF_INT_AVX2(name, T, SCALAR) \
+static TARGET("avx2") uint64_t \
+name(const diff_job *job, uint64_t i, const uint64_t n, diff_acc *s) \
+{ \
+	const uint64_t per = 32 / sizeof(T); \
+	for (; i + per <= n; i += per) { \
+		__m256i x = _mm256_loadu_si256((const __m256i*)(job->a + i*sizeof(T))); \
+		__m256i y = _mm256_loadu_si256((const __m256i*)(job->b + i*sizeof(T))); \
+		uint64_t m = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) & 0xffffffffULL; \
+		while (m) {  /* one bit per byte; the lowest marks the next element that differs */ \
+			uint64_t k = __builtin_ctzll(m) / sizeof(T); \
+			SCALAR(job, i + k, i + k + 1, s); \
+			m &= ~(((1ULL << sizeof(T)) - 1) << k*sizeof(T)); \
+		} \
+	} \
+	return i; \
+}
+
+DIFF_INT_AVX2(diff_u8_avx2,  uint8_t,  diff_u8)
+DIFF_INT_AVX2(diff_u16_avx2, uint16_t, diff_u16)
+DIFF_INT_AVX2(diff_u32_avx2, uint32_t, diff_u32)
+DIFF_INT_AVX2(diff_u64_avx2, uint64_t, diff_u64)
+DIFF_INT_AVX2(diff_i8_avx2,  int8_t,   diff_i8)
+DIFF_INT_AVX2(diff_i16_avx2, int16_t,  diff_i16)
+DIFF_INT_AVX2(diff_i32_avx2, int32_t,  diff_i32)
+DIFF_INT_AVX2(diff_i64_avx2, int64_t,  diff_i64)
+#endif
+
+static int
+diff_task(void *job_, const uint64_t c)
+{
+	diff_job *job = job_;
+	uint64_t i = c*DIFF_CHUNK;
+	uint64_t n = i + DIFF_CHUNK < job->n ? i + DIFF_CHUNK : job->n;
+	diff_acc *s = &job->acc[c];
+	diff_acc_init(s);
+	if (job->simd)
+		i = job->simd(job, i, n, s);
+	job->scalar(job, i, n, s);
+	return 0;
+}
+
+static int
+same_shape(const ra_t *a, const ra_t *b)
+{
+	if (a->eltype != b->eltype || a->elbyte != b->elbyte || a->ndims != b->ndims)
+		return 0;
+	for (uint64_t k = 0; k < a->ndims; ++k)
+		if (a->dims[k] != b->dims[k])
+			return 0;
+	return 1;
+}
+
+int
+ra_diff_stats(const ra_t *a, const ra_t *b, const double atol, const double rtol,
+		ra_diffstat_t *stats)
+{  /* elementwise comparison of uncompressed arrays of the same type and shape */
+	if (is_compressed((ra_t*)a) || is_compressed((ra_t*)b))
+		return fail(RA_EINVAL, "decompress arrays before comparing them");
+	if (!same_shape(a, b))
+		return 1;
+	diff_job job = { a->data, b->data, 0, 0, atol, rtol, NULL, NULL, NULL };
+	uint64_t vals = 1;  // values per element
+	switch (a->eltype * 16 + a->elbyte) {
+	case RA_TYPE_INT*16 + 1:  job.scalar = diff_i8;  break;
+	case RA_TYPE_INT*16 + 2:  job.scalar = diff_i16; break;
+	case RA_TYPE_INT*16 + 4:  job.scalar = diff_i32; break;
+	case RA_TYPE_INT*16 + 8:  job.scalar = diff_i64; break;
+	case RA_TYPE_UINT*16 + 2: job.scalar = diff_u16; break;
+	case RA_TYPE_UINT*16 + 4: job.scalar = diff_u32; break;
+	case RA_TYPE_UINT*16 + 8: job.scalar = diff_u64; break;
+	case RA_TYPE_FLOAT*16 + 2:  job.scalar = diff_f16;  break;
+	case RA_TYPE_BFLOAT*16 + 2: job.scalar = diff_bf16; break;
+	case RA_TYPE_FLOAT*16 + 4:
+		job.scalar = diff_f32;
+		break;
+	case RA_TYPE_FLOAT*16 + 8:
+		job.scalar = diff_f64;
+		break;
+	case RA_TYPE_COMPLEX*16 + 8:
+		job.scalar = diff_f32;
+		job.cplx = 1;
+		vals = 2;
+		break;
+	case RA_TYPE_COMPLEX*16 + 16:
+		job.scalar = diff_f64;
+		job.cplx = 1;
+		vals = 2;
+		break;
+	default:  // uint8 and user types are compared byte by byte
+		job.scalar = diff_u8;
+	}
+#ifdef RA_X86
+	if (have_avx2()) {
+		if (job.scalar == diff_f32)
+			job.simd = diff_f32_avx2;
+		else if (job.scalar == diff_f64)
+			job.simd = diff_f64_avx2;
+		else if (job.scalar == diff_bf16)
+			job.simd = diff_bf16_avx2;
+		else if (job.scalar == diff_f16 && have_f16c())
+			job.simd = diff_f16_avx2;
+		else if (job.scalar == diff_u8)
+			job.simd = diff_u8_avx2;
+		else if (job.scalar == diff_u16)
+			job.simd = diff_u16_avx2;
+		else if (job.scalar == diff_u32)
+			job.simd = diff_u32_avx2;
+		else if (job.scalar == diff_u64)
+			job.simd = diff_u64_avx2;
+		else if (job.scalar == diff_i8)
+			job.simd = diff_i8_avx2;
+		else if (job.scalar == diff_i16)
+			job.simd = diff_i16_avx2;
+		else if (job.scalar == diff_i32)
+			job.simd = diff_i32_avx2;
+		else if (job.scalar == diff_i64)
+			job.simd = diff_i64_avx2;
+	}
+#endif
+	uint64_t width = job.scalar == diff_u8 ? 1 : a->elbyte / vals;
+	job.n = a->size / width;
+	uint64_t nchunks = (job.n + DIFF_CHUNK - 1) / DIFF_CHUNK;
+	if ((job.acc = safe_malloc(nchunks*sizeof(diff_acc))) == NULL && nchunks > 0)
+		return -RA_ENOMEM;
+	parallel_for(nchunks, diff_task, &job);
+	diff_acc s;
+	diff_acc_init(&s);
+	for (uint64_t c = 0; c < nchunks; ++c)
+		diff_acc_merge(&s, &job.acc[c]);
+	free(job.acc);
+
+	stats->n = job.n / vals;
+	stats->ndiffer = s.ndiffer;
+	stats->first = s.ndiffer ? s.first : stats->n;
+	stats->nexceed = s.nexceed;
+	stats->maxulp = s.maxulp;
+	stats->l1 = s.l1;
+	stats->l2 = sqrt(s.l2);
+	stats->linf = isnan(s.l1) ? NAN : s.linf;  // max() drops NaNs, the sum keeps them
+	stats->maxrel = s.maxrel;
+	return 0;
+}
+
+static void
+print_element(const ra_t *r, const uint64_t i)
+{
+	const uint8_t *p = r->data + i*r->elbyte;
+	union { int8_t i8; int16_t i16; int32_t i32; int64_t i64; uint8_t u8; uint16_t u16;
+		uint32_t u32; uint64_t u64; float f32[2]; double f64[2]; } v;
+	memcpy(&v, p, r->elbyte <= sizeof v ? r->elbyte : sizeof v);
+	switch (r->eltype * 16 + r->elbyte) {
+	case RA_TYPE_INT*16 + 1:  printf("%d", v.i8); break;
+	case RA_TYPE_INT*16 + 2:  printf("%d", v.i16); break;
+	case RA_TYPE_INT*16 + 4:  printf("%d", v.i32); break;
+	case RA_TYPE_INT*16 + 8:  printf("%ld", v.i64); break;
+	case RA_TYPE_UINT*16 + 2: printf("%u", v.u16); break;
+	case RA_TYPE_UINT*16 + 4: printf("%u", v.u32); break;
+	case RA_TYPE_UINT*16 + 8: printf("%lu", v.u64); break;
+	case RA_TYPE_FLOAT*16 + 2: printf("%.5g", half_to_float(v.u16)); break;
+	case RA_TYPE_BFLOAT*16 + 2: printf("%.4g", bf16_to_float(v.u16)); break;
+	case RA_TYPE_FLOAT*16 + 4: printf("%.9g", v.f32[0]); break;
+	case RA_TYPE_FLOAT*16 + 8: printf("%.17g", v.f64[0]); break;
+	case RA_TYPE_COMPLEX*16 + 8: printf("%.9g%+.9gim", v.f32[0], v.f32[1]); break;
+	case RA_TYPE_COMPLEX*16 + 16: printf("%.17g%+.17gim", v.f64[0], v.f64[1]); break;
+	default: printf("%u", v.u8);
+	}
+}
+
+int
+ra_diff(const ra_t * a, const ra_t * b, const int diff_type)
+{
+    if (a->flags != b->flags)
+        return DIFF_FLAGS;
+    if (a->eltype != b->eltype)
+        return DIFF_ELTYPE;
+    if (a->elbyte != b->elbyte)
+        return DIFF_ELBYTE;
+    if (a->size != b->size)
+        return DIFF_SIZE;
+    if (a->ndims != b->ndims)
+        return DIFF_NDIMS;
+    for (size_t i = 0; i < a->ndims; ++i)
+        if (a->dims[i] != b->dims[i])
+            return DIFF_DIMS;
+    if (is_compressed((ra_t*)a))  // same encoder, same bytes
+        return memcmp(a->data, b->data, a->size) ? DIFF_DATA : 0;
+    ra_diffstat_t s;
+    int ret = ra_diff_stats(a, b, 0, 0, &s);
+    if (ret < 0)
+        return ret;
+    if (diff_type == RA_DIFF_EQ)
+    {
+        if (s.ndiffer > 0)
+        {
+            printf("differ at element %lu: lhs=", s.first);
+            print_element(a, s.first);
+            printf(" rhs=");
+            print_element(b, s.first);
+            printf("\n");
+        }
+    }
+    else if (diff_type == RA_DIFF_L1)
+        printf("L1 distance: %g\n", s.l1);
+    else if (diff_type == RA_DIFF_L2)
+        printf("L2 distance: %g\n", s.l2);
+    else if (diff_type == RA_DIFF_LINF)
+        printf("Linf distance: %g\n", s.linf);
+    else
+        return fail(RA_EINVAL, "Unknown diff_type %d", diff_type);
+    return s.ndiffer > 0 ? DIFF_DATA : 0;
+}
+
+
+//
+// STATISTICS
+//
+
+/*
+   Every value is widened to double, STATS_BLOCK at a time, and the block
+   is reduced while it sits in L1: one vector pass for its sum and
+   extremes, a second for its squared deviations about its own mean.
+   Blocks, then chunks, are merged with the pairwise update of Chan et
+   al., which keeps the variance accurate where a running sum of squares
+   would cancel. NaN and Inf are counted and left out of the rest, and
+   complex elements contribute their magnitude. Chunks always start at the
+   same elements, so results do not depend on the thread count or on
+   whether a file was mapped or streamed.
+*/
+
+#define STATS_BLOCK  512          /* values widened and reduced at once */
+#define STATS_CHUNK  (1UL<<16)    /* elements per task */
+#define STATS_BATCH  (1UL<<24)    /* uncompressed bytes decoded per batch when streaming */
+
+typedef struct {
+	uint64_t n, nnan, ninf;  /* n counts finite values */
+	double min, max, mean, m2;
+} stats_acc;
+
+typedef void (*widen_fn)(const uint8_t *p, const uint64_t n, double *x);
+
+typedef struct {
+	const uint8_t *data;
+	uint64_t n, elbyte;      /* elements */
+	uint64_t swap;           /* word width to byte-swap first, 0 for host order */
+	widen_fn widen;
+	stats_acc *acc;          /* one per chunk */
+} stats_job;
+
+static void
+stats_acc_init(stats_acc *s)
+{
+	memset(s, 0, sizeof(stats_acc));
+	s->min = INFINITY;
+	s->max = -INFINITY;
+}
+
+static void
+stats_merge(stats_acc *s, const stats_acc *t)
+{
+	s->nnan += t->nnan;
+	s->ninf += t->ninf;
+	if (t->n == 0)
+		return;
+	if (s->n == 0) {  // an overflowing delta*delta would be multiplied by none
+		*s = (stats_acc){ t->n, s->nnan, s->ninf, t->min, t->max, t->mean, t->m2 };
+		return;
+	}
+	uint64_t n = s->n + t->n;
+	double delta = t->mean - s->mean;
+	if (isfinite(delta))
+		s->mean += delta * ((double)t->n / n);
+	else  // means of either sign near the largest double
+		s->mean = s->mean * ((double)s->n / n) + t->mean * ((double)t->n / n);
+	s->m2 += t->m2 + delta*delta * ((double)s->n / n) * t->n;
+	s->n = n;
+	if (t->min < s->min) s->min = t->min;
+	if (t->max > s->max) s->max = t->max;
+}
+
+#define STATS_WIDEN(name, T) \
+static void \
+name(const uint8_t *p, const uint64_t n, double *x) \
+{ \
+	const T *v = (const T*)p; \
+	for (uint64_t i = 0; i < n; ++i) \
+		x[i] = v[i]; \
+}
+
+STATS_WIDEN(widen_u8,  uint8_t)
+STATS_WIDEN(widen_u16, uint16_t)
+STATS_WIDEN(widen_u32, uint32_t)
+STATS_WIDEN(widen_u64, uint64_t)
+STATS_WIDEN(widen_i8,  int8_t)
+STATS_WIDEN(widen_i16, int16_t)
+STATS_WIDEN(widen_i32, int32_t)
+STATS_WIDEN(widen_i64, int64_t)
+STATS_WIDEN(widen_f32, float)
+STATS_WIDEN(widen_f64, double)
+
+static void
+widen_f16(const uint8_t *p, const uint64_t n, double *x)
+{
+	const uint16_t *v = (const uint16_t*)p;
+	for (uint64_t i = 0; i < n; ++i)
+		x[i] = half_to_float(v[i]);
+}
+
+static void
+widen_bf16(const uint8_t *p, const uint64_t n, double *x)
+{
+	const uint16_t *v = (const uint16_t*)p;
+	for (uint64_t i = 0; i < n; ++i)
+		x[i] = bf16_to_float(v[i]);
+}
+
+static double
+magnitude(const double re, const double im)
+{  /* hypot only where the squares overflow */
+	double m = sqrt(re*re + im*im);
+	return isinf(m) && isfinite(re) && isfinite(im) ? hypot(re, im) : m;
+}
+
+static void
+widen_c8(const uint8_t *p, const uint64_t n, double *x)
+{
+	const float *v = (const float*)p;
+	for (uint64_t i = 0; i < n; ++i)
+		x[i] = magnitude(v[2*i], v[2*i+1]);
+}
+
+static void
+widen_c16(const uint8_t *p, const uint64_t n, double *x)
+{
+	const double *v = (const double*)p;
+	for (uint64_t i = 0; i < n; ++i)
+		x[i] = magnitude(v[2*i], v[2*i+1]);
+}
+
+static uint64_t
+stats_sum(const double *x, const uint64_t n, double *sum, double *lo, double *hi, uint64_t i)
+{
+	for (; i < n; ++i) {
+		*sum += x[i];
+		if (x[i] < *lo) *lo = x[i];
+		if (x[i] > *hi) *hi = x[i];
+	}
+	return i;
+}
+
+static uint64_t
+stats_dev(const double *x, const uint64_t n, const double mean, double *m2, uint64_t i)
+{
+	for (; i < n; ++i)
+		*m2 += (x[i] - mean)*(x[i] - mean);
+	return i;
+}
+
+#ifdef RA_X86
+static inline __m128i
+load_si32(const uint8_t *q)
+{
+	int32_t w;
+	memcpy(&w, q, sizeof w);
+	return _mm_cvtsi32_si128(w);
+}
+
+#define STATS_WIDEN_AVX2(name, scalar, E, LOAD) \
+static TARGET("avx2") void \
+name(const uint8_t *p, const uint64_t n, double *x) \
+{  /* four values per step, through LOAD of the bytes at q */ \
+	uint64_t i = 0; \
+	for (; i + 4 <= n; i += 4) { \
+		const uint8_t *q = p + i*E; \
+		_mm256_storeu_pd(x + i, LOAD); \
+	} \
+	scalar(p + i*E, n - i, x + i); \
+}
+
+STATS_WIDEN_AVX2(widen_u8_avx2, widen_u8, 1,
+		_mm256_cvtepi32_pd(_mm_cvtepu8_epi32(load_si32(q))))
+STATS_WIDEN_AVX2(widen_i8_avx2, widen_i8, 1,
+		_mm256_cvtepi32_pd(_mm_cvtepi8_epi32(load_si32(q))))
+STATS_WIDEN_AVX2(widen_u16_avx2, widen_u16, 2,
+		_mm256_cvtepi32_pd(_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)q))))
+STATS_WIDEN_AVX2(widen_i16_avx2, widen_i16, 2,
+		_mm256_cvtepi32_pd(_mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i*)q))))
+STATS_WIDEN_AVX2(widen_i32_avx2, widen_i32, 4,
+		_mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)q)))
+STATS_WIDEN_AVX2(widen_f32_avx2, widen_f32, 4,
+		_mm256_cvtps_pd(_mm_loadu_ps((const float*)q)))
+STATS_WIDEN_AVX2(widen_bf16_avx2, widen_bf16, 2,
+		_mm256_cvtps_pd(_mm256_castps256_ps128(widen8_bf16(_mm_loadl_epi64((const __m128i*)q)))))
+
+static TARGET("avx2,f16c") void
+widen_f16_avx2(const uint8_t *p, const uint64_t n, double *x)
+{
+	uint64_t i = 0;
+	for (; i + 4 <= n; i += 4)
+		_mm256_storeu_pd(x + i, _mm256_cvtps_pd(_mm_cvtph_ps(_mm_loadl_epi64((const __m128i*)(p + 2*i)))));
+	widen_f16(p + 2*i, n - i, x + i);
+}
+
+static TARGET("avx2") void
+widen_c8_avx2(const uint8_t *p, const uint64_t n, double *x)
+{  /* squares of re and im side by side, summed across pairs, then put back in order */
+	const float *v = (const float*)p;
+	uint64_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256 z = _mm256_loadu_ps(v + 2*i);
+		__m256d a = _mm256_cvtps_pd(_mm256_castps256_ps128(z));
+		__m256d b = _mm256_cvtps_pd(_mm256_extractf128_ps(z, 1));
+		__m256d s = _mm256_hadd_pd(_mm256_mul_pd(a, a), _mm256_mul_pd(b, b));
+		_mm256_storeu_pd(x + i, _mm256_sqrt_pd(_mm256_permute4x64_pd(s, 0xd8)));
+	}
+	widen_c8(p + i*8, n - i, x + i);  // float squares cannot overflow a double
+}
+
+static TARGET("avx2") void
+widen_c16_avx2(const uint8_t *p, const uint64_t n, double *x)
+{
+	const double *v = (const double*)p;
+	const __m256d inf = _mm256_set1_pd(INFINITY);
+	uint64_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256d a = _mm256_loadu_pd(v + 2*i), b = _mm256_loadu_pd(v + 2*i + 4);
+		__m256d s = _mm256_hadd_pd(_mm256_mul_pd(a, a), _mm256_mul_pd(b, b));
+		s = _mm256_sqrt_pd(_mm256_permute4x64_pd(s, 0xd8));
+		if (_mm256_movemask_pd(_mm256_cmp_pd(s, inf, _CMP_EQ_OQ)))
+			widen_c16(p + i*16, 4, x + i);  // an overflow, or a true Inf
+		else
+			_mm256_storeu_pd(x + i, s);
+	}
+	widen_c16(p + i*16, n - i, x + i);
+}
+
+static TARGET("avx2") uint64_t
+stats_sum_avx2(const double *x, const uint64_t n, double *sum, double *lo, double *hi, uint64_t i)
+{
+	__m256d s0 = _mm256_setzero_pd(), s1 = s0;
+	__m256d l = _mm256_set1_pd(*lo), h = _mm256_set1_pd(*hi), l1 = l, h1 = h;
+	for (; i + 8 <= n; i += 8) {
+		__m256d a = _mm256_loadu_pd(x + i), b = _mm256_loadu_pd(x + i + 4);
+		s0 = _mm256_add_pd(s0, a);
+		s1 = _mm256_add_pd(s1, b);
+		l = _mm256_min_pd(l, a);
+		l1 = _mm256_min_pd(l1, b);
+		h = _mm256_max_pd(h, a);
+		h1 = _mm256_max_pd(h1, b);
+	}
+	double vs[4], vl[4], vh[4];
+	_mm256_storeu_pd(vs, _mm256_add_pd(s0, s1));
+	_mm256_storeu_pd(vl, _mm256_min_pd(l, l1));
+	_mm256_storeu_pd(vh, _mm256_max_pd(h, h1));
+	*sum += (vs[0] + vs[1]) + (vs[2] + vs[3]);
+	for (int k = 0; k < 4; ++k) {
+		if (vl[k] < *lo) *lo = vl[k];
+		if (vh[k] > *hi) *hi = vh[k];
+	}
+	return i;
+}
+
+static TARGET("avx2") uint64_t
+stats_dev_avx2(const double *x, const uint64_t n, const double mean, double *m2, uint64_t i)
+{
+	const __m256d m = _mm256_set1_pd(mean);
+	__m256d s0 = _mm256_setzero_pd(), s1 = s0;
+	for (; i + 8 <= n; i += 8) {
+		__m256d a = _mm256_sub_pd(_mm256_loadu_pd(x + i), m);
+		__m256d b = _mm256_sub_pd(_mm256_loadu_pd(x + i + 4), m);
+		s0 = _mm256_add_pd(s0, _mm256_mul_pd(a, a));
+		s1 = _mm256_add_pd(s1, _mm256_mul_pd(b, b));
+	}
+	double v[4];
+	_mm256_storeu_pd(v, _mm256_add_pd(s0, s1));
+	*m2 += (v[0] + v[1]) + (v[2] + v[3]);
+	return i;
+}
+#endif
+
+static void
+stats_fold(stats_acc *s, double *x, uint64_t n)
+{  /* fold a block of n values into s */
+	stats_acc b;
+	stats_acc_init(&b);
+	double sum = 0;
+	uint64_t i = 0;
+#ifdef RA_X86
+	if (have_avx2())
+		i = stats_sum_avx2(x, n, &sum, &b.min, &b.max, i);
+#endif
+	stats_sum(x, n, &sum, &b.min, &b.max, i);
+	if (!isfinite(sum)) {  // set NaN and Inf aside and start over
+		uint64_t k = 0;
+		for (i = 0; i < n; ++i)
+			if (isnan(x[i]))
+				++b.nnan;
+			else if (isinf(x[i]))
+				++b.ninf;
+			else
+				x[k++] = x[i];
+		n = k;
+		sum = 0;
+		b.min = INFINITY;
+		b.max = -INFINITY;
+		stats_sum(x, n, &sum, &b.min, &b.max, 0);
+	}
+	if ((b.n = n) > 0) {
+		double unit = 1, lo = 0, hi = 0;
+		if (!isfinite(sum)) {  // finite values too large to sum, scaled down exactly by a power of two
+			unit = STATS_BLOCK;
+			for (i = 0; i < n; ++i)
+				x[i] /= unit;
+			sum = 0;
+			stats_sum(x, n, &sum, &lo, &hi, 0);
+		}
+		b.mean = sum / n;
+		i = 0;
+#ifdef RA_X86
+		if (have_avx2())
+			i = stats_dev_avx2(x, n, b.mean, &b.m2, i);
+#endif
+		stats_dev(x, n, b.mean, &b.m2, i);
+		b.mean *= unit;
+		b.m2 *= unit*unit;  // Inf if the spread is too wide to square
+	}
+	stats_merge(s, &b);
+}
+
+static int
+stats_task(void *job_, const uint64_t c)
+{
+	stats_job *job = job_;
+	double x[STATS_BLOCK];
+	uint8_t raw[STATS_BLOCK*16];
+	uint64_t i = c*STATS_CHUNK;
+	uint64_t end = i + STATS_CHUNK < job->n ? i + STATS_CHUNK : job->n;
+	stats_acc *s = &job->acc[c];
+	stats_acc_init(s);
+	for (; i < end; i += STATS_BLOCK) {
+		uint64_t n = end - i < STATS_BLOCK ? end - i : STATS_BLOCK;
+		const uint8_t *p = job->data + i*job->elbyte;
+		if (job->swap) {  // a mapping of foreign data
+			memcpy(raw, p, n*job->elbyte);
+			swap_bytes(raw, n*job->elbyte, job->swap);
+			p = raw;
+		}
+		job->widen(p, n, x);
+		stats_fold(s, x, n);
+	}
+	return 0;
+}
+
+static widen_fn
+widen_fast(const widen_fn f)
+{  /* the vector version of f, if there is one and the CPU can run it */
+#ifdef RA_X86
+	if (have_avx2()) {
+		const widen_fn scalar[] = { widen_u8, widen_i8, widen_u16, widen_i16, widen_i32,
+			widen_f32, widen_c8, widen_c16, widen_bf16 };
+		const widen_fn vector[] = { widen_u8_avx2, widen_i8_avx2, widen_u16_avx2, widen_i16_avx2,
+			widen_i32_avx2, widen_f32_avx2, widen_c8_avx2, widen_c16_avx2, widen_bf16_avx2 };
+		for (int k = 0; k < 9; ++k)
+			if (f == scalar[k])
+				return vector[k];
+		if (f == widen_f16 && have_f16c())
+			return widen_f16_avx2;
+	}
+#endif
+	return f;
+}
+
+static int
+stats_init(stats_job *job, const ra_t *r)
+{
+	memset(job, 0, sizeof(stats_job));
+	job->elbyte = r->elbyte;
+	job->swap = is_foreign((ra_t*)r) ? swap_width(r) : 0;
+	switch (r->eltype * 16 + r->elbyte) {
+	case RA_TYPE_INT*16 + 1:  job->widen = widen_i8;  break;
+	case RA_TYPE_INT*16 + 2:  job->widen = widen_i16; break;
+	case RA_TYPE_INT*16 + 4:  job->widen = widen_i32; break;
+	case RA_TYPE_INT*16 + 8:  job->widen = widen_i64; break;
+	case RA_TYPE_UINT*16 + 1: job->widen = widen_u8;  break;
+	case RA_TYPE_UINT*16 + 2: job->widen = widen_u16; break;
+	case RA_TYPE_UINT*16 + 4: job->widen = widen_u32; break;
+	case RA_TYPE_UINT*16 + 8: job->widen = widen_u64; break;
+	case RA_TYPE_FLOAT*16 + 2: job->widen = widen_f16; break;
+	case RA_TYPE_FLOAT*16 + 4: job->widen = widen_f32; break;
+	case RA_TYPE_FLOAT*16 + 8: job->widen = widen_f64; break;
+	case RA_TYPE_BFLOAT*16 + 2: job->widen = widen_bf16; break;
+	case RA_TYPE_COMPLEX*16 + 8:  job->widen = widen_c8;  break;
+	case RA_TYPE_COMPLEX*16 + 16: job->widen = widen_c16; break;
+	default:
+		return fail(RA_EINVAL, "no statistics for elements of type %lu and %lu bytes",
+				r->eltype, r->elbyte);
+	}
+	job->widen = widen_fast(job->widen);
+	return 0;
+}
+
+static int
+stats_run(stats_job *job, stats_acc *total)
+{  /* fold the job->n elements at job->data into total, chunk by chunk */
+	uint64_t nchunks = (job->n + STATS_CHUNK - 1) / STATS_CHUNK;
+	if (nchunks == 0)
+		return 0;
+	if ((job->acc = safe_malloc(nchunks*sizeof(stats_acc))) == NULL)
+		return -RA_ENOMEM;
+	int ret = parallel_for(nchunks, stats_task, job);
+	for (uint64_t c = 0; c < nchunks; ++c)
+		stats_merge(total, &job->acc[c]);
+	free(job->acc);
+	return ret;
+}
+
+static void
+stats_result(const stats_acc *s, ra_stats_t *st)
+{
+	st->n = s->n + s->nnan + s->ninf;
+	st->nnan = s->nnan;
+	st->ninf = s->ninf;
+	st->min = s->n ? s->min : NAN;
+	st->max = s->n ? s->max : NAN;
+	st->mean = s->n ? s->mean : NAN;
+	st->std = s->n ? sqrt(s->m2 / s->n) : NAN;
+}
+
+int
+ra_stats(const ra_t *r, ra_stats_t *st)
+{
+	stats_job job;
+	stats_acc total;
+	int ret;
+	if (is_compressed((ra_t*)r))
+		return fail(RA_EINVAL, "decompress arrays before taking their statistics");
+	if ((ret = stats_init(&job, r)) < 0)
+		return ret;
+	stats_acc_init(&total);
+	job.data = r->data;
+	job.n = r->size / r->elbyte;
+	if ((ret = stats_run(&job, &total)) < 0)
+		return ret;
+	stats_result(&total, st);
+	return 0;
+}
+
+typedef int (*scan_fn)(void *arg, const ra_t *h, const uint8_t *data, const uint64_t n);
+
+static int
+scan_file(const char *path, scan_fn fn, void *arg)
+{  /* hand the elements of a file to fn in order, in runs of whole chunks:
+	  at once from a mapping if it is uncompressed, else a batch of blocks at a time */
+	ra_t h;
+	block_reader br;
+	uint8_t *zbuf = NULL, *buf = NULL;
+	int ret;
+	int fd = ra_read_header(&h, path);
+	if (fd < 0)
+		return fd;
+	if (h.elbyte == 0) {  // runs are counted in elements, which need a size
+		close(fd);
+		ra_free(&h);
+		return fail(RA_EINVAL, "elements of %s have no size", path);
+	}
+	if (!is_compressed(&h)) {
+		close(fd);
+		ra_free(&h);
+		if ((ret = ra_mmap(&h, path, RA_MMAP_SEQUENTIAL)) < 0)
+			return ret;
+		ret = fn(arg, &h, h.data, h.size / h.elbyte);
+		ra_free(&h);
+		return ret;
+	}
+	if ((ret = block_reader_open(&br, fd, &h)) < 0)
+		goto done;
+	// a batch starts with the elements left over from the last partial chunk
+	uint64_t chunkbytes = STATS_CHUNK*h.elbyte, have = 0;
+	uint64_t cap = br.blocksize > STATS_BATCH ? br.blocksize : STATS_BATCH;
+	zbuf = safe_malloc(br.maxstored > STREAM_BUFSIZE ? br.maxstored : STREAM_BUFSIZE);
+	buf = safe_malloc(chunkbytes + cap);
+	if (zbuf == NULL || buf == NULL) {
+		ret = -RA_ENOMEM;
+		goto done;
+	}
+	block_job bj = { br.c, zbuf, NULL, br.rawsize, br.blocksize, 0, br.offsets, 0 };
+	for (uint64_t b = 0, e; b < br.nblocks && ret == 0; b = e) {
+		e = b + 1;
+		while (e < br.nblocks && br.offsets[e+1] - br.offsets[b] <= STREAM_BUFSIZE
+				&& (e + 1 - b)*br.blocksize <= cap)
+			++e;
+		if ((ret = valid_pread(fd, zbuf, br.offsets[e] - br.offsets[b], br.data_off + br.offsets[b])) < 0)
+			break;
+		bj.first = b;
+		bj.dst = buf + have;
+		if ((ret = parallel_for(e - b, decompress_task, &bj)) < 0)
+			break;
+		uint64_t avail = have + (e*br.blocksize < br.rawsize ? e*br.blocksize : br.rawsize) - b*br.blocksize;
+		uint64_t whole = e == br.nblocks ? avail : avail - avail % chunkbytes;
+		if ((ret = fn(arg, &h, buf, whole / h.elbyte)) < 0)
+			break;
+		memmove(buf, buf + whole, avail - whole);
+		have = avail - whole;
+	}
+
+done:
+	free(zbuf);
+	free(buf);
+	block_reader_close(&br);
+	close(fd);
+	ra_free(&h);
+	return ret;
+}
+
+static int
+stats_scan(void *total, const ra_t *h, const uint8_t *data, const uint64_t n)
+{
+	stats_job job;
+	int ret = stats_init(&job, h);
+	if (ret < 0)
+		return ret;
+	job.data = data;
+	job.n = n;
+	return stats_run(&job, total);
+}
+
+int
+ra_stats_file(const char *path, ra_stats_t *st)
+{  /* the data is mapped or streamed, never copied whole */
+	stats_acc total;
+	stats_acc_init(&total);
+	int ret = scan_file(path, stats_scan, &total);
+	if (ret == 0)
+		stats_result(&total, st);
+	return ret;
+}
+
+
+//
+// HISTOGRAMS
+//
+
+/*
+   A histogram needs no range up front if values are binned by their
+   leading bits. The bits of a double are reordered so that unsigned order
+   is numeric order, and the top 12 (sign and exponent) pick one of 4096
+   groups, the next 8 one of 256 bins in the group. A bin thus spans 1/256
+   of a power of two, and groups get their bins only once a value lands in
+   them, so a typical array touches a few dozen groups. Each thread bins
+   its own share of the chunks and the counts are added up at the end.
+*/
+
+#define HIST_GROUPS  4096
+#define HIST_FINE    256
+#define HIST_SHIFT   44          /* 64 bits less 12 for the group, 8 for the bin */
+#define HIST_ZERO    ((1ULL << 63) >> HIST_SHIFT)   /* the bin of +0 */
+
+static uint64_t
+hist_key(const double x)
+{  /* the bits of x, reordered so that unsigned order is numeric order */
+	uint64_t u;
+	memcpy(&u, &x, sizeof u);
+	return u >> 63 ? ~u : u | (1ULL << 63);
+}
+
+static double
+hist_value(const uint64_t key)
+{
+	uint64_t u = key >> 63 ? key & ~(1ULL << 63) : ~key;
+	double x;
+	memcpy(&x, &u, sizeof x);
+	return x;
+}
+
+static int
+hist_init(ra_hist_t *h)
+{
+	memset(h, 0, sizeof(ra_hist_t));
+	h->min = INFINITY;
+	h->max = -INFINITY;
+	if ((h->bins = calloc(HIST_GROUPS, sizeof(uint64_t*))) == NULL)
+		return fail(RA_ENOMEM, "unable to allocate histogram");
+	return 0;
+}
+
+void
+ra_hist_free(ra_hist_t *h)
+{
+	if (h->bins != NULL)
+		for (uint64_t g = 0; g < HIST_GROUPS; ++g)
+			free(h->bins[g]);
+	free(h->bins);
+	h->bins = NULL;
+}
+
+static void
+hist_merge(ra_hist_t *h, ra_hist_t *t)
+{  /* add the counts of t to h, taking over its bins where h has none */
+	h->n += t->n;
+	h->nnan += t->nnan;
+	h->ninf += t->ninf;
+	if (t->min < h->min) h->min = t->min;
+	if (t->max > h->max) h->max = t->max;
+	for (uint64_t g = 0; g < HIST_GROUPS; ++g) {
+		if (t->bins[g] == NULL)
+			continue;
+		if (h->bins[g] == NULL) {
+			h->bins[g] = t->bins[g];
+			t->bins[g] = NULL;
+		} else
+			for (int f = 0; f < HIST_FINE; ++f)
+				h->bins[g][f] += t->bins[g][f];
+	}
+}
+
+static uint64_t
+hist_index(ra_hist_t *h, const double *x, const uint64_t n, uint32_t *idx, uint64_t *k, uint64_t i)
+{  /* the bin of each finite value, counting the others */
+	for (; i < n; ++i)
+		if (isnan(x[i]))
+			++h->nnan;
+		else if (isinf(x[i]))
+			++h->ninf;
+		else {
+			if (x[i] < h->min) h->min = x[i];
+			if (x[i] > h->max) h->max = x[i];
+			idx[(*k)++] = hist_key(x[i]) >> HIST_SHIFT;
+		}
+	return i;
+}
+
+#ifdef RA_X86
+static TARGET("avx2") uint64_t
+hist_index_avx2(ra_hist_t *h, const double *x, const uint64_t n, uint32_t *idx, uint64_t *k, uint64_t i)
+{  /* four keys at a time; a quad holding NaN or Inf goes through the scalar path */
+	const __m256i expo = _mm256_set1_epi64x(0x7ff0000000000000LL);
+	const __m256i sign = _mm256_set1_epi64x(0x8000000000000000ULL);
+	const __m256i lows = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+	__m256d lo = _mm256_set1_pd(h->min), hi = _mm256_set1_pd(h->max);
+	for (; i + 4 <= n; i += 4) {
+		__m256d v = _mm256_loadu_pd(x + i);
+		__m256i u = _mm256_castpd_si256(v);
+		if (_mm256_movemask_pd(_mm256_castsi256_pd(
+				_mm256_cmpeq_epi64(_mm256_and_si256(u, expo), expo)))) {
+			hist_index(h, x, i + 4, idx, k, i);
+			continue;
+		}
+		lo = _mm256_min_pd(lo, v);
+		hi = _mm256_max_pd(hi, v);
+		__m256i neg = _mm256_cmpgt_epi64(_mm256_setzero_si256(), u);
+		__m256i key = _mm256_srli_epi64(_mm256_xor_si256(u, _mm256_or_si256(neg, sign)), HIST_SHIFT);
+		_mm_storeu_si128((__m128i*)(idx + *k),
+				_mm256_castsi256_si128(_mm256_permutevar8x32_epi32(key, lows)));
+		*k += 4;
+	}
+	double vl[4], vh[4];
+	_mm256_storeu_pd(vl, lo);
+	_mm256_storeu_pd(vh, hi);
+	for (int j = 0; j < 4; ++j) {
+		if (vl[j] < h->min) h->min = vl[j];
+		if (vh[j] > h->max) h->max = vh[j];
+	}
+	return i;
+}
+#endif
+
+static int
+hist_add(ra_hist_t *h, const uint32_t *idx, const uint64_t n)
+{  /* count n bins, giving a group its bins on first use */
+	for (uint64_t i = 0; i < n; ++i) {
+		uint64_t **g = &h->bins[idx[i] / HIST_FINE];
+		if (*g == NULL && (*g = calloc(HIST_FINE, sizeof(uint64_t))) == NULL)
+			return fail(RA_ENOMEM, "unable to allocate histogram bins");
+		++(*g)[idx[i] % HIST_FINE];
+	}
+	h->n += n;
+	return 0;
+}
+
+typedef struct {
+	stats_job s;         /* the data and how to widen it */
+	uint64_t per;        /* chunks per task */
+	ra_hist_t *part;     /* one per task */
+} hist_job;
+
+static int
+hist_task(void *job_, const uint64_t t)
+{
+	hist_job *job = job_;
+	ra_hist_t *h = &job->part[t];
+	double x[STATS_BLOCK];
+	uint32_t idx[STATS_BLOCK];
+	uint8_t raw[STATS_BLOCK*16];
+	uint64_t i = t*job->per*STATS_CHUNK;
+	uint64_t end = i + job->per*STATS_CHUNK < job->s.n ? i + job->per*STATS_CHUNK : job->s.n;
+	int ret = 0;
+	for (; i < end && ret == 0; i += STATS_BLOCK) {
+		uint64_t n = end - i < STATS_BLOCK ? end - i : STATS_BLOCK, j = 0, k = 0;
+		const uint8_t *p = job->s.data + i*job->s.elbyte;
+		if (job->s.swap) {
+			memcpy(raw, p, n*job->s.elbyte);
+			swap_bytes(raw, n*job->s.elbyte, job->s.swap);
+			p = raw;
+		}
+		job->s.widen(p, n, x);
+#ifdef RA_X86
+		if (have_avx2())
+			j = hist_index_avx2(h, x, n, idx, &k, j);
+#endif
+		hist_index(h, x, n, idx, &k, j);
+		ret = hist_add(h, idx, k);
+	}
+	return ret;
+}
+
+static int
+hist_scan(void *h_, const ra_t *r, const uint8_t *data, const uint64_t n)
+{  /* add n elements at data to the histogram h_ */
+	ra_hist_t *h = h_;
+	hist_job job;
+	int ret = stats_init(&job.s, r);
+	if (ret < 0 || n == 0)
+		return ret;
+	job.s.data = data;
+	job.s.n = n;
+	uint64_t nchunks = (n + STATS_CHUNK - 1) / STATS_CHUNK, ntasks = ra_num_threads();
+	job.per = (nchunks + ntasks - 1) / ntasks;
+	ntasks = (nchunks + job.per - 1) / job.per;
+	if ((job.part = calloc(ntasks, sizeof(ra_hist_t))) == NULL)
+		return fail(RA_ENOMEM, "unable to allocate histograms");
+	for (uint64_t t = 0; t < ntasks && ret == 0; ++t)
+		ret = hist_init(&job.part[t]);
+	if (ret == 0)
+		ret = parallel_for(ntasks, hist_task, &job);
+	for (uint64_t t = 0; t < ntasks; ++t) {
+		if (ret == 0)
+			hist_merge(h, &job.part[t]);
+		ra_hist_free(&job.part[t]);
+	}
+	free(job.part);
+	return ret;
+}
+
+static int
+hist_finish(ra_hist_t *h, const int ret)
+{
+	if (ret < 0)
+		ra_hist_free(h);
+	else if (h->n == 0)
+		h->min = h->max = NAN;
+	return ret;
+}
+
+int
+ra_histogram(const ra_t *r, ra_hist_t *h)
+{
+	stats_job job;
+	int ret;
+	if (is_compressed((ra_t*)r))
+		return fail(RA_EINVAL, "decompress arrays before taking their histogram");
+	if ((ret = stats_init(&job, r)) < 0 || (ret = hist_init(h)) < 0)
+		return ret;
+	return hist_finish(h, hist_scan(h, r, r->data, r->size / r->elbyte));
+}
+
+int
+ra_histogram_file(const char *path, ra_hist_t *h)
+{
+	int ret;
+	if ((ret = hist_init(h)) < 0)
+		return ret;
+	return hist_finish(h, scan_file(path, hist_scan, h));
+}
+
+static void
+hist_edges(const ra_hist_t *h, const uint64_t b, double *lo, double *hi)
+{  /* the values bin b spans, trimmed to those seen; the bins either side of
+	  zero hold only it and denormals below 2^-1030, and count as zero */
+	*lo = hist_value((uint64_t)b << HIST_SHIFT);
+	*hi = hist_value((uint64_t)(b + 1) << HIST_SHIFT);
+	if (b == HIST_ZERO || b + 1 == HIST_ZERO)
+		*lo = *hi = 0;
+	if (*lo < h->min) *lo = h->min;
+	if (*hi > h->max || isnan(*hi)) *hi = h->max;
+}
+
+double
+ra_hist_quantile(const ra_hist_t *h, const double p)
+{  /* interpolate within the bin that holds rank p*(n - 1) */
+	if (h->n == 0 || !(p > 0))
+		return h->min;
+	if (p >= 1)
+		return h->max;
+	double rank = p*(h->n - 1), seen = 0;
+	for (uint64_t g = 0; g < HIST_GROUPS; ++g) {
+		if (h->bins[g] == NULL)
+			continue;
+		for (uint64_t f = 0; f < HIST_FINE; ++f) {
+			uint64_t c = h->bins[g][f];
+			if (c == 0 || seen + c <= rank) {
+				seen += c;
+				continue;
+			}
+			double lo, hi;
+			hist_edges(h, g*HIST_FINE + f, &lo, &hi);
+			return lo + (hi - lo)*((rank - seen + 0.5) / c);
+		}
+	}
+	return h->max;
+}
+
+void
+ra_hist_bins(const ra_hist_t *h, const double lo, const double hi, const uint64_t nbins,
+		uint64_t counts[])
+{  /* each fine bin goes wholly to the output bin holding its midpoint */
+	memset(counts, 0, nbins*sizeof(uint64_t));
+	for (uint64_t g = 0; g < HIST_GROUPS; ++g) {
+		if (h->bins[g] == NULL)
+			continue;
+		for (uint64_t f = 0; f < HIST_FINE; ++f) {
+			if (h->bins[g][f] == 0)
+				continue;
+			double a, b;
+			hist_edges(h, g*HIST_FINE + f, &a, &b);
+			double m = (a + b) / 2;
+			if (m < lo || m > hi)
+				continue;
+			uint64_t k = hi > lo ? (uint64_t)((m - lo) / (hi - lo) * nbins) : 0;
+			counts[k < nbins ? k : nbins - 1] += h->bins[g][f];
+		}
+	}
+}
+
+
+//
+// TYPE CONVERSION
+//
+
+/*
+   Each block of elements is widened to double, scaled, and narrowed to
+   the new type, with AVX2 kernels for the common types. Where a 64-bit
+   integer is involved the block goes through long double instead, which
+   holds every such integer exactly. Integers round to nearest and clamp
+   at the ends of their range, or with RA_CONVERT_WRAP keep their low bits
+   as a C cast does; NaN becomes 0. Complex parts convert separately, the
+   offset going to the real part only. A real array becomes complex with
+   zero imaginary parts, and a complex array becomes real by dropping them.
+*/
+
+#define CONVERT_BLOCK  256        /* elements per pass of the kernels */
+
+typedef void (*narrow_fn)(const double *x, const uint64_t n, uint8_t *p, const int wrap);
+typedef void (*widenl_fn)(const uint8_t *p, const uint64_t n, long double *x);
+typedef void (*narrowl_fn)(const long double *x, const uint64_t n, uint8_t *p, const int wrap);
+
+typedef struct {
+	const uint8_t *src;
+	uint8_t *dst;
+	uint64_t n;              /* elements */
+	uint64_t sbyte, dbyte;   /* bytes per element */
+	uint64_t swap;           /* word width to byte-swap the source by, 0 for host order */
+	int sv, dv;              /* values per element, 2 for complex */
+	int wrap;
+	double scale, offset;
+	widen_fn widen;          /* double path */
+	narrow_fn narrow;
+	widenl_fn widenl;        /* long double path, if set */
+	narrowl_fn narrowl;
+} convert_job;
+
+static uint64_t
+low_bits(const long double y)
+{  /* the low 64 bits of the integer y in two's complement; 0 beyond 2^64 */
+	if (!(fabsl(y) < 18446744073709551616.0L))
+		return 0;
+	return y < 0 ? -(uint64_t)(-y) : (uint64_t)y;
+}
+
+#define CONVERT_WIDENL(name, T) \
+static void \
+name(const uint8_t *p, const uint64_t n, long double *x) \
+{ \
+	const T *v = (const T*)p; \
+	for (uint64_t i = 0; i < n; ++i) \
+		x[i] = v[i]; \
+}
+
+#define CONVERT_NARROW_FLOAT(name, W, T) \
+static void \
+name(const W *x, const uint64_t n, uint8_t *p, const int wrap) \
+{ \
+	T *v = (T*)p; \
+	for (uint64_t i = 0; i < n; ++i) \
+		v[i] = (T)x[i]; \
+}
+
+#define CONVERT_WIDENL_HALF(name, WIDEN) \
+static void \
+name(const uint8_t *p, const uint64_t n, long double *x) \
+{ \
+	const uint16_t *v = (const uint16_t*)p; \
+	for (uint64_t i = 0; i < n; ++i) \
+		x[i] = WIDEN(v[i]); \
+}
+
+#define CONVERT_NARROW_HALF(name, W, ODD, NARROW) \
+static void \
+name(const W *x, const uint64_t n, uint8_t *p, const int wrap) \
+{ \
+	uint16_t *v = (uint16_t*)p; \
+	for (uint64_t i = 0; i < n; ++i) \
+		v[i] = NARROW(ODD(x[i])); \
+}
+
+#define CONVERT_NARROW_INT(name, W, T, LO, HI, RINT) \
+static void \
+name(const W *x, const uint64_t n, uint8_t *p, const int wrap) \
+{  /* comparing against the bounds as W rounds HI of 64 bits up to 2^63 or 2^64 */ \
+	T *v = (T*)p; \
+	for (uint64_t i = 0; i < n; ++i) { \
+		W y = RINT(x[i]); \
+		if (wrap) \
+			v[i] = (T)low_bits(y); \
+		else \
+			v[i] = y != y ? 0 : y <= (W)(LO) ? (LO) : y >= (W)(HI) ? (HI) : (T)y; \
+	} \
+}
+
+CONVERT_WIDENL(widenl_u8,  uint8_t)
+CONVERT_WIDENL(widenl_u16, uint16_t)
+CONVERT_WIDENL(widenl_u32, uint32_t)
+CONVERT_WIDENL(widenl_u64, uint64_t)
+CONVERT_WIDENL(widenl_i8,  int8_t)
+CONVERT_WIDENL(widenl_i16, int16_t)
+CONVERT_WIDENL(widenl_i32, int32_t)
+CONVERT_WIDENL(widenl_i64, int64_t)
+CONVERT_WIDENL(widenl_f32, float)
+CONVERT_WIDENL(widenl_f64, double)
+CONVERT_WIDENL_HALF(widenl_f16, half_to_float)
+CONVERT_WIDENL_HALF(widenl_bf16, bf16_to_float)
+
+CONVERT_NARROW_FLOAT(narrow_f32, double, float)
+CONVERT_NARROW_FLOAT(narrow_f64, double, double)
+CONVERT_NARROW_HALF(narrow_f16, double, odd_float, float_to_half)
+CONVERT_NARROW_HALF(narrow_bf16, double, odd_float, float_to_bf16)
+CONVERT_NARROW_INT(narrow_u8,  double, uint8_t,  0, UINT8_MAX,  rint)
+CONVERT_NARROW_INT(narrow_u16, double, uint16_t, 0, UINT16_MAX, rint)
+CONVERT_NARROW_INT(narrow_u32, double, uint32_t, 0, UINT32_MAX, rint)
+CONVERT_NARROW_INT(narrow_i8,  double, int8_t,  INT8_MIN,  INT8_MAX,  rint)
+CONVERT_NARROW_INT(narrow_i16, double, int16_t, INT16_MIN, INT16_MAX, rint)
+CONVERT_NARROW_INT(narrow_i32, double, int32_t, INT32_MIN, INT32_MAX, rint)
+
+CONVERT_NARROW_FLOAT(narrowl_f32, long double, float)
+CONVERT_NARROW_FLOAT(narrowl_f64, long double, double)
+CONVERT_NARROW_HALF(narrowl_f16, long double, odd_floatl, float_to_half)
+CONVERT_NARROW_HALF(narrowl_bf16, long double, odd_floatl, float_to_bf16)
+CONVERT_NARROW_INT(narrowl_u8,  long double, uint8_t,  0, UINT8_MAX,  rintl)
+CONVERT_NARROW_INT(narrowl_u16, long double, uint16_t, 0, UINT16_MAX, rintl)
+CONVERT_NARROW_INT(narrowl_u32, long double, uint32_t, 0, UINT32_MAX, rintl)
+CONVERT_NARROW_INT(narrowl_u64, long double, uint64_t, 0, UINT64_MAX, rintl)
+CONVERT_NARROW_INT(narrowl_i8,  long double, int8_t,  INT8_MIN,  INT8_MAX,  rintl)
+CONVERT_NARROW_INT(narrowl_i16, long double, int16_t, INT16_MIN, INT16_MAX, rintl)
+CONVERT_NARROW_INT(narrowl_i32, long double, int32_t, INT32_MIN, INT32_MAX, rintl)
+CONVERT_NARROW_INT(narrowl_i64, long double, int64_t, INT64_MIN, INT64_MAX, rintl)
+
+#ifdef RA_X86
+/* Saturating narrowings: NaN is zeroed, values are clamped while still
+   doubles, and the conversion rounds to nearest as rint does. */
+
+#define NARROW_AVX2(name, T, LO, HI, STORE) \
+static TARGET("avx2") void \
+name(const double *x, const uint64_t n, uint8_t *p, const int wrap) \
+{ \
+	const __m256d lo = _mm256_set1_pd(LO), hi = _mm256_set1_pd(HI); \
+	uint64_t i = 0; \
+	if (!wrap) \
+		for (; i + 8 <= n; i += 8) { \
+			__m256d a = _mm256_loadu_pd(x + i), b = _mm256_loadu_pd(x + i + 4); \
+			a = _mm256_and_pd(a, _mm256_cmp_pd(a, a, _CMP_ORD_Q)); \
+			b = _mm256_and_pd(b, _mm256_cmp_pd(b, b, _CMP_ORD_Q)); \
+			__m128i qa = _mm256_cvtpd_epi32(_mm256_min_pd(_mm256_max_pd(a, lo), hi)); \
+			__m128i qb = _mm256_cvtpd_epi32(_mm256_min_pd(_mm256_max_pd(b, lo), hi)); \
+			STORE; \
+		} \
+	name##_tail(x + i, n - i, p + i*sizeof(T), wrap); \
+}
+
+#define narrow_u8_avx2_tail   narrow_u8
+#define narrow_u16_avx2_tail  narrow_u16
+#define narrow_i16_avx2_tail  narrow_i16
+#define narrow_i32_avx2_tail  narrow_i32
+
+NARROW_AVX2(narrow_u8_avx2, uint8_t, 0, UINT8_MAX,
+		_mm_storel_epi64((__m128i*)(p + i), _mm_packus_epi16(_mm_packus_epi32(qa, qb), _mm_setzero_si128())))
+NARROW_AVX2(narrow_u16_avx2, uint16_t, 0, UINT16_MAX,
+		_mm_storeu_si128((__m128i*)(p + 2*i), _mm_packus_epi32(qa, qb)))
+NARROW_AVX2(narrow_i16_avx2, int16_t, INT16_MIN, INT16_MAX,
+		_mm_storeu_si128((__m128i*)(p + 2*i), _mm_packs_epi32(qa, qb)))
+NARROW_AVX2(narrow_i32_avx2, int32_t, INT32_MIN, INT32_MAX,
+		_mm_storeu_si128((__m128i*)(p + 4*i), qa); _mm_storeu_si128((__m128i*)(p + 4*i + 16), qb))
+
+static TARGET("avx2") void
+narrow_f32_avx2(const double *x, const uint64_t n, uint8_t *p, const int wrap)
+{
+	uint64_t i = 0;
+	for (; i + 8 <= n; i += 8)
+		_mm256_storeu_ps((float*)(p + 4*i), _mm256_set_m128(_mm256_cvtpd_ps(_mm256_loadu_pd(x + i + 4)),
+				_mm256_cvtpd_ps(_mm256_loadu_pd(x + i))));
+	narrow_f32(x + i, n - i, p + 4*i, wrap);
+}
+
+static TARGET("avx2,f16c") void
+narrow_f16_avx2(const double *x, const uint64_t n, uint8_t *p, const int wrap)
+{
+	uint64_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256 f = _mm256_set_m128(odd_float_avx2(_mm256_loadu_pd(x + i + 4)),
+				odd_float_avx2(_mm256_loadu_pd(x + i)));
+		_mm_storeu_si128((__m128i*)(p + 2*i), _mm256_cvtps_ph(f, _MM_FROUND_TO_NEAREST_INT));
+	}
+	narrow_f16(x + i, n - i, p + 2*i, wrap);
+}
+
+static TARGET("avx2") void
+narrow_bf16_avx2(const double *x, const uint64_t n, uint8_t *p, const int wrap)
+{
+	uint64_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256 f = _mm256_set_m128(odd_float_avx2(_mm256_loadu_pd(x + i + 4)),
+				odd_float_avx2(_mm256_loadu_pd(x + i)));
+		_mm_storeu_si128((__m128i*)(p + 2*i), narrow8_bf16(f));
+	}
+	narrow_bf16(x + i, n - i, p + 2*i, wrap);
+}
+
+static TARGET("avx2") uint64_t
+affine_avx2(double *x, const uint64_t n, const double scale, const double offset)
+{
+	const __m256d a = _mm256_set1_pd(scale), b = _mm256_set1_pd(offset);
+	uint64_t i = 0;
+	for (; i + 4 <= n; i += 4)
+		_mm256_storeu_pd(x + i, _mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(x + i), a), b));
+	return i;
+}
+#endif
+
+static void
+affine(double *x, const uint64_t n, const int step, const double scale, const double offset)
+{  /* x*scale + offset, the offset only to every step-th value */
+	uint64_t i = 0;
+#ifdef RA_X86
+	if (have_avx2() && step == 1)
+		i = affine_avx2(x, n, scale, offset);
+#endif
+	for (; i < n; ++i)
+		x[i] = x[i]*scale + (i % step ? 0 : offset);
+}
+
+static void
+convert_block(const convert_job *job, const uint8_t *p, const uint64_t n, uint8_t *out)
+{  /* n elements from p to out */
+	uint64_t nv = n*job->sv;
+	int scaled = job->scale != 1 || job->offset != 0;
+	if (job->widenl != NULL) {
+		long double x[2*CONVERT_BLOCK];
+		job->widenl(p, nv, x);
+		if (scaled)
+			for (uint64_t i = 0; i < nv; ++i)
+				x[i] = x[i]*job->scale + (i % job->sv ? 0 : job->offset);
+		if (job->sv > job->dv)  // keep the real parts
+			for (uint64_t i = 0; i < n; ++i)
+				x[i] = x[2*i];
+		else if (job->sv < job->dv)  // give each a zero imaginary part
+			for (uint64_t i = n; i-- > 0; ) {
+				x[2*i] = x[i];
+				x[2*i+1] = 0;
+			}
+		job->narrowl(x, n*job->dv, out, job->wrap);
+	} else {
+		double x[2*CONVERT_BLOCK];
+		job->widen(p, nv, x);
+		if (scaled)
+			affine(x, nv, job->sv, job->scale, job->offset);
+		if (job->sv > job->dv)
+			for (uint64_t i = 0; i < n; ++i)
+				x[i] = x[2*i];
+		else if (job->sv < job->dv)
+			for (uint64_t i = n; i-- > 0; ) {
+				x[2*i] = x[i];
+				x[2*i+1] = 0;
+			}
+		job->narrow(x, n*job->dv, out, job->wrap);
+	}
+}
+
+static int
+convert_task(void *job_, const uint64_t c)
+{
+	convert_job *job = job_;
+	uint8_t raw[CONVERT_BLOCK*16];
+	uint64_t i = c*STATS_CHUNK;
+	uint64_t end = i + STATS_CHUNK < job->n ? i + STATS_CHUNK : job->n;
+	for (; i < end; i += CONVERT_BLOCK) {
+		uint64_t n = end - i < CONVERT_BLOCK ? end - i : CONVERT_BLOCK;
+		const uint8_t *p = job->src + i*job->sbyte;
+		if (job->swap) {
+			memcpy(raw, p, n*job->sbyte);
+			swap_bytes(raw, n*job->sbyte, job->swap);
+			p = raw;
+		}
+		convert_block(job, p, n, job->dst + i*job->dbyte);
+	}
+	return 0;
+}
+
+static int
+convert_kernels(const uint64_t eltype, const uint64_t width, widen_fn *w, narrow_fn *nf,
+		widenl_fn *wl, narrowl_fn *nl)
+{  /* the kernels for values of one part of an element */
+	*w = NULL;
+	*nf = NULL;
+	switch (eltype * 16 + width) {
+	case RA_TYPE_INT*16 + 1:  *w = widen_i8;  *nf = narrow_i8;  *wl = widenl_i8;  *nl = narrowl_i8;  break;
+	case RA_TYPE_INT*16 + 2:  *w = widen_i16; *nf = narrow_i16; *wl = widenl_i16; *nl = narrowl_i16; break;
+	case RA_TYPE_INT*16 + 4:  *w = widen_i32; *nf = narrow_i32; *wl = widenl_i32; *nl = narrowl_i32; break;
+	case RA_TYPE_INT*16 + 8:  *wl = widenl_i64; *nl = narrowl_i64; break;
+	case RA_TYPE_UINT*16 + 1: *w = widen_u8;  *nf = narrow_u8;  *wl = widenl_u8;  *nl = narrowl_u8;  break;
+	case RA_TYPE_UINT*16 + 2: *w = widen_u16; *nf = narrow_u16; *wl = widenl_u16; *nl = narrowl_u16; break;
+	case RA_TYPE_UINT*16 + 4: *w = widen_u32; *nf = narrow_u32; *wl = widenl_u32; *nl = narrowl_u32; break;
+	case RA_TYPE_UINT*16 + 8: *wl = widenl_u64; *nl = narrowl_u64; break;
+	case RA_TYPE_FLOAT*16 + 2:
+		*w = widen_f16; *nf = narrow_f16; *wl = widenl_f16; *nl = narrowl_f16; break;
+	case RA_TYPE_BFLOAT*16 + 2:
+		*w = widen_bf16; *nf = narrow_bf16; *wl = widenl_bf16; *nl = narrowl_bf16; break;
+	case RA_TYPE_FLOAT*16 + 4:
+	case RA_TYPE_COMPLEX*16 + 4:
+		*w = widen_f32; *nf = narrow_f32; *wl = widenl_f32; *nl = narrowl_f32; break;
+	case RA_TYPE_FLOAT*16 + 8:
+	case RA_TYPE_COMPLEX*16 + 8:
+		*w = widen_f64; *nf = narrow_f64; *wl = widenl_f64; *nl = narrowl_f64; break;
+	default:
+		return fail(RA_EINVAL, "no conversion for elements of type %lu and %lu bytes",
+				eltype, width * (eltype == RA_TYPE_COMPLEX ? 2 : 1));
+	}
+	return 0;
+}
+
+static int
+convert_init(convert_job *job, const ra_t *from, const ra_t *to, const double scale,
+		const double offset, const int flags)
+{
+	widen_fn w, unused_w;
+	narrow_fn unused_n, nf;
+	widenl_fn wl, unused_wl;
+	narrowl_fn unused_nl, nl;
+	int ret;
+	memset(job, 0, sizeof(convert_job));
+	job->sv = from->eltype == RA_TYPE_COMPLEX ? 2 : 1;
+	job->dv = to->eltype == RA_TYPE_COMPLEX ? 2 : 1;
+	job->sbyte = from->elbyte;
+	job->dbyte = to->elbyte;
+	if ((ret = convert_kernels(from->eltype, from->elbyte / job->sv, &w, &unused_n, &wl, &unused_nl)) < 0
+			|| (ret = convert_kernels(to->eltype, to->elbyte / job->dv, &unused_w, &nf, &unused_wl, &nl)) < 0)
+		return ret;
+	job->swap = is_foreign((ra_t*)from) ? swap_width(from) : 0;
+	job->wrap = flags & RA_CONVERT_WRAP;
+	job->scale = scale;
+	job->offset = offset;
+	if (w == NULL || nf == NULL) {  // a 64-bit integer at either end
+		job->widenl = wl;
+		job->narrowl = nl;
+		return 0;
+	}
+	job->widen = widen_fast(w);
+	job->narrow = nf;
+#ifdef RA_X86
+	if (have_avx2()) {
+		const narrow_fn scalar[] = { narrow_u8, narrow_u16, narrow_i16, narrow_i32, narrow_f32,
+			narrow_bf16 };
+		const narrow_fn vector[] = { narrow_u8_avx2, narrow_u16_avx2, narrow_i16_avx2,
+			narrow_i32_avx2, narrow_f32_avx2, narrow_bf16_avx2 };
+		for (int k = 0; k < 6; ++k)
+			if (nf == scalar[k])
+				job->narrow = vector[k];
+		if (nf == narrow_f16 && have_f16c())
+			job->narrow = narrow_f16_avx2;
+	}
+#endif
+	return 0;
+}
+
+static int
+convert_run(convert_job *job, const uint8_t *src, uint8_t *dst, const uint64_t n)
+{
+	job->src = src;
+	job->dst = dst;
+	job->n = n;
+	return parallel_for((n + STATS_CHUNK - 1) / STATS_CHUNK, convert_task, job);
+}
+
+int
+ra_convert_scaled(ra_t *r, const char *type, const double scale, const double offset,
+		const int flags)
+{  /* convert to type in memory, as x*scale + offset */
+	ra_t to = *r;
+	convert_job job;
+	int ret;
+	if (is_compressed(r))
+		return fail(RA_EINVAL, "decompress arrays before converting them");
+	if ((ret = ra_parse_type(type, &to.eltype, &to.elbyte)) < 0
+			|| (ret = convert_init(&job, r, &to, scale, offset, flags)) < 0)
+		return ret;
+	uint64_t n = r->size / r->elbyte;
+	uint8_t *out = safe_malloc(n*to.elbyte > 0 ? n*to.elbyte : 1);
+	if (out == NULL)
+		return -RA_ENOMEM;
+	if ((ret = convert_run(&job, r->data, out, n)) < 0 || (ret = replace_data(r, out, n*to.elbyte)) < 0) {
+		free(out);
+		return ret;
+	}
+	r->eltype = to.eltype;
+	r->elbyte = to.elbyte;
+	r->flags = (r->flags & ~RA_FLAG_BIG_ENDIAN) | HOST_ORDER;
+	refresh_mem_from_struct(r);
+	return 0;
+}
+
+int
+ra_convert(ra_t *r, const char *type)
+{
+	return ra_convert_scaled(r, type, 1, 0, 0);
+}
+
+typedef struct {
+	convert_job job;
+	int fd;
+	uint8_t *out;
+	uint64_t batch;      /* elements converted per write */
+	uint32_t crc;
+	int started;
+} convert_stream;
+
+static int
+convert_scan(void *cs_, const ra_t *h, const uint8_t *data, const uint64_t n)
+{  /* convert a run of elements a batch at a time and append them to the file */
+	convert_stream *cs = cs_;
+	int ret = 0;
+	cs->job.swap = is_foreign((ra_t*)h) ? swap_width(h) : 0;
+	for (uint64_t i = 0; i < n && ret == 0; i += cs->batch) {
+		uint64_t k = n - i < cs->batch ? n - i : cs->batch;
+		if ((ret = convert_run(&cs->job, data + i*cs->job.sbyte, cs->out, k)) == 0)
+			ret = chunked_write(cs->fd, NULL, cs->out, k*cs->job.dbyte, 0,
+					write_checksum ? &cs->crc : NULL);
+	}
+	return ret;
+}
+
+int
+ra_convert_file(const char *src, const char *dst, const char *type, const double scale,
+		const double offset, const int flags)
+{  /* stream src through the conversion into an uncompressed dst */
+	ra_t h, to;
+	convert_stream cs;
+	uint8_t *header = NULL;
+	int ret;
+	int fd = ra_read_header(&h, src);
+	if (fd < 0)
+		return fd;
+	close(fd);
+	cs.fd = -1;
+	cs.out = NULL;
+	cs.crc = 0;
+	to = h;
+	to.flags = (h.flags & RA_FLAG_ALIGNED) | HOST_ORDER;
+	if ((ret = ra_parse_type(type, &to.eltype, &to.elbyte)) < 0
+			|| (ret = convert_init(&cs.job, &h, &to, scale, offset, flags)) < 0
+			|| (ret = distinct_output(src, dst)) < 0)
+		goto done;
+	to.size = ra_data_size(&h) / h.elbyte * to.elbyte;
+	cs.batch = STATS_BATCH / (to.elbyte > h.elbyte ? to.elbyte : h.elbyte);
+	cs.batch -= cs.batch % STATS_CHUNK;
+	if ((cs.out = safe_malloc(cs.batch*to.elbyte)) == NULL
+			|| (header = header_block(&to)) == NULL) {
+		ret = -RA_ENOMEM;
+		goto done;
+	}
+	if ((cs.fd = ret = valid_open(dst, O_WRONLY | O_TRUNC | O_CREAT)) < 0
+			|| (ret = valid_write(cs.fd, header, ra_header_size(&to))) < 0
+			|| (ret = scan_file(src, convert_scan, &cs)) < 0)
+		goto done;
+	if (write_checksum) {
+		uint64_t record[2] = { RA_CHECKSUM_TAG, cs.crc };
+		ret = valid_write(cs.fd, record, RA_CHECKSUM_SIZE);
+	}
+
+done:
+	if (cs.fd >= 0 && close(cs.fd) != 0 && ret == 0)
+		ret = fail_sys(RA_EIO, "unable to close %s", dst);
+	free(header);
+	free(cs.out);
+	ra_free(&h);
+	return ret;
+}
+
+
+//
+// COMPLEX LAYOUT
+//
+
+/*
+   Complex elements are stored interleaved, as (re, im) pairs. Splitting
+   gives two real arrays of the same shape: the real and imaginary parts,
+   as FFT libraries and GPU staging often want them, or with
+   RA_COMPLEX_POLAR the magnitude and the phase in radians. Interleaving
+   is the inverse. The parts move through AVX2 shuffles a block at a time.
+   Magnitudes reuse the widening kernels of the statistics; phases and
+   polar inputs go through libm.
+*/
+
+typedef void (*split_fn)(const uint8_t *z, const uint64_t n, uint8_t *a, uint8_t *b);
+typedef void (*join_fn)(const uint8_t *a, const uint8_t *b, const uint64_t n, uint8_t *z);
+
+typedef struct {
+	const uint8_t *in[2];    /* z, or its two parts */
+	uint8_t *out[2];         /* the two parts, or z; a NULL second part is not kept */
+	uint64_t n;              /* elements */
+	uint64_t width;          /* bytes per part */
+	uint64_t swap[2];        /* word width to byte-swap each input by, 0 for host order */
+	int polar;
+	split_fn split;          /* to parts, or to the phase with polar */
+	join_fn join;
+	widen_fn magnitude;
+	narrow_fn narrow;
+} cplx_job;
+
+#define CPLX_SPLIT(name, T) \
+static void \
+name(const uint8_t *z, const uint64_t n, uint8_t *a, uint8_t *b) \
+{ \
+	const T *v = (const T*)z; \
+	T *re = (T*)a, *im = (T*)b; \
+	for (uint64_t i = 0; i < n; ++i) { \
+		re[i] = v[2*i]; \
+		im[i] = v[2*i+1]; \
+	} \
+}
+
+#define CPLX_JOIN(name, T) \
+static void \
+name(const uint8_t *a, const uint8_t *b, const uint64_t n, uint8_t *z) \
+{ \
+	const T *re = (const T*)a, *im = (const T*)b; \
+	T *v = (T*)z; \
+	for (uint64_t i = 0; i < n; ++i) { \
+		v[2*i] = re[i]; \
+		v[2*i+1] = im[i]; \
+	} \
+}
+
+#define CPLX_PHASE(name, T, ATAN2) \
+static void \
+name(const uint8_t *z, const uint64_t n, uint8_t *unused, uint8_t *b) \
+{ \
+	const T *v = (const T*)z; \
+	T *ph = (T*)b; \
+	for (uint64_t i = 0; i < n; ++i) \
+		ph[i] = ATAN2(v[2*i+1], v[2*i]); \
+}
+
+#define CPLX_POLAR(name, T, COS, SIN) \
+static void \
+name(const uint8_t *a, const uint8_t *b, const uint64_t n, uint8_t *z) \
+{ \
+	const T *m = (const T*)a, *ph = (const T*)b; \
+	T *v = (T*)z; \
+	for (uint64_t i = 0; i < n; ++i) { \
+		v[2*i] = m[i]*COS(ph[i]); \
+		v[2*i+1] = m[i]*SIN(ph[i]); \
+	} \
+}
+
+CPLX_SPLIT(split_c8, float)
+CPLX_SPLIT(split_c16, double)
+CPLX_JOIN(join_c8, float)
+CPLX_JOIN(join_c16, double)
+CPLX_PHASE(phase_c8, float, atan2f)
+CPLX_PHASE(phase_c16, double, atan2)
+CPLX_POLAR(polar_c8, float, cosf, sinf)
+CPLX_POLAR(polar_c16, double, cos, sin)
+
+#ifdef RA_X86
+static TARGET("avx2") void
+split_c8_avx2(const uint8_t *z, const uint64_t n, uint8_t *a, uint8_t *b)
+{  /* the shuffles leave the lanes holding parts 0,1,4,5 and 2,3,6,7, put back in order */
+	const float *v = (const float*)z;
+	uint64_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256 p = _mm256_loadu_ps(v + 2*i), q = _mm256_loadu_ps(v + 2*i + 8);
+		__m256 re = _mm256_shuffle_ps(p, q, _MM_SHUFFLE(2, 0, 2, 0));
+		__m256 im = _mm256_shuffle_ps(p, q, _MM_SHUFFLE(3, 1, 3, 1));
+		_mm256_storeu_pd((double*)(a + 4*i), _mm256_permute4x64_pd(_mm256_castps_pd(re), 0xd8));
+		_mm256_storeu_pd((double*)(b + 4*i), _mm256_permute4x64_pd(_mm256_castps_pd(im), 0xd8));
+	}
+	split_c8(z + 8*i, n - i, a + 4*i, b + 4*i);
+}
+
+static TARGET("avx2") void
+join_c8_avx2(const uint8_t *a, const uint8_t *b, const uint64_t n, uint8_t *z)
+{
+	uint64_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256 re = _mm256_loadu_ps((const float*)(a + 4*i)), im = _mm256_loadu_ps((const float*)(b + 4*i));
+		__m256 lo = _mm256_unpacklo_ps(re, im), hi = _mm256_unpackhi_ps(re, im);
+		_mm256_storeu_ps((float*)(z + 8*i), _mm256_permute2f128_ps(lo, hi, 0x20));
+		_mm256_storeu_ps((float*)(z + 8*i + 32), _mm256_permute2f128_ps(lo, hi, 0x31));
+	}
+	join_c8(a + 4*i, b + 4*i, n - i, z + 8*i);
+}
+
+static TARGET("avx2") void
+split_c16_avx2(const uint8_t *z, const uint64_t n, uint8_t *a, uint8_t *b)
+{
+	const double *v = (const double*)z;
+	uint64_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256d p = _mm256_loadu_pd(v + 2*i), q = _mm256_loadu_pd(v + 2*i + 4);
+		_mm256_storeu_pd((double*)(a + 8*i), _mm256_permute4x64_pd(_mm256_unpacklo_pd(p, q), 0xd8));
+		_mm256_storeu_pd((double*)(b + 8*i), _mm256_permute4x64_pd(_mm256_unpackhi_pd(p, q), 0xd8));
+	}
+	split_c16(z + 16*i, n - i, a + 8*i, b + 8*i);
+}
+
+static TARGET("avx2") void
+join_c16_avx2(const uint8_t *a, const uint8_t *b, const uint64_t n, uint8_t *z)
+{
+	uint64_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256d re = _mm256_loadu_pd((const double*)(a + 8*i)), im = _mm256_loadu_pd((const double*)(b + 8*i));
+		__m256d lo = _mm256_unpacklo_pd(re, im), hi = _mm256_unpackhi_pd(re, im);
+		_mm256_storeu_pd((double*)(z + 16*i), _mm256_permute2f128_pd(lo, hi, 0x20));
+		_mm256_storeu_pd((double*)(z + 16*i + 32), _mm256_permute2f128_pd(lo, hi, 0x31));
+	}
+	join_c16(a + 8*i, b + 8*i, n - i, z + 16*i);
+}
+#endif
+
+static int
+cplx_init(cplx_job *job, const uint64_t width, const int flags)
+{  /* the kernels for parts of width bytes */
+	memset(job, 0, sizeof(cplx_job));
+	job->width = width;
+	job->polar = flags & RA_COMPLEX_POLAR;
+	if (width == 4) {
+		job->split = job->polar ? phase_c8 : split_c8;
+		job->join = job->polar ? polar_c8 : join_c8;
+		job->magnitude = widen_c8;
+		job->narrow = narrow_f32;
+	} else if (width == 8) {
+		job->split = job->polar ? phase_c16 : split_c16;
+		job->join = job->polar ? polar_c16 : join_c16;
+		job->magnitude = widen_c16;
+		job->narrow = narrow_f64;
+	} else
+		return fail(RA_EINVAL, "complex parts of %lu bytes are not supported; use c8 or c16", width);
+	job->magnitude = widen_fast(job->magnitude);
+#ifdef RA_X86
+	if (have_avx2()) {
+		if (job->split == split_c8) job->split = split_c8_avx2;
+		if (job->split == split_c16) job->split = split_c16_avx2;
+		if (job->join == join_c8) job->join = join_c8_avx2;
+		if (job->join == join_c16) job->join = join_c16_avx2;
+		if (job->narrow == narrow_f32) job->narrow = narrow_f32_avx2;
+	}
+#endif
+	return 0;
+}
+
+static int
+split_task(void *job_, const uint64_t c)
+{
+	cplx_job *job = job_;
+	const uint64_t w = job->width;
+	uint8_t raw[CONVERT_BLOCK*16], spare[CONVERT_BLOCK*8];
+	double x[CONVERT_BLOCK];
+	uint64_t i = c*STATS_CHUNK;
+	uint64_t end = i + STATS_CHUNK < job->n ? i + STATS_CHUNK : job->n;
+	for (; i < end; i += CONVERT_BLOCK) {
+		uint64_t n = end - i < CONVERT_BLOCK ? end - i : CONVERT_BLOCK;
+		const uint8_t *z = job->in[0] + 2*i*w;
+		uint8_t *a = job->out[0] + i*w, *b = job->out[1] ? job->out[1] + i*w : spare;
+		if (job->swap[0]) {
+			memcpy(raw, z, 2*n*w);
+			swap_bytes(raw, 2*n*w, job->swap[0]);
+			z = raw;
+		}
+		if (job->polar) {
+			job->magnitude(z, n, x);
+			job->narrow(x, n, a, 0);
+			if (job->out[1])
+				job->split(z, n, NULL, b);
+		} else
+			job->split(z, n, a, b);
+	}
+	return 0;
+}
+
+static int
+join_task(void *job_, const uint64_t c)
+{
+	cplx_job *job = job_;
+	const uint64_t w = job->width;
+	uint8_t raw[2][CONVERT_BLOCK*8];
+	uint64_t i = c*STATS_CHUNK;
+	uint64_t end = i + STATS_CHUNK < job->n ? i + STATS_CHUNK : job->n;
+	for (; i < end; i += CONVERT_BLOCK) {
+		uint64_t n = end - i < CONVERT_BLOCK ? end - i : CONVERT_BLOCK;
+		const uint8_t *p[2] = { job->in[0] + i*w, job->in[1] + i*w };
+		for (int k = 0; k < 2; ++k)
+			if (job->swap[k]) {
+				memcpy(raw[k], p[k], n*w);
+				swap_bytes(raw[k], n*w, job->swap[k]);
+				p[k] = raw[k];
+			}
+		job->join(p[0], p[1], n, job->out[0] + 2*i*w);
+	}
+	return 0;
+}
+
+static int
+cplx_run(cplx_job *job, task_fn task, const uint64_t n)
+{
+	job->n = n;
+	return parallel_for((n + STATS_CHUNK - 1) / STATS_CHUNK, task, job);
+}
+
+static int
+create_like(ra_t *out, const ra_t *like, const uint64_t eltype, const uint64_t elbyte)
+{  /* a new array of the shape of like, with other elements */
+	char type[24];
+	snprintf(type, sizeof type, "%c%lu", RA_TYPE_CODES[eltype], elbyte);
+	ra_t *t = ra_create(type, like->ndims, like->dims, like->flags & RA_FLAG_ALIGNED);
+	if (t == NULL)
+		return -RA_ENOMEM;
+	*out = *t;
+	free(t);
+	return 0;
+}
+
+static int
+check_complex(const ra_t *z)
+{
+	if (z->eltype != RA_TYPE_COMPLEX)
+		return fail(RA_EINVAL, "only complex arrays can be split");
+	return 0;
+}
+
+static int
+check_parts(const ra_t *a, const ra_t *b)
+{
+	if (a->eltype != RA_TYPE_FLOAT || !same_shape(a, b))
+		return fail(RA_EINVAL, "parts to interleave must be float arrays of one type and shape");
+	return 0;
+}
+
+int
+ra_complex_split(const ra_t *z, ra_t *a, ra_t *b, const int flags)
+{
+	cplx_job job;
+	int ret;
+	if (is_compressed((ra_t*)z))
+		return fail(RA_EINVAL, "decompress arrays before splitting them");
+	if ((ret = check_complex(z)) < 0 || (ret = cplx_init(&job, z->elbyte / 2, flags)) < 0)
+		return ret;
+	if ((ret = create_like(a, z, RA_TYPE_FLOAT, job.width)) < 0)
+		return ret;
+	if (b != NULL && (ret = create_like(b, z, RA_TYPE_FLOAT, job.width)) < 0) {
+		ra_free(a);
+		return ret;
+	}
+	job.in[0] = z->data;
+	job.out[0] = a->data;
+	job.out[1] = b ? b->data : NULL;
+	job.swap[0] = is_foreign((ra_t*)z) ? swap_width(z) : 0;
+	return cplx_run(&job, split_task, z->size / z->elbyte);
+}
+
+int
+ra_complex_interleave(const ra_t *a, const ra_t *b, ra_t *z, const int flags)
+{
+	cplx_job job;
+	int ret;
+	if (is_compressed((ra_t*)a) || is_compressed((ra_t*)b))
+		return fail(RA_EINVAL, "decompress arrays before interleaving them");
+	if ((ret = check_parts(a, b)) < 0 || (ret = cplx_init(&job, a->elbyte, flags)) < 0
+			|| (ret = create_like(z, a, RA_TYPE_COMPLEX, 2*job.width)) < 0)
+		return ret;
+	job.in[0] = a->data;
+	job.in[1] = b->data;
+	job.out[0] = z->data;
+	job.swap[0] = is_foreign((ra_t*)a) ? swap_width(a) : 0;
+	job.swap[1] = is_foreign((ra_t*)b) ? swap_width(b) : 0;
+	return cplx_run(&job, join_task, a->size / a->elbyte);
+}
+
+typedef struct {
+	cplx_job job;
+	const ra_t *other;       /* the second part, when interleaving */
+	uint64_t done;           /* elements written so far */
+	uint64_t batch;          /* elements per write */
+	int fd[2];
+	uint8_t *out[2];
+	uint32_t crc[2];
+} cplx_stream;
+
+static int
+split_scan(void *cs_, const ra_t *h, const uint8_t *data, const uint64_t n)
+{  /* split a run of elements a batch at a time and append the parts to their files */
+	cplx_stream *cs = cs_;
+	const uint64_t w = cs->job.width;
+	int ret = 0;
+	cs->job.swap[0] = is_foreign((ra_t*)h) ? swap_width(h) : 0;
+	for (uint64_t i = 0; i < n && ret == 0; i += cs->batch) {
+		uint64_t k = n - i < cs->batch ? n - i : cs->batch;
+		cs->job.in[0] = data + 2*i*w;
+		cs->job.out[0] = cs->out[0];
+		cs->job.out[1] = cs->out[1];
+		ret = cplx_run(&cs->job, split_task, k);
+		for (int p = 0; p < 2 && ret == 0; ++p)
+			if (cs->fd[p] >= 0)
+				ret = chunked_write(cs->fd[p], NULL, cs->out[p], k*w, 0,
+						write_checksum ? &cs->crc[p] : NULL);
+	}
+	return ret;
+}
+
+static int
+join_scan(void *cs_, const ra_t *h, const uint8_t *data, const uint64_t n)
+{  /* interleave a run of the first part with the same elements of the second */
+	cplx_stream *cs = cs_;
+	const uint64_t w = cs->job.width;
+	int ret = 0;
+	cs->job.swap[0] = is_foreign((ra_t*)h) ? swap_width(h) : 0;
+	cs->job.swap[1] = is_foreign((ra_t*)cs->other) ? swap_width(cs->other) : 0;
+	for (uint64_t i = 0; i < n && ret == 0; i += cs->batch) {
+		uint64_t k = n - i < cs->batch ? n - i : cs->batch;
+		cs->job.in[0] = data + i*w;
+		cs->job.in[1] = cs->other->data + cs->done*w;
+		cs->job.out[0] = cs->out[0];
+		if ((ret = cplx_run(&cs->job, join_task, k)) == 0)
+			ret = chunked_write(cs->fd[0], NULL, cs->out[0], 2*k*w, 0,
+					write_checksum ? &cs->crc[0] : NULL);
+		cs->done += k;
+	}
+	return ret;
+}
+
+static int
+output_open(const char *path, const ra_t *h)
+{  /* create path and write the header of h; returns the descriptor */
+	uint8_t *header = header_block(h);
+	if (header == NULL)
+		return -RA_ENOMEM;
+	int ret, fd = valid_open(path, O_WRONLY | O_TRUNC | O_CREAT);
+	if (fd >= 0 && (ret = valid_write(fd, header, ra_header_size(h))) < 0) {
+		close(fd);
+		fd = ret;
+	}
+	free(header);
+	return fd;
+}
+
+static int
+output_close(const int fd, const char *path, const uint32_t crc, int ret)
+{  /* append the checksum record if checksums are on, and close */
+	if (fd < 0)
+		return ret;
+	if (ret == 0 && write_checksum) {
+		uint64_t record[2] = { RA_CHECKSUM_TAG, crc };
+		ret = valid_write(fd, record, RA_CHECKSUM_SIZE);
+	}
+	if (close(fd) != 0 && ret == 0)
+		ret = fail_sys(RA_EIO, "unable to close %s", path);
+	return ret;
+}
+
+int
+ra_complex_split_file(const char *src, const char *dsta, const char *dstb, const int flags)
+{  /* stream src into one or two uncompressed files of parts */
+	ra_t h, part;
+	cplx_stream cs = { .fd = { -1, -1 } };
+	int ret;
+	int fd = ra_read_header(&h, src);
+	if (fd < 0)
+		return fd;
+	close(fd);
+	if ((ret = check_complex(&h)) < 0 || (ret = cplx_init(&cs.job, h.elbyte / 2, flags)) < 0)
+		goto done;
+	part = h;
+	part.flags = (h.flags & RA_FLAG_ALIGNED) | HOST_ORDER;
+	part.eltype = RA_TYPE_FLOAT;
+	part.elbyte = cs.job.width;
+	part.size = ra_data_size(&h) / 2;
+	cs.batch = STATS_BATCH / h.elbyte;
+	cs.batch -= cs.batch % STATS_CHUNK;
+	for (int p = 0; p < 2 && ret == 0; ++p) {
+		const char *path = p ? dstb : dsta;
+		if (path == NULL)
+			continue;
+		if ((ret = distinct_output(src, path)) < 0
+				|| (p && dsta != NULL && (ret = distinct_output(dsta, path)) < 0))
+			break;
+		if ((cs.out[p] = safe_malloc(cs.batch*part.elbyte)) == NULL)
+			ret = -RA_ENOMEM;
+		else if ((cs.fd[p] = output_open(path, &part)) < 0)
+			ret = cs.fd[p];
+	}
+	if (ret == 0)
+		ret = scan_file(src, split_scan, &cs);
+
+done:
+	ret = output_close(cs.fd[0], dsta, cs.crc[0], ret);
+	ret = output_close(cs.fd[1], dstb, cs.crc[1], ret);
+	free(cs.out[0]);
+	free(cs.out[1]);
+	ra_free(&h);
+	return ret;
+}
+
+int
+ra_complex_interleave_file(const char *srca, const char *srcb, const char *dst, const int flags)
+{  /* stream srca, with srcb mapped alongside, into an uncompressed dst */
+	ra_t h, b, z;
+	cplx_stream cs = { .fd = { -1, -1 } };
+	int ret;
+	int fd = ra_read_header(&h, srca);
+	if (fd < 0)
+		return fd;
+	close(fd);
+	memset(&b, 0, sizeof b);
+	if ((ret = ra_mmap(&b, srcb, RA_MMAP_SEQUENTIAL)) < 0)
+		goto done;
+	if (is_compressed(&b)) {  // only this part is read whole
+		ra_free(&b);
+		if ((ret = ra_read(&b, srcb)) < 0 || ra_decompress(&b) == NULL) {
+			ret = ret < 0 ? ret : -RA_ECOMPRESS;
+			goto done;
+		}
+	}
+	h.size = ra_data_size(&h);
+	if ((ret = check_parts(&h, &b)) < 0 || (ret = cplx_init(&cs.job, h.elbyte, flags)) < 0)
+		goto done;
+	z = h;
+	z.flags = (h.flags & RA_FLAG_ALIGNED) | HOST_ORDER;
+	z.eltype = RA_TYPE_COMPLEX;
+	z.elbyte = 2*h.elbyte;
+	z.size = 2*h.size;
+	cs.other = &b;
+	cs.batch = STATS_BATCH / z.elbyte;
+	cs.batch -= cs.batch % STATS_CHUNK;
+	if ((ret = distinct_output(srca, dst)) < 0 || (ret = distinct_output(srcb, dst)) < 0)
+		goto done;
+	if ((cs.out[0] = safe_malloc(cs.batch*z.elbyte)) == NULL)
+		ret = -RA_ENOMEM;
+	else if ((cs.fd[0] = output_open(dst, &z)) < 0)
+		ret = cs.fd[0];
+	else
+		ret = scan_file(srca, join_scan, &cs);
+
+done:
+	ret = output_close(cs.fd[0], dst, cs.crc[0], ret);
+	free(cs.out[0]);
+	ra_free(&b);
+	ra_free(&h);
+	return ret;
 }
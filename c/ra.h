@@ -47,16 +47,35 @@ typedef struct {
                                    Use chars to handle generic data, since reader can use 'type'
                                    enum to recreate correct pointer cast */
 	uint8_t *top;               /* pointer to top of the memory area holding the file in RAM */
+	size_t mapsize;             /* length of the mapping if top was mmap-ed by ra_mmap, else 0 */
+	size_t topoff;              /* bytes of the allocation or mapping before top */
+	uint64_t align;             /* data alignment in the file with RA_FLAG_ALIGNED, else 0 */
 } ra_t;
 
+/* the header of a file on its own, see ra_header */
+typedef struct {
+    uint64_t magic;
+    uint64_t flags;
+    uint64_t eltype;
+    uint64_t elbyte;
+    uint64_t size;
+    uint64_t ndims;
+    uint64_t align;             /* data alignment with RA_FLAG_ALIGNED, else 0 */
+    uint64_t dims[];            /* ndims entries */
+} ra_header_t;
+
 
 static const uint64_t RA_MAGIC_NUMBER = 0x7961727261776172ULL;
 
 /* flags */
-#define NFLAGS              2
+#define NFLAGS              6
 #define RA_DEFAULT          0
 #define RA_FLAG_BIG_ENDIAN  (1ULL<<0)
 #define RA_FLAG_COMPRESSED  (1ULL<<1)
+#define RA_FLAG_CHUNKED     (1ULL<<2)  /* compressed in independent blocks, see below */
+#define RA_FLAG_SHUFFLE     (1ULL<<3)  /* bytes grouped by significance before compression */
+#define RA_FLAG_BITSHUFFLE  (1ULL<<4)  /* bits grouped by significance before compression */
+#define RA_FLAG_ALIGNED     (1ULL<<5)  /* header padded so data starts on an aligned offset */
 #define RA_UNKNOWN_FLAGS    (-(1LL<<NFLAGS))
 
 /* maximum size that read system call can handle */
@@ -64,6 +83,118 @@ static const uint64_t RA_MAGIC_NUMBER = 0x7961727261776172ULL;
 // max read chunk on Linux
 #define RA_MAX_BYTES  0x7ffff000ULL
 
+/*
+   Chunked compression layout
+
+   With RA_FLAG_COMPRESSED | RA_FLAG_CHUNKED the data segment holds the
+   uncompressed data cut into blocks of 'blocksize' bytes (the last may be
+   short), each LZ4-compressed independently, followed by an index:
+
+     block 0 | block 1 | ... | block n-1 | offsets[n+1] | blocksize | n
+
+   offsets[] are UInt64 byte offsets of each block from the start of the
+   data segment, with offsets[n] marking the end of the last block. A block
+   whose stored length equals its uncompressed length is stored raw.
+
+   RA_FLAG_SHUFFLE stores byte j of every element of a block together
+   before compressing, which exposes the slowly varying sign and exponent
+   bytes of floats to LZ4. RA_FLAG_BITSHUFFLE goes on to group bit k of
+   every byte in each of those planes. Complex elements are shuffled as
+   pairs of floats.
+*/
+#define RA_BLOCK_SIZE  (1ULL<<20)  /* default uncompressed bytes per block */
+
+/*
+   Checksum record
+
+   A file may carry a CRC32C of its data segment, as stored (that is,
+   compressed if the array is), in the first 16 bytes of the volatile
+   metadata region:
+
+     data | RA_CHECKSUM_TAG | crc
+
+   both as UInt64. ra_write adds the record after ra_set_checksum(1), and
+   ra_read verifies it whenever it is present, hashing each piece of the
+   file as it is read. ra_mmap, ra_read_into and ra_read_slab do not
+   verify.
+*/
+#define RA_CHECKSUM_TAG   0x6332336372636172ULL  /* "racrc32c" */
+#define RA_CHECKSUM_SIZE  16
+
+/*
+   Aligned data
+
+   With RA_FLAG_ALIGNED the dims are followed by the alignment as a UInt64
+   and then zeros, up to the first multiple of the alignment:
+
+     header | dims | align | 0 ... | data
+
+   The alignment is a power of two from 8 to RA_MAX_ALIGN. The data of a
+   mapped file then starts on that boundary, and reads of it can bypass the
+   page cache. Independently of the file layout, ra_read, ra_create and
+   ra_read_slab place the data on an RA_MEM_ALIGN boundary in memory.
+*/
+#define RA_DEFAULT_ALIGN  4096  /* used by ra_create with RA_FLAG_ALIGNED */
+#define RA_MAX_ALIGN      (1ULL<<21)
+#define RA_MEM_ALIGN      64
+
+/*
+   Packs
+
+   A pack holds many small RA files in one. It is itself an RA file of
+   user type, elbyte 1 and one dimension, whose data segment is the member
+   files back to back. Each starts on a multiple of 8 bytes, or of its
+   alignment if it has RA_FLAG_ALIGNED, and the gaps are zeros. An index
+   follows the data:
+
+     header | member 0 | ... | member n-1 | entries[n] | buckets[m] | names | trailer
+
+   Each entry holds the member's byte offset from the start of the pack, its
+   length and the offset of its NUL-terminated name in the name table, all
+   UInt64. buckets[] is an open-addressing hash table of m (a power of two)
+   slots mapping the FNV-1a hash of a name to its entry index plus one, with
+   zero marking an empty slot. The name table is padded with zeros to a
+   multiple of 8 bytes. The trailer is n | m | offset of entries[] |
+   RA_PACK_TAG.
+*/
+#define RA_PACK_TAG           0x31306b6361706172ULL  /* "rapack01" */
+#define RA_PACK_TRAILER_SIZE  32
+
+/*
+   Indexes
+
+   An index lists the headers of every .ra file below a directory so that
+   they can be searched without opening the files. It is itself an RA file
+   of UInt64 with dims (RA_INDEX_WORDS, n), one ra_index_entry_t per file in
+   order of path, followed by a name table and a trailer:
+
+     header | entries[n] | names | trailer
+
+   The names are the NUL-terminated paths of the files relative to the
+   directory, padded with zeros to a multiple of 8 bytes. The trailer is
+   the length of the name table | RA_INDEX_TAG. Only the first
+   RA_INDEX_MAXDIMS dims of a file are recorded.
+*/
+#define RA_INDEX_TAG           0x313078646e696172ULL  /* "raindx01" */
+#define RA_INDEX_TRAILER_SIZE  16
+#define RA_INDEX_MAXDIMS       8
+#define RA_INDEX_WORDS         (8 + RA_INDEX_MAXDIMS)
+#define RA_INDEX_NAME          ".raindex"  /* kept in the indexed directory */
+#define RA_ANY                 UINT64_MAX  /* wildcard of an ra_filter_t */
+
+/* ra_mmap hints */
+#define RA_MMAP_DEFAULT     0
+#define RA_MMAP_POPULATE    (1<<0)  /* prefault the whole file into the mapping */
+#define RA_MMAP_SEQUENTIAL  (1<<1)  /* expect sequential access (aggressive readahead) */
+#define RA_MMAP_RANDOM      (1<<2)  /* expect random access (no readahead) */
+#define RA_MMAP_WILLNEED    (1<<3)  /* start asynchronous readahead of the whole file */
+
+/* ra_convert flags */
+#define RA_CONVERT_WRAP     (1<<0)  /* integers keep their low bits, as a C cast does */
+
+/* ra_complex_split flags */
+#define RA_COMPLEX_POLAR    (1<<0)  /* parts are magnitude and phase, not re and im */
+
 
 /* elemental types */
 typedef enum {
@@ -74,32 +205,166 @@ typedef enum {
     RA_TYPE_INT,
     RA_TYPE_UINT,
     RA_TYPE_FLOAT,
-    RA_TYPE_COMPLEX
+    RA_TYPE_COMPLEX,
+    RA_TYPE_BFLOAT    /* bfloat16, the upper half of an IEEE single;
+                          elbyte 2. RA_TYPE_FLOAT of 2 bytes is IEEE half */
 } ra_type;
 
 
-enum { RA_DIFF_EQ, RA_DIFF_L1, RA_DIFF_L2 };
+/* a file in an index, see above */
+typedef struct {
+    uint64_t mtime;             /* of the file when indexed, in ns since the epoch */
+    uint64_t fsize;             /* length of the file in bytes */
+    uint64_t flags;
+    uint64_t eltype;
+    uint64_t elbyte;
+    uint64_t size;
+    uint64_t ndims;
+    uint64_t name;              /* offset of its path in the name table */
+    uint64_t dims[RA_INDEX_MAXDIMS];  /* zero past ndims */
+} ra_index_entry_t;
+
+/* what ra_index_match selects; fields set to RA_ANY match anything */
+typedef struct {
+    uint64_t eltype;
+    uint64_t elbyte;
+    uint64_t ndims;
+    uint64_t dims[RA_INDEX_MAXDIMS];
+    uint64_t minsize, maxsize;  /* bounds on size, inclusive */
+} ra_filter_t;
+
+enum { RA_DIFF_EQ, RA_DIFF_L1, RA_DIFF_L2, RA_DIFF_LINF };
+
+/* elementwise comparison of two arrays, see ra_diff_stats */
+typedef struct {
+    uint64_t n;                 /* elements compared; a complex pair counts once */
+    uint64_t ndiffer;           /* elements that are not equal (NaN matches NaN) */
+    uint64_t first;             /* index of the first differing element, or n */
+    uint64_t nexceed;           /* elements with |a - b| > atol + rtol*|b| */
+    uint64_t maxulp;            /* largest distance in units in the last place;
+                                   for integers this is |a - b| */
+    double l1, l2, linf;        /* norms of a - b, using complex magnitudes */
+    double maxrel;              /* largest |a - b| / |b| over nonzero b */
+} ra_diffstat_t;
+
+/* summary of the values of an array, see ra_stats */
+typedef struct {
+    uint64_t n;                 /* elements */
+    uint64_t nnan, ninf;        /* elements that are NaN or infinite */
+    double min, max;            /* over the finite elements, NaN if there are none */
+    double mean, std;           /* likewise; std is the population standard deviation */
+} ra_stats_t;
+
+/* histogram of the finite values of an array, see ra_histogram */
+typedef struct {
+    uint64_t n, nnan, ninf;     /* finite, NaN and infinite elements */
+    double min, max;            /* of the finite elements, NaN if there are none */
+    uint64_t **bins;            /* private: counts by the leading bits of each value */
+} ra_hist_t;
+
+/*
+   Error handling
+
+   Library calls do not exit. Functions returning int return 0 (or a
+   count) on success and a negated error code on failure; functions
+   returning pointers return NULL, and the uint64_t header accessors
+   return RA_BAD_FIELD. The code and a description of the last failure
+   are kept per thread, see ra_errno and ra_strerror. Command line tools
+   can restore the old print-and-exit behaviour with ra_set_exit_on_error.
+*/
+typedef enum {
+    RA_OK = 0,
+    RA_EIO,         /* short or failed read or write */
+    RA_ENOMEM,      /* allocation or mapping failed */
+    RA_EOPEN,       /* file could not be opened or created */
+    RA_EFORMAT,     /* not an RA file, or header or block index is corrupt */
+    RA_ECOMPRESS,   /* LZ4 rejected the data */
+    RA_EINVAL,      /* bad argument, such as a type code or mismatched shape */
+    RA_ECHECKSUM    /* data does not match its stored checksum */
+} ra_error;
+
+#define RA_BAD_FIELD  UINT64_MAX
+
+static const char RA_TYPE_CODES[] = { "siufcb" };
 
-static const char RA_TYPE_CODES[] = { "siufc" };
+/* streaming writer, see ra_writer_open */
+typedef struct ra_writer ra_writer_t;
+typedef struct ra_pack ra_pack_t;
+typedef struct ra_index ra_index_t;
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 
+// Errors
+int ra_errno(void);
+const char *ra_strerror(void);
+void ra_set_exit_on_error(const int on);
+
 // Basic functions
 ra_t * ra_create(const char *type, const uint64_t ndims, const uint64_t dims[], const uint64_t flags);
 int ra_read(ra_t * a, const char *path);
+int ra_mmap(ra_t * a, const char *path, const int hints);
+/* out[] must be zero-filled or hold arrays from earlier reads, whose memory is
+   reused; entries that fail to read are zeroed */
+int ra_read_many(const char * const paths[], const size_t n, ra_t out[]);
+void ra_munmap(ra_t * a);
+int64_t ra_read_into(const char *path, void *dst, const size_t cap);
+int ra_read_slab(const char *path, const uint64_t start[], const uint64_t count[],
+		const uint64_t stride[], ra_t *out);
 int ra_write(ra_t *a, const char *path);
 int ra_copy(ra_t* dst, ra_t* src);
+/* Write an array whose last dimension grows as slices arrive. The header is
+   updated after each buffered write to cover the whole slices on disk, so
+   readers can follow the file while it grows. */
+ra_writer_t * ra_writer_open(const char *path, const char *type, const uint64_t ndims,
+		const uint64_t dims[], const uint64_t flags);
+int ra_writer_append(ra_writer_t *w, const void *data, const uint64_t n);
+int ra_writer_sync(ra_writer_t *w);
+int ra_writer_close(ra_writer_t *w);
+
+// Packs of many small arrays
+int ra_pack_files(const char *path, const char * const members[], const size_t n);
+ra_pack_t * ra_pack_open(const char *path);
+void ra_pack_close(ra_pack_t *p);
+uint64_t ra_pack_count(const ra_pack_t *p);
+const char * ra_pack_name(const ra_pack_t *p, const uint64_t i);
+int64_t ra_pack_find(const ra_pack_t *p, const char *name);
+int ra_pack_mmap(const ra_pack_t *p, const uint64_t i, ra_t *a);
+int ra_pack_read(const ra_pack_t *p, const uint64_t i, ra_t *a);
+int ra_pack_extract(const ra_pack_t *p, const uint64_t i, const char *path);
+
+// Indexes of the headers below a directory
+/* Write the index of dir to path, or to dir/RA_INDEX_NAME if path is NULL.
+   Entries of an existing index whose file has the same mtime and size are
+   kept; the other headers are read in parallel. Returns how many were read. */
+int ra_index_build(const char *dir, const char *path);
+ra_index_t * ra_index_open(const char *path);
+void ra_index_close(ra_index_t *x);
+uint64_t ra_index_count(const ra_index_t *x);
+const ra_index_entry_t * ra_index_entry(const ra_index_t *x, const uint64_t i);
+const char * ra_index_name(const ra_index_t *x, const uint64_t i);
+void ra_filter_init(ra_filter_t *f);
+int ra_index_match(const ra_index_entry_t *e, const ra_filter_t *f);
 void ra_free(ra_t * a);
 void print_magic(const ra_t *r);
 ra_t * ra_decompress(ra_t *r);
 ra_t * ra_compress(ra_t *r);
+ra_t * ra_compress_chunked(ra_t *r, const uint64_t blocksize, const uint64_t filter);
+void ra_set_num_threads(const int n);
+int ra_num_threads(void);
 
 int ra_read_header(ra_t *a, const char *path);
+/* Read a header with a single pread, or take it from an LRU cache keyed on
+   the file's device, inode, mtime and size, which holds 1024 headers unless
+   resized with ra_set_header_cache. Free the result with free. */
+ra_header_t * ra_header(const char *path);
+int ra_header_many(const char * const paths[], const size_t n, ra_header_t *out[]);
+void ra_set_header_cache(const size_t n);
 void ra_peek(const ra_t *a);
-void ra_print_header(const char *path);
+int ra_parse_type(const char *typestr, uint64_t *eltype, uint64_t *elbyte);
+int ra_print_header(const char *path);
 uint64_t ra_flags(const char *path);
 uint64_t ra_eltype(const char *path);
 uint64_t ra_elbyte(const char *path);
@@ -108,7 +373,63 @@ uint64_t ra_ndims(const char *path);
 uint64_t *ra_dims(const char *path);
 void ra_print_dims(const char *path);
 int ra_reshape(ra_t * r, const uint64_t newdims[], const uint64_t ndimsnew);
+int ra_reshape_file(const char *path, const uint64_t newdims[], const uint64_t ndimsnew);
+/* Permute dims out of place: dim k of the result is dim perm[k] of the
+   input, counting from 0. The file version maps both files, so neither
+   has to fit in memory. */
+int ra_permute(ra_t *r, const uint64_t perm[]);
+int ra_permute_file(const char *src, const char *dst, const uint64_t perm[]);
+/* 0 removes the padding */
+int ra_align(ra_t *r, const uint64_t align);
+int ra_align_file(const char *path, const uint64_t align);
+/* Rewrite a file in place so its data is stored in the given byte order,
+   0 for little-endian or RA_FLAG_BIG_ENDIAN. Reads swap to host order. */
+int ra_endian_file(const char *path, const uint64_t order);
 int ra_diff(const ra_t * a, const ra_t * b, const int diff_type);
+uint32_t ra_crc32c(uint32_t crc, const void *data, const size_t len);
+/* returns 1 if the file's checksum record matches, 0 if it has none */
+int ra_checksum(const char *path, uint32_t *crc);
+int ra_checksum_store(const char *path);
+void ra_set_checksum(const int on);
+/* stream ra_read and ra_write through O_DIRECT where the filesystem allows it */
+void ra_set_direct_io(const int on);
+int ra_diff_stats(const ra_t *a, const ra_t *b, const double atol, const double rtol,
+		ra_diffstat_t *stats);
+/* Min, max, mean, std and NaN and Inf counts in one pass. Complex elements
+   contribute their magnitude. The file version maps uncompressed files
+   and streams compressed ones, so the data is never copied whole. */
+int ra_stats(const ra_t *r, ra_stats_t *st);
+int ra_stats_file(const char *path, ra_stats_t *st);
+/* A histogram in one pass, with no range given: values are binned by their
+   leading bits, 256 bins to each power of two, so quantiles and windows
+   come out within 0.4% of the value. Complex elements contribute their
+   magnitude. Free the bins with ra_hist_free. */
+int ra_histogram(const ra_t *r, ra_hist_t *h);
+int ra_histogram_file(const char *path, ra_hist_t *h);
+double ra_hist_quantile(const ra_hist_t *h, const double p);
+/* counts in nbins equal bins spanning [lo, hi] */
+void ra_hist_bins(const ra_hist_t *h, const double lo, const double hi, const uint64_t nbins,
+		uint64_t counts[]);
+void ra_hist_free(ra_hist_t *h);
+/* Convert to another element type, as x*scale + offset. Integers round to
+   nearest and saturate unless flags has RA_CONVERT_WRAP; complex arrays
+   become real by dropping the imaginary part. The file version streams,
+   so it runs in constant memory, and always writes uncompressed data. */
+int ra_convert(ra_t *r, const char *type);
+int ra_convert_scaled(ra_t *r, const char *type, const double scale, const double offset,
+		const int flags);
+int ra_convert_file(const char *src, const char *dst, const char *type, const double scale,
+		const double offset, const int flags);
+/* Split c8 or c16 arrays into two float arrays of the same shape, the
+   real and imaginary parts or with RA_COMPLEX_POLAR the magnitude and
+   phase; b may be NULL to keep only the first. Interleave is the inverse.
+   The file versions stream, mapping the second part when interleaving,
+   or reading it whole if it is compressed. */
+int ra_complex_split(const ra_t *z, ra_t *a, ra_t *b, const int flags);
+int ra_complex_interleave(const ra_t *a, const ra_t *b, ra_t *z, const int flags);
+int ra_complex_split_file(const char *src, const char *dsta, const char *dstb, const int flags);
+int ra_complex_interleave_file(const char *srca, const char *srcb, const char *dst,
+		const int flags);
 
 
 #ifdef __cplusplus
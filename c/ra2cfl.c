@@ -87,6 +87,7 @@ int
 main(int argc, char *argv[])
 {
     ra_t a;
+    ra_set_exit_on_error(1);
     if (argc < 3)
     {
         printf("Convert an ra file to a cfl format.\n");
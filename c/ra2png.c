@@ -1,9 +1,11 @@
 #include <assert.h>
 #include <getopt.h>
+#include <math.h>
 #include <png.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <strings.h>
 
 #include "ra.h"
@@ -126,24 +128,54 @@ save_png_to_file (bitmap_t *bitmap, const char *path)
     return status;
 }
 
-/* Given "value" and "max", the maximum value which we expect "value"
-   to take, this returns an integer between 0 and 255 proportional to
-   "value" divided by "max". */
+/* Given "value" and the display window ["lo", "hi"], this returns an
+   integer between 0 and 255 proportional to where "value" falls in the
+   window, clamping values outside it. */
 
 static int 
-as_pix(float value, float max)
+as_pix(double value, double lo, double hi)
 {
-    if (value < 0)
+    if (!(value > lo))
         return 0;
-    return (int) (256.0 *(value/max));
+    if (value >= hi)
+        return 255;
+    return (int) (256.0 * (value - lo) / (hi - lo));
+}
+
+/* Element "i" of "r" as a double; complex elements give their magnitude. */
+
+static double
+value_at(const ra_t *r, uint64_t i)
+{
+    const uint8_t *p = r->data + i*r->elbyte;
+    union { int8_t i8; int16_t i16; int32_t i32; int64_t i64; uint8_t u8; uint16_t u16;
+        uint32_t u32; uint64_t u64; float f32[2]; double f64[2]; } v;
+    memcpy(&v, p, r->elbyte <= sizeof v ? r->elbyte : sizeof v);
+    switch (r->eltype * 16 + r->elbyte) {
+    case RA_TYPE_INT*16 + 1:  return v.i8;
+    case RA_TYPE_INT*16 + 2:  return v.i16;
+    case RA_TYPE_INT*16 + 4:  return v.i32;
+    case RA_TYPE_INT*16 + 8:  return v.i64;
+    case RA_TYPE_UINT*16 + 2: return v.u16;
+    case RA_TYPE_UINT*16 + 4: return v.u32;
+    case RA_TYPE_UINT*16 + 8: return v.u64;
+    case RA_TYPE_FLOAT*16 + 4: return v.f32[0];
+    case RA_TYPE_FLOAT*16 + 8: return v.f64[0];
+    case RA_TYPE_COMPLEX*16 + 8: return hypot(v.f32[0], v.f32[1]);
+    case RA_TYPE_COMPLEX*16 + 16: return hypot(v.f64[0], v.f64[1]);
+    default: return v.u8;
+    }
 }
 
 void
 print_usage()
 {
-    fprintf(stderr, "Usage: ra2png [-g] [-h] <file.ra>\n");
+    fprintf(stderr, "Usage: ra2png [-g] [-p lo:hi] [-w lo:hi] [-h] <file.ra>\n");
     fprintf(stderr, "\t-g\t\t grayscale (default is RGB)\n");
+    fprintf(stderr, "\t-p\t\t display window from percentiles (default 1:99)\n");
+    fprintf(stderr, "\t-w\t\t display window from values, overriding -p at the ends given\n");
     fprintf(stderr, "\t-h\t\t help\n");
+    fprintf(stderr, "Arrays of more than two dimensions are written one png per 2-D slice.\n");
 }
 
 
@@ -154,19 +186,34 @@ main (int argc, char *argv[])
     int x, y, c;
     int status = 0;
 	int grayscale = 0;
-	char rafilename[256], pngfilename[256];
+	double plo = 1, phi = 99, lo = NAN, hi = NAN;
+	char *colon;
+	char base[256], pngfilename[300];
+	ra_set_exit_on_error(1);
 
 	if (argc < 2) {
 		print_usage();
 		return 1;
 	}
 
-    while ((c = getopt(argc, argv, "gh")) != -1)
+    while ((c = getopt(argc, argv, "gp:w:h")) != -1)
     {
         switch (c) {
         case 'g':
             grayscale = 1;
             break;
+        case 'p':
+            plo = strtod(optarg, &colon);
+            phi = *colon == ':' ? strtod(colon + 1, NULL) : 100 - plo;
+            break;
+        case 'w':
+            lo = strtod(optarg, &colon);
+            if (colon == optarg)  /* an end left out, as in ":hi" or "lo:", comes from -p */
+                lo = NAN;
+            hi = NAN;
+            if (*colon == ':' && colon[1] != '\0')
+                hi = strtod(colon + 1, NULL);
+            break;
         case 'h':
         default:
             print_usage();
@@ -175,17 +222,32 @@ main (int argc, char *argv[])
     }
     argc -= optind;
     argv += optind;
+	if (argc < 1) {
+		print_usage();
+		return 1;
+	}
 
+	/* one read: the window comes from a histogram of the data in memory */
 	ra_t r;
 	ra_read(&r, *argv);
+	ra_decompress(&r);
 	assert(r.ndims >= 2); 
+	if (r.elbyte == 2 && (r.eltype == RA_TYPE_FLOAT || r.eltype == RA_TYPE_BFLOAT))
+		ra_convert(&r, "f4");  /* widen halves once, on all threads */
+	if (isnan(lo) || isnan(hi)) {
+		ra_hist_t h;
+		ra_histogram(&r, &h);
+		if (isnan(lo))  /* only the ends -w left out */
+			lo = ra_hist_quantile(&h, plo / 100);
+		if (isnan(hi))
+			hi = ra_hist_quantile(&h, phi / 100);
+		ra_hist_free(&h);
+	}
 
-	char *ext_ptr = rindex(*argv, '.');
-	*ext_ptr = '\0';
-	snprintf(rafilename, sizeof rafilename, "%s.ra", *argv);
-	snprintf(pngfilename, sizeof pngfilename, "%s.png", *argv);
-
-	printf("%s -> %s\n", rafilename, pngfilename);
+	snprintf(base, sizeof base, "%s", *argv);
+	char *ext_ptr = rindex(base, '.');
+	if (ext_ptr != NULL && strcmp(ext_ptr, ".ra") == 0)
+		*ext_ptr = '\0';
 
     /* Create an image. */
     image.width = (int)r.dims[0];
@@ -194,25 +256,34 @@ main (int argc, char *argv[])
     if (!image.pixels)
 		return -1;
 
-    for (y = 0; y < image.height; y++)
-        for (x = 0; x < image.width; x++) 
-		{
-            pixel_t *pixel = pixel_at(&image, x, y);
-			//y*width + x
-			int pix = as_pix(*((float*)r.data+x + y*image.width), 1.0f);
-			printf("pix=%d\n", pix);
-			pixel->red = pix;
-			pixel->green = pix;
-			pixel->blue = pix;
-        }
+	uint64_t npix = image.width * image.height;
+	uint64_t nslices = npix ? r.size / r.elbyte / npix : 0;
+	for (uint64_t s = 0; s < nslices; ++s) {
+		if (nslices == 1)
+			snprintf(pngfilename, sizeof pngfilename, "%s.png", base);
+		else
+			snprintf(pngfilename, sizeof pngfilename, "%s_%04lu.png", base, s);
+		printf("%s -> %s  window [%g, %g]\n", *argv, pngfilename, lo, hi);
 
-    /* Write the image to a file 'image.png'. */
-    if (save_png_to_file(&image, pngfilename)) {
-		fprintf(stderr, "Error writing file.\n");
-		status = -1;
-    }
+		for (y = 0; y < image.height; y++)
+			for (x = 0; x < image.width; x++) 
+			{
+				pixel_t *pixel = pixel_at(&image, x, y);
+				int pix = as_pix(value_at(&r, s*npix + x + y*image.width), lo, hi);
+				pixel->red = pix;
+				pixel->green = pix;
+				pixel->blue = pix;
+			}
+
+		/* Write the image to a file. */
+		if (save_png_to_file(&image, pngfilename)) {
+			fprintf(stderr, "Error writing file.\n");
+			status = -1;
+		}
+	}
 
     free(image.pixels);
+	ra_free(&r);
 
     return status;
 }
@@ -1,6 +1,8 @@
 #!/bin/sh
 
 ./timing 10
+./timing -m 10
+./timing -j $(nproc) 10
 ./h5time 10
 
 ./pngtime ../data/mnist_eight
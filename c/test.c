@@ -1,6 +1,12 @@
 
 #include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include "ra.h"
 
 
@@ -59,11 +65,1292 @@ test_compress()
     return 0;
 }
 
+int
+test_mmap()
+{
+    const char *testfile1 = "../data/cifar_airplane.ra";
+
+    ra_t r, rmap;
+    ra_read(&r, testfile1);
+    ra_mmap(&rmap, testfile1, RA_MMAP_POPULATE);
+	assert(rmap.mapsize > 0);
+	assert(ra_diff(&r, &rmap, 0) == 0);
+	ra_free(&rmap);
+	assert(rmap.top == NULL);
+    printf("Mmap TEST PASSED\n");
+	ra_free(&r);
+
+    return 0;
+}
+
+int
+test_slab()
+{
+    const char *testfile1 = "../data/cifar_airplane.ra";
+	const uint64_t start[][3] = { {0, 0, 1}, {3, 5, 0}, {1, 0, 0} };
+	const uint64_t count[][3] = { {32, 32, 1}, {10, 4, 3}, {8, 32, 2} };
+	const uint64_t stride[][3] = { {1, 1, 1}, {1, 2, 1}, {3, 1, 2} };
+
+    ra_t r, s;
+    ra_read(&r, testfile1);
+	for (int t = 0; t < 3; ++t) {
+		ra_read_slab(testfile1, start[t], count[t], stride[t], &s);
+		for (uint64_t k = 0; k < 3; ++k)
+			assert(s.dims[k] == count[t][k]);
+		size_t n = 0;
+		for (uint64_t z = 0; z < count[t][2]; ++z)
+			for (uint64_t y = 0; y < count[t][1]; ++y)
+				for (uint64_t x = 0; x < count[t][0]; ++x, ++n) {
+					uint64_t i = start[t][0] + x*stride[t][0]
+						+ r.dims[0]*(start[t][1] + y*stride[t][1]
+						+ r.dims[1]*(start[t][2] + z*stride[t][2]));
+					assert(s.data[n] == r.data[i]);
+				}
+		assert(n == s.size);
+		ra_free(&s);
+	}
+    printf("Slab TEST PASSED\n");
+	ra_free(&r);
+
+    return 0;
+}
+
+int
+test_chunked()
+{
+    const char *testfile1 = "../data/cifar_airplane.ra";
+    const char *testfile2 = "test.ra";
+	const uint64_t start[] = {5, 7, 1}, count[] = {20, 9, 2}, stride[] = {1, 3, 1};
+
+    ra_t r, rorig, s, sorig;
+    ra_read(&r, testfile1);
+    ra_read(&rorig, testfile1);
+	ra_set_num_threads(3);
+	ra_compress_chunked(&r, 500, 0);
+	assert(r.flags & RA_FLAG_CHUNKED);
+	ra_write(&r, testfile2);
+	ra_free(&r);
+
+	ra_read_slab(testfile2, start, count, stride, &s);
+	ra_read_slab(testfile1, start, count, stride, &sorig);
+	assert(ra_diff(&s, &sorig, 0) == 0);
+
+	ra_read(&r, testfile2);
+	ra_decompress(&r);
+	assert(ra_diff(&r, &rorig, 0) == 0);
+	ra_set_num_threads(1);
+    printf("Chunked TEST PASSED\n");
+	ra_free(&r);
+	ra_free(&rorig);
+	ra_free(&s);
+	ra_free(&sorig);
+
+    return 0;
+}
+
+int
+test_shuffle()
+{
+    const char *testfile2 = "test.ra";
+	const uint64_t filters[] = { RA_FLAG_SHUFFLE, RA_FLAG_BITSHUFFLE };
+	const uint64_t blocksizes[] = { 1000, RA_BLOCK_SIZE };
+	uint64_t dims[] = { 1001, 3 };
+	const uint64_t start[] = {10, 1}, count[] = {900, 2};
+
+	ra_t *orig = ra_create("c8", 2, dims, RA_DEFAULT);
+	for (uint64_t i = 0; i < 2*dims[0]*dims[1]; ++i)
+		((float*)orig->data)[i] = sinf(i*0.01f) * 100.f;
+	ra_write(orig, "test2.ra");
+	for (int f = 0; f < 2; ++f)
+		for (int b = 0; b < 2; ++b) {
+			ra_t r, s, sorig;
+			ra_read(&r, "test2.ra");
+			ra_compress_chunked(&r, blocksizes[b], filters[f]);
+			assert(r.flags & filters[f]);
+			ra_write(&r, testfile2);
+			ra_decompress(&r);
+			assert(ra_diff(&r, orig, 0) == 0);
+			float *buf = malloc(orig->size);
+			assert(ra_read_into(testfile2, buf, orig->size) == orig->size);
+			assert(memcmp(buf, orig->data, orig->size) == 0);
+			free(buf);
+			ra_read_slab(testfile2, start, count, NULL, &s);
+			ra_read_slab("test2.ra", start, count, NULL, &sorig);
+			assert(ra_diff(&s, &sorig, 0) == 0);
+			ra_free(&r);
+			ra_free(&s);
+			ra_free(&sorig);
+		}
+    printf("Shuffle TEST PASSED\n");
+	ra_free(orig);
+	free(orig);
+
+    return 0;
+}
+
+int
+test_read_into()
+{
+	const char *testfiles[] = { "../data/cifar_airplane.ra", "../data/cifar_airplane_z.ra" };
+	uint8_t buf[4096];
+
+	ra_t r;
+	ra_read(&r, testfiles[0]);
+	for (int i = 0; i < 2; ++i) {
+		assert(ra_read_into(testfiles[i], buf, sizeof(buf)) == r.size);
+		assert(memcmp(buf, r.data, r.size) == 0);
+	}
+    printf("Read into TEST PASSED\n");
+	ra_free(&r);
+
+	return 0;
+}
+
+int
+test_reshape()
+{
+    const char *testfile1 = "../data/cifar_airplane.ra";
+    const char *testfile2 = "test.ra";
+	const uint64_t dims1[] = {3072}, dims2[] = {64, 16, 3}, dims3[] = {32, 32, 3};
+
+	ra_t r, r2;
+	ra_read(&r, testfile1);
+	ra_write(&r, testfile2);
+	ra_reshape_file(testfile2, dims1, 1);
+	assert(ra_ndims(testfile2) == 1);
+	ra_reshape_file(testfile2, dims2, 3);
+	ra_read(&r2, testfile2);
+	assert(r2.dims[0] == 64 && r2.dims[1] == 16);
+	assert(memcmp(r.data, r2.data, r.size) == 0);
+	ra_reshape(&r2, dims1, 1);
+	ra_reshape(&r2, dims3, 3);
+	assert(ra_diff(&r, &r2, 0) == 0);
+	ra_free(&r2);
+	ra_reshape_file(testfile2, dims3, 3);
+	ra_read(&r2, testfile2);
+	assert(ra_diff(&r, &r2, 0) == 0);
+    printf("Reshape TEST PASSED\n");
+	ra_free(&r);
+	ra_free(&r2);
+
+	return 0;
+}
+
+int
+test_read_many()
+{
+	const char *paths[] = { "../data/cifar_airplane.ra", "../data/cifar_airplane_z.ra",
+		"no/such/file.ra", "../data/cifar_airplane.ra" };
+	ra_t ref, out[4];
+
+	memset(out, 0, sizeof(out));
+	ra_read(&ref, paths[0]);
+	ra_set_num_threads(3);
+	ra_set_exit_on_error(0);
+	for (int pass = 0; pass < 2; ++pass) {  // the second pass reuses the arrays
+		assert(ra_read_many(paths, 4, out) == -RA_EOPEN);
+		assert(out[2].data == NULL);
+		assert(ra_diff(&ref, &out[0], 0) == 0);
+		assert(ra_diff(&ref, &out[3], 0) == 0);
+		assert(out[1].flags & RA_FLAG_COMPRESSED);
+		ra_decompress(&out[1]);
+		assert(memcmp(ref.data, out[1].data, ref.size) == 0);
+	}
+	assert(ra_read_many(paths, 2, out) == 0);
+	ra_set_exit_on_error(1);
+	ra_set_num_threads(1);
+	for (int i = 0; i < 4; ++i)
+		ra_free(&out[i]);
+	ra_free(&ref);
+    printf("Read many TEST PASSED\n");
+
+	return 0;
+}
+
+int
+test_diff()
+{
+	const uint64_t n = 200003;  // several chunks and a ragged tail
+	ra_diffstat_t s;
+	ra_t *a = ra_create("f4", 1, &n, RA_DEFAULT), *b = ra_create("f4", 1, &n, RA_DEFAULT);
+	float *x = (float*)a->data, *y = (float*)b->data;
+	for (uint64_t i = 0; i < n; ++i)
+		x[i] = y[i] = i * 0.5f;
+	ra_set_num_threads(3);
+	assert(ra_diff_stats(a, b, 0, 0, &s) == 0 && s.ndiffer == 0 && s.first == n);
+	y[70001] += 2.f;
+	y[150000] = nextafterf(y[150000], 0.f);
+	y[199999] -= 4.f;
+	assert(ra_diff_stats(a, b, 0, 0, &s) == 0);
+	assert(s.ndiffer == 3 && s.first == 70001 && s.nexceed == 3);
+	assert(s.linf == 4.0 && s.maxulp > 1);
+	assert(fabs(s.l1 - (6.0 + (x[150000] - y[150000]))) < 1e-9);
+	assert(fabs(s.l2 - sqrt(20.0 + pow(x[150000] - y[150000], 2))) < 1e-9);
+	assert(ra_diff_stats(a, b, 0, 1e-6, &s) == 0 && s.nexceed == 2);
+	assert(ra_diff_stats(a, b, 4.0, 0, &s) == 0 && s.nexceed == 0);
+	assert(ra_diff(a, b, RA_DIFF_EQ) != 0);
+	y[70001] = x[70001];
+	y[199999] = x[199999];
+	assert(ra_diff_stats(a, b, 0, 0, &s) == 0 && s.maxulp == 1);
+	ra_free(a); free(a);
+	ra_free(b); free(b);
+
+	const uint64_t dims[] = {2, 3};  // complex elements differ by magnitude
+	a = ra_create("c8", 2, dims, RA_DEFAULT);
+	b = ra_create("c8", 2, dims, RA_DEFAULT);
+	memset(a->data, 0, a->size);
+	memset(b->data, 0, b->size);
+	((float*)b->data)[8] = 3.f;
+	((float*)b->data)[9] = -4.f;
+	assert(ra_diff_stats(a, b, 0, 0, &s) == 0);
+	assert(s.n == 6 && s.ndiffer == 1 && s.first == 4 && s.linf == 5.0 && s.l1 == 5.0);
+	ra_free(a); free(a);
+	ra_free(b); free(b);
+
+	const uint64_t m = 5;
+	a = ra_create("i2", 1, &m, RA_DEFAULT);
+	b = ra_create("i2", 1, &m, RA_DEFAULT);
+	int16_t *p = (int16_t*)a->data, *q = (int16_t*)b->data;
+	for (int i = 0; i < 5; ++i)
+		p[i] = q[i] = -i;
+	q[3] = 30000;
+	p[4] = -30000;
+	assert(ra_diff_stats(a, b, 0, 0, &s) == 0);
+	assert(s.ndiffer == 2 && s.first == 3 && s.maxulp == 30003 && s.linf == 30003.0);
+	ra_free(a); free(a);
+	ra_free(b); free(b);
+
+	const char *ints[] = { "i1", "u1", "i2", "u2", "i4", "u4", "i8", "u8" };
+	for (int t = 0; t < 8; ++t) {  // one differing byte each, in neighbouring elements and the tail
+		a = ra_create(ints[t], 1, &n, RA_DEFAULT);
+		b = ra_create(ints[t], 1, &n, RA_DEFAULT);
+		uint64_t e = a->elbyte;
+		for (uint64_t i = 0; i < a->size; ++i)
+			a->data[i] = b->data[i] = (uint8_t)(i*7);
+		assert(ra_diff_stats(a, b, 0, 0, &s) == 0 && s.ndiffer == 0 && s.first == n);
+		b->data[40000*e] ^= 1;
+		b->data[40001*e + e - 1] ^= 0x10;
+		b->data[(n - 1)*e] ^= 2;
+		assert(ra_diff_stats(a, b, 0, 0, &s) == 0 && s.ndiffer == 3 && s.first == 40000);
+		assert(s.maxulp == 1ULL << (8*e - 4) && s.nexceed == 3);  // bit 4 of the top byte
+		ra_free(a); free(a);
+		ra_free(b); free(b);
+	}
+	ra_set_num_threads(1);
+    printf("Diff TEST PASSED\n");
+
+	return 0;
+}
+
+int
+test_checksum()
+{
+    const char *testfile1 = "../data/cifar_airplane.ra";
+    const char *testfile2 = "test.ra";
+	uint32_t crc, crc2;
+	ra_t r, r2;
+
+	assert(ra_crc32c(0, "123456789", 9) == 0xe3069283);
+	ra_read(&r, testfile1);
+	assert(ra_checksum(testfile1, &crc) == 0);
+	assert(crc == ra_crc32c(0, r.data, r.size));
+	ra_set_checksum(1);
+	ra_write(&r, testfile2);
+	ra_set_checksum(0);
+	assert(ra_checksum(testfile2, &crc2) == 1 && crc2 == crc);
+	ra_read(&r2, testfile2);  // verified on the way in
+	assert(ra_diff(&r, &r2, 0) == 0);
+	ra_free(&r2);
+
+	FILE *f = fopen(testfile2, "r+");  // flip a bit of the data
+	fseek(f, r.data - r.top + 100, SEEK_SET);
+	fputc(r.data[100] ^ 1, f);
+	fclose(f);
+	ra_set_exit_on_error(0);
+	assert(ra_read(&r2, testfile2) == -RA_ECHECKSUM);
+	assert(ra_checksum(testfile2, &crc2) == -RA_ECHECKSUM);
+	ra_set_exit_on_error(1);
+	assert(ra_checksum_store(testfile2) == 0);
+	assert(ra_checksum(testfile2, &crc2) == 1 && crc2 != crc);
+	ra_write(&r, testfile2);
+	assert(ra_checksum_store(testfile2) == 0);
+	assert(ra_checksum(testfile2, &crc2) == 1 && crc2 == crc);
+	ra_free(&r);
+    printf("Checksum TEST PASSED\n");
+
+	return 0;
+}
+
+int
+test_align()
+{
+    const char *testfile1 = "../data/cifar_airplane.ra";
+    const char *testfile2 = "test.ra";
+	const uint64_t dims1[] = {3072}, start[] = {1024}, count[] = {32};
+	ra_t r, r2, *c;
+
+	ra_read(&r, testfile1);  // unpadded file, data still aligned in memory
+	assert((uintptr_t)r.data % RA_MEM_ALIGN == 0);
+	ra_align(&r, 4096);
+	assert(r.data - r.top == 4096 && (uintptr_t)r.data % RA_MEM_ALIGN == 0);
+	ra_write(&r, testfile2);
+	assert(ra_flags(testfile2) & RA_FLAG_ALIGNED);
+	ra_mmap(&r2, testfile2, RA_MMAP_DEFAULT);
+	assert(r2.align == 4096 && (uintptr_t)r2.data % 4096 == 0);
+	assert(memcmp(r.data, r2.data, r.size) == 0);
+	ra_munmap(&r2);
+	ra_reshape_file(testfile2, dims1, 1);  // dims fit in the padding
+	ra_read(&r2, testfile2);
+	assert(r2.ndims == 1 && r2.data - r2.top == 4096);
+	assert(memcmp(r.data, r2.data, r.size) == 0);
+	ra_free(&r2);
+	ra_align_file(testfile2, 0);
+	assert(ra_size(testfile2) == r.size && !(ra_flags(testfile2) & RA_FLAG_ALIGNED));
+	ra_align_file(testfile2, 64);
+	ra_read(&r2, testfile2);
+	assert(r2.data - r2.top == 64 && memcmp(r.data, r2.data, r.size) == 0);
+	ra_free(&r2);
+	ra_read_slab(testfile2, start, count, NULL, &r2);
+	assert(r2.align == 64 && (uintptr_t)r2.data % RA_MEM_ALIGN == 0);
+	assert(memcmp(r2.data, r.data + 1024, 32) == 0);
+	ra_free(&r2);
+	ra_align(&r, 0);
+	ra_write(&r, testfile2);
+	ra_read(&r2, testfile2);
+	assert(ra_diff(&r, &r2, 0) == 0);
+	ra_free(&r2);
+	ra_free(&r);
+
+	c = ra_create("f4", 1, dims1, RA_FLAG_ALIGNED);
+	assert(c->data - c->top == RA_DEFAULT_ALIGN && (uintptr_t)c->data % RA_MEM_ALIGN == 0);
+	ra_free(c);
+	free(c);
+    printf("Align TEST PASSED\n");
+
+	return 0;
+}
+
+int
+test_direct()
+{
+    const char *testfile = "test.ra";
+	const uint64_t dims[] = {1000, 2501};  // several bounce buffers and a ragged tail
+	ra_t *r = ra_create("f4", 2, dims, RA_DEFAULT), r2;
+	for (uint64_t i = 0; i < dims[0]*dims[1]; ++i)
+		((float*)r->data)[i] = i;
+
+	ra_set_direct_io(1);
+	ra_set_checksum(1);
+	ra_write(r, testfile);
+	ra_set_checksum(0);
+	ra_read(&r2, testfile);  // verifies the record
+	assert(ra_diff(r, &r2, 0) == 0);
+	ra_free(&r2);
+	ra_align(r, 4096);
+	ra_write(r, testfile);
+	ra_read(&r2, testfile);
+	assert(memcmp(r->data, r2.data, r->size) == 0);
+	ra_free(&r2);
+	ra_set_direct_io(0);
+	ra_read(&r2, testfile);
+	assert(memcmp(r->data, r2.data, r->size) == 0);
+	ra_free(&r2);
+	ra_free(r);
+	free(r);
+    printf("Direct IO TEST PASSED\n");
+
+	return 0;
+}
+
+int
+test_writer()
+{
+    const char *testfile = "test.ra";
+	const uint64_t dims[] = {3, 100, 0}, n = 3*100*1000;
+	float *v = malloc(n*sizeof(float));
+	ra_t r;
+	uint32_t crc;
+	for (uint64_t i = 0; i < n; ++i)
+		v[i] = i;
+
+	ra_set_checksum(1);
+	ra_writer_t *w = ra_writer_open(testfile, "f4", 3, dims, RA_DEFAULT);
+	ra_set_checksum(0);
+	for (uint64_t k = 0; k < 5; ++k)  // slice by slice, through the buffer
+		ra_writer_append(w, v + 300*k, 1);
+	ra_writer_sync(w);
+	ra_read(&r, testfile);  // a reader following the file
+	assert(r.dims[2] == 5 && r.size == 5*300*sizeof(float));
+	assert(memcmp(r.data, v, r.size) == 0);
+	ra_free(&r);
+	ra_writer_append(w, v + 1500, 995);  // large enough to bypass the buffer
+	ra_writer_close(w);
+	ra_read(&r, testfile);
+	assert(r.ndims == 3 && r.dims[0] == 3 && r.dims[1] == 100 && r.dims[2] == 1000);
+	assert(memcmp(r.data, v, n*sizeof(float)) == 0);
+	assert(ra_checksum(testfile, &crc) == 1);
+	ra_free(&r);
+	w = ra_writer_open(testfile, "f4", 3, dims, RA_FLAG_BIG_ENDIAN | RA_FLAG_CHUNKED | RA_FLAG_SHUFFLE);
+	ra_writer_append(w, v, 2);  // the data is raw and in host order, whatever flags say
+	ra_set_exit_on_error(0);
+	assert(ra_writer_append(w, v, UINT64_MAX / 1200) == -RA_EINVAL);  // bytes past 2^64
+	const uint64_t huge[] = { 1ULL << 40, 1ULL << 30, 0 };
+	assert(ra_writer_open("test2.ra", "f4", 3, huge, RA_DEFAULT) == NULL && ra_errno() == RA_EINVAL);
+	ra_set_exit_on_error(1);
+	ra_writer_close(w);
+	ra_read(&r, testfile);
+	assert(r.dims[2] == 2 && memcmp(r.data, v, r.size) == 0);
+	ra_free(&r);
+	free(v);
+    printf("Writer TEST PASSED\n");
+
+	return 0;
+}
+
+int
+test_pack()
+{
+	const char *members[] = { "../data/cifar_airplane.ra", "../data/cifar_airplane_z.ra", "test.ra" };
+	const char *packfile = "testpack.ra";
+	ra_t r, r2;
+	ra_pack_t *p;
+
+	ra_read(&r, members[0]);
+	ra_align(&r, 64);
+	ra_write(&r, members[2]);
+	ra_pack_files(packfile, members, 3);
+	p = ra_pack_open(packfile);
+	assert(ra_pack_count(p) == 3);
+	assert(ra_pack_find(p, "test.ra") == 2 && ra_pack_find(p, members[1]) == 1);
+	assert(strcmp(ra_pack_name(p, 0), members[0]) == 0);
+	ra_pack_mmap(p, 2, &r2);
+	assert(r2.align == 64 && (uintptr_t)r2.data % 64 == 0);  // the member kept its alignment
+	assert(memcmp(r.data, r2.data, r.size) == 0);
+	ra_munmap(&r2);
+	ra_pack_read(p, 0, &r2);
+	assert(r2.ndims == 3 && memcmp(r.data, r2.data, r.size) == 0);
+	ra_free(&r2);
+	ra_pack_read(p, 1, &r2);
+	assert(r2.flags & RA_FLAG_COMPRESSED);
+	ra_decompress(&r2);
+	assert(memcmp(r.data, r2.data, r.size) == 0);
+	ra_free(&r2);
+	ra_set_exit_on_error(0);
+	assert(ra_pack_find(p, "missing.ra") == -RA_EINVAL);
+	assert(ra_pack_read(p, 3, &r2) == -RA_EINVAL);
+	assert(ra_pack_open(members[0]) == NULL && ra_errno() == RA_EFORMAT);
+	ra_pack_close(p);
+
+	// a full bucket table ends a search, and one no larger than the pack is refused
+	uint64_t trailer[4], full[2] = { 1, 1 };
+	ra_pack_files(packfile, members, 1);
+	FILE *f = fopen(packfile, "r+b");
+	fseek(f, -(long)sizeof trailer, SEEK_END);
+	assert(fread(trailer, sizeof trailer, 1, f) == 1 && trailer[0] == 1 && trailer[1] == 2);
+	fseek(f, trailer[2] + 3*sizeof(uint64_t), SEEK_SET);  // past the one entry
+	fwrite(full, sizeof full, 1, f);
+	fclose(f);
+	p = ra_pack_open(packfile);
+	assert(ra_pack_find(p, "missing.ra") == -RA_EINVAL);
+	ra_pack_close(p);
+	trailer[1] = 1;
+	f = fopen(packfile, "r+b");
+	fseek(f, -(long)sizeof trailer, SEEK_END);
+	fwrite(trailer, sizeof trailer, 1, f);
+	fclose(f);
+	assert(ra_pack_open(packfile) == NULL && ra_errno() == RA_EFORMAT);
+	assert(ra_pack_files("./test.ra", members, 3) == -RA_EINVAL);  // onto a member
+	ra_set_exit_on_error(1);
+	ra_read(&r2, "test.ra");
+	assert(r2.size == r.size && memcmp(r.data, r2.data, r.size) == 0);
+	ra_free(&r2);
+	remove(packfile);
+	ra_free(&r);
+    printf("Pack TEST PASSED\n");
+
+	return 0;
+}
+
+int
+test_header()
+{
+    const char *testfile1 = "../data/cifar_airplane.ra";
+    const char *testfile2 = "test.ra";
+	const char *paths[] = { testfile1, testfile2, "../data/randc64.ra" };
+	const uint64_t dims1[] = {3072};
+	ra_header_t *h, *hs[3];
+	ra_t r;
+
+	ra_read(&r, testfile1);
+	ra_write(&r, testfile2);
+	h = ra_header(testfile2);
+	assert(h->ndims == 3 && h->dims[2] == 3 && h->size == 3072 && h->align == 0);
+	free(h);
+	h = ra_header(testfile2);  // from the cache
+	assert(h->ndims == 3 && ra_ndims(testfile2) == 3);
+	free(h);
+	ra_reshape_file(testfile2, dims1, 1);  // a changed file is read again
+	uint64_t *dims = ra_dims(testfile2);
+	assert(ra_ndims(testfile2) == 1 && dims[0] == 3072);
+	free(dims);
+	ra_align_file(testfile2, 4096);
+	h = ra_header(testfile2);
+	assert(h->align == 4096 && h->dims[0] == 3072);
+	free(h);
+	ra_set_header_cache(0);
+	assert(ra_size(testfile2) == 3072 && ra_elbyte(testfile2) == 1);
+	ra_set_header_cache(1024);
+	ra_header_many(paths, 3, hs);
+	assert(hs[0]->ndims == 3 && hs[1]->ndims == 1 && hs[2]->eltype == RA_TYPE_COMPLEX);
+	for (int i = 0; i < 3; ++i)
+		free(hs[i]);
+
+	// two files in one bucket of the cache (one of 4096, by inode) through a cache of one
+	static int16_t seen[4096];
+	char name[2][32];
+	struct stat st;
+	int k = 0, other = -1;
+	memset(seen, -1, sizeof seen);
+	for (; other < 0; ++k) {
+		const uint64_t len = k + 1;
+		ra_t *a = ra_create("u1", 1, &len, 0);
+		snprintf(name[0], sizeof name[0], "testcache%d.ra", k);
+		ra_write(a, name[0]);
+		ra_free(a);
+		free(a);
+		stat(name[0], &st);
+		other = seen[st.st_ino % 4096];
+		seen[st.st_ino % 4096] = k;
+	}
+	snprintf(name[1], sizeof name[1], "testcache%d.ra", other);
+	ra_set_header_cache(1);
+	for (int i = 0; i < 4; ++i) {
+		h = ra_header(name[i % 2]);
+		assert(h->dims[0] == (i % 2 ? other : k - 1) + 1);
+		free(h);
+	}
+	ra_set_header_cache(1024);
+	while (k-- > 0) {
+		snprintf(name[0], sizeof name[0], "testcache%d.ra", k);
+		remove(name[0]);
+	}
+	ra_free(&r);
+    printf("Header TEST PASSED\n");
+
+	return 0;
+}
+
+int
+test_index()
+{
+	const char *dir = "testindex", *files[] = { "testindex/a.ra", "testindex/sub/b.ra", "testindex/sub/c.ra" };
+	const uint64_t dims[] = { 256, 256, 4 };
+	ra_filter_t f;
+	ra_index_t *x;
+
+	mkdir(dir, 0755);
+	mkdir("testindex/sub", 0755);
+	for (int i = 0; i < 3; ++i) {
+		ra_t *r = ra_create(i == 1 ? "f4" : "c8", 3 - (i == 2), dims, 0);
+		ra_write(r, files[i]);
+		ra_free(r);
+		free(r);
+	}
+	assert(ra_index_build(dir, NULL) == 3);
+	assert(ra_index_build(dir, NULL) == 0);  // nothing changed
+	ra_t *r = ra_create("c8", 2, dims, 0);
+	ra_write(r, files[0]);
+	ra_free(r);
+	free(r);
+	assert(ra_index_build(dir, NULL) == 1);  // only the rewritten file is read
+	x = ra_index_open("testindex/" RA_INDEX_NAME);
+	assert(ra_index_count(x) == 3 && strcmp(ra_index_name(x, 1), "sub/b.ra") == 0);
+	assert(ra_index_entry(x, 0)->ndims == 2 && ra_index_entry(x, 2)->size == 256*256*8);
+	ra_filter_init(&f);
+	f.eltype = RA_TYPE_COMPLEX;
+	f.ndims = 2;
+	f.dims[0] = 256;
+	assert(ra_index_match(ra_index_entry(x, 0), &f) && ra_index_match(ra_index_entry(x, 2), &f));
+	assert(!ra_index_match(ra_index_entry(x, 1), &f));
+	f.dims[1] = 4;
+	assert(!ra_index_match(ra_index_entry(x, 0), &f));
+	ra_filter_init(&f);
+	f.minsize = 256*256*8 + 1;
+	assert(ra_index_match(ra_index_entry(x, 1), &f) && !ra_index_match(ra_index_entry(x, 2), &f));
+	ra_index_close(x);
+	for (int i = 0; i < 3; ++i)
+		remove(files[i]);
+	remove("testindex/" RA_INDEX_NAME);
+	remove("testindex/sub");
+	remove(dir);
+    printf("Index TEST PASSED\n");
+
+	return 0;
+}
+
+static int
+permuted_ok(const ra_t *in, const ra_t *out, const uint64_t perm[])
+{  /* compare element by element against the index arithmetic */
+	uint64_t n = in->size / in->elbyte, idx[8];
+	for (uint64_t i = 0; i < n; ++i) {
+		uint64_t rem = i, off = 0;
+		for (uint64_t k = 0; k < out->ndims; ++k) {
+			idx[perm[k]] = rem % out->dims[k];
+			rem /= out->dims[k];
+		}
+		for (uint64_t k = in->ndims; k-- > 0; )
+			off = off*in->dims[k] + idx[k];
+		if (memcmp(out->data + i*out->elbyte, in->data + off*in->elbyte, in->elbyte) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+int
+test_permute()
+{
+	const uint64_t dims[][4] = { {67, 45}, {5, 1, 7, 9}, {3, 4, 5, 6}, {64, 64, 2} };
+	const uint64_t perms[][4] = { {1, 0}, {2, 3, 1, 0}, {0, 2, 1, 3}, {1, 0, 2, 3}, {3, 2, 1, 0}, {2, 0, 1} };
+	const int which[] = { 0, 1, 2, 2, 2, 3 };
+	const char *types[] = { "u1", "u2", "s3", "f4", "c8", "s12", "c16" };
+	ra_t *a, b;
+
+	for (int t = 0; t < 7; ++t)
+		for (int c = 0; c < 6; ++c) {
+			const uint64_t *d = dims[which[c]];
+			uint64_t nd = which[c] == 0 ? 2 : which[c] == 3 ? 3 : 4;
+			a = ra_create(types[t], nd, d, 0);
+			for (uint64_t i = 0; i < a->size; ++i)
+				a->data[i] = i*7 + i/251;
+			ra_t *c2 = ra_create(types[t], nd, d, 0);
+			ra_copy(c2, a);
+			ra_permute(c2, perms[c]);
+			for (uint64_t k = 0; k < nd; ++k)
+				assert(c2->dims[k] == d[perms[c][k]]);
+			assert(permuted_ok(a, c2, perms[c]));
+			ra_free(c2);
+			free(c2);
+			if (t == 3) {  // through files, and from a mapping
+				ra_write(a, "test.ra");
+				ra_permute_file("test.ra", "test2.ra", perms[c]);
+				ra_read(&b, "test2.ra");
+				assert(b.ndims == nd && permuted_ok(a, &b, perms[c]));
+				ra_free(&b);
+				ra_mmap(&b, "test.ra", RA_MMAP_DEFAULT);
+				ra_permute(&b, perms[c]);
+				assert(b.mapsize == 0 && permuted_ok(a, &b, perms[c]));
+				ra_free(&b);
+			}
+			ra_free(a);
+			free(a);
+		}
+	ra_set_exit_on_error(0);
+	a = ra_create("f4", 2, dims[0], 0);
+	assert(ra_permute(a, perms[2]) == -RA_EINVAL);  // not a permutation of 0, 1
+	ra_write(a, "test.ra");
+	assert(ra_permute_file("test.ra", "./test.ra", perms[0]) == -RA_EINVAL);  // onto itself
+	ra_set_exit_on_error(1);
+	ra_read(&b, "test.ra");
+	assert(b.size == a->size && memcmp(b.data, a->data, a->size) == 0);
+	ra_free(&b);
+	ra_free(a);
+	free(a);
+    printf("Permute TEST PASSED\n");
+
+	return 0;
+}
+
+static uint8_t *
+slurp(const char *path, size_t *n)
+{
+	FILE *f = fopen(path, "rb");
+	fseek(f, 0, SEEK_END);
+	*n = ftell(f);
+	rewind(f);
+	uint8_t *buf = malloc(*n);
+	assert(fread(buf, 1, *n, f) == *n);
+	fclose(f);
+	return buf;
+}
+
+int
+test_endian()
+{
+	const uint64_t dims[] = { 37, 29 }, start[] = { 0, 0 };
+	ra_t *a = ra_create("c8", 2, dims, 0), b;
+	float *v = (float*)a->data, buf[2*37*29];
+	size_t n, m;
+	uint32_t crc;
+
+	for (uint64_t i = 0; i < 2*37*29; ++i)
+		v[i] = i*0.5f - 300.0f;
+	ra_set_checksum(1);
+	ra_write(a, "test.ra");
+	ra_set_checksum(0);
+	uint8_t *le = slurp("test.ra", &n);
+	assert(ra_endian_file("test.ra", RA_FLAG_BIG_ENDIAN) == 0);
+	assert(ra_checksum("test.ra", &crc) == 1);  // the record follows the data
+	uint8_t *be = slurp("test.ra", &m);
+	uint64_t off = a->data - a->top;
+	assert(m == n && (ra_flags("test.ra") & RA_FLAG_BIG_ENDIAN));
+	for (uint64_t i = off; i < off + a->size; ++i)  // each float half reversed
+		assert(be[i] == le[i - (i - off)%4 + 3 - (i - off)%4]);
+
+	ra_read(&b, "test.ra");
+	assert(!(b.flags & RA_FLAG_BIG_ENDIAN) && ra_diff(a, &b, 0) == 0);
+	ra_free(&b);
+	assert(ra_read_into("test.ra", buf, sizeof buf) == a->size && memcmp(buf, v, a->size) == 0);
+	ra_read_slab("test.ra", start, dims, NULL, &b);
+	assert(ra_diff(a, &b, 0) == 0);
+	ra_free(&b);
+
+	// a file written whole on a big-endian machine, header included
+	for (uint64_t i = 0; i < off; i += 8)
+		for (int j = 0; j < 4; ++j) {
+			uint8_t t = be[i+j];
+			be[i+j] = be[i+7-j];
+			be[i+7-j] = t;
+		}
+	FILE *f = fopen("test2.ra", "wb");
+	fwrite(be, 1, off + a->size, f);
+	fclose(f);
+	uint64_t *d = ra_dims("test2.ra");
+	assert(ra_ndims("test2.ra") == 2 && d[0] == 37 && d[1] == 29);
+	free(d);
+	ra_read(&b, "test2.ra");
+	assert(ra_diff(a, &b, 0) == 0);
+	ra_free(&b);
+	ra_set_exit_on_error(0);
+	assert(ra_mmap(&b, "test2.ra", RA_MMAP_DEFAULT) == -RA_EFORMAT);
+	ra_set_exit_on_error(1);
+	assert(ra_endian_file("test2.ra", 0) == 0);
+	free(be);
+	be = slurp("test2.ra", &m);
+	assert(m == off + a->size && memcmp(be, le, m) == 0);
+
+	// data that fails its record is refused before a byte of it is swapped
+	le[off] ^= 1;
+	f = fopen("test.ra", "wb");
+	fwrite(le, 1, n, f);
+	fclose(f);
+	ra_set_exit_on_error(0);
+	assert(ra_endian_file("test.ra", RA_FLAG_BIG_ENDIAN) == -RA_ECHECKSUM);
+	ra_set_exit_on_error(1);
+	free(be);
+	be = slurp("test.ra", &m);
+	assert(m == n && memcmp(be, le, n) == 0);
+
+	free(le);
+	free(be);
+	ra_free(a);
+	free(a);
+    printf("Endian TEST PASSED\n");
+
+	return 0;
+}
+
+static int
+close_to(const double x, const double y, const double tol)
+{
+	return fabs(x - y) <= tol*fabs(y);
+}
+
+int
+test_stats()
+{
+	const uint64_t n = 5000003;
+	ra_t *a = ra_create("f4", 1, &n, 0), *b;
+	float *v = (float*)a->data;
+	ra_stats_t s, t;
+	ra_hist_t h;
+	long double sum = 0, sq = 0;
+	float lo = INFINITY, hi = -INFINITY;
+
+	for (uint64_t i = 0; i < n; ++i)
+		v[i] = 1e4f + sinf(i*0.001f)*(i % 1000);  // a large mean over a small spread
+	v[17] = NAN;
+	v[n-1] = -INFINITY;
+	v[n/2] = INFINITY;
+	for (uint64_t i = 0; i < n; ++i)
+		if (isfinite(v[i])) {
+			sum += v[i];
+			lo = v[i] < lo ? v[i] : lo;
+			hi = v[i] > hi ? v[i] : hi;
+		}
+	double mean = sum / (n - 3);
+	for (uint64_t i = 0; i < n; ++i)
+		if (isfinite(v[i]))
+			sq += (v[i] - mean)*(v[i] - mean);
+	assert(ra_stats(a, &s) == 0);
+	assert(s.n == n && s.nnan == 1 && s.ninf == 2 && s.min == lo && s.max == hi);
+	assert(close_to(s.mean, mean, 1e-14) && close_to(s.std, sqrtl(sq / (n - 3)), 1e-12));
+
+	// mapped, streamed from compressed blocks, and mapped in the other byte order
+	ra_write(a, "test.ra");
+	assert(ra_stats_file("test.ra", &t) == 0 && memcmp(&s, &t, sizeof s) == 0);
+	ra_compress_chunked(a, 1000000, RA_FLAG_SHUFFLE);
+	ra_write(a, "test2.ra");
+	assert(ra_stats_file("test2.ra", &t) == 0 && memcmp(&s, &t, sizeof s) == 0);
+	ra_endian_file("test.ra", RA_FLAG_BIG_ENDIAN);
+	assert(ra_stats_file("test.ra", &t) == 0 && memcmp(&s, &t, sizeof s) == 0);
+	ra_free(a);
+	free(a);
+
+	const uint64_t m = 1001;
+	a = ra_create("i2", 1, &m, 0);
+	b = ra_create("c8", 1, &m, 0);
+	for (uint64_t i = 0; i < m; ++i) {
+		((int16_t*)a->data)[i] = (int16_t)(i*37 - 20000);
+		((float*)b->data)[2*i] = 3*i;
+		((float*)b->data)[2*i+1] = -4.0f*i;  // magnitude 5i
+	}
+	ra_stats(a, &s);
+	assert(s.n == m && s.min == -20000 && s.max == 1000*37 - 20000 && s.mean == 500*37 - 20000);
+	ra_stats(b, &s);
+	assert(s.min == 0 && s.max == 5000 && close_to(s.mean, 2500, 1e-15));
+	assert(close_to(s.std, 5*sqrt((m*m - 1)/12.0), 1e-14));
+	ra_stats_file("../data/cifar_airplane.ra", &s);
+	ra_stats_file("../data/cifar_airplane_z.ra", &t);
+	assert(s.n == 3072 && s.min == 12 && s.max == 251 && memcmp(&s, &t, sizeof s) == 0);
+	ra_free(a);
+	ra_free(b);
+	free(a);
+	free(b);
+	const uint64_t four = 4;  // finite values whose sum overflows
+	a = ra_create("f8", 1, &four, 0);
+	for (uint64_t i = 0; i < four; ++i)
+		((double*)a->data)[i] = 1e308;
+	assert(ra_stats(a, &s) == 0 && s.nnan == 0 && s.ninf == 0 && s.mean == 1e308 && s.std == 0);
+	ra_free(a);
+	free(a);
+	a = ra_create("f8", 1, &n, 0);  // halves at either end of the range, over several chunks
+	for (uint64_t i = 0; i < n; ++i)
+		((double*)a->data)[i] = i < n/2 ? DBL_MAX : -DBL_MAX;
+	assert(ra_stats(a, &s) == 0 && s.ninf == 0 && fabs(s.mean) < 1e-5*DBL_MAX && s.std == INFINITY);
+	ra_free(a);
+	free(a);
+	a = ra_create("s1", 1, &m, 0);
+	ra_set_exit_on_error(0);
+	assert(ra_stats(a, &s) == -RA_EINVAL);
+	a->eltype = RA_TYPE_USER;  // user elements of no size are refused, not divided by
+	a->elbyte = 0;
+	a->size = 0;
+	ra_write(a, "test.ra");
+	assert(ra_stats_file("test.ra", &s) == -RA_EINVAL);
+	assert(ra_histogram(a, &h) == -RA_EINVAL && ra_histogram_file("test.ra", &h) == -RA_EINVAL);
+	ra_set_exit_on_error(1);
+	ra_free(a);
+	free(a);
+    printf("Stats TEST PASSED\n");
+
+	return 0;
+}
+
+static int
+compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+int
+test_hist()
+{
+	const uint64_t n = 1000003, nbins = 10;
+	const double ps[] = { 0, 0.01, 0.25, 0.5, 0.9, 0.99, 1 };
+	ra_t *a = ra_create("f8", 1, &n, 0);
+	double *v = (double*)a->data, *sorted = malloc(n*sizeof(double));
+	uint64_t counts[10], total = 0;
+	ra_hist_t h, g;
+
+	for (uint64_t i = 0; i < n; ++i)  // every integer in [-300000, 700003) once, scattered
+		v[i] = (double)((i*7919) % n) - 300000;
+	memcpy(sorted, v, n*sizeof(double));
+	qsort(sorted, n, sizeof(double), compare_doubles);
+	v[5] = NAN;
+	v[6] = -INFINITY;
+	assert(ra_histogram(a, &h) == 0);
+	assert(h.n == n - 2 && h.nnan == 1 && h.ninf == 1);
+	for (int k = 0; k < 7; ++k) {
+		double q = ra_hist_quantile(&h, ps[k]), exact = sorted[(uint64_t)(ps[k]*(n - 1))];
+		assert(fabs(q - exact) <= fabs(exact)/256 + 2);
+	}
+	assert(h.min == sorted[0] || h.min == sorted[1]);  // one of them was replaced
+	ra_hist_bins(&h, h.min, h.max, nbins, counts);
+	for (uint64_t b = 0; b < nbins; ++b) {
+		assert(counts[b] > 0.09*n && counts[b] < 0.11*n);
+		total += counts[b];
+	}
+	assert(total == h.n);
+
+	ra_compress_chunked(a, 100000, 0);  // streamed from blocks, same counts
+	ra_write(a, "test.ra");
+	assert(ra_histogram_file("test.ra", &g) == 0 && g.n == h.n && g.min == h.min && g.max == h.max);
+	for (int k = 0; k < 7; ++k)
+		assert(ra_hist_quantile(&g, ps[k]) == ra_hist_quantile(&h, ps[k]));
+	ra_hist_free(&g);
+	ra_hist_free(&h);
+	ra_free(a);
+	free(a);
+	free(sorted);
+
+	ra_histogram_file("../data/mnist_8.ra", &h);
+	assert(h.n == 2352 && h.min == 0 && h.max == 255);
+	assert(ra_hist_quantile(&h, 0.5) == 0 && fabs(ra_hist_quantile(&h, 0.75) - 126) < 0.5);
+	ra_hist_free(&h);
+    printf("Histogram TEST PASSED\n");
+
+	return 0;
+}
+
+int
+test_convert()
+{
+	const float pattern[] = { -1.5, -0.5, 0.5, 1.5, 2.5, 300, -300, NAN, 70000, 1e10 };
+	const uint8_t sat_u1[] = { 0, 0, 0, 2, 2, 255, 0, 0, 255, 255 };
+	const uint8_t wrap_u1[] = { 254, 0, 0, 2, 2, 44, 212, 0, 112, 0 };
+	const int16_t sat_i2[] = { -2, 0, 0, 2, 2, 300, -300, 0, 32767, 32767 };
+	const uint64_t n = 40, big = 3000017;
+	ra_t *a = ra_create("f4", 1, &n, 0), b, c;
+	uint32_t crc;
+
+	for (uint64_t i = 0; i < n; ++i)  // long enough for the vector kernels and their tails
+		((float*)a->data)[i] = pattern[i % 10];
+	ra_write(a, "test.ra");
+	ra_read(&b, "test.ra");
+	ra_convert(&b, "u1");
+	assert(b.eltype == RA_TYPE_UINT && b.elbyte == 1 && b.size == n);
+	ra_read(&c, "test.ra");
+	ra_convert_scaled(&c, "u1", 1, 0, RA_CONVERT_WRAP);
+	for (uint64_t i = 0; i < n; ++i)
+		assert(b.data[i] == sat_u1[i % 10] && c.data[i] == wrap_u1[i % 10]);
+	ra_free(&b);
+	ra_free(&c);
+	ra_read(&b, "test.ra");
+	ra_convert(&b, "i2");
+	for (uint64_t i = 0; i < n; ++i)
+		assert(((int16_t*)b.data)[i] == sat_i2[i % 10]);
+	ra_convert_scaled(&b, "c8", 0.5, 1, 0);  // the offset goes to the real part
+	assert(b.eltype == RA_TYPE_COMPLEX && b.size == 8*n);
+	for (uint64_t i = 0; i < n; ++i)
+		assert(((float*)b.data)[2*i] == sat_i2[i % 10]*0.5f + 1 && ((float*)b.data)[2*i+1] == 0);
+	ra_convert(&b, "f8");  // and back to real
+	for (uint64_t i = 0; i < n; ++i)
+		assert(((double*)b.data)[i] == sat_i2[i % 10]*0.5 + 1);
+	ra_free(&b);
+	ra_free(a);
+	free(a);
+
+	// 64-bit integers convert exactly
+	const int64_t wide[] = { 9007199254740993LL, -1, INT64_MAX, INT64_MIN };
+	const uint64_t four = 4;
+	a = ra_create("i8", 1, &four, 0);
+	memcpy(a->data, wide, sizeof wide);
+	ra_convert(a, "u8");
+	assert(((uint64_t*)a->data)[0] == 9007199254740993ULL && ((uint64_t*)a->data)[1] == 0);
+	assert(((uint64_t*)a->data)[2] == INT64_MAX && ((uint64_t*)a->data)[3] == 0);
+	ra_convert(a, "u4");
+	assert(((uint32_t*)a->data)[0] == UINT32_MAX && ((uint32_t*)a->data)[1] == 0);
+	ra_free(a);
+	free(a);
+
+	// streamed from compressed blocks and from a foreign mapping, as in memory
+	a = ra_create("f8", 1, &big, 0);
+	for (uint64_t i = 0; i < big; ++i)
+		((double*)a->data)[i] = sin(i*1e-3)*1000;
+	ra_write(a, "test.ra");
+	ra_convert_scaled(a, "u2", 20, 30000, 0);
+	ra_read(&b, "test.ra");
+	ra_compress_chunked(&b, 123456, 0);
+	ra_write(&b, "test2.ra");
+	ra_free(&b);
+	ra_set_checksum(1);
+	assert(ra_convert_file("test2.ra", "test2.ra.u2", "u2", 20, 30000, 0) == 0);
+	ra_set_checksum(0);
+	assert(ra_checksum("test2.ra.u2", &crc) == 1);
+	ra_read(&b, "test2.ra.u2");
+	assert(ra_diff(a, &b, 0) == 0);
+	ra_free(&b);
+	ra_endian_file("test.ra", RA_FLAG_BIG_ENDIAN);
+	ra_convert_file("test.ra", "test2.ra.u2", "u2", 20, 30000, 0);
+	ra_read(&b, "test2.ra.u2");
+	assert(ra_diff(a, &b, 0) == 0);
+	ra_free(&b);
+	remove("test2.ra.u2");
+	ra_free(a);
+	free(a);
+	ra_set_exit_on_error(0);
+	a = ra_create("f4", 1, &four, 0);
+	assert(ra_convert(a, "s4") == -RA_EINVAL && a->eltype == RA_TYPE_FLOAT);
+	ra_write(a, "test.ra");
+	assert(ra_convert_file("test.ra", "./test.ra", "f8", 1, 0, 0) == -RA_EINVAL);  // onto itself
+	ra_set_exit_on_error(1);
+	ra_read(&b, "test.ra");
+	assert(b.eltype == RA_TYPE_FLOAT && b.elbyte == 4 && ra_diff(a, &b, 0) == 0);
+	ra_free(&b);
+	ra_free(a);
+	free(a);
+    printf("Convert TEST PASSED\n");
+
+	return 0;
+}
+
+int
+test_half()
+{
+	const uint64_t all = 65536, n = 24;
+	const char *types[] = { "f2", "b2" };
+	ra_t *a, b;
+	ra_stats_t s1, s2;
+	ra_diffstat_t d;
+	uint64_t eltype, elbyte;
+
+	ra_parse_type("b2", &eltype, &elbyte);
+	assert(eltype == RA_TYPE_BFLOAT && elbyte == 2);
+	for (int t = 0; t < 2; ++t) {  // every bit pattern widens exactly and narrows back
+		a = ra_create(types[t], 1, &all, 0);
+		for (uint64_t i = 0; i < all; ++i)
+			((uint16_t*)a->data)[i] = i;
+		ra_write(a, "test.ra");
+		ra_convert(a, "f4");
+		ra_stats(a, &s1);
+		ra_convert(a, types[t]);
+		for (uint64_t i = 0; i < all; ++i) {
+			uint16_t h = ((uint16_t*)a->data)[i], e = t ? 0x7f80 : 0x7c00;
+			if ((i & e) == e && (i & ~(e | 0x8000)))  // NaN, made quiet
+				assert((h & e) == e && (h & (t ? 0x40 : 0x200)) && (h & 0x8000) == (i & 0x8000));
+			else
+				assert(h == i);
+		}
+		ra_stats_file("test.ra", &s2);
+		assert(s1.n == s2.n && s1.nnan == s2.nnan && s1.ninf == s2.ninf && s2.ninf == 2);
+		assert(s1.min == s2.min && s1.max == s2.max && s1.mean == s2.mean && s1.std == s2.std);
+		ra_free(a);
+		free(a);
+	}
+
+	// ties go to even, and doubles are rounded once
+	const double in[] = { 1 + 0x1p-11, 1 + 3*0x1p-11, 1 + 0x1p-11 + 0x1p-40, 65519, 65520,
+		0x1p-25, 0x1.8p-25, -1e-8, 1e300, 1 + 0x1p-8, 1 + 3*0x1p-8, 1 + 0x1p-8 + 0x1p-30 };
+	const uint16_t half[] = { 0x3c00, 0x3c02, 0x3c01, 0x7bff, 0x7c00, 0, 1, 0x8000, 0x7c00 };
+	const uint16_t bf[] = { 0x3f80, 0x3f82, 0x3f81 };
+	a = ra_create("f8", 1, &n, 0);
+	for (uint64_t i = 0; i < n; ++i)  // twice, for the vector kernels and their tails
+		((double*)a->data)[i] = in[i % 12];
+	ra_write(a, "test.ra");
+	ra_convert(a, "f2");
+	ra_read(&b, "test.ra");
+	ra_convert(&b, "b2");
+	for (uint64_t i = 0; i < n; ++i) {
+		if (i % 12 < 9)
+			assert(((uint16_t*)a->data)[i] == half[i % 12]);
+		if (i % 12 >= 9)
+			assert(((uint16_t*)b.data)[i] == bf[i % 12 - 9]);
+	}
+	ra_free(&b);
+
+	// comparisons count units in the last place, and signed zeros match
+	ra_read(&b, "test.ra");
+	ra_convert(&b, "f2");
+	((uint16_t*)b.data)[5] = 0x8000;
+	((uint16_t*)b.data)[13] += 1;
+	((uint16_t*)b.data)[20] -= 2;
+	assert(ra_diff_stats(a, &b, 0, 0, &d) == 0);
+	assert(d.ndiffer == 2 && d.first == 13 && d.maxulp == 2);
+	ra_free(&b);
+	ra_free(a);
+	free(a);
+
+	// 64-bit integers round once too
+	const uint64_t one = 1;
+	a = ra_create("i8", 1, &one, 0);
+	*(int64_t*)a->data = (1LL << 62) + (1LL << 54) + 1;
+	ra_convert(a, "b2");
+	assert(*(uint16_t*)a->data == 0x5e81);
+	ra_free(a);
+	free(a);
+    printf("Half TEST PASSED\n");
+
+	return 0;
+}
+
+int
+test_complex()
+{
+	const uint64_t dims[2] = { 1001, 203 }, n = 1001*203;
+	ra_t *z = ra_create("c8", 2, dims, 0), a, b, y, fa, fb;
+
+	for (uint64_t i = 0; i < n; ++i) {
+		((float*)z->data)[2*i] = 0.5f*i;
+		((float*)z->data)[2*i+1] = -(float)i;
+	}
+	((float*)z->data)[7] = NAN;
+	assert(ra_complex_split(z, &a, &b, 0) == 0);
+	assert(a.eltype == RA_TYPE_FLOAT && a.elbyte == 4 && a.ndims == 2 && a.dims[1] == 203);
+	for (uint64_t i = 0; i < n; ++i)
+		assert(((float*)a.data)[i] == 0.5f*i && (i == 3 || ((float*)b.data)[i] == -(float)i));
+	assert(isnan(((float*)b.data)[3]));
+	assert(ra_complex_interleave(&a, &b, &y, 0) == 0);
+	assert(y.eltype == RA_TYPE_COMPLEX && y.elbyte == 8 && memcmp(y.data, z->data, z->size) == 0);
+	ra_free(&y);
+
+	// the file versions stream compressed and foreign inputs to the same parts
+	ra_write(z, "test.ra");
+	ra_compress_chunked(z, 100000, 0);
+	ra_write(z, "test2.ra");
+	ra_set_checksum(1);
+	assert(ra_complex_split_file("test2.ra", "test2.ra.re", "test2.ra.im", 0) == 0);
+	ra_set_checksum(0);
+	uint32_t crc;
+	assert(ra_checksum("test2.ra.re", &crc) == 1 && ra_checksum("test2.ra.im", &crc) == 1);
+	ra_read(&fa, "test2.ra.re");
+	ra_read(&fb, "test2.ra.im");
+	assert(fa.size == a.size && memcmp(fa.data, a.data, a.size) == 0);
+	assert(fb.size == b.size && memcmp(fb.data, b.data, b.size) == 0);
+	ra_free(&fa);
+	ra_free(&fb);
+	ra_endian_file("test.ra", RA_FLAG_BIG_ENDIAN);
+	ra_complex_split_file("test.ra", "test2.ra.re", NULL, 0);
+	ra_read(&fa, "test2.ra.re");
+	assert(memcmp(fa.data, a.data, a.size) == 0);
+	ra_free(&fa);
+	ra_write(&b, "test2.ra.im");
+	ra_compress_chunked(&b, 65536, 0);
+	ra_write(&b, "test2.ra.im");
+	ra_endian_file("test2.ra.re", RA_FLAG_BIG_ENDIAN);
+	assert(ra_complex_interleave_file("test2.ra.re", "test2.ra.im", "test2.ra", 0) == 0);
+	ra_read(&y, "test2.ra");
+	ra_free(z);
+	ra_read(z, "test.ra");
+	assert(y.size == z->size && memcmp(y.data, z->data, z->size) == 0);
+	ra_free(&y);
+	ra_free(&a);
+	ra_free(&b);
+	ra_free(z);
+	free(z);
+
+	// magnitude and phase, and back
+	z = ra_create("c16", 2, dims, 0);
+	for (uint64_t i = 0; i < n; ++i) {
+		((double*)z->data)[2*i] = cos(i*1e-3)*(i % 17) - 3;
+		((double*)z->data)[2*i+1] = sin(i*1e-2)*(i % 5);
+	}
+	ra_complex_split(z, &a, &b, RA_COMPLEX_POLAR);
+	for (uint64_t i = 0; i < n; ++i) {
+		double re = ((double*)z->data)[2*i], im = ((double*)z->data)[2*i+1];
+		assert(close_to(((double*)a.data)[i], hypot(re, im), 1e-15));
+		assert(((double*)b.data)[i] == atan2(im, re));
+	}
+	ra_complex_interleave(&a, &b, &y, RA_COMPLEX_POLAR);
+	for (uint64_t i = 0; i < 2*n; ++i)
+		assert(fabs(((double*)y.data)[i] - ((double*)z->data)[i]) < 1e-13);
+	ra_free(&y);
+	ra_free(&b);
+	ra_free(&a);
+	ra_write(z, "test.ra");
+	ra_complex_split_file("test.ra", "test2.ra.re", NULL, RA_COMPLEX_POLAR);  // magnitude only
+	ra_read(&fa, "test2.ra.re");
+	ra_convert(z, "f8");  // not the same: the real part
+	assert(fa.size == z->size && memcmp(fa.data, z->data, z->size) != 0);
+	ra_read(&y, "test.ra");
+	ra_complex_split(&y, &a, NULL, RA_COMPLEX_POLAR);
+	assert(memcmp(fa.data, a.data, a.size) == 0);
+	ra_free(&a);
+	ra_free(&y);
+	ra_free(&fa);
+
+	// only complex arrays split, and only matching float parts interleave
+	ra_set_exit_on_error(0);
+	assert(ra_complex_split(z, &a, &b, 0) == -RA_EINVAL);
+	ra_read(&a, "test.ra");
+	assert(ra_complex_interleave(z, &a, &y, 0) == -RA_EINVAL);
+	// nor onto an input, or one part onto the other
+	assert(ra_complex_interleave_file("test2.ra.re", "test.ra", "./test.ra", 0) == -RA_EINVAL);
+	assert(ra_complex_split_file("test.ra", "test2.ra.re", "./test.ra", 0) == -RA_EINVAL);
+	assert(ra_complex_split_file("test.ra", "test2.ra.re", "./test2.ra.re", 0) == -RA_EINVAL);
+	ra_set_exit_on_error(1);
+	ra_read(&y, "test.ra");
+	assert(y.size == a.size && memcmp(y.data, a.data, a.size) == 0);
+	ra_free(&y);
+	ra_free(&a);
+	ra_free(z);
+	free(z);
+	remove("test2.ra.re");
+	remove("test2.ra.im");
+    printf("Complex TEST PASSED\n");
+
+	return 0;
+}
+
+int
+test_errors()
+{
+    const char *testfile1 = "../data/cifar_airplane.ra";
+    const char *testfile2 = "test.ra";
+	const uint64_t dims[] = {7};
+	uint8_t buf[16];
+	ra_t r, r2;
+
+	ra_set_exit_on_error(0);
+	assert(ra_read(&r, "no/such/file.ra") == -RA_EOPEN);
+	assert(ra_errno() == RA_EOPEN);
+	assert(strstr(ra_strerror(), "no/such/file.ra") != NULL);
+	assert(ra_flags("no/such/file.ra") == RA_BAD_FIELD);
+	assert(ra_dims("no/such/file.ra") == NULL);
+
+	FILE *f = fopen(testfile2, "w");  // not an RA file
+	fputs("this is not a raw array", f);
+	fclose(f);
+	assert(ra_read(&r, testfile2) == -RA_EFORMAT);
+	assert(ra_mmap(&r, testfile2, RA_MMAP_DEFAULT) == -RA_EFORMAT);
+
+	ra_read(&r, testfile1);  // header promises more data than is present
+	f = fopen(testfile2, "w");
+	fwrite(r.top, 1, r.data - r.top + r.size/2, f);
+	fclose(f);
+	assert(ra_read(&r2, testfile2) == -RA_EFORMAT);
+	assert(ra_read_into(testfile2, buf, sizeof(buf)) < 0);
+
+	assert(ra_read_into(testfile1, buf, sizeof(buf)) == -RA_EINVAL);
+	assert(ra_reshape(&r, dims, 1) == -RA_EINVAL);
+	assert(ra_reshape_file(testfile1, dims, 1) == -RA_EINVAL);
+	assert(ra_create("x8", 1, dims, 0) == NULL && ra_errno() == RA_EINVAL);
+	ra_free(&r);
+	ra_set_exit_on_error(1);
+    printf("Errors TEST PASSED\n");
+
+	return 0;
+}
+
 
 int
 main ()
 {
+	ra_set_exit_on_error(1);
 	test_rw();
 	test_compress();
+	test_mmap();
+	test_slab();
+	test_chunked();
+	test_shuffle();
+	test_read_into();
+	test_reshape();
+	test_read_many();
+	test_diff();
+	test_checksum();
+	test_align();
+	test_direct();
+	test_writer();
+	test_pack();
+	test_header();
+	test_index();
+	test_permute();
+	test_endian();
+	test_stats();
+	test_hist();
+	test_convert();
+	test_half();
+	test_complex();
+	test_errors();
 	return 0;
 }
@@ -28,11 +28,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
 #include "ra.h"
 
 //static clock_t begin, end;
 size_t total_bytes;
 struct timeval begin, end;
+int use_mmap = 0;
+int max_threads = 1;
 
 uint64_t
 time_usec(const struct timeval *tv)
@@ -40,10 +44,20 @@ time_usec(const struct timeval *tv)
 	return tv->tv_usec + 1000000*tv->tv_sec;
 }
 
-uint64_t
-rasmalltest (size_t n, size_t nfiles)
+void
+read_array (ra_t *r, const char *path)
 {
+	if (use_mmap)
+		ra_mmap(r, path, RA_MMAP_POPULATE);
+	else
+		ra_read(r, path);
+}
+
+uint64_t
+rasmalltest (size_t n, size_t nfiles, uint64_t *tloop, uint64_t *tbatch)
+{  /* returns write+read time; tloop and tbatch time the reads alone */
 	char filename[32];
+	struct timeval t0;
 	uint64_t dims[] = {0};
 	dims[0] = n;
 	ra_t *r = ra_create("f4", 1, dims, RA_DEFAULT);
@@ -54,20 +68,40 @@ rasmalltest (size_t n, size_t nfiles)
 		ra_write(r, filename);
 	}
 	ra_free(r);
+	gettimeofday(&t0,NULL);
 	for (size_t i = 0; i < nfiles; ++i) {
 		sprintf(filename, "tmp/%ld.ra", i);
 		//puts(filename);
-		ra_read(r, filename);
+		read_array(r, filename);
 		ra_free(r);
 	}
 	gettimeofday(&end,NULL);
+	uint64_t t = time_usec(&end) - time_usec(&begin);
+	*tloop = time_usec(&end) - time_usec(&t0);
+
+	char *names = malloc(nfiles*32);
+	const char **paths = malloc(nfiles*sizeof(char*));
+	ra_t *out = calloc(nfiles, sizeof(ra_t));
+	for (size_t i = 0; i < nfiles; ++i) {
+		paths[i] = names + 32*i;
+		sprintf(names + 32*i, "tmp/%ld.ra", i);
+	}
+	ra_set_num_threads(max_threads);
+	gettimeofday(&t0,NULL);
+	ra_read_many(paths, nfiles, out);
+	gettimeofday(&end,NULL);
+	*tbatch = time_usec(&end) - time_usec(&t0);
+	for (size_t i = 0; i < nfiles; ++i)
+		ra_free(&out[i]);
+	free(out);
+	free(paths);
+	free(names);
 
 	//printf("r.data[0] = %f\n", testval);
 	for (size_t i = 0; i < nfiles; ++i) {
 		sprintf(filename, "tmp/%ld.ra", i);
 		unlink(filename);
 	}
-	uint64_t t = time_usec(&end) - time_usec(&begin);
 	//float mb = total_bytes * 1e-6;
 	free(r);
 	return t;
@@ -84,7 +118,7 @@ rabigtest (size_t n, size_t nfiles)
 	gettimeofday(&begin, NULL);
 	ra_write(r, "tmp/big.ra");
 	ra_free(r);
-	ra_read(r, "tmp/big.ra");
+	read_array(r, "tmp/big.ra");
 	gettimeofday(&end, NULL);
 	unlink("tmp/big.ra");
 	//float t = (float)(end - begin) / (float)CLOCKS_PER_SEC;
@@ -94,6 +128,55 @@ rabigtest (size_t n, size_t nfiles)
 	return t;
 }
 
+void
+racompresstest (size_t n, size_t m, int nthreads, uint64_t *tz, uint64_t *tx)
+{  /* time compression and decompression of an in-memory n x m float array */
+	uint64_t dims[] = {0, 0};
+	dims[0] = n;
+	dims[1] = m;
+	ra_t *r = ra_create("f4", 2, dims, RA_DEFAULT);
+	for (size_t i = 0; i < n*m; ++i)
+		((float*)r->data)[i] = (i % 1000) * 0.25f;
+	total_bytes = r->size;
+	ra_set_num_threads(nthreads);
+	gettimeofday(&begin, NULL);
+	ra_compress(r);
+	gettimeofday(&end, NULL);
+	*tz = time_usec(&end) - time_usec(&begin);
+	gettimeofday(&begin, NULL);
+	ra_decompress(r);
+	gettimeofday(&end, NULL);
+	*tx = time_usec(&end) - time_usec(&begin);
+	ra_free(r);
+	free(r);
+}
+
+void
+print_rate (const char *name, uint64_t t[], const int navg)
+{
+	float ravg = 0.f, rmax = 0.f;
+	for (int i = 0; i < navg; ++i) {
+		float rate = t[i] > 0 ? (float)total_bytes / t[i] : 0.f;  // bytes/us = MB/s
+		ravg += rate;
+		if (rate > rmax) rmax = rate;
+	}
+	ravg /= navg;
+	printf("%s, %8.1f, MB/s avg of %d, %8.1f, max\n", name, ravg, navg, rmax);
+}
+
+void
+print_files_rate (const char *name, uint64_t t[], const int navg, const size_t nfiles)
+{
+	float ravg = 0.f, rmax = 0.f;
+	for (int i = 0; i < navg; ++i) {
+		float rate = t[i] > 0 ? 1e6f * nfiles / t[i] : 0.f;
+		ravg += rate;
+		if (rate > rmax) rmax = rate;
+	}
+	ravg /= navg;
+	printf("%s, %10.0f, files/s avg of %d, %10.0f, max\n", name, ravg, navg, rmax);
+}
+
 void
 print_stats (const char *name, uint64_t t[], const int navg)
 {
@@ -116,28 +199,71 @@ main (int argc, char *argv[])
 	size_t nfiles = 100000;
 	size_t n = 10;
 	//float mb = 1e-6*n*nfiles*sizeof(float);
-	char name[32];
+	char name[64];
+	const char *mode;
+	int c;
+
+	ra_set_exit_on_error(1);
+	while ((c = getopt(argc, argv, "mj:h")) != -1) {
+		switch (c) {
+		case 'm':
+			use_mmap = 1;
+			break;
+		case 'j':
+			max_threads = atoi(optarg);
+			break;
+		case 'h':
+		default:
+			fprintf(stderr, "Usage: %s [-m] [-j maxthreads] [navg]\n", argv[0]);
+			fprintf(stderr, "\t-m\tread with ra_mmap instead of ra_read\n");
+			fprintf(stderr, "\t-j\tthreads for batch reads; measure compression scaling up to this many\n");
+			return 1;
+		}
+	}
+	mode = use_mmap ? "mmap" : "read";
+	mkdir("tmp", 0755);
 
 	int navg;
-	if(argc < 2) {
+	if (argc <= optind) {
 		navg = 1;
 	} else
-		navg = atoi(argv[1]);
+		navg = atoi(argv[optind]);
 	uint64_t *t = (uint64_t*)malloc(navg*sizeof(uint64_t));
 
+	uint64_t *t2 = (uint64_t*)malloc(navg*sizeof(uint64_t));
+	uint64_t *t3 = (uint64_t*)malloc(navg*sizeof(uint64_t));
 	for (int i = 0; i < navg; ++i) 
-		t[i] = rasmalltest(n, nfiles); 
-	sprintf(name, "RawArray %ld %ldx1", nfiles, n);
+		t[i] = rasmalltest(n, nfiles, &t2[i], &t3[i]); 
+	sprintf(name, "RawArray %s %ld %ldx1", mode, nfiles, n);
 	print_stats(name, t, navg);
+	sprintf(name, "RawArray %s loop %ld %ldx1", mode, nfiles, n);
+	print_files_rate(name, t2, navg, nfiles);
+	sprintf(name, "RawArray read_many j%d %ld %ldx1", max_threads, nfiles, n);
+	print_files_rate(name, t3, navg, nfiles);
 	for (int i = 0; i < navg; ++i)
-		t[i] = rasmalltest(n*10, nfiles/10);
-	sprintf(name, "RawArray %ld %ldx1", nfiles/10, n*10);
+		t[i] = rasmalltest(n*10, nfiles/10, &t2[i], &t3[i]);
+	sprintf(name, "RawArray %s %ld %ldx1", mode, nfiles/10, n*10);
 	print_stats(name, t, navg);
+	sprintf(name, "RawArray %s loop %ld %ldx1", mode, nfiles/10, n*10);
+	print_files_rate(name, t2, navg, nfiles/10);
+	sprintf(name, "RawArray read_many j%d %ld %ldx1", max_threads, nfiles/10, n*10);
+	print_files_rate(name, t3, navg, nfiles/10);
 	for (int i = 0; i < navg; ++i)
 		t[i] = rabigtest(n, nfiles);
-	sprintf(name, "RawArray 1 %ldx%ld", n,nfiles);
+	sprintf(name, "RawArray %s 1 %ldx%ld", mode, n,nfiles);
 	print_stats(name, t, navg);
 
+	for (int j = 1; j <= max_threads; j *= 2) {
+		for (int i = 0; i < navg; ++i)
+			racompresstest(n*100, nfiles/10, j, &t[i], &t2[i]);
+		sprintf(name, "RawArray compress %ldx%ld j%d", n*100, nfiles/10, j);
+		print_rate(name, t, navg);
+		sprintf(name, "RawArray decompress %ldx%ld j%d", n*100, nfiles/10, j);
+		print_rate(name, t2, navg);
+	}
+
+	free(t3);
+	free(t2);
 	free(t);
 
     return 0;
@@ -27,20 +27,29 @@ import numpy as np
 
 FLAG_BIG_ENDIAN = 0b1
 FLAG_COMPRESSED = 0b10
+FLAG_ALIGNED = 0b100000
 MAGIC_NUMBER = 8746397786917265778
 dtype_kind_to_enum = {'i':1,'u':2,'f':3,'c':4}
-dtype_enum_to_name = {0:'user',1:'int',2:'uint',3:'float',4:'complex'}
+dtype_enum_to_name = {0:'user',1:'int',2:'uint',3:'float',4:'complex',5:'bfloat'}
+TYPE_BFLOAT = 5
 
 def read(filename):
     f = open(filename,'rb')
     h = getheader(f)
     h['dims'] = h['dims'][::-1]
-    data = f.read()
+    data = f.read(int(h['size']))  # not a checksum record that may follow
     if h['eltype'] == 0:
         print('Unable to convert user data. Returning raw byte string.')
     else:
-        d = '%s%d' % (dtype_enum_to_name[h['eltype']], h['elbyte']*8)
-        data = np.fromstring(data, dtype=np.dtype(d))
+        if h['eltype'] == TYPE_BFLOAT:  # numpy has no bfloat16; read the bits
+            d = np.dtype('uint16')
+        else:
+            d = np.dtype('%s%d' % (dtype_enum_to_name[h['eltype']], h['elbyte']*8))
+        if h['flags'] & FLAG_BIG_ENDIAN:
+            d = d.newbyteorder('>')
+        data = np.frombuffer(data, dtype=d)
+        if h['eltype'] == TYPE_BFLOAT:  # and widen them to float32
+            data = (data.astype('<u4') << 16).view('<f4')
         data = data.reshape(h['dims']).transpose()
     f.close()
     return data
@@ -57,6 +66,10 @@ def getheader(f):
     h['ndims'] = header_data[5]
     buf = f.read(int(8*h['ndims']))
     h['dims'] = np.frombuffer(buf, '<Q')
+    if h['flags'] & FLAG_ALIGNED:  # alignment word, then zeros up to the data
+        h['align'] = int(np.frombuffer(f.read(8), '<Q')[0])
+        used = 56 + 8*int(h['ndims'])
+        f.read((h['align'] - used % h['align']) % h['align'])
     return h
 
 
@@ -69,7 +82,6 @@ def query(filename):
         endian = 'big'
     else:
         endian = 'little'
-    assert endian == 'little'  # big not implemented yet
     q += 'endian: %s\n' % endian
     q += 'type: %s%d\n' % (dtype_enum_to_name[h['eltype']], h['elbyte']*8)
     q += 'size: %d\n' % h['size']